@@ -19,8 +19,9 @@
 #include <iostream>
 #include <unistd.h>
 
-// Librería CAN (mcp2515)
+// Librería CAN (mcp2515) y gestor de varios buses
 #include "src/mcp_can_rpi.h"
+#include "src/mcp_bus_manager_rpi.h"
 
 // Muestra en la consola más información
 #define DEBUG_MODE    1
@@ -37,6 +38,9 @@ void printCANMsg1();
 MCP_CAN CAN0(0, 10000000, IntPIN0); // (No hay que tocar nada aqui)
 MCP_CAN CAN1(1, 10000000, IntPIN1); // (No hay que tocar nada aqui)
 
+// Un solo hilo atiende a los dos MCP2515: bus 0 = CAN0, bus 1 = CAN1
+McpBusManager buses;
+
 int main()
 {
     /* -----------------------------------------------------------------
@@ -55,10 +59,6 @@ int main()
     CAN1.setupSpi();
     printf("GPIO Pins initialized & SPI started\n");
 
-    // Inicialización wiringPi e inicializamos interrupciones
-    wiringPiISR(IntPIN0, INT_EDGE_FALLING, printCANMsg0);
-    wiringPiISR(IntPIN1, INT_EDGE_FALLING, printCANMsg1);
-
     /* Inicializamos el bus CAN:
      * INT8U begin(INT8U idmodeset, INT8U speedset, INT8U clockset);
      * Permitimos cualquier tipo de mensaje (standard o extended)
@@ -83,11 +83,16 @@ int main()
     printf("CAN BUS Shield 0 init ok!\n");   // El bus ya está funcionando
     CAN0.setMode(MCP_NORMAL);
 
+    // El gestor espera a los dos pines INT, lee los mensajes recibidos y envía los de buses.send()
+    buses.addBus(&CAN0, CAN_RING_DROP_OLDEST);
+    buses.addBus(&CAN1, CAN_RING_DROP_OLDEST);
+    buses.start(0, -1);
+
 
 
-    // Los 2 bytes que vamos a enviar por el bus CAN
-    uint8_t data0[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
-    uint8_t data1[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    // Los mensajes que vamos a enviar por el bus CAN (id, ext, rtr, dlc, datos)
+    CanFrame frame0 = { 0x12C, 1, 0, 8, { 0, 1, 2, 3, 4, 5, 6, 7 }, 0, 0 };
+    CanFrame frame1 = { 0x12D, 1, 0, 8, { 0, 1, 2, 3, 4, 5, 6, 7 }, 0, 0 };
 
     while (1)
     {
@@ -95,19 +100,23 @@ int main()
          * LOOP
          * -----------------------------------------------------------------
          */
-        data0[1] = data0[1] + 1;
-        data1[1] = data1[1] + 1;
+        frame0.data[1] = frame0.data[1] + 1;
+        frame1.data[1] = frame1.data[1] + 1;
 
-        int result0 = CAN0.sendMsgBuf(0x12C, 1, 8, data0);
+        int result0 = buses.send(0, frame0);
         printf("\n\nMessage sent from CAN 0: %d\n", result0);
 
         usleep(2000000);
+        printCANMsg0();
+        printCANMsg1();
 
 
-        int result1 = CAN1.sendMsgBuf(0x12D, 1, 8, data1);
+        int result1 = buses.send(1, frame1);
         printf("\n\nMessage sent from CAN 1: %d\n", result1);
 
         usleep(2000000);
+        printCANMsg0();
+        printCANMsg1();
     }
     return 0;
 }
@@ -115,23 +124,18 @@ int main()
 
 void printCANMsg0()
 {
-    INT8U  len    = 0;
-    INT8U  buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    INT32U canId  = 0;
+    CanFrame frame;
 
-    if (CAN_MSGAVAIL == CAN0.checkReceive())  // check if data coming
+    while (buses.readFrames(0, &frame, 1) == 1)  // mensajes guardados por el gestor
     {
-        // INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *len, INT8U buf[])
-        // Read data rellena canId, len y guarda los datos en buf
-        CAN0.readMsgBuf(&canId, &len, &buf[0]);
+        INT32U canId = frame.id & 0x1FFFFFFF;
 
-        canId = canId & 0x1FFFFFFF;
         printf("-----------------------------\n");
-        printf("get data from ID: %lu | len:%d\n", canId, len);
+        printf("get data from ID: %lu | len:%d\n", canId, frame.dlc);
 
-        for (int i = 0; i < len; i++) // print the data
+        for (int i = 0; i < frame.dlc; i++) // print the data
         {
-            printf("(%d)", buf[i]);
+            printf("(%d)", frame.data[i]);
             printf("\t");
         }
     }
@@ -140,23 +144,18 @@ void printCANMsg0()
 
 void printCANMsg1()
 {
-    INT8U  len    = 0;
-    INT8U  buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    INT32U canId  = 0;
+    CanFrame frame;
 
-    if (CAN_MSGAVAIL == CAN1.checkReceive())  // check if data coming
+    while (buses.readFrames(1, &frame, 1) == 1)  // mensajes guardados por el gestor
     {
-        // INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *len, INT8U buf[])
-        // Read data rellena canId, len y guarda los datos en buf
-        CAN1.readMsgBuf(&canId, &len, &buf[0]);
+        INT32U canId = frame.id & 0x1FFFFFFF;
 
-        canId = canId & 0x1FFFFFFF;
         printf("-----------------------------\n");
-        printf("get data from ID: %lu | len:%d\n", canId, len);
+        printf("get data from ID: %lu | len:%d\n", canId, frame.dlc);
 
-        for (int i = 0; i < len; i++) // print the data
+        for (int i = 0; i < frame.dlc; i++) // print the data
         {
-            printf("(%d)", buf[i]);
+            printf("(%d)", frame.data[i]);
             printf("\t");
         }
     }
@@ -2,7 +2,7 @@
  * 0_basic_example.cxx
  * Alberto Sánchez Cuadrado
  *
- * This example uses interrupts to read messages
+ * This example reads messages with the library receive thread (woken by the INT pin)
  * It also sends a message periodically
  *
  * Connexions:
@@ -62,9 +62,6 @@ int main()
     CAN.setupSpi();
     printf("GPIO Pins initialized & SPI started\n");
 
-    // Attach interrupt to read incoming messages
-    wiringPiISR(IntPIN, INT_EDGE_FALLING, printCANMsg);
-
     /* Start CAN bus
      * INT8U begin(INT8U idmodeset, INT8U speedset, INT8U clockset);
      */
@@ -78,6 +75,9 @@ int main()
     printf("CAN BUS Shield init ok!\n");
     CAN.setMode(MCPMode);
 
+    // Receive thread: waits for the INT pin and queues incoming messages
+    CAN.startRxThread(CAN_RING_DROP_OLDEST);
+
     while (1)
     {
         /* -----------------------------------------------------------------
@@ -90,6 +90,8 @@ int main()
         printf("\n\nMessage sent: %d\n", CAN.sendMsgBuf(id, EXT, N, data));
 
         usleep(DELAY);
+
+        printCANMsg();
     }
     return 0;
 }
@@ -97,24 +99,18 @@ int main()
 
 void printCANMsg()
 {
-    INT8U  len    = 0;
-    INT8U  buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    INT32U canId  = 0;
+    CanFrame frame;
 
-    if (CAN_MSGAVAIL == CAN.checkReceive())  // check if data coming
+    while (CAN.readFrames(&frame, 1) == 1)  // messages queued by the receive thread
     {
-        // INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *len, INT8U buf[])
-        // Read data rellena canId, len y guarda los datos en buf
-        CAN.readMsgBuf(&canId, &len, &buf[0]);
-
-        canId = canId & 0x1FFFFFFF;
+        INT32U canId = frame.id & 0x1FFFFFFF;
 
         printf("-----------------------------\n");
-        printf("Received data from ID: %lu | len:%d\n", canId, len);
+        printf("Received data from ID: %lu | len:%d\n", canId, frame.dlc);
 
-        for (int i = 0; i < len; i++) // print the data
+        for (int i = 0; i < frame.dlc; i++) // print the data
         {
-            printf("(%d)", buf[i]);
+            printf("(%d)", frame.data[i]);
             printf("\t");
         }
     }
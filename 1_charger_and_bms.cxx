@@ -10,8 +10,12 @@
 #include <iostream>
 #include <unistd.h>
 
-// CAN library (with mcp2515)
+// CAN library (with mcp2515), per-ID dispatch, cyclic transmission and BMS polling
 #include "src/mcp_can_rpi.h"
+#include "src/can_dispatch_rpi.h"
+#include "src/mcp_scheduler_rpi.h"
+#include "src/mcp_bms_poller_rpi.h"
+#include "src/zeva_bms_rpi.h"
 
 // Shows more info on the console
 #define DEBUG_MODE                1
@@ -30,20 +34,33 @@
 #define maxChargingVolts          90   // Max charging voltage (V)
 #define maxChargingAmps           5    // Max charging current (A)
 #define shuntVoltageMillivolts    3600 // Cell balancing voltage (mV)
+#define queryPeriodUs             1000000 // The pack and the charger are queried once per period
 
 // New MCP_CAN instance
 MCP_CAN CAN(SPIBus, 10000000, IntPIN);
 
+// Handler of every received ID
+CanDispatcher dispatcher;
+
+// Charger commands sent on absolute deadlines
+McpCyclicScheduler scheduler(&CAN);
+
+// All BMS modules queried at once, replies matched per module
+McpBmsPoller poller(&CAN, nBMS, shuntVoltageMillivolts);
+
 // Auxiliary functions
 void printCANMsg();
 void readIncomingCANMsg();
+void onCharger(void *ctx, const CanFrame &frame);
+void onBmsModule(void *ctx, const McpBmsReply &reply);
 void printData();
 void saveData();
-INT8U queryCharger(float voltage, float current, int address, int charge);
-INT8U queryBMS(int moduleID, int shuntVoltageMillivolts);
+CanFrame chargerFrame(int volts, int amps, int address, int charge);
 
-// data -> [voltajes, temperaturas, tension cargador, corriente cargador]
-int  data[nBMS * 14 + 7];
+// Cell voltages and temperatures of every module
+ZevaPackState pack;
+// Last status frame of the charger
+ChargerStatus chargerStatus;
 char fileName[15] = "datos.txt";
 bool updateNeeded = false;
 
@@ -62,14 +79,9 @@ int main()
     CAN.setupSpi();
     printf("GPIO Pins initialized & SPI started\n");
 
-    // Attach interrupt to read incoming messages
-    wiringPiISR(IntPIN, INT_EDGE_FALLING, readIncomingCANMsg());
-
     // Inicializar todos los datos a 0
-    for (int i = 0; i < nBMS * 14 + 7; i++)
-    {
-        data[i] = 0;
-    }
+    zevaPackInit(&pack, nBMS);
+    chargerStatus = ChargerStatus();
 
     /* Start CAN bus
      * INT8U begin(INT8U idmodeset, INT8U speedset, INT8U clockset);
@@ -84,6 +96,37 @@ int main()
     printf("CAN BUS Shield init ok!\n");
     CAN.setMode(MCPMode);
 
+    // Only the BMS replies (300 + 10n + 1..4) and the charger get past the MCP2515 filters. The BMS
+    // answer in the format of the query (extended), standard replies are accepted as well.
+    CanIdRange ids[2 * 16 + 1];
+    for (int n = 0; n < 2 * 16; n++)
+    {
+        ids[n].ext = n / 16;
+        ids[n].lo  = 300 + 10 * (n % 16) + 1;
+        ids[n].hi  = 300 + 10 * (n % 16) + 4;
+    }
+    ids[2 * 16].ext = 1;
+    ids[2 * 16].lo  = chargerID;
+    ids[2 * 16].hi  = chargerID;
+    CAN.subscribe(ids, 2 * 16 + 1);
+
+    // Same IDs, each to its handler: BMS n replies 300 + 10n + 1..4, collected by the poller
+    dispatcher.addExact(1, chargerID, onCharger, NULL);
+    for (int n = 0; n < 2 * 16; n++)
+    {
+        dispatcher.addRange(ids[n].ext, ids[n].lo, ids[n].hi, McpBmsPoller::onFrameHandler, &poller);
+    }
+    dispatcher.compile();
+    poller.setCallback(onBmsModule, NULL);
+
+    // Receive thread: waits for the INT pin and queues incoming messages
+    CAN.startRxThread(CAN_RING_DROP_OLDEST);
+
+    // Cyclic charger command: the processing time below does not stretch the period
+    scheduler.addMessage(chargerFrame(maxChargingVolts, maxChargingAmps, chargerID, StartCharge),
+                         queryPeriodUs, MCP_CYC_AUTO_PHASE);
+    scheduler.start(0, -1);
+
     while (1)
     {
         /* -----------------------------------------------------------------
@@ -91,19 +134,23 @@ int main()
          * -----------------------------------------------------------------
          */
 
-        for (int i = 0; i < nBMS; i++)
+        // Query every module back to back, then wait for their replies (or timeouts)
+        poller.refresh();
+        do
         {
-            queryBMS(i, shuntVoltageMillivolts);
-            usleep(1000000);
+            usleep(500);                                // about one frame at 250 kbps
+            readIncomingCANMsg();
         }
-
-        startCharging(maxChargingVolts, maxChargingAmps, chargerID, StartCharge);
+        while (poller.service() > 0);
+        printf("Pack refreshed in %lu us\n", (unsigned long)(poller.refreshTime() / 1000));
 
         if (updateNeeded)
         {
             saveData();
             printData();
+            updateNeeded = false;
         }
+        usleep(queryPeriodUs);
     }
     return 0;
 }
@@ -111,58 +158,41 @@ int main()
 
 void readIncomingCANMsg()
 {
-    INT8U  len    = 0;
-    INT8U  buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    INT32U canId  = 0;
+    CanFrame frames[16];
+    INT32U   n;
 
-    if (CAN_MSGAVAIL == CAN.checkReceive())
+    while ((n = CAN.readFrames(frames, 16)) > 0)  // messages queued by the receive thread
+    {
+        dispatcher.dispatch(frames, n);
+    }
+}
+
+
+void onCharger(void *, const CanFrame &frame)
+{
+    // Vc, Ic (0.1 V, 0.1 A) and fault flags
+    if (chargerDecodeStatus(frame, &chargerStatus) == CAN_OK)
     {
         updateNeeded = true;
-        CAN.readMsgBuf(&canId, &len, &buf[0]);
-        canId = canId & 0x1FFFFFFF;
+    }
+}
 
-        if (canId == chargerID)
-        {
-            // Vc
-            data[nBMS * 14] = ((buf[0] << 8) + buf[1]) * 100;
-            // Ic
-            data[nBMS * 14 + 1] = ((buf[2] << 8) + buf[3]) * 100;
-            // Flags
-            int flags = buf[4];
-            data[nBMS * 14 + 2] = (flags >> 7) & 0x1; // Flag 0
-            data[nBMS * 14 + 3] = (flags >> 6) & 0x1; // Flag 1
-            data[nBMS * 14 + 4] = (flags >> 5) & 0x1; // Flag 2
-            data[nBMS * 14 + 5] = (flags >> 4) & 0x1; // Flag 3
-            data[nBMS * 14 + 6] = (flags >> 3) & 0x1; // Flag 4
-        }
 
-        // BMS modules
-        if ((canId > 300) && (canId < 300 + 16 * 10))
-        {
-            // BMS number (1-16)
-            int n = (canId - 300) / 10;
-            // Message number (0-3)
-            int m = (canId - 300 - n * 10 - 1);
-
-            // Voltage frame
-            if (m < 3)
-            {
-                for (int i = 0; i < 4; i++)
-                {
-                    data[n * 14 + m * 4 + i] = (buf[2 * i] << 8) + buf[2 * i + 1];
-                }
-            }
-
-
-            // Temperature frame
-            else if (m == 3)
-            {
-                for (int i = 0; i < 2; i++)
-                {
-                    data[n * 14 + m * 4 + i] = buf[i] - 40;
-                }
-            }
-        }
+void onBmsModule(void *, const McpBmsReply &reply)
+{
+    int n = reply.module;
+
+    if (reply.result != CAN_OK)
+    {
+        printf("BMS %d did not reply (%d attempts)\n", n, reply.attempts);
+        return;
+    }
+    updateNeeded = true;
+
+    // Voltage frames (0-2) and temperature frame
+    for (int m = 0; m < MCP_BMS_REPLIES; m++)
+    {
+        zevaDecode(&pack, reply.frames[m]);
     }
 }
 
@@ -199,14 +229,13 @@ void printData()
         printf("\nBMS %d: \n", i);
         for (int j = 0; j < 12; j++)
         {
-            printf("V%d: %d\t", j, data[14 * i + j]);
+            printf("V%d: %d\t", j, pack.cell_mv[ZEVA_CELLS * i + j]);
         }
     }
 
-    printf("\nCharger: V = %d \t I = %d \t Flag = %d %d %d %d %d",
-           data[3 * nBMS], data[3 * nBMS + 1], data[3 * nBMS + 2],
-           data[3 * nBMS + 3], data[3 * nBMS + 4], data[3 * nBMS + 5],
-           data[3 * nBMS + 6]);
+    printf("\nCharger: V = %u.%u \t I = %u.%u \t Flags = 0x%02X",
+           chargerStatus.voltage_dv / 10, chargerStatus.voltage_dv % 10,
+           chargerStatus.current_da / 10, chargerStatus.current_da % 10, chargerStatus.flags);
 }
 
 
@@ -219,36 +248,33 @@ void saveData()
 
     for (int i = 0; i < nBMS; i++)
     {
-        for (int j = 0; j < 14; j++)
+        for (int j = 0; j < ZEVA_CELLS; j++)
         {
-            fprintf(file, " %d ,", data[14 * i + j]);
+            fprintf(file, " %d ,", pack.cell_mv[ZEVA_CELLS * i + j]);
+        }
+        for (int j = 0; j < ZEVA_TEMPS; j++)
+        {
+            fprintf(file, " %d ,", pack.temp_c[ZEVA_TEMPS * i + j]);
         }
     }
 
-    fprintf(file, " %d , %d , %d ]", data[14 * nBMS], data[14 * nBMS + 1], data[14 * nBMS + 2]);
+    // Charger in mV and mA
+    fprintf(file, " %d , %d , %d ]", chargerStatus.voltage_dv * 100, chargerStatus.current_da * 100,
+            chargerStatus.flags);
     fclose(file);
 }
 
 
-INT8U queryCharger(float voltage, float current, int address, int charge)
-{
-    uint8_t v = (uint8_t)(voltage * 10);
-    uint8_t i = (uint8_t)(current * 10);
-    uint8_t messageCharger[5] = { (uint8_t)(v >> 8) & 0xFF, v & 0xFF, (i >> 8) & 0xFF, i & 0xFF, 1 - charge };
-
-    int res = sendMsgBuf((uint8_t)address, 1, 5, messageCharger);
-
-    return res;
-}
-
-
-INT8U queryBMS(int moduleID, int shuntVoltageMillivolts)
+CanFrame chargerFrame(int volts, int amps, int address, int charge)
 {
-    uint8_t messageBMS[2] = { (shuntVoltageMillivolts >> 8) & 0xFF, shuntVoltageMillivolts & 0xFF };
+    CanFrame frame;
 
-    int res = sendMsgBuf(300 + 10 * moduleID, 1, 2, messageBMS);
+    chargerCommandInit(&frame, address);
+    chargerSetVoltage(&frame, volts * 10);                 // 0.1 V
+    chargerSetCurrent(&frame, amps * 10);                  // 0.1 A
+    chargerSetCharge(&frame, charge != 0);
 
-    return res;
+    return frame;
 }
 
 
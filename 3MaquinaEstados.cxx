@@ -24,8 +24,16 @@
 #include <iostream>
 #include <unistd.h>
 #include <ctime>
+#include <atomic>
 
 #include "src/mcp_can_rpi.h"           // Librería CAN (mcp2515)
+#include "src/mcp_bus_manager_rpi.h"   // Hilo del bus: recepción antes que transmisión
+#include "src/can_dispatch_rpi.h"      // Manejador de cada ID
+#include "src/can_filter_tuner_rpi.h"  // Ajuste de máscaras y filtros según el tráfico
+#include "src/mcp_scheduler_rpi.h"     // Envío periódico de las peticiones
+#include "src/zeva_bms_rpi.h"          // Decodificación de los BMS
+#include "src/zeva_pack_stats_rpi.h"   // Mínimos, máximos y celdas fuera de rango
+#include "src/mcp_protection_rpi.h"    // Parada del cargador en cuanto salta una protección
 
 #define DEBUG_MODE                1    // Muestra en la consola más información
 
@@ -34,6 +42,8 @@
 #define proteccionesPIN           24          // Pin de control interrupciones
 #define nBMS                      3           // Número de celdas
 #define chargerID                 0x1806E7F4  // ID del cargador
+#define ciclosRetune              10          // Ciclos entre reajustes de los filtros
+#define periodoPeticiones         1000000     // Periodo de las peticiones (us)
 
 // Operation Variables
 #define tensionMaxCarga           90      // Tensión máxima
@@ -44,8 +54,11 @@
 #define maxTemp                   70      // Temp max en grados
 
 // Data variables
-#define nDatos                    nBMS * 14 + 9;
-int  data[nDatos];                    // Variables a leer y guardar
+ZevaPackState pack;                   // Tensiones y temperaturas de todos los BMS (hilo del bus)
+ZevaPackStats estadisticas;           // Se actualizan con cada paquete recibido (hilo del bus)
+ChargerStatus estadoCargador;         // Tensión, intensidad (0.1 V, 0.1 A) y flags del cargador
+CanFrame comandoCargador;             // Orden al cargador, se cambia sobre la misma trama
+std::atomic<bool> disparo(false);     // alDisparar() -> bucle principal
 char fileName[15] = "datos.txt";      // Fichero donde guardar datos
 
 enum
@@ -56,12 +69,40 @@ estado;
 
 // Inicializamos una variable de clase MCP_CAN
 MCP_CAN CAN(0, 10000000, IntPIN);             // (No hay que tocar nada aqui)
+CanFilterTuner tuner(&CAN);                   // Reajusta los filtros del mcp2515
+McpBusManager bus;                            // Hilo que atiende el pin INT
+McpCyclicScheduler ciclico(&bus, 0);          // Peticiones con plazos absolutos
+int msgCargador;                              // Mensaje del cargador en ciclico
+McpProtection proteccion(&CAN, &pack, &estadisticas);  // Límites en cada paquete y pin de protecciones
+McpGpioLine lineaProtecciones(MCP_GPIO_CHIP, proteccionesPIN);
+CanDispatcher limites;                        // IDs de los BMS -> proteccion, en el hilo del bus
+
+// Ve cada trama en el hilo del bus, antes que el bucle principal: los límites se comprueban al
+// recibir el paquete y no al volver del usleep()
+struct GanchoProtecciones : public McpBusHook
+{
+    bool onReceive(INT8U, const CanFrame &frame)
+    {
+        limites.dispatch(frame);
+        return false;                 // La trama sigue al anillo: cargador y tuner.account()
+    }
+
+    void onLoaded(INT8U, const CanFrame &, INT8U)
+    {
+    }
+}
+gancho;
 
 // Funciones lectura datos del bus CAN
 void readIncomingCANMsg();
 void saveData();
 void getTime(char *dateString);
-void queryAll(int charge);
+void queryAll(bool requestCharge);
+void initCargador();
+CanFrame tramaBMS(int modulo);
+void setInterest(int modo);
+void retuneFilters();
+void alDisparar(void *ctx, INT8U causa);
 
 // Funciones manejo datos
 int checkCellsOK(); // Return 0 if all cells ok
@@ -82,15 +123,13 @@ int main()
     CAN.setupSpi();
     printf("GPIO Pins initialized & SPI started\n");
 
-    // Inicialización wiringPi e inicializamos interrupciones
+    // Inicialización wiringPi
     wiringPiSetup();
-    wiringPiISR(IntPIN, INT_EDGE_FALLING, readIncomingCANMsg);
 
     // Inicializar todos los datos a 0
-    for (int i = 0; i < nDatos; i++)
-    {
-        data[i] = 0;
-    }
+    zevaPackInit(&pack, nBMS);
+    zevaPackStatsInit(&estadisticas, &pack, minCellVoltage, maxCellVoltage, maxTemp);
+    initCargador();
 
     // Inicializamos CAN BUS
     while (CAN_OK != CAN.begin(MCP_ANY, CAN_250KBPS, MCP_8MHZ))
@@ -101,6 +140,41 @@ int main()
     }
     printf("CAN BUS Shield init ok!\n"); // El bus ya está funcionando
 
+    // Orden de parada precargada en TXB2: sale con un solo RTS, antes que las demás tramas
+    proteccion.setStopFrame(comandoCargador);  // Sale de initCargador() con la orden de parada
+    proteccion.setCallback(alDisparar, NULL);
+    if (lineaProtecciones.open())     // Flanco de bajada del pin de protecciones = STOP
+    {
+        proteccion.setLine(&lineaProtecciones);
+        proteccion.start(0, -1);
+    }
+
+    // Filtros del estado inicial: solo llegan por SPI los mensajes que leemos
+    setInterest(estado);
+    int estadoFiltros = estado;
+    int ciclos        = 0;
+
+    // Paquetes 1..4 de cada BMS a proteccion.onFrame(), extendidos como la consulta o estándar
+    for (int i = 0; i < 2 * nBMS; i++)
+    {
+        limites.addRange(i / nBMS, 300 + (i % nBMS) * 10 + 1, 300 + (i % nBMS) * 10 + 4,
+                         McpProtection::onFrameHandler, &proteccion);
+    }
+    limites.compile();
+
+    // Hilo del bus: espera al pin INT, comprueba los límites y guarda los mensajes recibidos
+    bus.addBus(&CAN, CAN_RING_DROP_OLDEST);
+    bus.setHook(&gancho);
+    bus.start(0, -1);
+
+    // Peticiones periódicas a los BMS y al cargador, repartidas dentro del periodo
+    for (int i = 0; i < nBMS; i++)
+    {
+        ciclico.addMessage(tramaBMS(i), periodoPeticiones, MCP_CYC_AUTO_PHASE);
+    }
+    msgCargador = ciclico.addMessage(comandoCargador, periodoPeticiones, MCP_CYC_AUTO_PHASE);
+    ciclico.start(0, -1);
+
     while (1)                            // Bucle de funcionamiento
     {
         /* -----------------------------------------------------------------
@@ -110,6 +184,22 @@ int main()
 
         printf("----------------------------------\n\n");
 
+        if (disparo.exchange(false))     // Saltó una protección: estado y orden solo desde aquí
+        {
+            estado = standby;            // Para volver a cargar: proteccion.rearm()
+        }
+
+        if (estado != estadoFiltros)     // Cambio de estado: otros mensajes de interés
+        {
+            setInterest(estado);
+            estadoFiltros = estado;
+        }
+        else if (++ciclos >= ciclosRetune) // Reajuste periódico de los filtros
+        {
+            retuneFilters();
+            ciclos = 0;
+        }
+
         switch (estado)
         {
         case standby:
@@ -128,6 +218,7 @@ int main()
             break;
         }
 
+        readIncomingCANMsg();
         saveData();
         usleep(1000000);
     }
@@ -137,56 +228,25 @@ int main()
 
 void readIncomingCANMsg()
 {
-    INT8U  len    = 0;
-    INT8U  buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    INT32U canId  = 0;
+    CanFrame frame;
 
-    if (CAN_MSGAVAIL == CAN.checkReceive()) // check if data coming
+    while (bus.readFrames(0, &frame, 1) == 1)  // Mensajes guardados por el hilo del bus
     {
-        // Leemos el mensaje del bus
-        CAN.readMsgBuf(&canId, &len, &buf[0]);
+        INT32U canId = frame.id;
+        bool   usado = false;
 
         if (canId == chargerID) // Mensaje del cargador
         {
-            // Tensión detectada carga
-            data[nBMS * 14] = ((buf[0] << 8) + buf[1]) * 100;
+            usado = true;
 
-            // Intensidad actual de carga
-            data[nBMS * 14 + 1] = ((buf[2] << 8) + buf[3]) * 100;
-
-            // Flags
-            int flags = buf[4];
-
-            data[nBMS * 14 + 2] = flags & 0xFF; // Flag0
-            data[nBMS * 14 + 3] = flags & 0xFF; // Flag1
-            data[nBMS * 14 + 4] = flags & 0xFF; // Flag2
-            data[nBMS * 14 + 5] = flags & 0xFF; // Flag3
-            data[nBMS * 14 + 6] = flags & 0xFF; // Flag4
+            chargerDecodeStatus(frame, &estadoCargador);  // Tensión, intensidad y flags
         }
-
-        // Corregimos dirección para poder leer las direcciones de los BMS
-        canId = canId & 0xFFFFFFF;
-
-        if ((canId > 300) && (canId < 300 + 16 * 10)) // BMS
-        {
-            int n = (canId - 300) / 10;               // Numero del BMS (de 0 a 16)
-            int m = (canId - 300 - n * 10 - 1);       // N paquete dentro del BMS (0-3)
-
-            if (m < 3)                                // Paquete de tensiones
-            {
-                for (int i = 0; i < 4; i++)
-                {
-                    data[n * 14 + m * 4 + i] = (buf[2 * i] << 8) + buf[2 * i + 1];
-                }
-            }
-            else if (m == 3) // Paquete de temperaturas
-            {
-                for (int i = 0; i < 2; i++)
-                {
-                    data[n * 14 + m * 4 + i] = buf[i] - 40;
-                }
-            }
+        else if (limites.lookup(frame) != CAN_DISPATCH_NONE)  // Paquete de un BMS: ya decodificado y
+        {                                                     // comprobado en el hilo del bus
+            usado = true;
         }
+
+        tuner.account(frame, usado);            // Estadística para reajustar los filtros
     }
 }
 
@@ -195,65 +255,123 @@ void saveData() // Saves all data into file
 {
     FILE *file;
     char date[50];
+    char ruta[80];
 
     getTime(date);
+    snprintf(ruta, sizeof(ruta), "data/%s.txt", date);
 
-    file = fopen("data/" + date + ".txt", "w+");
+    file = fopen(ruta, "w+");
+    if (file == NULL)
+    {
+        printf("No se pudo abrir %s\n", ruta);
+        return;
+    }
     fprintf(file, "[");
 
-    for (int i = 0; i < nDatos - 1; i++)
+    for (int i = 0; i < nBMS; i++)
     {
-        fprintf(file, " %d ,", data[i]);
+        for (int j = 0; j < ZEVA_CELLS; j++)
+        {
+            fprintf(file, " %d ,", pack.cell_mv[i * ZEVA_CELLS + j]);
+        }
+        for (int j = 0; j < ZEVA_TEMPS; j++)
+        {
+            fprintf(file, " %d ,", pack.temp_c[i * ZEVA_TEMPS + j]);
+        }
     }
-
-    fprintf(file, " %d ]", data[nDatos - 1]);
+    // Cargador en mV y mA
+    fprintf(file, " %d , %d , %d ]", estadoCargador.voltage_dv * 100, estadoCargador.current_da * 100,
+            estadoCargador.flags);
     fclose(file);
 }
 
 
-void queryAll(bool requestCharge)
+void queryAll(bool requestCharge)    // Las peticiones salen solas: solo cambia la del cargador
 {
-    for (int i = 0; i < nBMS; i++)
-    {
-        CAN.queryBMS(i, shuntVoltageMillivolts);
-    }
+    chargerSetCharge(&comandoCargador, requestCharge);
+    ciclico.updatePayload(msgCargador, comandoCargador.data, comandoCargador.dlc);
+}
+
+
+void initCargador()                  // Consignas en punto fijo, sin cargar; estado a 0
+{
+    chargerCommandInit(&comandoCargador, chargerID);
+    chargerSetVoltage(&comandoCargador, tensionMaxCarga * 10);    // 0.1 V
+    chargerSetCurrent(&comandoCargador, intensidadMaxCarga * 10); // 0.1 A
+    estadoCargador = ChargerStatus();
+}
+
+
+CanFrame tramaBMS(int modulo)
+{
+    CanFrame trama = CanFrame();
+
+    trama.id      = 300 + 10 * modulo;
+    trama.ext     = 1;
+    trama.dlc     = 2;
+    trama.data[0] = (shuntVoltageMillivolts >> 8) & 0xFF;
+    trama.data[1] = shuntVoltageMillivolts & 0xFF;
+
+    return trama;
+}
 
-    if (requestCharge)
+
+void setInterest(int modo)            // Mensajes que hay que recibir en cada estado
+{
+    CanIdRange ids[2 * nBMS + 1];
+    int        n = 0;
+
+    for (int i = 0; i < 2 * nBMS; i++)   // Paquetes 1..4 de cada BMS, extendidos como la consulta
+    {                                    // o estándar
+        ids[n].ext = i / nBMS;
+        ids[n].lo  = 300 + (i % nBMS) * 10 + 1;
+        ids[n].hi  = 300 + (i % nBMS) * 10 + 4;
+        n++;
+    }
+    if (modo != run)                 // En marcha el cargador no está conectado
     {
-        CAN.queryCharger(tensionMaxCarga, intensidadMaxCarga, chargerID, 1);
+        ids[n].ext = 1;
+        ids[n].lo  = chargerID;
+        ids[n].hi  = chargerID;
+        n++;
     }
-    else
+
+    if (tuner.setInterest(ids, n) != CAN_OK)
     {
-        CAN.queryCharger(tensionMaxCarga, intensidadMaxCarga, chargerID, 0);
+        printf("No se pudieron programar los filtros\n");
     }
 }
 
 
-int checkCellsOK()                   // Checks cells V and Temp
+void retuneFilters()                 // Reajusta los filtros con el tráfico de los últimos ciclos
 {
-    for (int i = 0; i < nBMS; i++)   // Num BMS
+    CanTuneReport r = tuner.retune();
+
+    if (DEBUG_MODE)
     {
-        for (int j = 0; j < 12; j++) // Num CelL
-        {
-            int v = data[i * 14 + j];
+        printf("Filtros: %lu mensajes/s -> %lu mensajes/s%s\n", (unsigned long)r.rate_before,
+               (unsigned long)r.rate_after, r.applied ? " (reajustados)" : "");
+    }
+}
 
-            if ((v < minCellVoltage) || (v > maxCellVoltage))
-            {
-                return 1; // Some cell is above or below
-            }
-        }
-        for (int j = 0; j < 2; j++)
-        {
-            int temp = data[i * 14 + 12 + j];
 
-            if (temp > maxTemp)
-            {
-                return 1;
-            }
-        }
-    }
+void alDisparar(void *, INT8U causa)  // La trama de parada ya está en el bus (hilo del bus o de
+                                      // protecciones)
+{
+    McpProtectionStats st = proteccion.stats();
+
+    disparo = true;                   // El bucle pasa a standby; el ID del cargador queda
+                                      // bloqueado hasta proteccion.rearm()
+#if DEBUG_MODE
+    printf("Protección 0x%02X: parada en %llu us\n", causa,
+           (unsigned long long)(st.latency_last_ns / 1000));
+#endif
+}
 
-    return 0;
+
+int checkCellsOK()                   // Checks cells V and Temp
+{
+    return zevaPackOK(&estadisticas) ? 0 : 1;  // Some cell is above or below, or too hot
 }
 
 
@@ -261,8 +379,6 @@ void getTime(char *dateString)
 {
     time_t curr_time;
     tm     *curr_tm;
-    char   date_string[100];
-    char   time_string[100];
 
     time(&curr_time);
     curr_tm = localtime(&curr_time);
@@ -0,0 +1,374 @@
+/*
+ * 5_benchmark.cxx
+ *
+ * Measures the driver against the MCP2515 emulator (no hardware needed):
+ *  - rx:         a fully loaded bus, frames read from the INT pin with readMsgBatch()
+ *  - tx_async:   back-to-back sendMsgBufAsync() with serviceTx() on the TX interrupts
+ *  - tx_blocking: back-to-back sendMsgBuf()
+ * for every bitrate and frame size, with the SPI cost model of a 10 MHz spidev bus.
+ *
+ * Output is CSV on stdout, one row per test. Times are emulated (bus + SPI time), except cpu_ns,
+ * which is the CPU time of this process per frame (driver and emulator together).
+ *
+ * Build:  g++ -std=c++11 -O2 5_benchmark.cxx -o benchmark -pthread
+ * Usage:  ./benchmark [frames per test] [SPI clock in Hz] [submit overhead in ns] [interrupt delay in ns]
+ *
+ * The interrupt delay is added between the INT pin going low and the handler running (the emulator
+ * has no operating system); rx latency percentiles include it.
+ *
+ * A row with lost frames does not measure the driver at full load: it is reported on stderr and
+ * the benchmark exits with 1.
+ *
+ */
+
+
+// Presinstalled libraries
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+// CAN library (with mcp2515) and the emulated controller. No debug output: stdout is the CSV.
+#define DEBUG_MODE    0
+#include "src/mcp_emulator_rpi.h"
+
+#define MCPClock      MCP_8MHZ
+#define OSC_HZ        8000000
+#define FRAMES        10000
+#define SPI_HZ        10000000
+#define SUBMIT_NS     MCP_EMU_SUBMIT_NS
+#define BATCH         16
+
+struct Bitrate
+{
+    INT8U speedset;
+    int   kbps;
+};
+
+static const Bitrate bitrates[] = {
+    { CAN_125KBPS,  125  },
+    { CAN_250KBPS,  250  },
+    { CAN_500KBPS,  500  },
+    { CAN_1000KBPS, 1000 },
+};
+static const INT8U sizes[] = { 0, 4, 8 };
+
+static INT32U        nFrames  = FRAMES;
+static uint64_t      irqNs    = 0;
+static McpEmuLatency spiModel = { SUBMIT_NS, MCP_EMU_CS_NS, 8000000000ULL / SPI_HZ };
+
+struct Result
+{
+    const char *test;
+    int         kbps;
+    INT8U       dlc;
+    INT8U       ext;
+    INT32U      frames;                  // delivered / transmitted
+    INT32U      lost;                    // overflows / failed sends
+    uint64_t    elapsed_ns;
+    McpSpiStats spi;
+    uint64_t    cpu_ns;
+    std::vector<uint64_t> latency;       // rx only
+};
+
+// Auxiliary functions
+static uint64_t cpuNow();
+static uint64_t percentile(std::vector<uint64_t> &v, double p);
+static CanFrame makeFrame(INT32U seq, INT8U ext, INT8U dlc);
+static void benchRx(const Bitrate &br, INT8U ext, INT8U dlc, Result &r);
+static void benchTx(const Bitrate &br, INT8U ext, INT8U dlc, bool async, Result &r);
+static void printHeader();
+static INT32U printResult(Result &r);
+
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        nFrames = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2)
+    {
+        spiModel.byte_ns = 8000000000ULL / strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3)
+    {
+        spiModel.submit_ns = strtoul(argv[3], NULL, 0);
+    }
+    if (argc > 4)
+    {
+        irqNs = strtoull(argv[4], NULL, 0);
+    }
+
+    INT32U lost = 0;
+
+    printHeader();
+    for (unsigned b = 0; b < sizeof(bitrates) / sizeof(bitrates[0]); b++)
+    {
+        for (INT8U ext = 0; ext <= 1; ext++)
+        {
+            for (unsigned s = 0; s < sizeof(sizes); s++)
+            {
+                Result rx, txa, txb;
+
+                benchRx(bitrates[b], ext, sizes[s], rx);
+                lost += printResult(rx);
+                benchTx(bitrates[b], ext, sizes[s], true, txa);
+                lost += printResult(txa);
+                benchTx(bitrates[b], ext, sizes[s], false, txb);
+                lost += printResult(txb);
+            }
+        }
+    }
+
+    if (lost)
+    {
+        fprintf(stderr, "benchmark: %lu frames lost, results invalid\n", (unsigned long)lost);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Another node sends nFrames back to back. The loop plays the part of the INT pin handler: whenever
+ * the pin is low it empties the receive buffers; latency is from the end of a frame on the bus (when
+ * it sets RXnIF) to readMsgBatch() returning it.
+ */
+static void benchRx(const Bitrate &br, INT8U ext, INT8U dlc, Result &r)
+{
+    McpEmulatorTransport emu(OSC_HZ);
+    MCP_CAN              CAN(&emu, 0);
+    CanFrame             frames[BATCH];
+    std::vector<uint64_t> arrival(nFrames);
+    INT32U               injected = 0, next = 0;
+    uint64_t             start, bitNs, cpu0;
+
+    emu.setLatency(spiModel);
+    CAN.begin(MCP_ANY, br.speedset, MCPClock);
+    CAN.setMode(MCP_NORMAL);
+
+    bitNs = emu.bitTimeNs();
+    start = emu.now();
+    emu.resetStats();
+    cpu0 = cpuNow();
+
+    r.test = "rx";
+    r.latency.reserve(nFrames);
+
+    while (next < nFrames)
+    {
+        // Keep the bus busy: frames end one frame time after the other
+        while (injected < nFrames && injected - next < MCP_EMU_BUS_QUEUE / 2)
+        {
+            CanFrame f = makeFrame(injected, ext, dlc);
+
+            arrival[injected] = start + (uint64_t)(injected + 1) * McpEmulatorTransport::frameBits(f) * bitNs;
+            emu.busInjectAt(f, arrival[injected]);
+            injected++;
+        }
+
+        if (emu.intActive())
+        {
+            emu.advance(irqNs);
+
+            INT32U   n = CAN.readMsgBatch(frames, BATCH);
+            uint64_t t = emu.now();
+
+            for (INT32U i = 0; i < n; i++)
+            {
+                INT32U mask = ext ? 0x1FFFFFFF : 0x7FF;
+                INT32U seq  = next + ((frames[i].id - next) & mask);  // frames lost in between are skipped
+
+                if (seq < nFrames)
+                {
+                    r.latency.push_back(t - arrival[seq]);
+                    next = seq + 1;
+                }
+            }
+        }
+        else if (next < injected && emu.now() < arrival[injected - 1])
+        {
+            uint64_t now = emu.now();
+            INT32U   k   = next;
+
+            while (k < injected && arrival[k] <= now)
+            {
+                k++;
+            }
+            if (k < injected)
+            {
+                emu.advance(arrival[k] - now);                        // idle until the next frame ends
+            }
+            else
+            {
+                next = injected;                                      // the rest was lost
+            }
+        }
+        else
+        {
+            next = injected;
+        }
+    }
+
+    r.cpu_ns     = cpuNow() - cpu0;
+    r.elapsed_ns = emu.now() - start;
+    r.frames     = r.latency.size();
+    r.lost       = emu.emuStats().rx_overflows;
+    r.spi        = emu.stats();
+    r.kbps       = br.kbps;
+    r.dlc        = dlc;
+    r.ext        = ext;
+}
+
+
+/*
+ * nFrames sent as fast as the driver allows. Async: the queue is kept full and the TX interrupts
+ * are serviced as they come. Blocking: one sendMsgBuf() after the other.
+ */
+static void benchTx(const Bitrate &br, INT8U ext, INT8U dlc, bool async, Result &r)
+{
+    McpEmulatorTransport emu(OSC_HZ);
+    MCP_CAN              CAN(&emu, 0);
+    CanFrame             f, out;
+    INT32U               queued = 0, failed = 0;
+    uint64_t             start, bitNs, cpu0;
+
+    emu.setLatency(spiModel);
+    CAN.begin(MCP_ANY, br.speedset, MCPClock);
+    CAN.setMode(MCP_NORMAL);
+
+    bitNs = emu.bitTimeNs();
+    start = emu.now();
+    emu.resetStats();
+    cpu0 = cpuNow();
+
+    r.test = async ? "tx_async" : "tx_blocking";
+
+    if (async)
+    {
+        while (queued < nFrames || CAN.txPending() > 0)
+        {
+            while (queued < nFrames)
+            {
+                f = makeFrame(queued, ext, dlc);
+                if (CAN.sendMsgBufAsync(f.id, ext, dlc, f.data) != CAN_OK)
+                {
+                    break;                                            // queue full
+                }
+                queued++;
+            }
+
+            if (emu.intActive())
+            {
+                CAN.serviceTx();
+            }
+            else
+            {
+                emu.advance(8 * bitNs);
+            }
+            while (emu.busPop(out))
+            {
+            }
+        }
+        failed = CAN.txFailed();
+    }
+    else
+    {
+        for (queued = 0; queued < nFrames; queued++)
+        {
+            f = makeFrame(queued, ext, dlc);
+            if (CAN.sendMsgBuf(f.id, ext, dlc, f.data) != CAN_OK)
+            {
+                failed++;
+            }
+            while (emu.busPop(out))
+            {
+            }
+        }
+    }
+
+    r.cpu_ns     = cpuNow() - cpu0;
+    r.elapsed_ns = emu.now() - start;
+    r.frames     = emu.emuStats().tx_frames;
+    r.lost       = failed;
+    r.spi        = emu.stats();
+    r.kbps       = br.kbps;
+    r.dlc        = dlc;
+    r.ext        = ext;
+}
+
+
+static CanFrame makeFrame(INT32U seq, INT8U ext, INT8U dlc)
+{
+    CanFrame f;
+
+    f.id        = ext ? (seq & 0x1FFFFFFF) : (seq & 0x7FF);
+    f.ext       = ext;
+    f.rtr       = 0;
+    f.dlc       = dlc;
+    f.filhit    = 0;
+    f.timestamp = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        f.data[i] = (INT8U)(seq >> (8 * (i & 3)));
+    }
+
+    return f;
+}
+
+
+static uint64_t cpuNow()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+
+static uint64_t percentile(std::vector<uint64_t> &v, double p)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+    return v[(size_t)(p * (v.size() - 1))];
+}
+
+
+static void printHeader()
+{
+    printf("test,kbps,ext,dlc,frames,lost,fps,bus_fps,spi_txn_per_frame,spi_bytes_per_frame,"
+           "spi_submits_per_frame,spi_load,lat_p50_us,lat_p90_us,lat_p99_us,lat_max_us,cpu_ns_per_frame\n");
+}
+
+
+static INT32U printResult(Result &r)
+{
+    CanFrame f      = makeFrame(0, r.ext, r.dlc);
+    double   bitNs  = 1000000.0 / r.kbps;
+    double   busFps = 1e9 / (McpEmulatorTransport::frameBits(f) * bitNs);
+    double   n      = r.frames ? r.frames : 1;
+    double   busy   = (double)r.spi.submits * spiModel.submit_ns + (double)r.spi.transactions * spiModel.cs_ns +
+                      (double)r.spi.bytes * spiModel.byte_ns;
+
+    std::sort(r.latency.begin(), r.latency.end());
+
+    printf("%s,%d,%d,%d,%lu,%lu,%.0f,%.0f,%.2f,%.2f,%.2f,%.3f,%.1f,%.1f,%.1f,%.1f,%.0f\n",
+           r.test, r.kbps, r.ext, r.dlc, (unsigned long)r.frames, (unsigned long)r.lost,
+           r.frames * 1e9 / (r.elapsed_ns ? r.elapsed_ns : 1), busFps,
+           r.spi.transactions / n, r.spi.bytes / n, r.spi.submits / n,
+           busy / (r.elapsed_ns ? r.elapsed_ns : 1),
+           percentile(r.latency, 0.50) / 1000.0, percentile(r.latency, 0.90) / 1000.0,
+           percentile(r.latency, 0.99) / 1000.0, percentile(r.latency, 1.0) / 1000.0,
+           r.cpu_ns / n);
+
+    if (r.lost)
+    {
+        fprintf(stderr, "%s %d kbps ext=%d dlc=%d: %lu frames lost\n",
+                r.test, r.kbps, r.ext, r.dlc, (unsigned long)r.lost);
+    }
+    return r.lost;
+}
@@ -0,0 +1,554 @@
+/*
+ * 6_microbench.cxx
+ *
+ * ns/op of the CPU-side work done for every frame, with no SPI and no controller:
+ *  - id_pack_std / id_pack_ext:  canEncodeId(), as used by LOAD TX and the TX/ID registers
+ *  - id_unpack:                  canDecodeId() on received register images
+ *  - tx_image / rx_image:        whole TX buffer images built and RX buffer images decoded
+ *  - filter_match:               MCP2515 acceptance test of each frame against RXF0..5
+ *  - dispatch:                   the id if-chain of readIncomingCANMsg() (charger / BMS / other)
+ *  - zeva_decode:                readIncomingCANMsg() decoding into the data[] array
+ *  - rx_path:                    rx_image + dispatch + zeva_decode, one received frame end to end
+ *
+ * The traffic is generated from a fixed seed: 16 ZEVA BMS modules sending 3 voltage frames and a
+ * temperature frame each, with cells around the values of ejmDatos.txt (3607..3619 mV, 20 C), the
+ * charger status frame and 10% unrelated standard frames, in bus order. The same seed gives the same
+ * dataset on every machine, so numbers from a workstation and from the Pi can be compared, and the
+ * checksum column shows that a rewritten kernel still computes the same thing.
+ *
+ * Build:  g++ -std=c++11 -O2 6_microbench.cxx -o microbench
+ * Usage:  ./microbench [passes over the dataset] [seed]
+ *
+ * Each kernel runs RUNS times over the whole dataset; min and median ns/op are printed as CSV.
+ *
+ */
+
+
+// Presinstalled libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+// Encode/decode kernels of the CAN library
+#include "src/can_codec_rpi.h"
+#include "src/can_ring_rpi.h"
+#include "src/zeva_bms_rpi.h"
+#include "src/zeva_pack_stats_rpi.h"
+#include "src/charger_codec_rpi.h"
+
+#define DATASET                   4096 // Frames in the dataset
+#define PASSES                    64   // Passes over the dataset per run
+#define RUNS                      9
+#define SEED                      0x2017CA11
+#define nBMS                      16   // ZEVA modules on the bus
+#define chargerID                 0x1806E7F4
+
+// Same layout as 1_charger_and_bms.cxx: [voltajes, temperaturas, tension cargador, corriente cargador]
+static int data[nBMS * 14 + 7];
+
+// Same frames decoded into the structure-of-arrays pack state of src/zeva_bms_rpi.h
+static ZevaPackState pack;
+static ZevaPackStats packStats;
+static CanFrame chargerCmd;
+
+// Cells of the first module in ejmDatos.txt, in mV
+static const int cellBase[12] = { 3610, 3607, 3609, 3608, 3614, 3608, 3608, 3608, 3619, 3609, 3612, 3608 };
+
+struct Dataset
+{
+    std::vector<CanFrame> frames;                  // As received
+    std::vector<INT8U>    rxImages;                // READ RX images (SIDH..D7) of frames
+    std::vector<INT32U>   stdIds;
+    std::vector<INT32U>   extIds;
+    INT8U                 masks[2][4];             // RXM0, RXM1
+    INT8U                 filters[6][4];           // RXF0..5
+};
+
+typedef uint32_t (*Kernel)(const Dataset &d);
+
+struct Bench
+{
+    const char *name;
+    Kernel      kernel;
+    bool        perId;                             // ops are ids, not frames
+};
+
+static uint32_t seedState;
+static volatile uint32_t sink;
+
+// Auxiliary functions
+static uint32_t nextRandom();
+static void buildDataset(Dataset &d);
+static void storeRxImage(const CanFrame &f, INT8U *image);
+static int dispatchFrame(const CanFrame &f);
+static void decodeFrame(int kind, const CanFrame &f);
+
+static uint32_t kIdPackStd(const Dataset &d);
+static uint32_t kIdPackExt(const Dataset &d);
+static uint32_t kIdUnpack(const Dataset &d);
+static uint32_t kTxImage(const Dataset &d);
+static uint32_t kRxImage(const Dataset &d);
+static uint32_t kFilterMatch(const Dataset &d);
+static uint32_t kDispatch(const Dataset &d);
+static uint32_t kZevaDecode(const Dataset &d);
+static uint32_t kZevaSoa(const Dataset &d);
+static uint32_t kPackStats(const Dataset &d);
+static uint32_t kCharger(const Dataset &d);
+static uint32_t kRxPath(const Dataset &d);
+
+static const Bench benches[] = {
+    { "id_pack_std",  kIdPackStd,   true  },
+    { "id_pack_ext",  kIdPackExt,   true  },
+    { "id_unpack",    kIdUnpack,    false },
+    { "tx_image",     kTxImage,     false },
+    { "rx_image",     kRxImage,     false },
+    { "filter_match", kFilterMatch, false },
+    { "dispatch",     kDispatch,    false },
+    { "zeva_decode",  kZevaDecode,  false },
+    { "zeva_soa",     kZevaSoa,     false },
+    { "pack_stats",   kPackStats,   false },
+    { "charger",      kCharger,     false },
+    { "rx_path",      kRxPath,      false },
+};
+
+
+int main(int argc, char **argv)
+{
+    Dataset d;
+    INT32U  passes = PASSES;
+
+    seedState = SEED;
+    if (argc > 1)
+    {
+        passes = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2)
+    {
+        seedState = strtoul(argv[2], NULL, 0);
+    }
+    if (seedState == 0)
+    {
+        seedState = SEED;                          // xorshift never leaves 0
+    }
+
+    buildDataset(d);
+    zevaPackInit(&pack, nBMS);
+    zevaPackStatsInit(&packStats, &pack, 2800, 4200, 70);
+    chargerCommandInit(&chargerCmd, chargerID);
+
+    printf("kernel,ops,ns_per_op_min,ns_per_op_median,checksum\n");
+    for (unsigned b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+    {
+        std::vector<double> ns;
+        uint32_t            check = benches[b].kernel(d);  // Warm up, and the reference result
+        double              ops   = (double)passes * (benches[b].perId ? d.stdIds.size() : d.frames.size());
+
+        for (int r = 0; r < RUNS; r++)
+        {
+            uint64_t t0 = canNowNs();
+            uint32_t x  = 0;
+
+            for (INT32U p = 0; p < passes; p++)
+            {
+                x += benches[b].kernel(d);
+            }
+            ns.push_back((canNowNs() - t0) / ops);
+            sink = x;
+        }
+        std::sort(ns.begin(), ns.end());
+
+        printf("%s,%.0f,%.2f,%.2f,%08lx\n", benches[b].name, ops, ns[0], ns[ns.size() / 2], (unsigned long)check);
+    }
+
+    return 0;
+}
+
+
+static uint32_t kIdPackStd(const Dataset &d)
+{
+    INT8U    image[4];
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.stdIds.size(); i++)
+    {
+        canEncodeId(0, d.stdIds[i], image);
+        x = (x << 1 | x >> 31) ^ (image[0] | image[1] << 8 | image[2] << 16 | (uint32_t)image[3] << 24);
+    }
+    return x;
+}
+
+
+static uint32_t kIdPackExt(const Dataset &d)
+{
+    INT8U    image[4];
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.extIds.size(); i++)
+    {
+        canEncodeId(1, d.extIds[i], image);
+        x = (x << 1 | x >> 31) ^ (image[0] | image[1] << 8 | image[2] << 16 | (uint32_t)image[3] << 24);
+    }
+    return x;
+}
+
+
+static uint32_t kIdUnpack(const Dataset &d)
+{
+    INT8U    ext;
+    INT32U   id;
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        canDecodeId(&d.rxImages[i * MCP_RXB_IMAGE_LEN], &ext, &id);
+        x = (x << 1 | x >> 31) ^ (uint32_t)id ^ ext;
+    }
+    return x;
+}
+
+
+static uint32_t kTxImage(const Dataset &d)
+{
+    INT8U    image[MCP_TXB_IMAGE_LEN];
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        INT8U n = canEncodeTxImage(d.frames[i], image);
+
+        x = (x << 1 | x >> 31) ^ image[MCP_SIDH] ^ image[MCP_SIDL] << 8 ^ image[n - 1] << 16 ^ n;
+    }
+    return x;
+}
+
+
+static uint32_t kRxImage(const Dataset &d)
+{
+    CanFrame f;
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        canDecodeRxImage(&d.rxImages[i * MCP_RXB_IMAGE_LEN], f);
+        x = (x << 1 | x >> 31) ^ (uint32_t)f.id ^ f.dlc << 24 ^ f.data[0] ^ f.data[7] << 8;
+    }
+    return x;
+}
+
+
+/*
+ * RXB0 (RXM0, RXF0..1) and RXB1 (RXM1, RXF2..5) in that order, first hit wins, like the controller.
+ */
+static uint32_t kFilterMatch(const Dataset &d)
+{
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        uint32_t hit = 7;
+
+        for (INT8U k = 0; k < 6; k++)
+        {
+            if (canFilterMatch(d.masks[k < 2 ? 0 : 1], d.filters[k], d.frames[i]))
+            {
+                hit = k;
+                break;
+            }
+        }
+        x = (x << 3 | x >> 29) ^ hit;
+    }
+    return x;
+}
+
+
+static uint32_t kDispatch(const Dataset &d)
+{
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        x = (x << 2 | x >> 30) ^ (uint32_t)dispatchFrame(d.frames[i]);
+    }
+    return x;
+}
+
+
+static uint32_t kZevaDecode(const Dataset &d)
+{
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        decodeFrame(dispatchFrame(d.frames[i]), d.frames[i]);
+    }
+    for (int i = 0; i < nBMS * 14 + 7; i++)
+    {
+        x = (x << 1 | x >> 31) ^ (uint32_t)data[i];
+    }
+    return x;
+}
+
+
+static uint32_t kZevaSoa(const Dataset &d)
+{
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        zevaDecode(&pack, d.frames[i]);
+    }
+    for (int i = 0; i < nBMS * ZEVA_CELLS; i++)
+    {
+        x = (x << 1 | x >> 31) ^ pack.cell_mv[i];
+    }
+    for (int i = 0; i < nBMS * ZEVA_TEMPS; i++)
+    {
+        x = (x << 1 | x >> 31) ^ (uint32_t)pack.temp_c[i];
+    }
+    return x;
+}
+
+
+/*
+ * Decode, then the per-module analytics update and the window check, as on every received frame.
+ */
+static uint32_t kPackStats(const Dataset &d)
+{
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        zevaPackStatsUpdate(&packStats, &pack, zevaDecode(&pack, d.frames[i]));
+        x = (x << 1 | x >> 31) ^ zevaPackOK(&packStats);
+    }
+    return x ^ packStats.cells.sum_mv ^ (uint32_t)packStats.cells.imbalance_mv << 16;
+}
+
+
+/*
+ * Every frame read as a charger status, and the cached command patched with a new setpoint from it.
+ */
+static uint32_t kCharger(const Dataset &d)
+{
+    ChargerStatus s = ChargerStatus();
+    uint32_t      x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        chargerDecodeStatus(d.frames[i], &s);
+        chargerSetVoltage(&chargerCmd, s.voltage_dv);
+        chargerSetCurrent(&chargerCmd, chargerDeci(s.current_da * 100U));
+        chargerSetCharge(&chargerCmd, (s.flags & CHARGER_FLAGS) == 0);
+        x = (x << 1 | x >> 31) ^ chargerCmd.data[1] ^ (uint32_t)chargerCmd.data[3] << 8 ^ chargerCmd.data[4];
+    }
+    return x;
+}
+
+
+static uint32_t kRxPath(const Dataset &d)
+{
+    CanFrame f;
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        canDecodeRxImage(&d.rxImages[i * MCP_RXB_IMAGE_LEN], f);
+        decodeFrame(dispatchFrame(f), f);
+    }
+    for (int i = 0; i < nBMS * 14 + 7; i++)
+    {
+        x = (x << 1 | x >> 31) ^ (uint32_t)data[i];
+    }
+    return x;
+}
+
+
+/*
+ * The id tests of readIncomingCANMsg(): 0 other, 1 charger, 2 BMS.
+ */
+static int dispatchFrame(const CanFrame &f)
+{
+    INT32U canId = f.id & 0x1FFFFFFF;
+
+    if (canId == chargerID)
+    {
+        return 1;
+    }
+    if ((canId > 300) && (canId < 300 + 16 * 10))
+    {
+        return 2;
+    }
+    return 0;
+}
+
+
+/*
+ * The body of readIncomingCANMsg() in 1_charger_and_bms.cxx and 3MaquinaEstados.cxx.
+ */
+static void decodeFrame(int kind, const CanFrame &f)
+{
+    const INT8U *buf   = f.data;
+    INT32U       canId = f.id & 0x1FFFFFFF;
+
+    if (kind == 1)
+    {
+        // Vc
+        data[nBMS * 14] = ((buf[0] << 8) + buf[1]) * 100;
+        // Ic
+        data[nBMS * 14 + 1] = ((buf[2] << 8) + buf[3]) * 100;
+        // Flags
+        int flags = buf[4];
+        data[nBMS * 14 + 2] = (flags >> 7) & 0x1; // Flag 0
+        data[nBMS * 14 + 3] = (flags >> 6) & 0x1; // Flag 1
+        data[nBMS * 14 + 4] = (flags >> 5) & 0x1; // Flag 2
+        data[nBMS * 14 + 5] = (flags >> 4) & 0x1; // Flag 3
+        data[nBMS * 14 + 6] = (flags >> 3) & 0x1; // Flag 4
+    }
+    else if (kind == 2)
+    {
+        // BMS number (1-16)
+        int n = (canId - 300) / 10;
+        // Message number (0-3)
+        int m = (canId - 300 - n * 10 - 1);
+
+        // Voltage frame
+        if (m < 3)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                data[n * 14 + m * 4 + i] = (buf[2 * i] << 8) + buf[2 * i + 1];
+            }
+        }
+        // Temperature frame
+        else if (m == 3)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                data[n * 14 + m * 4 + i] = buf[i] - 40;
+            }
+        }
+    }
+}
+
+
+/*
+ * Bus order: module by module, frames 1..4 of each (ids 300 + 10n + 1..4), a charger status frame
+ * after every round, and unrelated traffic in between. Masks and filters: RXB0 takes the charger
+ * (exact 29-bit match), RXB1 the BMS ids 300..459 by their upper bits and a few diagnostics ids.
+ */
+static void buildDataset(Dataset &d)
+{
+    INT32U module = 0, frame = 0;
+
+    while (d.frames.size() < DATASET)
+    {
+        CanFrame f;
+
+        f.ext       = 0;
+        f.rtr       = 0;
+        f.dlc       = 8;
+        f.filhit    = 0;
+        f.timestamp = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            f.data[i] = 0;
+        }
+
+        if (nextRandom() % 10 == 0)
+        {
+            f.id  = 0x500 + nextRandom() % 0x300;
+            f.dlc = nextRandom() % 9;
+            for (int i = 0; i < f.dlc; i++)
+            {
+                f.data[i] = (INT8U)nextRandom();
+            }
+        }
+        else if (module == nBMS)
+        {
+            INT32U vc = 900 + nextRandom() % 5;        // 90.0 V
+            INT32U ic = 50 + nextRandom() % 3;         // 5.0 A
+
+            f.id      = chargerID;
+            f.ext     = 1;
+            f.data[0] = (INT8U)(vc >> 8);
+            f.data[1] = (INT8U)vc;
+            f.data[2] = (INT8U)(ic >> 8);
+            f.data[3] = (INT8U)ic;
+            f.data[4] = (INT8U)((nextRandom() % 4 == 0) ? 0x08 : 0x00);
+            module    = 0;
+        }
+        else
+        {
+            f.id = 300 + module * 10 + frame + 1;
+            if (frame < 3)
+            {
+                for (int i = 0; i < 4; i++)
+                {
+                    int mv = cellBase[frame * 4 + i] + (int)(nextRandom() % 13) - 6;
+
+                    f.data[2 * i]     = (INT8U)(mv >> 8);
+                    f.data[2 * i + 1] = (INT8U)mv;
+                }
+            }
+            else
+            {
+                f.dlc     = 2;
+                f.data[0] = (INT8U)(60 + nextRandom() % 3);  // 20 C + 40
+                f.data[1] = (INT8U)(60 + nextRandom() % 3);
+            }
+            if (++frame == 4)
+            {
+                frame = 0;
+                module++;
+            }
+        }
+
+        d.frames.push_back(f);
+    }
+
+    d.rxImages.resize(d.frames.size() * MCP_RXB_IMAGE_LEN);
+    for (size_t i = 0; i < d.frames.size(); i++)
+    {
+        storeRxImage(d.frames[i], &d.rxImages[i * MCP_RXB_IMAGE_LEN]);
+        d.stdIds.push_back(nextRandom() & 0x7FF);
+        d.extIds.push_back(nextRandom() & 0x1FFFFFFF);
+    }
+
+    canEncodeMf(1, 0x1FFFFFFF, d.masks[0]);
+    canEncodeMf(0, 0x07C00000, d.masks[1]);        // std id bits 10..6, data bytes ignored
+    canEncodeMf(1, chargerID, d.filters[0]);
+    canEncodeMf(1, chargerID, d.filters[1]);
+    canEncodeMf(0, 0x01000000, d.filters[2]);      // 256..319
+    canEncodeMf(0, 0x01400000, d.filters[3]);      // 320..383
+    canEncodeMf(0, 0x01800000, d.filters[4]);      // 384..447
+    canEncodeMf(0, 0x01C00000, d.filters[5]);      // 448..511
+}
+
+
+/*
+ * What the controller writes into RXBnSIDH..RXBnD7 for f.
+ */
+static void storeRxImage(const CanFrame &f, INT8U *image)
+{
+    canEncodeId(f.ext, f.id, image);
+    if (!f.ext && f.rtr)
+    {
+        image[MCP_SIDL] |= MCP_RXB_SRR_M;
+    }
+    image[MCP_RXB_DLC] = f.dlc | ((f.ext && f.rtr) ? MCP_RXB_RTR_M : 0);
+    for (int i = 0; i < 8; i++)
+    {
+        image[MCP_RXB_D0 + i] = f.data[i];
+    }
+}
+
+
+static uint32_t nextRandom()
+{
+    seedState ^= seedState << 13;
+    seedState ^= seedState >> 17;
+    seedState ^= seedState << 5;
+    return seedState;
+}
@@ -0,0 +1,154 @@
+/*
+ * 7_gateway.cxx
+ *
+ * CAN-to-CAN gateway between the motor controller bus (CAN0) and the battery bus (CAN1), with the
+ * two-controller wiring of 04DosBusCan.cxx. Only the frames in the routing table cross; the rest
+ * stays on its own bus and is printed here.
+ *
+ * Connections (SPI 0 of the Raspberry Pi):
+ * MOSI (GPIO10);
+ * MISO (GPIO9);
+ * SCLK (GPIO11);
+ * CE0 (GPIO8), INT (GPIO25): CAN0, motor controller
+ * CE1 (GPIO7), INT (GPIO24): CAN1, battery
+ *
+ */
+
+
+// Presinstalled libraries
+#include <iostream>
+#include <unistd.h>
+
+// CAN library (with mcp2515), bus manager and gateway
+#include "src/mcp_can_rpi.h"
+#include "src/mcp_gateway_rpi.h"
+
+// Shows more information on the console
+#define DEBUG_MODE    1
+
+#define IntPIN0       25
+#define IntPIN1       24
+
+#define MOTOR_BUS     0
+#define BATTERY_BUS   1
+
+MCP_CAN CAN0(0, 10000000, IntPIN0);
+MCP_CAN CAN1(1, 10000000, IntPIN1);
+
+McpBusManager buses;
+McpGateway    gateway(&buses);
+
+// src_bus, ext, id, mask, dst_bus, rewrite_mask, rewrite_id, rate_hz, burst, local
+static const McpGatewayRoute routes[] = {
+    // Motor status 0x100..0x10F goes to the battery bus as 0x300..0x30F
+    { MOTOR_BUS,   0, 0x100,      0x7F0,      BATTERY_BUS, 0x700, 0x300, 0,  0, 0 },
+    // Charger status (J1939 style, extended), at most 10 per second, also printed here
+    { BATTERY_BUS, 1, 0x18FF50E5, 0x1FFFFFFF, MOTOR_BUS,   0,     0,     10, 2, 1 },
+    // BMS cell data 0x200..0x2FF, unchanged
+    { BATTERY_BUS, 0, 0x200,      0x700,      MOTOR_BUS,   0,     0,     0,  0, 0 },
+};
+
+void printLocal(INT8U bus);
+void printStats();
+
+int main()
+{
+    /* -----------------------------------------------------------------
+     * SETUP
+     * -----------------------------------------------------------------
+     */
+
+    printf("Welcome\n\n");
+
+    CAN0.setupInterruptGpio();
+    CAN0.setupSpi();
+    CAN1.setupInterruptGpio();
+    CAN1.setupSpi();
+    printf("GPIO Pins initialized & SPI started\n");
+
+    while (CAN_OK != CAN0.begin(MCP_ANY, CAN_500KBPS, MCP_8MHZ))
+    {
+        printf("CAN BUS Shield 0 init fail\n");
+        usleep(1000000);
+    }
+    CAN0.setMode(MCP_NORMAL);
+
+    while (CAN_OK != CAN1.begin(MCP_ANY, CAN_500KBPS, MCP_8MHZ))
+    {
+        printf("CAN BUS Shield 1 init fail\n");
+        usleep(1000000);
+    }
+    CAN1.setMode(MCP_NORMAL);
+    printf("CAN BUS Shields init ok!\n");
+
+    buses.addBus(&CAN0, CAN_RING_DROP_OLDEST);                  // MOTOR_BUS
+    buses.addBus(&CAN1, CAN_RING_DROP_OLDEST);                  // BATTERY_BUS
+
+    for (unsigned i = 0; i < sizeof(routes) / sizeof(routes[0]); i++)
+    {
+        gateway.addRoute(routes[i]);
+    }
+    if (gateway.compile() != CAN_OK)
+    {
+        printf("Routing table refers to an unknown bus\n");
+        return 1;
+    }
+
+    // Forwarding runs in the manager's thread: give it the CPU before anything else on the Pi
+    buses.start(50, 3);
+
+    while (1)
+    {
+        /* -----------------------------------------------------------------
+         * LOOP
+         * -----------------------------------------------------------------
+         */
+        printLocal(MOTOR_BUS);
+        printLocal(BATTERY_BUS);
+        printStats();
+        usleep(1000000);
+    }
+    return 0;
+}
+
+
+void printLocal(INT8U bus)
+{
+    CanFrame frame;
+
+    while (buses.readFrames(bus, &frame, 1) == 1)               // not forwarded, or local routes
+    {
+        printf("bus %d ID: %lx | len:%d\n", bus, (unsigned long)frame.id, frame.dlc);
+    }
+}
+
+
+void printStats()
+{
+    McpGatewayLatency lat = gateway.latency();
+
+    for (INT32U r = 0; r < gateway.routeCount(); r++)
+    {
+        McpRouteStats s = gateway.routeStats(r);
+
+        printf("route %lu: matched %lu forwarded %lu rate limited %lu queue full %lu max %lu us\n",
+               (unsigned long)r, (unsigned long)s.matched, (unsigned long)s.forwarded,
+               (unsigned long)s.rate_limited, (unsigned long)s.queue_full,
+               (unsigned long)(s.latency_max_ns / 1000));
+    }
+
+    printf("latency (us, log2 buckets):");
+    for (int k = 0; k < MCP_GW_HIST_BUCKETS; k++)
+    {
+        printf(" %lu", (unsigned long)lat.buckets[k]);
+    }
+    if (lat.count > 0)
+    {
+        printf(" | mean %lu max %lu\n", (unsigned long)(lat.total_ns / lat.count / 1000),
+               (unsigned long)(lat.max_ns / 1000));
+    }
+    else
+    {
+        printf("\n");
+    }
+}
@@ -0,0 +1,217 @@
+/*
+ *  can_codec_rpi.h
+ *  CPU-side kernels shared by MCP_CAN and the tools around it: packing CAN identifiers into the
+ *  MCP2515 SIDH/SIDL/EID8/EID0 layout and back, TX/RX buffer images, and the acceptance filter test.
+ *  They touch no hardware, so they can be measured on their own (see 6_microbench.cxx).
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef CAN_CODEC_RPI_H
+#define CAN_CODEC_RPI_H
+
+#include <stdint.h>
+
+#include "mcp_can_dfs_rpi.h"
+
+#define MAX_CHAR_IN_MESSAGE    8
+
+struct CanFrame
+{
+    INT32U id;                                                          // CAN ID (without flag bits)
+    INT8U  ext;                                                         // Extended (29 bit) identifier
+    INT8U  rtr;                                                         // Remote request flag
+    INT8U  dlc;                                                         // Data Length Code
+    INT8U  data[MAX_CHAR_IN_MESSAGE];                                   // Data array
+    INT8U  filhit;                                                      // Acceptance filter hit, RXF0..5
+    uint64_t timestamp;                                                 // CLOCK_MONOTONIC ns at reception
+};
+
+
+/*********************************************************************************************************
+** Function name:           canEncodeId
+** Descriptions:            Encode CAN ID into a SIDH/SIDL/EID8/EID0 register image
+*********************************************************************************************************/
+static inline void canEncodeId(const INT8U ext, const INT32U id, INT8U *tbufdata)
+{
+    uint16_t canid;
+
+    canid = (uint16_t)(id & 0x0FFFF);
+
+    if (ext == 1)
+    {
+        tbufdata[MCP_EID0] = (INT8U)(canid & 0xFF);
+        tbufdata[MCP_EID8] = (INT8U)(canid >> 8);
+        canid = (uint16_t)(id >> 16);
+        tbufdata[MCP_SIDL]  = (INT8U)(canid & 0x03);
+        tbufdata[MCP_SIDL] += (INT8U)((canid & 0x1C) << 3);
+        tbufdata[MCP_SIDL] |= MCP_TXB_EXIDE_M;
+        tbufdata[MCP_SIDH]  = (INT8U)(canid >> 5);
+    }
+    else
+    {
+        tbufdata[MCP_SIDH] = (INT8U)(canid >> 3);
+        tbufdata[MCP_SIDL] = (INT8U)((canid & 0x07) << 5);
+        tbufdata[MCP_EID0] = 0;
+        tbufdata[MCP_EID8] = 0;
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           canEncodeMf
+** Descriptions:            Encode Mask or Filter into a SIDH/SIDL/EID8/EID0 register image. For standard
+**                          ids bits 16..26 are the identifier and bits 0..15 match the first two data
+**                          bytes.
+*********************************************************************************************************/
+static inline void canEncodeMf(const INT8U ext, const INT32U id, INT8U *tbufdata)
+{
+    uint16_t canid;
+
+    canid = (uint16_t)(id & 0x0FFFF);
+
+    if (ext == 1)
+    {
+        tbufdata[MCP_EID0] = (INT8U)(canid & 0xFF);
+        tbufdata[MCP_EID8] = (INT8U)(canid >> 8);
+        canid = (uint16_t)(id >> 16);
+        tbufdata[MCP_SIDL]  = (INT8U)(canid & 0x03);
+        tbufdata[MCP_SIDL] += (INT8U)((canid & 0x1C) << 3);
+        tbufdata[MCP_SIDL] |= MCP_TXB_EXIDE_M;
+        tbufdata[MCP_SIDH]  = (INT8U)(canid >> 5);
+    }
+    else
+    {
+        tbufdata[MCP_EID0] = (INT8U)(canid & 0xFF);
+        tbufdata[MCP_EID8] = (INT8U)(canid >> 8);
+        canid = (uint16_t)(id >> 16);
+        tbufdata[MCP_SIDL] = (INT8U)((canid & 0x07) << 5);
+        tbufdata[MCP_SIDH] = (INT8U)(canid >> 3);
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           canDecodeId
+** Descriptions:            Decode CAN ID from a SIDH/SIDL/EID8/EID0 register image
+*********************************************************************************************************/
+static inline void canDecodeId(const INT8U *tbufdata, INT8U *ext, INT32U *id)
+{
+    *ext = 0;
+    *id  = (tbufdata[MCP_SIDH] << 3) + (tbufdata[MCP_SIDL] >> 5);
+
+    if ((tbufdata[MCP_SIDL] & MCP_TXB_EXIDE_M) == MCP_TXB_EXIDE_M)
+    {
+        /* extended id                  */
+        *id  = (*id << 2) + (tbufdata[MCP_SIDL] & 0x03);
+        *id  = (*id << 8) + tbufdata[MCP_EID8];
+        *id  = (*id << 8) + tbufdata[MCP_EID0];
+        *ext = 1;
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           canEncodeTxImage
+** Descriptions:            Build the TXBnSIDH..TXBnD7 image of frame. Returns the bytes that matter
+**                          (header and dlc data bytes).
+*********************************************************************************************************/
+static inline INT8U canEncodeTxImage(const CanFrame &frame, INT8U *image)
+{
+    INT8U dlc = frame.dlc & MCP_DLC_MASK;
+
+    if (dlc > MAX_CHAR_IN_MESSAGE)
+    {
+        dlc = MAX_CHAR_IN_MESSAGE;
+    }
+
+    canEncodeId(frame.ext, frame.id, image);                            /* CAN id                       */
+    image[MCP_TXB_DLC] = dlc;                                           /* RTR and DLC                  */
+    if (frame.rtr == 1)
+    {
+        image[MCP_TXB_DLC] |= MCP_RTR_MASK;
+    }
+    for (INT8U i = 0; i < dlc; i++)                                     /* data bytes                   */
+    {
+        image[MCP_TXB_D0 + i] = frame.data[i];
+    }
+
+    return MCP_TXB_D0 + dlc;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canDecodeRxImage
+** Descriptions:            Fills frame from a READ RX BUFFER image (SIDH to D7). filhit is left alone.
+*********************************************************************************************************/
+static inline void canDecodeRxImage(const INT8U *image, CanFrame &frame)
+{
+    canDecodeId(image, &frame.ext, &frame.id);
+
+    if (frame.ext)                                                      /* ext: RTR bit in RXBnDLC      */
+    {
+        frame.rtr = (image[MCP_RXB_DLC] & MCP_RXB_RTR_M) ? 1 : 0;
+    }
+    else                                                                /* std: SRR bit in RXBnSIDL     */
+    {
+        frame.rtr = (image[MCP_SIDL] & MCP_RXB_SRR_M) ? 1 : 0;
+    }
+
+    frame.dlc = image[MCP_RXB_DLC] & MCP_DLC_MASK;
+    if (frame.dlc > MAX_CHAR_IN_MESSAGE)
+    {
+        frame.dlc = MAX_CHAR_IN_MESSAGE;
+    }
+
+    for (int i = 0; i < MAX_CHAR_IN_MESSAGE; i++)                       /* fixed size copy              */
+    {
+        frame.data[i] = image[MCP_RXB_D0 + i];
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           canFilterMatch
+** Descriptions:            MCP2515 acceptance test of frame against one filter under one mask, both as
+**                          register images. For standard frames the EID8 and EID0 bytes of mask and
+**                          filter apply to the first two data bytes.
+*********************************************************************************************************/
+static inline bool canFilterMatch(const INT8U *m, const INT8U *f, const CanFrame &frame)
+{
+    INT32U msid = (m[MCP_SIDH] << 3) | (m[MCP_SIDL] >> 5);
+    INT32U fsid = (f[MCP_SIDH] << 3) | (f[MCP_SIDL] >> 5);
+    INT32U meid, feid;
+
+    if (((f[MCP_SIDL] & MCP_TXB_EXIDE_M) ? 1 : 0) != frame.ext)
+    {
+        return false;
+    }
+
+    if (frame.ext)
+    {
+        meid = ((INT32U)(m[MCP_SIDL] & 0x03) << 16) | ((INT32U)m[MCP_EID8] << 8) | m[MCP_EID0];
+        feid = ((INT32U)(f[MCP_SIDL] & 0x03) << 16) | ((INT32U)f[MCP_EID8] << 8) | f[MCP_EID0];
+
+        return (((frame.id >> 18) ^ fsid) & msid) == 0 && ((frame.id ^ feid) & meid & 0x3FFFF) == 0;
+    }
+
+    if (((frame.id ^ fsid) & msid) != 0)
+    {
+        return false;
+    }
+    for (INT8U i = 0; i < 2; i++)
+    {
+        if (!frame.rtr && i < frame.dlc && ((frame.data[i] ^ f[MCP_EID8 + i]) & m[MCP_EID8 + i]) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif
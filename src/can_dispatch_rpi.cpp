@@ -0,0 +1,313 @@
+/*
+ *  can_dispatch_rpi.cpp
+ *  Per-ID frame dispatch.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define CAN_DISPATCH_USED      0x80000000
+
+
+/*********************************************************************************************************
+** Function name:           canDispatchHash
+** Descriptions:            Home slot of an extended ID (multiplicative hashing)
+*********************************************************************************************************/
+static inline uint32_t canDispatchHash(INT32U id)
+{
+    return ((uint32_t)id * 2654435761U) >> (32 - 10);                   /* 2^10 = CAN_DISPATCH_EXT_SLOTS */
+}
+
+
+/*********************************************************************************************************
+** Function name:           CanDispatcher
+** Descriptions:            No rules, no default handler
+*********************************************************************************************************/
+CanDispatcher::CanDispatcher()
+{
+    n_rules         = 0;
+    default_handler = NULL;
+    default_ctx     = NULL;
+    n_unmatched     = 0;
+    n_ext_hashed    = 0;
+    n_ext_wide      = 0;
+    memset(std_rule, CAN_DISPATCH_NONE, sizeof(std_rule));
+    memset(ext_hash, 0, sizeof(ext_hash));
+}
+
+
+/*********************************************************************************************************
+** Function name:           add
+** Descriptions:            Appends rule after checking it. Takes effect at compile().
+*********************************************************************************************************/
+int CanDispatcher::add(const CanDispatchRule &rule)
+{
+    INT32U max = rule.ext ? 0x1FFFFFFF : 0x7FF;
+
+    if (n_rules == CAN_DISPATCH_MAX_RULES || rule.handler == NULL || rule.lo > rule.hi || rule.hi > max)
+    {
+        return -1;
+    }
+
+    rules[n_rules] = rule;
+    return n_rules++;
+}
+
+
+/*********************************************************************************************************
+** Function name:           addExact
+** Descriptions:            Public function, handler gets the frames with this ID
+*********************************************************************************************************/
+int CanDispatcher::addExact(INT8U ext, INT32U id, CanHandler handler, void *ctx)
+{
+    return addRange(ext, id, id, handler, ctx);
+}
+
+
+/*********************************************************************************************************
+** Function name:           addRange
+** Descriptions:            Public function, handler gets the frames with lo <= ID <= hi
+*********************************************************************************************************/
+int CanDispatcher::addRange(INT8U ext, INT32U lo, INT32U hi, CanHandler handler, void *ctx)
+{
+    CanDispatchRule rule;
+
+    rule.ext     = ext ? 1 : 0;
+    rule.lo      = lo;
+    rule.hi      = hi;
+    rule.value   = 0;
+    rule.mask    = 0;
+    rule.handler = handler;
+    rule.ctx     = ctx;
+
+    return add(rule);
+}
+
+
+/*********************************************************************************************************
+** Function name:           addMask
+** Descriptions:            Public function, handler gets the frames whose ID matches id in the mask bits
+*********************************************************************************************************/
+int CanDispatcher::addMask(INT8U ext, INT32U id, INT32U mask, CanHandler handler, void *ctx)
+{
+    INT32U max = ext ? 0x1FFFFFFF : 0x7FF;
+
+    if ((mask & max) == max)
+    {
+        return addRange(ext, id & max, id & max, handler, ctx);         /* full mask: one ID            */
+    }
+
+    CanDispatchRule rule;
+
+    rule.ext     = ext ? 1 : 0;
+    rule.lo      = 0;
+    rule.hi      = max;
+    rule.value   = id & mask & max;
+    rule.mask    = mask & max;
+    rule.handler = handler;
+    rule.ctx     = ctx;
+
+    return add(rule);
+}
+
+
+/*********************************************************************************************************
+** Function name:           setDefault
+** Descriptions:            Public function, handler for frames no rule matches (NULL: none)
+*********************************************************************************************************/
+void CanDispatcher::setDefault(CanHandler handler, void *ctx)
+{
+    default_handler = handler;
+    default_ctx     = ctx;
+}
+
+
+/*********************************************************************************************************
+** Function name:           firstMatch
+** Descriptions:            First rule in registration order for id
+*********************************************************************************************************/
+INT8U CanDispatcher::firstMatch(INT8U ext, INT32U id)
+{
+    for (INT32U i = 0; i < n_rules; i++)
+    {
+        const CanDispatchRule &r = rules[i];
+
+        if (r.ext == ext && r.lo <= id && id <= r.hi && ((id ^ r.value) & r.mask) == 0)
+        {
+            return i;
+        }
+    }
+
+    return CAN_DISPATCH_NONE;
+}
+
+
+/*********************************************************************************************************
+** Function name:           insertExt
+** Descriptions:            Puts an extended ID in the hash with its first matching rule, unless it is there
+*********************************************************************************************************/
+bool CanDispatcher::insertExt(INT32U id)
+{
+    uint32_t h = canDispatchHash(id);
+
+    for (;;)
+    {
+        ExtSlot &s = ext_hash[h];
+
+        if (s.key == (id | CAN_DISPATCH_USED))
+        {
+            return true;
+        }
+        if (s.key == 0)
+        {
+            if (n_ext_hashed == CAN_DISPATCH_EXT_IDS)
+            {
+                return false;
+            }
+            s.key  = id | CAN_DISPATCH_USED;
+            s.rule = firstMatch(1, id);
+            n_ext_hashed++;
+            return true;
+        }
+        h = (h + 1) & (CAN_DISPATCH_EXT_SLOTS - 1);
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           compile
+** Descriptions:            Public function, builds the lookup tables. Standard IDs get a direct table;
+**                          exact extended IDs and narrow extended ranges are expanded into the hash, each
+**                          entry already resolved to the first matching rule, and the other extended rules
+**                          are scanned in order after a hash miss (no narrow rule can match then).
+*********************************************************************************************************/
+INT8U CanDispatcher::compile(void)
+{
+    for (INT32U id = 0; id < CAN_DISPATCH_STD_IDS; id++)
+    {
+        std_rule[id] = firstMatch(0, id);
+    }
+
+    memset(ext_hash, 0, sizeof(ext_hash));
+    n_ext_hashed = 0;
+    n_ext_wide   = 0;
+    for (INT32U i = 0; i < n_rules; i++)
+    {
+        const CanDispatchRule &r = rules[i];
+
+        if (!r.ext)
+        {
+            continue;
+        }
+        if (r.hi - r.lo >= CAN_DISPATCH_EXPAND)
+        {
+            ext_wide[n_ext_wide++] = i;
+            continue;
+        }
+        for (INT32U id = r.lo; id <= r.hi; id++)
+        {
+            if (((id ^ r.value) & r.mask) == 0 && !insertExt(id))
+            {
+#if DEBUG_MODE
+                printf("Dispatch rule %lu: extended ID hash full\r\n", (unsigned long)i);
+#endif
+                return CAN_FAIL;
+            }
+        }
+    }
+    n_unmatched = 0;
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           lookup
+** Descriptions:            Public function, rule that gets frame, CAN_DISPATCH_NONE if none
+*********************************************************************************************************/
+INT8U CanDispatcher::lookup(const CanFrame &frame)
+{
+    if (!frame.ext)
+    {
+        return std_rule[frame.id & 0x7FF];
+    }
+
+    INT32U   key = frame.id | CAN_DISPATCH_USED;
+    uint32_t h   = canDispatchHash(frame.id);
+
+    while (ext_hash[h].key != 0)
+    {
+        if (ext_hash[h].key == key)
+        {
+            return ext_hash[h].rule;
+        }
+        h = (h + 1) & (CAN_DISPATCH_EXT_SLOTS - 1);
+    }
+
+    for (INT32U k = 0; k < n_ext_wide; k++)
+    {
+        const CanDispatchRule &r = rules[ext_wide[k]];
+
+        if (r.lo <= frame.id && frame.id <= r.hi && ((frame.id ^ r.value) & r.mask) == 0)
+        {
+            return ext_wide[k];
+        }
+    }
+
+    return CAN_DISPATCH_NONE;
+}
+
+
+/*********************************************************************************************************
+** Function name:           dispatch
+** Descriptions:            Public function, calls the handler of frame (or the default handler)
+*********************************************************************************************************/
+bool CanDispatcher::dispatch(const CanFrame &frame)
+{
+    INT8U r = lookup(frame);
+
+    if (r != CAN_DISPATCH_NONE)
+    {
+        rules[r].handler(rules[r].ctx, frame);
+        return true;
+    }
+
+    n_unmatched++;
+    if (default_handler != NULL)
+    {
+        default_handler(default_ctx, frame);
+    }
+    return false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           dispatch
+** Descriptions:            Public function, dispatches n frames in order
+*********************************************************************************************************/
+INT32U CanDispatcher::dispatch(const CanFrame *frames, INT32U n)
+{
+    INT32U handled = 0;
+
+    for (INT32U i = 0; i < n; i++)
+    {
+        handled += dispatch(frames[i]) ? 1 : 0;
+    }
+
+    return handled;
+}
+
+
+/*********************************************************************************************************
+** Function name:           unmatched
+** Descriptions:            Public function, frames no rule matched since compile()
+*********************************************************************************************************/
+INT32U CanDispatcher::unmatched(void)
+{
+    return n_unmatched;
+}
@@ -0,0 +1,93 @@
+/*
+ *  can_dispatch_rpi.h
+ *  Per-ID frame dispatch: handlers registered by exact ID, ID range or ID/mask, compiled into a
+ *  direct table for the 2048 standard IDs and an open addressed hash for extended IDs, so finding
+ *  the handler of a frame costs a fixed number of memory accesses. CPU only, like can_codec_rpi.h;
+ *  feed it what readFrames()/readMsgBatch() return.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef CAN_DISPATCH_RPI_H
+#define CAN_DISPATCH_RPI_H
+
+#include <stdint.h>
+
+#include "can_codec_rpi.h"
+
+#define CAN_DISPATCH_MAX_RULES   128                                    /* Handlers per dispatcher      */
+#define CAN_DISPATCH_NONE        0xFF
+#define CAN_DISPATCH_STD_IDS     2048                                   /* 11 bit identifiers           */
+#define CAN_DISPATCH_EXT_SLOTS   1024                                   /* Ext hash, power of two       */
+#define CAN_DISPATCH_EXT_IDS     (CAN_DISPATCH_EXT_SLOTS / 2)           /* ...at most half full         */
+#define CAN_DISPATCH_EXPAND      64                                     /* Ext range size put in hash   */
+
+// Called for every frame of its rule, from the thread that calls dispatch()
+typedef void (*CanHandler)(void *ctx, const CanFrame &frame);
+
+// Frames of one type with lo <= id <= hi and ((id ^ value) & mask) == 0
+struct CanDispatchRule
+{
+    INT8U  ext;
+    INT32U lo;
+    INT32U hi;
+    INT32U value;
+    INT32U mask;
+    CanHandler handler;
+    void *ctx;
+};
+
+/*
+ *  Usage: add the handlers, compile(), then dispatch() every frame received. The first rule in
+ *  registration order that matches a frame gets it; frames without a rule go to the default handler
+ *  if one is set. Extended ranges of up to CAN_DISPATCH_EXPAND IDs and exact extended IDs go into
+ *  the hash; wider extended rules are checked one by one after a hash miss. Rules cannot change
+ *  while another thread dispatches.
+ */
+class CanDispatcher
+{
+public:
+    CanDispatcher();
+
+    int addExact(INT8U ext, INT32U id, CanHandler handler, void *ctx);  // Rule number, -1 on failure
+    int addRange(INT8U ext, INT32U lo, INT32U hi, CanHandler handler, void *ctx);
+    int addMask(INT8U ext, INT32U id, INT32U mask, CanHandler handler, void *ctx);
+    void setDefault(CanHandler handler, void *ctx);                     // Frames without a rule
+    INT8U compile(void);                                                // CAN_OK / CAN_FAIL (hash full)
+
+    INT8U lookup(const CanFrame &frame);                                // Rule, CAN_DISPATCH_NONE if none
+    bool dispatch(const CanFrame &frame);                               // Handled by a rule
+    INT32U dispatch(const CanFrame *frames, INT32U n);                  // Frames handled by a rule
+    INT32U unmatched(void);                                             // Frames without a rule
+
+private:
+    struct ExtSlot
+    {
+        INT32U key;                                                     // id | CAN_DISPATCH_USED, 0 = free
+        INT8U rule;
+    };
+
+    int add(const CanDispatchRule &rule);
+    INT8U firstMatch(INT8U ext, INT32U id);                             // Linear scan, compile() only
+    bool insertExt(INT32U id);
+
+    CanDispatchRule rules[CAN_DISPATCH_MAX_RULES];
+    INT32U n_rules;
+    CanHandler default_handler;
+    void *default_ctx;
+    INT32U n_unmatched;
+
+    INT8U std_rule[CAN_DISPATCH_STD_IDS];                               // Rule of every 11 bit ID
+    ExtSlot ext_hash[CAN_DISPATCH_EXT_SLOTS];                           // Linear probing
+    INT32U n_ext_hashed;
+    INT8U ext_wide[CAN_DISPATCH_MAX_RULES];                             // Other ext rules, rule order
+    INT32U n_ext_wide;
+};
+
+#include "can_dispatch_rpi.cpp"
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ *  can_filter_plan_rpi.cpp
+ *  Mask/filter planner for the MCP2515 acceptance filters.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+
+#define CAN_PLAN_STD_SPACE    0x1FFC0000                                /* Standard ID bits, 29 bit layout */
+#define CAN_PLAN_EXT_SPACE    0x1FFFFFFF
+
+// A group of wanted IDs sharing one filter: every ID with (key ^ v) & m == 0
+struct CanPlanCluster
+{
+    INT8U  ext;
+    INT32U v;
+    INT32U m;
+    double cost;
+};
+
+struct CanPlanWork
+{
+    CanPlanCluster blocks[CAN_PLAN_MAX_BLOCKS];                         // The wanted set, exactly
+    INT32U n_blocks;
+    const CanIdTraffic *traffic;
+    INT32U n_traffic;
+    double unseen;                                                      // Weight of an ID let through
+    const CanFilterPlan *plan;                                          // Post-filter, for traffic
+};
+
+
+/*********************************************************************************************************
+** Function name:           canPlanSpace
+** Descriptions:            Bits of the 29 bit layout an ID of this type uses
+*********************************************************************************************************/
+static inline INT32U canPlanSpace(INT8U ext)
+{
+    return ext ? CAN_PLAN_EXT_SPACE : CAN_PLAN_STD_SPACE;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanKey
+** Descriptions:            ID in the 29 bit layout
+*********************************************************************************************************/
+static inline INT32U canPlanKey(INT8U ext, INT32U id)
+{
+    return ext ? id : id << 18;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanSize
+** Descriptions:            Number of IDs of a type with (key ^ v) & m == 0
+*********************************************************************************************************/
+static inline uint64_t canPlanSize(INT8U ext, INT32U m)
+{
+    INT32U space = canPlanSpace(ext);
+
+    return 1ULL << (__builtin_popcount(space) - __builtin_popcount(m & space));
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanCost
+** Descriptions:            Estimated unwanted frames accepted by one filter: every ID outside the wanted
+**                          set costs work->unseen, plus the frames observed on such IDs.
+*********************************************************************************************************/
+static double canPlanCost(const CanPlanWork *work, INT8U ext, INT32U v, INT32U m)
+{
+    uint64_t wanted = 0;
+    double   seen   = 0;
+
+    for (INT32U i = 0; i < work->n_blocks; i++)
+    {
+        const CanPlanCluster &b = work->blocks[i];
+
+        if (b.ext == ext && ((v ^ b.v) & m & b.m) == 0)
+        {
+            wanted += canPlanSize(ext, m | b.m);
+        }
+    }
+
+    for (INT32U i = 0; i < work->n_traffic; i++)
+    {
+        const CanIdTraffic &t = work->traffic[i];
+        CanFrame            frame;
+
+        if (t.ext != ext || ((canPlanKey(ext, t.id) ^ v) & m) != 0)
+        {
+            continue;
+        }
+        frame.ext = t.ext;
+        frame.id  = t.id;
+        if (!canPlanWanted(*work->plan, frame))
+        {
+            seen += t.frames;
+        }
+    }
+
+    return (double)(canPlanSize(ext, m) - wanted) * work->unseen + seen;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanNormalize
+** Descriptions:            Sorts the wanted ranges by type and start, merges overlapping and adjacent ones
+**                          and clips them to the ID space. Returns the count, -1 if there are too many.
+*********************************************************************************************************/
+static int canPlanNormalize(const CanIdRange *wanted, INT32U n, CanIdRange *out)
+{
+    INT32U count = 0;
+
+    for (INT32U i = 0; i < n; i++)
+    {
+        CanIdRange r   = wanted[i];
+        INT32U     top = r.ext ? 0x1FFFFFFF : 0x7FF;
+        INT32U     pos;
+
+        r.ext = r.ext ? 1 : 0;
+        if (r.hi > top)
+        {
+            r.hi = top;
+        }
+        if (r.lo > r.hi)
+        {
+            continue;
+        }
+        if (count == CAN_PLAN_MAX_RANGES)
+        {
+            return -1;
+        }
+
+        pos = count;                                                    /* insertion sort (ext, lo)     */
+        while (pos > 0 && (out[pos - 1].ext > r.ext || (out[pos - 1].ext == r.ext && out[pos - 1].lo > r.lo)))
+        {
+            out[pos] = out[pos - 1];
+            pos--;
+        }
+        out[pos] = r;
+        count++;
+    }
+
+    INT32U k = 0;
+
+    for (INT32U i = 0; i < count; i++)
+    {
+        if (k > 0 && out[k - 1].ext == out[i].ext && (uint64_t)out[k - 1].hi + 1 >= out[i].lo)
+        {
+            if (out[i].hi > out[k - 1].hi)
+            {
+                out[k - 1].hi = out[i].hi;
+            }
+            continue;
+        }
+        out[k++] = out[i];
+    }
+
+    return k;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanBlocks
+** Descriptions:            Splits a range into aligned power-of-two blocks (value/mask pairs). Returns
+**                          false if work->blocks is full.
+*********************************************************************************************************/
+static bool canPlanBlocks(CanPlanWork *work, const CanIdRange &r)
+{
+    uint64_t lo = r.lo;
+
+    while (lo <= r.hi)
+    {
+        uint64_t size = 1;
+
+        while ((lo & (size * 2 - 1)) == 0 && lo + size * 2 - 1 <= r.hi)
+        {
+            size *= 2;
+        }
+        if (work->n_blocks == CAN_PLAN_MAX_BLOCKS)
+        {
+            return false;
+        }
+
+        CanPlanCluster &b = work->blocks[work->n_blocks++];
+
+        b.ext = r.ext;
+        b.v   = canPlanKey(r.ext, (INT32U)lo);
+        b.m   = canPlanSpace(r.ext) & ~canPlanKey(r.ext, (INT32U)(size - 1));
+        lo   += size;
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanPlace
+** Descriptions:            Tries every split of k clusters between RXB0 (up to 2) and RXB1 (up to 4).
+**                          The mask of a buffer keeps only the bits all its clusters care about (and no
+**                          data byte bits if a standard filter uses it). Writes the best placement into
+**                          plan if it beats best; returns the best cost.
+*********************************************************************************************************/
+static double canPlanPlace(const CanPlanWork *work, const CanPlanCluster *c, INT32U k, CanFilterPlan *plan,
+                           double best)
+{
+    for (INT32U a = 0; a < (1U << k); a++)                              /* bit i set: cluster i in RXB0 */
+    {
+        INT32U   n0 = __builtin_popcount(a);
+        INT32U   m[2] = { CAN_PLAN_EXT_SPACE, CAN_PLAN_EXT_SPACE };
+        bool     has_std[2] = { false, false };
+        double   cost = 0;
+        uint64_t ids  = 0;
+
+        if (n0 > 2 || k - n0 > 4)
+        {
+            continue;
+        }
+
+        for (INT32U i = 0; i < k; i++)
+        {
+            INT32U b = (a >> i) & 1 ? 0 : 1;
+
+            m[b] &= c[i].m;
+            has_std[b] = has_std[b] || !c[i].ext;
+        }
+        for (INT32U b = 0; b < 2; b++)
+        {
+            if (has_std[b])
+            {
+                m[b] &= CAN_PLAN_STD_SPACE;
+            }
+        }
+        for (INT32U i = 0; i < k && cost < best; i++)
+        {
+            INT32U b = (a >> i) & 1 ? 0 : 1;
+
+            cost += canPlanCost(work, c[i].ext, c[i].v & m[b], m[b]);
+            ids  += canPlanSize(c[i].ext, m[b]);
+        }
+        if (cost >= best)
+        {
+            continue;
+        }
+
+        // Filters of each buffer; an empty buffer repeats a cluster of the other one under its own mask
+        const INT8U first[2] = { 0, 2 };
+        const INT8U slots[2] = { 2, 4 };
+        INT8U       used[2]  = { 0, 0 };
+
+        best               = cost;
+        plan->cost         = cost;
+        plan->accepted_ids = ids;
+        for (INT32U i = 0; i < k; i++)
+        {
+            INT32U b = (a >> i) & 1 ? 0 : 1;
+            INT8U  f = first[b] + used[b]++;
+
+            plan->filt_ext[f] = c[i].ext;
+            plan->filt[f]     = c[i].ext ? (c[i].v & m[b]) : (c[i].v & m[b]) >> 18;
+        }
+        for (INT32U b = 0; b < 2; b++)
+        {
+            if (used[b] == 0)
+            {
+                const CanPlanCluster &o = c[0];
+
+                m[b] = o.m & (o.ext ? CAN_PLAN_EXT_SPACE : CAN_PLAN_STD_SPACE);
+                plan->filt_ext[first[b]] = o.ext;
+                plan->filt[first[b]]     = o.ext ? o.v : o.v >> 18;
+                used[b] = 1;
+            }
+            for (INT8U f = used[b]; f < slots[b]; f++)                  /* spare filters: repeat first  */
+            {
+                plan->filt_ext[first[b] + f] = plan->filt_ext[first[b]];
+                plan->filt[first[b] + f]     = plan->filt[first[b]];
+            }
+            plan->mask[b] = m[b];
+        }
+    }
+
+    return best;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanFilters
+** Descriptions:            Plans masks and filters for the wanted ranges. Without traffic every unwanted
+**                          ID that gets through counts the same; with traffic (frames per ID over some
+**                          window) observed frames dominate and unseen IDs weigh CAN_PLAN_UNSEEN_WEIGHT.
+**                          The ranges start as one cluster each and the pair that adds the least cost is
+**                          merged until one per type is left; every stage with at most 6 clusters is
+**                          placed on the two buffers and the cheapest placement is kept. Every wanted ID
+**                          is accepted by the result.
+*********************************************************************************************************/
+INT8U canPlanFilters(const CanIdRange *wanted, INT32U n_wanted, const CanIdTraffic *traffic, INT32U n_traffic,
+                     CanFilterPlan *plan)
+{
+    CanPlanWork        work;
+    CanIdRange         ranges[CAN_PLAN_MAX_RANGES];
+    CanPlanCluster     c[CAN_PLAN_MAX_RANGES];
+    double             delta[CAN_PLAN_MAX_RANGES][CAN_PLAN_MAX_RANGES];
+    double             best = 1e300;
+    int                n;
+    INT32U             k;
+
+    n = canPlanNormalize(wanted, n_wanted, ranges);
+    if (n <= 0)
+    {
+        return CAN_FAIL;
+    }
+
+    // Post-filter: exact wanted set
+    memset(plan, 0, sizeof(*plan));
+    for (int i = 0; i < n; i++)
+    {
+        plan->wanted_ids += (uint64_t)ranges[i].hi - ranges[i].lo + 1;
+        if (ranges[i].ext)
+        {
+            plan->ext_wanted[plan->n_ext_wanted++] = ranges[i];
+            continue;
+        }
+        for (INT32U id = ranges[i].lo; id <= ranges[i].hi; id++)
+        {
+            plan->std_wanted[id >> 3] |= 1 << (id & 0x07);
+        }
+    }
+
+    work.n_blocks  = 0;
+    work.traffic   = traffic;
+    work.n_traffic = traffic ? n_traffic : 0;
+    work.unseen    = work.n_traffic ? CAN_PLAN_UNSEEN_WEIGHT : 1.0;
+    work.plan      = plan;
+    for (int i = 0; i < n; i++)
+    {
+        if (!canPlanBlocks(&work, ranges[i]))
+        {
+            return CAN_FAIL;
+        }
+    }
+
+    // One cluster per range: the smallest aligned block holding it
+    for (int i = 0; i < n; i++)
+    {
+        INT32U lo = canPlanKey(ranges[i].ext, ranges[i].lo);
+        INT32U hi = canPlanKey(ranges[i].ext, ranges[i].hi);
+        INT32U d  = lo ^ hi;
+
+        c[i].ext = ranges[i].ext;
+        c[i].m   = canPlanSpace(c[i].ext);
+        if (d)
+        {
+            c[i].m &= ~((1U << (32 - __builtin_clz(d))) - 1);
+        }
+        c[i].v    = lo & c[i].m;
+        c[i].cost = canPlanCost(&work, c[i].ext, c[i].v, c[i].m);
+    }
+    k = n;
+
+    for (INT32U i = 0; i < k; i++)
+    {
+        for (INT32U j = i + 1; j < k; j++)
+        {
+            INT32U m = c[i].m & c[j].m & ~(c[i].v ^ c[j].v);
+
+            delta[i][j] = (c[i].ext != c[j].ext) ? 1e300 :
+                          canPlanCost(&work, c[i].ext, c[i].v & m, m) - c[i].cost - c[j].cost;
+        }
+    }
+
+    for (;;)
+    {
+        INT32U bi = 0, bj = 0;
+        double bd = 1e300;
+
+        if (k <= MCP_N_FILTERS)
+        {
+            best = canPlanPlace(&work, c, k, plan, best);
+        }
+
+        for (INT32U i = 0; i < k; i++)
+        {
+            for (INT32U j = i + 1; j < k; j++)
+            {
+                if (delta[i][j] < bd)
+                {
+                    bd = delta[i][j];
+                    bi = i;
+                    bj = j;
+                }
+            }
+        }
+        if (bd >= 1e300)
+        {
+            break;                                                      /* one cluster per type left    */
+        }
+
+        // Merge bj into bi, move the last cluster into bj
+        c[bi].m   &= c[bj].m & ~(c[bi].v ^ c[bj].v);
+        c[bi].v   &= c[bi].m;
+        c[bi].cost = canPlanCost(&work, c[bi].ext, c[bi].v, c[bi].m);
+        k--;
+        if (bj != k)
+        {
+            c[bj] = c[k];
+            for (INT32U i = 0; i < k; i++)
+            {
+                if (i < bj)
+                {
+                    delta[i][bj] = delta[i][k];
+                }
+                else if (i > bj)
+                {
+                    delta[bj][i] = delta[i][k];
+                }
+            }
+        }
+        for (INT32U i = 0; i < k; i++)
+        {
+            INT32U lo = i < bi ? i : bi, hi = i < bi ? bi : i;
+            INT32U m  = c[lo].m & c[hi].m & ~(c[lo].v ^ c[hi].v);
+
+            if (i == bi)
+            {
+                continue;
+            }
+            delta[lo][hi] = (c[lo].ext != c[hi].ext) ? 1e300 :
+                            canPlanCost(&work, c[lo].ext, c[lo].v & m, m) - c[lo].cost - c[hi].cost;
+        }
+    }
+
+    return best < 1e300 ? CAN_OK : CAN_FAIL;
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanImages
+** Descriptions:            Register images of a plan: masks = RXM0SIDH..RXM1EID0 (8 bytes), filters =
+**                          RXF0..RXF5 (24 bytes, RXF3 starts at RXF3SIDH on the chip)
+*********************************************************************************************************/
+void canPlanImages(const CanFilterPlan &plan, INT8U *masks, INT8U *filters)
+{
+    canEncodeMf(1, plan.mask[0], &masks[0]);
+    canEncodeMf(1, plan.mask[1], &masks[4]);
+    for (INT8U i = 0; i < MCP_N_FILTERS; i++)
+    {
+        if (plan.filt_ext[i])
+        {
+            canEncodeMf(1, plan.filt[i], &filters[4 * i]);
+        }
+        else
+        {
+            canEncodeMf(0, plan.filt[i] << 16, &filters[4 * i]);
+        }
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           canPlanAccepts
+** Descriptions:            Acceptance of frame by the masks and filters of plan, as on the chip
+*********************************************************************************************************/
+bool canPlanAccepts(const CanFilterPlan &plan, const CanFrame &frame)
+{
+    INT8U masks[8], filters[4 * MCP_N_FILTERS];
+
+    canPlanImages(plan, masks, filters);
+    for (INT8U i = 0; i < MCP_N_FILTERS; i++)
+    {
+        if (canFilterMatch(&masks[i < 2 ? 0 : 4], &filters[4 * i], frame))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,103 @@
+/*
+ *  can_filter_plan_rpi.h
+ *  Mask/filter planner: turns the set of IDs an application wants into the two masks and six filters
+ *  of the MCP2515 (RXB0: mask 0, filters 0..1; RXB1: mask 1, filters 2..5), accepting as few unwanted
+ *  frames as the hardware allows, plus the exact set for a software post-filter of what gets through.
+ *  CPU only, like can_codec_rpi.h; MCP_CAN::setFilterPlan() programs the result.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef CAN_FILTER_PLAN_RPI_H
+#define CAN_FILTER_PLAN_RPI_H
+
+#include <stdint.h>
+
+#include "can_codec_rpi.h"
+
+#define CAN_PLAN_MAX_RANGES      64                                     /* Wanted ranges, both types    */
+#define CAN_PLAN_MAX_BLOCKS      512                                    /* Ranges as mask/value blocks  */
+#define CAN_PLAN_STD_BYTES       (2048 / 8)                             /* Post-filter bitmap           */
+#define CAN_PLAN_UNSEEN_WEIGHT   0.001                                  /* Frames per unseen ID (traffic)*/
+
+// IDs lo..hi (inclusive) of one type
+struct CanIdRange
+{
+    INT8U  ext;
+    INT32U lo;
+    INT32U hi;
+};
+
+// Frames seen per ID, to weigh what a mask lets through (see canPlanFilters)
+struct CanIdTraffic
+{
+    INT8U  ext;
+    INT32U id;
+    INT32U frames;
+};
+
+/*
+ *  Masks and filter values use one 29 bit layout for both types: the 11 bit standard part is bits
+ *  28..18 (a standard ID is id << 18), the 18 bit extended part bits 17..0. A mask shared with a
+ *  standard filter never has bits 17..0 set (on the chip they would match data bytes).
+ */
+struct CanFilterPlan
+{
+    INT32U mask[2];                                                     // RXM0, RXM1 (layout above)
+    INT8U  filt_ext[MCP_N_FILTERS];
+    INT32U filt[MCP_N_FILTERS];                                         // RXF0..5, frame IDs
+    double cost;                                                        // Estimated unwanted accepts
+    uint64_t accepted_ids;                                              // IDs the masks let through
+    uint64_t wanted_ids;
+
+    INT8U std_wanted[CAN_PLAN_STD_BYTES];                               // Post-filter, bit per std ID
+    CanIdRange ext_wanted[CAN_PLAN_MAX_RANGES];                         // Post-filter, sorted, disjoint
+    INT32U n_ext_wanted;
+};
+
+INT8U canPlanFilters(const CanIdRange *wanted, INT32U n_wanted,         // CAN_OK / CAN_FAIL
+                     const CanIdTraffic *traffic, INT32U n_traffic,
+                     CanFilterPlan *plan);
+void canPlanImages(const CanFilterPlan &plan,                           // Mask and filter register
+                   INT8U *masks, INT8U *filters);                       // images, 8 and 24 bytes
+bool canPlanAccepts(const CanFilterPlan &plan, const CanFrame &frame);  // What the chip lets through
+
+
+/*********************************************************************************************************
+** Function name:           canPlanWanted
+** Descriptions:            Post-filter: frame is one of the IDs the plan was made for
+*********************************************************************************************************/
+static inline bool canPlanWanted(const CanFilterPlan &plan, const CanFrame &frame)
+{
+    INT32U lo, hi, mid;
+
+    if (!frame.ext)
+    {
+        return (plan.std_wanted[(frame.id & 0x7FF) >> 3] >> (frame.id & 0x07)) & 1;
+    }
+
+    lo = 0;
+    hi = plan.n_ext_wanted;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (plan.ext_wanted[mid].hi < frame.id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo < plan.n_ext_wanted && plan.ext_wanted[lo].lo <= frame.id;
+}
+
+#include "can_filter_plan_rpi.cpp"
+
+#endif
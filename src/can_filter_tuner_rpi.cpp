@@ -0,0 +1,341 @@
+/*
+ *  can_filter_tuner_rpi.cpp
+ *  Adaptive mask/filter tuning for one MCP_CAN.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#define CAN_TUNE_KEY_EXT       0x80000000
+#define CAN_TUNE_KEY_STD       0x40000000
+
+
+/*********************************************************************************************************
+** Function name:           CanFilterTuner
+** Descriptions:            Tunes the filters of can; sees its post-filtered frames from now on
+*********************************************************************************************************/
+CanFilterTuner::CanFilterTuner(MCP_CAN *can)
+{
+    this->can       = can;
+    n_interest      = 0;
+    window          = 1;                                                /* last_used 0 = never used     */
+    window_start_ns = canNowNs();
+    planned         = false;
+    memset(counts, 0, sizeof(counts));
+    memset(&report, 0, sizeof(report));
+    pthread_mutex_init(&lock, NULL);
+
+    can->setRxFilterCallback(onFiltered, this);
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~CanFilterTuner
+** Descriptions:            Detaches from the controller; its filters stay as they are
+*********************************************************************************************************/
+CanFilterTuner::~CanFilterTuner()
+{
+    can->setRxFilterCallback(NULL, NULL);
+    pthread_mutex_destroy(&lock);
+}
+
+
+/*********************************************************************************************************
+** Function name:           setInterest
+** Descriptions:            Public function, IDs the application must receive whatever the traffic. Plans
+**                          and programs the filters at once. Returns CAN_OK or CAN_FAIL.
+*********************************************************************************************************/
+INT8U CanFilterTuner::setInterest(const CanIdRange *ids, INT32U n)
+{
+    if (n == 0 || n > CAN_PLAN_MAX_RANGES)
+    {
+        return CAN_FAIL;
+    }
+
+    pthread_mutex_lock(&lock);
+    memcpy(interest, ids, n * sizeof(CanIdRange));
+    n_interest = n;
+    pthread_mutex_unlock(&lock);
+
+    return replan(true).result;
+}
+
+
+/*********************************************************************************************************
+** Function name:           slot
+** Descriptions:            Counters of the frame's ID, created on first use (lock held)
+*********************************************************************************************************/
+CanFilterTuner::IdCount *CanFilterTuner::slot(const CanFrame &frame)
+{
+    INT32U key = (frame.ext ? CAN_TUNE_KEY_EXT : CAN_TUNE_KEY_STD) | frame.id;
+    INT32U h   = (key * 2654435761U) % CAN_TUNE_MAX_IDS;
+
+    for (INT32U k = 0; k < CAN_TUNE_MAX_IDS; k++)
+    {
+        IdCount *c = &counts[(h + k) % CAN_TUNE_MAX_IDS];
+
+        if (c->key == key)
+        {
+            return c;
+        }
+        if (c->key == 0)
+        {
+            c->key = key;
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*********************************************************************************************************
+** Function name:           account
+** Descriptions:            Public function, the application took frame from the driver and used it (or not)
+*********************************************************************************************************/
+void CanFilterTuner::account(const CanFrame &frame, bool used)
+{
+    pthread_mutex_lock(&lock);
+
+    IdCount *c = slot(frame);
+
+    if (c != NULL && used)
+    {
+        c->consumed++;
+        c->last_used = window;
+    }
+    else if (c != NULL)
+    {
+        c->discarded++;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*********************************************************************************************************
+** Function name:           onFiltered
+** Descriptions:            MCP_CAN post-filter callback: a read frame nobody wants
+*********************************************************************************************************/
+void CanFilterTuner::onFiltered(void *ctx, const CanFrame &frame)
+{
+    ((CanFilterTuner *)ctx)->account(frame, false);
+}
+
+
+/*********************************************************************************************************
+** Function name:           buildWanted
+** Descriptions:            Interest set plus the IDs used in the last CAN_TUNE_FORGET windows (lock held).
+**                          Returns the number of ranges, CAN_PLAN_MAX_RANGES + 1 if they do not fit.
+*********************************************************************************************************/
+INT32U CanFilterTuner::buildWanted(CanIdRange *ranges)
+{
+    INT32U n = n_interest;
+
+    memcpy(ranges, interest, n * sizeof(CanIdRange));
+    for (INT32U i = 0; i < CAN_TUNE_MAX_IDS; i++)
+    {
+        const IdCount &c = counts[i];
+        CanIdRange    r;
+        bool          covered = false;
+
+        if (c.key == 0 || c.last_used == 0 || window - c.last_used >= CAN_TUNE_FORGET)
+        {
+            continue;
+        }
+
+        r.ext = (c.key & CAN_TUNE_KEY_EXT) ? 1 : 0;
+        r.lo  = c.key & 0x1FFFFFFF;
+        r.hi  = r.lo;
+        for (INT32U k = 0; k < n_interest && !covered; k++)
+        {
+            covered = interest[k].ext == r.ext && interest[k].lo <= r.lo && r.lo <= interest[k].hi;
+        }
+        if (covered)
+        {
+            continue;
+        }
+        if (n == CAN_PLAN_MAX_RANGES)
+        {
+            return CAN_PLAN_MAX_RANGES + 1;
+        }
+        ranges[n++] = r;
+    }
+
+    return n;
+}
+
+
+/*********************************************************************************************************
+** Function name:           replan
+** Descriptions:            Plans from the window's counts and programs the plan if the wanted set changed,
+**                          the accepted frames drop by CAN_TUNE_MIN_GAIN or force is set. The counts
+**                          start over. The filters are written without holding the tuner lock (the
+**                          post-filter callback takes it with the SPI lock held); if setFilterPlan()
+**                          fails, nothing was written and the programmed plan is kept.
+*********************************************************************************************************/
+CanTuneReport CanFilterTuner::replan(bool force)
+{
+    CanIdRange    ranges[CAN_PLAN_MAX_RANGES];
+    CanIdTraffic  traffic[CAN_TUNE_MAX_IDS];
+    CanFilterPlan next;
+    CanTuneReport r;
+    INT32U        n, n_traffic = 0;
+    uint64_t      now = canNowNs();
+    bool          apply = false;
+
+    memset(&r, 0, sizeof(r));
+    pthread_mutex_lock(&lock);
+
+    r.window_ns           = now - window_start_ns;
+    r.accepted_ids_before = planned ? plan.accepted_ids : (1ULL << 11) + (1ULL << 29);
+    r.accepted_ids_after  = r.accepted_ids_before;
+    r.result              = CAN_FAIL;
+
+    for (INT32U i = 0; i < CAN_TUNE_MAX_IDS; i++)
+    {
+        const IdCount &c = counts[i];
+
+        r.frames    += c.consumed + c.discarded;
+        r.consumed  += c.consumed;
+        r.discarded += c.discarded;
+        if (c.key != 0 && c.discarded + c.history > 0)                  // Hidden IDs keep their weight
+        {
+            traffic[n_traffic].ext    = (c.key & CAN_TUNE_KEY_EXT) ? 1 : 0;
+            traffic[n_traffic].id     = c.key & 0x1FFFFFFF;
+            traffic[n_traffic].frames = c.discarded + c.history;
+            n_traffic++;
+        }
+    }
+    r.accepted_after = r.frames;
+
+    n = buildWanted(ranges);
+    if (n <= CAN_PLAN_MAX_RANGES && canPlanFilters(ranges, n, traffic, n_traffic, &next) == CAN_OK)
+    {
+        bool same_filters = planned && memcmp(next.mask, plan.mask, sizeof(plan.mask)) == 0 &&
+                            memcmp(next.filt_ext, plan.filt_ext, sizeof(plan.filt_ext)) == 0 &&
+                            memcmp(next.filt, plan.filt, sizeof(plan.filt)) == 0;
+        bool same_wanted  = planned && memcmp(next.std_wanted, plan.std_wanted, sizeof(plan.std_wanted)) == 0 &&
+                            next.n_ext_wanted == plan.n_ext_wanted &&
+                            memcmp(next.ext_wanted, plan.ext_wanted, next.n_ext_wanted * sizeof(CanIdRange)) == 0;
+
+        r.accepted_after = 0;
+        for (INT32U i = 0; i < CAN_TUNE_MAX_IDS; i++)
+        {
+            const IdCount &c     = counts[i];
+            CanFrame       frame = CanFrame();
+            INT32U         seen  = c.consumed + c.discarded;
+
+            if (c.key == 0)
+            {
+                continue;
+            }
+            frame.ext = (c.key & CAN_TUNE_KEY_EXT) ? 1 : 0;
+            frame.id  = c.key & 0x1FFFFFFF;
+            if (canPlanAccepts(next, frame))
+            {
+                r.accepted_after += seen > 0 ? seen : c.history;
+            }
+        }
+
+        apply = force || !same_wanted ||
+                (!same_filters && r.accepted_after < r.frames * (1.0 - CAN_TUNE_MIN_GAIN));
+        r.result = CAN_OK;
+    }
+
+    if (r.window_ns > 0)
+    {
+        r.rate_before = r.frames * 1e9 / r.window_ns;
+        r.rate_after  = r.accepted_after * 1e9 / r.window_ns;
+    }
+
+    // New window: keep the IDs that still count as used or still carry traffic history
+    IdCount keep[CAN_TUNE_MAX_IDS];
+    INT32U  n_keep = 0;
+
+    window++;
+    for (INT32U i = 0; i < CAN_TUNE_MAX_IDS; i++)
+    {
+        IdCount c = counts[i];
+
+        c.history = (c.history + c.discarded) / 2;
+        if (c.key != 0 && (c.history > 0 || (c.last_used != 0 && window - c.last_used < CAN_TUNE_FORGET)))
+        {
+            keep[n_keep++] = c;
+        }
+    }
+    memset(counts, 0, sizeof(counts));
+    for (INT32U i = 0; i < n_keep; i++)
+    {
+        CanFrame frame = CanFrame();
+        IdCount *c;
+
+        frame.ext    = (keep[i].key & CAN_TUNE_KEY_EXT) ? 1 : 0;
+        frame.id     = keep[i].key & 0x1FFFFFFF;
+        c            = slot(frame);
+        c->history   = keep[i].history;
+        c->last_used = keep[i].last_used;
+    }
+    window_start_ns = now;
+    pthread_mutex_unlock(&lock);
+
+    if (apply)
+    {
+        if (can->setFilterPlan(next) == CAN_OK)
+        {
+            pthread_mutex_lock(&lock);
+            plan    = next;
+            planned = true;
+            pthread_mutex_unlock(&lock);
+
+            r.applied            = true;
+            r.accepted_ids_after = next.accepted_ids;
+        }
+        else
+        {
+            r.result = CAN_FAIL;
+        }
+    }
+    if (!r.applied)
+    {
+        r.accepted_after = r.frames;
+        r.rate_after     = r.rate_before;
+    }
+
+    pthread_mutex_lock(&lock);
+    report = r;
+    pthread_mutex_unlock(&lock);
+
+    return r;
+}
+
+
+/*********************************************************************************************************
+** Function name:           retune
+** Descriptions:            Public function, closes the counting window and re-plans the filters from it
+*********************************************************************************************************/
+CanTuneReport CanFilterTuner::retune(void)
+{
+    return replan(false);
+}
+
+
+/*********************************************************************************************************
+** Function name:           lastReport
+** Descriptions:            Public function, report of the latest setInterest()/retune()
+*********************************************************************************************************/
+CanTuneReport CanFilterTuner::lastReport(void)
+{
+    CanTuneReport r;
+
+    pthread_mutex_lock(&lock);
+    r = report;
+    pthread_mutex_unlock(&lock);
+
+    return r;
+}
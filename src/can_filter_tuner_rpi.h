@@ -0,0 +1,95 @@
+/*
+ *  can_filter_tuner_rpi.h
+ *  Adaptive mask/filter tuning for one MCP_CAN: counts, per ID, the frames read over SPI that the
+ *  application used and the ones it (or the post-filter) threw away, and re-plans the masks and
+ *  filters from those counts so busy IDs nobody reads stop costing SPI transfers.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef CAN_FILTER_TUNER_RPI_H
+#define CAN_FILTER_TUNER_RPI_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mcp_can_rpi.h"
+
+#define CAN_TUNE_MAX_IDS       256                                      /* IDs counted per window       */
+#define CAN_TUNE_FORGET        8                                        /* Windows a used ID is kept    */
+#define CAN_TUNE_MIN_GAIN      0.10                                     /* Re-plan: accepts must drop   */
+
+// One retune() call. Rates are frames per second over the window since the previous retune();
+// the "after" figures are what the new plan would have accepted of the frames seen in the window
+// (plus, for IDs the filters hid in this window, what was seen of them before).
+struct CanTuneReport
+{
+    uint64_t window_ns;
+    INT32U frames;                                                      // Read over SPI in the window
+    INT32U consumed;                                                    // ...used by the application
+    INT32U discarded;                                                   // ...thrown away or post-filtered
+    INT32U accepted_after;                                              // ...the new plan lets through
+    double rate_before;
+    double rate_after;
+    uint64_t accepted_ids_before;                                       // IDs the masks let through
+    uint64_t accepted_ids_after;
+    bool applied;                                                       // New plan programmed
+    INT8U result;                                                       // CAN_OK / CAN_FAIL
+};
+
+/*
+ *  Usage: setInterest() with the IDs the application must always receive (this programs a first plan),
+ *  then report every frame taken out of the driver with account(frame, used) and call retune()
+ *  periodically, at a point where the bus is quiet if there is one (e.g. before sending requests):
+ *  the masks can only be rewritten in configuration mode, during which the MCP2515 does not receive.
+ *  Frames already in the receive buffers are kept (moved to the ring first if the receive thread
+ *  runs), the filters are only written once the controller is in configuration mode, and if it does
+ *  not get there the previous plan stays in force. IDs used within the last CAN_TUNE_FORGET windows
+ *  stay wanted even if they were not in the interest set. account() and retune() may be called from
+ *  different threads.
+ */
+class CanFilterTuner
+{
+public:
+    CanFilterTuner(MCP_CAN *can);
+    ~CanFilterTuner();
+
+    INT8U setInterest(const CanIdRange *ids, INT32U n);                 // Plans and programs at once
+    void account(const CanFrame &frame, bool used);
+    CanTuneReport retune(void);
+    CanTuneReport lastReport(void);
+
+private:
+    struct IdCount
+    {
+        INT32U key;                                                     // Type bit | id, 0 = free
+        INT32U consumed;
+        INT32U discarded;
+        INT32U history;                                                 // Discarded, halved per window
+        INT32U last_used;                                               // Window it was last consumed
+    };
+
+    static void onFiltered(void *ctx, const CanFrame &frame);
+    IdCount *slot(const CanFrame &frame);                               // NULL when the table is full
+    INT32U buildWanted(CanIdRange *ranges);
+    CanTuneReport replan(bool force);
+
+    MCP_CAN *can;
+    pthread_mutex_t lock;
+    CanIdRange interest[CAN_PLAN_MAX_RANGES];
+    INT32U n_interest;
+    IdCount counts[CAN_TUNE_MAX_IDS];                                   // Open addressing on key
+    INT32U window;
+    uint64_t window_start_ns;
+    CanFilterPlan plan;                                                 // Programmed now
+    bool planned;
+    CanTuneReport report;
+};
+
+#include "can_filter_tuner_rpi.cpp"
+
+#endif
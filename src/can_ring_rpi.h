@@ -0,0 +1,214 @@
+/*
+ *  can_ring_rpi.h
+ *  Fixed-capacity single-producer/single-consumer ring used to hand received frames from the
+ *  MCP_CAN receive thread to the application without locks or system calls, a seqlock that lets
+ *  other threads copy a set of counters without tearing it, and the clock every module stamps with.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef CAN_RING_RPI_H
+#define CAN_RING_RPI_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
+
+#define CAN_CACHE_LINE           64
+
+#define CAN_RING_DROP_NEWEST     0                                      /* Full ring: discard new frame */
+#define CAN_RING_DROP_OLDEST     1                                      /* Full ring: overwrite oldest  */
+
+// CLOCK_MONOTONIC in ns: frame timestamps, deadlines and latencies
+static inline uint64_t canNowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ *  N must be a power of two. head is only written by the producer. tail is written by the
+ *  consumer and, with CAN_RING_DROP_OLDEST, by the producer when it discards the oldest entry;
+ *  both sides advance it with a CAS so the consumer notices (and retries) when the slots it was
+ *  copying have been reclaimed. T must be trivially copyable.
+ */
+template <typename T, uint32_t N>
+class CanRing
+{
+    static_assert((N & (N - 1)) == 0, "CanRing size must be a power of two");
+
+private:
+
+    alignas(CAN_CACHE_LINE) std::atomic<uint32_t> head;                 // Next slot to write (producer)
+    alignas(CAN_CACHE_LINE) std::atomic<uint32_t> tail;                 // Next slot to read (consumer)
+    alignas(CAN_CACHE_LINE) std::atomic<uint32_t> n_pushed;             // Producer-side counters
+    std::atomic<uint32_t> n_dropped;
+    uint8_t policy;
+    alignas(CAN_CACHE_LINE) T slots[N];
+
+public:
+
+    CanRing() : head(0), tail(0), n_pushed(0), n_dropped(0), policy(CAN_RING_DROP_NEWEST)
+    {
+    }
+
+    void setOverflowPolicy(uint8_t overflow_policy)
+    {
+        policy = overflow_policy;
+    }
+
+    uint8_t overflowPolicy(void) const
+    {
+        return policy;
+    }
+
+    // Producer only. Returns false if the frame (or the oldest one) had to be discarded.
+    bool push(const T &item)
+    {
+        uint32_t h  = head.load(std::memory_order_relaxed);
+        uint32_t t  = tail.load(std::memory_order_acquire);
+        bool     ok = true;
+
+        if (h - t >= N)
+        {
+            if (policy == CAN_RING_DROP_NEWEST)
+            {
+                n_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // Reclaim the oldest slot unless the consumer freed one meanwhile
+            if (tail.compare_exchange_strong(t, t + 1, std::memory_order_acq_rel))
+            {
+                n_dropped.fetch_add(1, std::memory_order_relaxed);
+                ok = false;
+            }
+        }
+
+        slots[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        n_pushed.fetch_add(1, std::memory_order_relaxed);
+
+        return ok;
+    }
+
+    // Consumer only. Copies up to max entries into out and returns how many were copied.
+    uint32_t popBatch(T *out, uint32_t max)
+    {
+        for (;;)
+        {
+            uint32_t t = tail.load(std::memory_order_acquire);
+            uint32_t h = head.load(std::memory_order_acquire);
+            uint32_t n = h - t;
+
+            if (n > max)
+            {
+                n = max;
+            }
+            for (uint32_t i = 0; i < n; i++)
+            {
+                out[i] = slots[(t + i) & (N - 1)];
+            }
+
+            if (n == 0 || tail.compare_exchange_strong(t, t + n, std::memory_order_acq_rel))
+            {
+                return n;
+            }
+            // Producer dropped the oldest entries while we were copying: copy again
+        }
+    }
+
+    uint32_t size(void) const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    uint32_t capacity(void) const
+    {
+        return N;
+    }
+
+    uint32_t pushed(void) const
+    {
+        return n_pushed.load(std::memory_order_relaxed);
+    }
+
+    uint32_t dropped(void) const
+    {
+        return n_dropped.load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ *  Seqlock around a T (counters): seq is odd while the writer holds it. One writer at a time: a
+ *  single thread, or writers serialized by a lock they already hold (writeBegin() does not wait, so
+ *  a preempted writer cannot make another one spin). read() copies the value and retries until seq
+ *  was even and unchanged around the copy, so it never returns a half-updated T.
+ *  T must be trivially copyable.
+ */
+template <typename T>
+class CanSeqlock
+{
+private:
+
+    std::atomic<uint32_t> seq;
+    T value;
+
+public:
+
+    CanSeqlock() : seq(0), value()
+    {
+    }
+
+    // Returns the value to update, then call writeEnd()
+    T *writeBegin(void)
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        return &value;
+    }
+
+    void writeEnd(void)
+    {
+        seq.fetch_add(1, std::memory_order_release);
+    }
+
+    T read(void) const
+    {
+        uint32_t s0, s1;
+        T        copy;
+
+        for (;;)
+        {
+            s0 = seq.load(std::memory_order_acquire);
+            if (s0 & 1)
+            {
+                sched_yield();                                          /* writer busy (or preempted)   */
+                continue;
+            }
+            copy = value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s1 = seq.load(std::memory_order_relaxed);
+            if (s0 == s1)
+            {
+                return copy;
+            }
+        }
+    }
+
+    void reset(void)
+    {
+        *writeBegin() = T();
+        writeEnd();
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ *  charger_codec_rpi.h
+ *  Fixed-point codec for the CAN charger (TC/Elcon protocol, 29-bit IDs). The command carries the
+ *  maximum voltage and current in 0.1 V / 0.1 A, big endian, and a control byte (0 = charge,
+ *  1 = stop); the status frame reports output voltage and current in the same units and five
+ *  fault flags. A command frame is encoded once and its setpoints are patched in place, so it can
+ *  be streamed (McpCyclicScheduler::updatePayload) without floats or rebuilding the frame.
+ *  CPU only, like can_codec_rpi.h.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef CHARGER_CODEC_RPI_H
+#define CHARGER_CODEC_RPI_H
+
+#include <stdint.h>
+
+#include "can_codec_rpi.h"
+
+#define CHARGER_DLC            5
+#define CHARGER_CTRL_CHARGE    0                                        /* Command byte 4               */
+#define CHARGER_CTRL_STOP      1
+
+// Status byte 4, bit per fault
+#define CHARGER_FLAG_HARDWARE  0x01                                     /* Hardware failure             */
+#define CHARGER_FLAG_OVERTEMP  0x02                                     /* Charger over temperature     */
+#define CHARGER_FLAG_INPUT     0x04                                     /* Input voltage wrong          */
+#define CHARGER_FLAG_BATTERY   0x08                                     /* No battery / reversed        */
+#define CHARGER_FLAG_TIMEOUT   0x10                                     /* No command received          */
+#define CHARGER_FLAGS          0x1F
+
+struct ChargerStatus
+{
+    uint16_t voltage_dv;                                                // Output voltage, 0.1 V
+    uint16_t current_da;                                                // Output current, 0.1 A
+    uint8_t  flags;                                                     // CHARGER_FLAG_*
+};
+
+
+/*********************************************************************************************************
+** Function name:           chargerPut16
+** Descriptions:            Big-endian 16-bit value into data[0..1]
+*********************************************************************************************************/
+static inline void chargerPut16(INT8U *data, uint16_t value)
+{
+    data[0] = (INT8U)(value >> 8);
+    data[1] = (INT8U)(value & 0xFF);
+}
+
+
+/*********************************************************************************************************
+** Function name:           chargerCommandInit
+** Descriptions:            Command frame to id with both setpoints at 0 and the charger stopped
+*********************************************************************************************************/
+static inline void chargerCommandInit(CanFrame *frame, INT32U id)
+{
+    *frame         = CanFrame();
+    frame->id      = id & 0x1FFFFFFF;
+    frame->ext     = 1;
+    frame->dlc     = CHARGER_DLC;
+    frame->data[4] = CHARGER_CTRL_STOP;
+}
+
+
+/*********************************************************************************************************
+** Function name:           chargerSetVoltage
+** Descriptions:            Patches the maximum charging voltage (0.1 V) into a command frame
+*********************************************************************************************************/
+static inline void chargerSetVoltage(CanFrame *frame, uint16_t voltage_dv)
+{
+    chargerPut16(&frame->data[0], voltage_dv);
+}
+
+
+/*********************************************************************************************************
+** Function name:           chargerSetCurrent
+** Descriptions:            Patches the maximum charging current (0.1 A) into a command frame
+*********************************************************************************************************/
+static inline void chargerSetCurrent(CanFrame *frame, uint16_t current_da)
+{
+    chargerPut16(&frame->data[2], current_da);
+}
+
+
+/*********************************************************************************************************
+** Function name:           chargerSetCharge
+** Descriptions:            Patches the control byte: charge or stop
+*********************************************************************************************************/
+static inline void chargerSetCharge(CanFrame *frame, bool charge)
+{
+    frame->data[4] = charge ? CHARGER_CTRL_CHARGE : CHARGER_CTRL_STOP;
+}
+
+
+/*********************************************************************************************************
+** Function name:           chargerDeci
+** Descriptions:            Milli units (mV, mA) to the 0.1 units of the frames, rounded and saturated
+*********************************************************************************************************/
+static inline uint16_t chargerDeci(INT32U milli)
+{
+    if (milli >= 0xFFFF * 100UL)
+    {
+        return 0xFFFF;
+    }
+
+    return (uint16_t)((milli + 50) / 100);
+}
+
+
+/*********************************************************************************************************
+** Function name:           chargerDecodeStatus
+** Descriptions:            Status frame into status. CAN_FAIL (status untouched) if the frame is too short.
+*********************************************************************************************************/
+static inline INT8U chargerDecodeStatus(const CanFrame &frame, ChargerStatus *status)
+{
+    const INT8U *d = frame.data;
+
+    if (frame.dlc < CHARGER_DLC)
+    {
+        return CAN_FAIL;
+    }
+
+    status->voltage_dv = (uint16_t)(d[0] << 8 | d[1]);
+    status->current_da = (uint16_t)(d[2] << 8 | d[3]);
+    status->flags      = d[4] & CHARGER_FLAGS;
+
+    return CAN_OK;
+}
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ *  mcp_bms_poller_rpi.cpp
+ *  Request/response correlation for ZEVA BMS modules.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+#include <time.h>
+
+
+/*********************************************************************************************************
+** Function name:           McpBmsPoller
+** Descriptions:            Polls modules 0..n_modules-1 through can, balancing at shunt_mv
+*********************************************************************************************************/
+McpBmsPoller::McpBmsPoller(MCP_CAN *can, INT8U n_modules, INT32U shunt_mv)
+{
+    this->can        = can;
+    this->n_modules  = n_modules > MCP_BMS_MAX_MODULES ? MCP_BMS_MAX_MODULES : n_modules;
+    this->shunt_mv   = shunt_mv;
+    timeout_ns       = MCP_BMS_TIMEOUT_US * 1000ULL;
+    retries          = MCP_BMS_RETRIES;
+    callback         = NULL;
+    callback_ctx     = NULL;
+    n_pending        = 0;
+    refresh_start_ns = 0;
+    refresh_ns       = 0;
+    memset(modules, 0, sizeof(modules));
+}
+
+
+/*********************************************************************************************************
+** Function name:           setCallback
+** Descriptions:            Public function, called for every module that completes or gives up
+*********************************************************************************************************/
+void McpBmsPoller::setCallback(McpBmsCallback callback, void *ctx)
+{
+    this->callback = callback;
+    callback_ctx   = ctx;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setTimeout
+** Descriptions:            Public function, time allowed per attempt and attempts after the first
+*********************************************************************************************************/
+void McpBmsPoller::setTimeout(INT32U timeout_us, INT8U retries)
+{
+    timeout_ns    = (uint64_t)timeout_us * 1000;
+    this->retries = retries;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setShunt
+** Descriptions:            Public function, cell balancing voltage sent with the next queries
+*********************************************************************************************************/
+void McpBmsPoller::setShunt(INT32U shunt_mv)
+{
+    this->shunt_mv = shunt_mv;
+}
+
+
+/*********************************************************************************************************
+** Function name:           query
+** Descriptions:            Queues the query of module and starts its timeout. false if the TX queue was
+**                          full (the attempt still counts, service() retries it).
+*********************************************************************************************************/
+bool McpBmsPoller::query(INT8U module, uint64_t now_ns)
+{
+    Module  &m     = modules[module];
+    CanFrame frame = CanFrame();
+
+    frame.id      = MCP_BMS_BASE_ID + 10 * module;
+    frame.ext     = 1;                                                  /* as MCP_CAN::queryBMS()       */
+    frame.dlc     = 2;
+    frame.data[0] = (shunt_mv >> 8) & 0xFF;
+    frame.data[1] = shunt_mv & 0xFF;
+
+    m.attempts++;
+    m.deadline_ns = now_ns + timeout_ns;
+    m.stats.queries++;
+
+    return can->sendFrameAsync(frame) == CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           refresh
+** Descriptions:            Public function, queries every module back to back. Modules still pending from
+**                          the previous refresh keep their replies and timeout.
+*********************************************************************************************************/
+INT8U McpBmsPoller::refresh(void)
+{
+    uint64_t now = canNowNs();
+    INT8U    res = CAN_OK;
+
+    refresh_start_ns = now;
+    for (INT8U i = 0; i < n_modules; i++)
+    {
+        Module &m = modules[i];
+
+        if (m.pending)
+        {
+            continue;
+        }
+
+        memset(&m.reply, 0, sizeof(m.reply));
+        m.reply.module = i;
+        m.pending      = true;
+        m.attempts     = 0;
+        m.first_ns     = now;
+        n_pending++;
+        if (!query(i, now))
+        {
+            res = CAN_FAIL;
+        }
+    }
+
+    return res;
+}
+
+
+/*********************************************************************************************************
+** Function name:           complete
+** Descriptions:            Ends the refresh of module m and hands its replies to the callback
+*********************************************************************************************************/
+void McpBmsPoller::complete(Module &m, INT8U result, uint64_t now_ns)
+{
+    m.pending          = false;
+    m.reply.result     = result;
+    m.reply.attempts   = m.attempts;
+    m.reply.latency_ns = now_ns - m.first_ns;
+    n_pending--;
+
+    if (result == CAN_OK)
+    {
+        m.stats.completed++;
+        m.stats.latency_last_ns = m.reply.latency_ns;
+        if (m.reply.latency_ns > m.stats.latency_max_ns)
+        {
+            m.stats.latency_max_ns = m.reply.latency_ns;
+        }
+    }
+    else
+    {
+        m.stats.timeouts++;
+    }
+    if (n_pending == 0)
+    {
+        refresh_ns = now_ns - refresh_start_ns;
+    }
+
+    if (callback != NULL)
+    {
+        callback(callback_ctx, m.reply);
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           onFrame
+** Descriptions:            Public function, matches frame against the pending modules. Returns true for
+**                          any reply ID of a polled module (also late or unexpected ones), standard or
+**                          extended: the modules answer in the format of the query.
+*********************************************************************************************************/
+bool McpBmsPoller::onFrame(const CanFrame &frame)
+{
+    INT32U offset, module, k;
+
+    if (frame.rtr || frame.id <= MCP_BMS_BASE_ID)
+    {
+        return false;
+    }
+
+    offset = frame.id - MCP_BMS_BASE_ID;
+    module = offset / 10;
+    k      = offset % 10 - 1;                                           /* reply 1..4 -> 0..3           */
+    if (module >= n_modules || k >= MCP_BMS_REPLIES)
+    {
+        return false;
+    }
+
+    Module &m = modules[module];
+
+    if (!m.pending)
+    {
+        m.stats.unexpected++;
+        return true;
+    }
+
+    m.reply.frames[k] = frame;
+    m.reply.received |= 1 << k;
+    if (m.reply.received == MCP_BMS_ALL_REPLIES)
+    {
+        complete(m, CAN_OK, canNowNs());
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           onFrameHandler
+** Descriptions:            Public function, onFrame() as a CanDispatcher handler (ctx: the poller)
+*********************************************************************************************************/
+void McpBmsPoller::onFrameHandler(void *ctx, const CanFrame &frame)
+{
+    ((McpBmsPoller *)ctx)->onFrame(frame);
+}
+
+
+/*********************************************************************************************************
+** Function name:           service
+** Descriptions:            Public function, resends the query of modules whose attempt timed out and gives
+**                          up on those out of retries. Returns the modules still pending.
+*********************************************************************************************************/
+INT32U McpBmsPoller::service(void)
+{
+    uint64_t now;
+
+    if (n_pending == 0)
+    {
+        return 0;
+    }
+
+    now = canNowNs();
+    for (INT8U i = 0; i < n_modules; i++)
+    {
+        Module &m = modules[i];
+
+        if (!m.pending || now < m.deadline_ns)
+        {
+            continue;
+        }
+        if (m.attempts > retries)
+        {
+            complete(m, CAN_FAIL, now);
+            continue;
+        }
+        m.stats.retries++;
+        query(i, now);
+    }
+
+    return n_pending;
+}
+
+
+/*********************************************************************************************************
+** Function name:           pending
+** Descriptions:            Public function, modules of the current refresh not completed yet
+*********************************************************************************************************/
+INT32U McpBmsPoller::pending(void)
+{
+    return n_pending;
+}
+
+
+/*********************************************************************************************************
+** Function name:           refreshTime
+** Descriptions:            Public function, from refresh() to the last module completing or giving up,
+**                          for the latest refresh that finished (0 before the first)
+*********************************************************************************************************/
+uint64_t McpBmsPoller::refreshTime(void)
+{
+    return refresh_ns;
+}
+
+
+/*********************************************************************************************************
+** Function name:           moduleStats
+** Descriptions:            Public function, counters of module (zeros for an unknown module)
+*********************************************************************************************************/
+McpBmsModuleStats McpBmsPoller::moduleStats(INT8U module)
+{
+    McpBmsModuleStats none;
+
+    if (module >= n_modules)
+    {
+        memset(&none, 0, sizeof(none));
+        return none;
+    }
+
+    return modules[module].stats;
+}
@@ -0,0 +1,105 @@
+/*
+ *  mcp_bms_poller_rpi.h
+ *  Request/response correlation for ZEVA BMS modules: refresh() queries every module back to back
+ *  (module n at 300 + 10n) and the replies are matched as they arrive (300 + 10n + 1..3 voltages,
+ *  + 4 temperatures). A module completes when its four replies are in, or fails after its timeout
+ *  and retries, so a pack refresh takes bus time instead of a sleep per module.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_BMS_POLLER_RPI_H
+#define MCP_BMS_POLLER_RPI_H
+
+#include <stdint.h>
+
+#include "mcp_can_rpi.h"
+
+#define MCP_BMS_MAX_MODULES    16
+#define MCP_BMS_BASE_ID        300                                      /* Query of module n: + 10n     */
+#define MCP_BMS_REPLIES        4                                        /* 3 voltage + 1 temperature    */
+#define MCP_BMS_ALL_REPLIES    ((1 << MCP_BMS_REPLIES) - 1)
+#define MCP_BMS_TIMEOUT_US     50000                                    /* Per attempt                  */
+#define MCP_BMS_RETRIES        2                                        /* Attempts after the first     */
+
+// Outcome of one module in a refresh. frames[k] is reply k + 1 (bit k of received).
+struct McpBmsReply
+{
+    INT8U module;
+    INT8U result;                                                       // CAN_OK / CAN_FAIL (timed out)
+    INT8U received;                                                     // Replies in, bit per frame
+    INT8U attempts;                                                     // Queries sent
+    uint64_t latency_ns;                                                // First query to completion
+    CanFrame frames[MCP_BMS_REPLIES];
+};
+
+struct McpBmsModuleStats
+{
+    INT32U queries;                                                     // Sent, retries included
+    INT32U completed;
+    INT32U timeouts;                                                    // Gave up after the retries
+    INT32U retries;
+    INT32U unexpected;                                                  // Replies while not polled
+    uint64_t latency_last_ns;
+    uint64_t latency_max_ns;
+};
+
+// Called from onFrame() or service() when a module completes or gives up
+typedef void (*McpBmsCallback)(void *ctx, const McpBmsReply &reply);
+
+/*
+ *  Usage: route the reply IDs to onFrame() (or register onFrameHandler with a CanDispatcher), call
+ *  refresh() to poll the pack and service() regularly while modules are pending (it resends on
+ *  timeout). The callback gets every module once per refresh. refresh(), onFrame() and service()
+ *  must be called from one thread. Queries go out through MCP_CAN::sendFrameAsync().
+ */
+class McpBmsPoller
+{
+public:
+    McpBmsPoller(MCP_CAN *can, INT8U n_modules, INT32U shunt_mv);
+
+    void setCallback(McpBmsCallback callback, void *ctx);
+    void setTimeout(INT32U timeout_us, INT8U retries);
+    void setShunt(INT32U shunt_mv);                                     // Balancing voltage in queries
+    INT8U refresh(void);                                                // CAN_OK, CAN_FAIL if one did not queue
+    bool onFrame(const CanFrame &frame);                                // true: a BMS reply
+    static void onFrameHandler(void *ctx, const CanFrame &frame);       // CanHandler, ctx = poller
+    INT32U service(void);                                               // Modules still pending
+    INT32U pending(void);
+    uint64_t refreshTime(void);                                         // ns, last complete refresh
+    McpBmsModuleStats moduleStats(INT8U module);
+
+private:
+    struct Module
+    {
+        bool pending;
+        INT8U attempts;
+        uint64_t first_ns;                                              // First query of this refresh
+        uint64_t deadline_ns;                                           // Current attempt times out
+        McpBmsReply reply;
+        McpBmsModuleStats stats;
+    };
+
+    bool query(INT8U module, uint64_t now_ns);
+    void complete(Module &m, INT8U result, uint64_t now_ns);
+
+    MCP_CAN *can;
+    INT8U n_modules;
+    INT32U shunt_mv;
+    uint64_t timeout_ns;
+    INT8U retries;
+    McpBmsCallback callback;
+    void *callback_ctx;
+    Module modules[MCP_BMS_MAX_MODULES];
+    INT32U n_pending;
+    uint64_t refresh_start_ns;
+    uint64_t refresh_ns;
+};
+
+#include "mcp_bms_poller_rpi.cpp"
+
+#endif
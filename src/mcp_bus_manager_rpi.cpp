@@ -0,0 +1,533 @@
+/*
+ *  mcp_bus_manager_rpi.cpp
+ *  Services several MCP2515 controllers from one epoll loop.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+/*********************************************************************************************************
+** Function name:           McpBusManager
+** Descriptions:            Creates the epoll set with the wake-up eventfd in it
+*********************************************************************************************************/
+McpBusManager::McpBusManager()
+{
+    struct epoll_event ev;
+
+    n_buses     = 0;
+    tx_next_bus = 0;
+    hook        = NULL;
+    running     = false;
+    for (INT32U i = 0; i < MCP_MAX_BUSES; i++)
+    {
+        pthread_mutex_init(&buses[i].tx_lock, NULL);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.u32 = MCP_MAX_BUSES;                                        /* not a bus number             */
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+    {
+#if DEBUG_MODE
+        printf("Bus manager: epoll setup Failure...\r\n");
+#endif
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~McpBusManager
+** Descriptions:            Stops the loop thread. The controllers are not touched.
+*********************************************************************************************************/
+McpBusManager::~McpBusManager()
+{
+    stop();
+    close(wake_fd);
+    close(epoll_fd);
+    for (INT32U i = 0; i < MCP_MAX_BUSES; i++)
+    {
+        pthread_mutex_destroy(&buses[i].tx_lock);
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           addBus
+** Descriptions:            Public function, services can from now on (before start()). Its INT pin line is
+**                          added to the epoll set; a controller without one is polled every
+**                          MCP_BUS_POLL_MS. overflow_policy is for the RX ring (CAN_RING_DROP_*).
+*********************************************************************************************************/
+int McpBusManager::addBus(MCP_CAN *can, INT8U overflow_policy)
+{
+    struct epoll_event ev;
+
+    if (n_buses == MCP_MAX_BUSES || epoll_fd < 0)
+    {
+        return -1;
+    }
+
+    Bus &b = buses[n_buses];
+
+    b.can        = can;
+    b.line       = can->interruptLine();
+    b.rx_pending = true;                                                /* first pass looks at the chip */
+    b.tx_pending = true;
+    b.tx_held    = false;
+    b.stats.reset();
+    b.tx_queued.store(0);
+    b.tx_rejected.store(0);
+    b.rx_ring.setOverflowPolicy(overflow_policy);
+
+    if (b.line != NULL && b.line->fd() >= 0)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.u32 = n_buses;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, b.line->fd(), &ev) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        b.line = NULL;
+    }
+
+    return n_buses++;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setHook
+** Descriptions:            Public function, hook that sees received frames first (see McpBusHook)
+*********************************************************************************************************/
+void McpBusManager::setHook(McpBusHook *hook)
+{
+    this->hook = hook;
+}
+
+
+/*********************************************************************************************************
+** Function name:           send
+** Descriptions:            Public function, queues frame for bus. Any thread; the loop loads it into a TX
+**                          buffer when no receive buffer is waiting. The loop is only woken when the ring
+**                          was empty (otherwise a TX interrupt will come).
+*********************************************************************************************************/
+INT8U McpBusManager::send(INT8U bus, const CanFrame &frame)
+{
+    bool  was_empty;
+    INT8U res;
+
+    res = queueTx(bus, frame, MCP_BUS_TAG_NONE, &was_empty);
+    if (res == CAN_OK && was_empty)
+    {
+        wake();
+    }
+
+    return res;
+}
+
+
+/*********************************************************************************************************
+** Function name:           forward
+** Descriptions:            Public function, send() for the hook: the loop is already running, so it is not
+**                          woken. onLoaded() reports the frame with tag when it is in a TX buffer.
+*********************************************************************************************************/
+INT8U McpBusManager::forward(INT8U bus, const CanFrame &frame, INT8U tag)
+{
+    bool was_empty;
+
+    return queueTx(bus, frame, tag, &was_empty);
+}
+
+
+/*********************************************************************************************************
+** Function name:           queueTx
+** Descriptions:            Pushes frame into the TX ring of bus under its producer lock
+*********************************************************************************************************/
+INT8U McpBusManager::queueTx(INT8U bus, const CanFrame &frame, INT8U tag, bool *was_empty)
+{
+    TxEntry entry;
+
+    if (bus >= n_buses)
+    {
+        return CAN_FAIL;
+    }
+
+    Bus &b = buses[bus];
+
+    entry.frame = frame;
+    entry.tag   = tag;
+
+    pthread_mutex_lock(&b.tx_lock);
+    *was_empty = (b.tx_ring.size() == 0);
+    if (!b.tx_ring.push(entry))
+    {
+        b.tx_rejected.fetch_add(1, std::memory_order_relaxed);
+        pthread_mutex_unlock(&b.tx_lock);
+        return CAN_TXQUEUEFULL;
+    }
+    b.tx_queued.fetch_add(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&b.tx_lock);
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readFrames
+** Descriptions:            Public function, pops up to max frames received on bus. Never blocks.
+*********************************************************************************************************/
+INT32U McpBusManager::readFrames(INT8U bus, CanFrame *frames, INT32U max)
+{
+    if (bus >= n_buses)
+    {
+        return 0;
+    }
+
+    return buses[bus].rx_ring.popBatch(frames, max);
+}
+
+
+/*********************************************************************************************************
+** Function name:           runOnce
+** Descriptions:            Public function, one epoll_wait (timeout_ms, -1 = forever; 0 if work is left)
+**                          and the RX/TX work it brings. Returns the number of SPI actions done.
+*********************************************************************************************************/
+INT32U McpBusManager::runOnce(int timeout_ms)
+{
+    struct epoll_event events[MCP_MAX_BUSES + 1];
+    uint64_t           first_ns, value;
+    INT32U             work = 0, edges;
+    int                n;
+
+    for (INT32U i = 0; i < n_buses; i++)
+    {
+        if (buses[i].rx_pending || buses[i].tx_pending)
+        {
+            timeout_ms = 0;
+        }
+        else if (buses[i].line == NULL && (timeout_ms < 0 || timeout_ms > MCP_BUS_POLL_MS))
+        {
+            timeout_ms = MCP_BUS_POLL_MS;
+        }
+    }
+
+    n = epoll_wait(epoll_fd, events, MCP_MAX_BUSES + 1, timeout_ms);
+    for (int i = 0; i < n; i++)
+    {
+        INT32U idx = events[i].data.u32;
+
+        if (idx == MCP_MAX_BUSES)
+        {
+            if (read(wake_fd, &value, sizeof(value)) < 0)
+            {
+                value = 0;
+            }
+            continue;
+        }
+        edges                 = buses[idx].line->readEvents(&first_ns);
+        buses[idx].stats.writeBegin()->edges += edges;
+        buses[idx].stats.writeEnd();
+        buses[idx].rx_pending = true;
+        buses[idx].tx_pending = true;
+    }
+    for (INT32U i = 0; i < n_buses; i++)
+    {
+        if (buses[i].line == NULL)
+        {
+            buses[i].rx_pending = true;
+            buses[i].tx_pending = true;
+        }
+    }
+
+    for (;;)                                                            /* RX first, TX one step at a time */
+    {
+        if (drainRx())
+        {
+            work++;
+            continue;
+        }
+        if (!stepTx())
+        {
+            break;
+        }
+        work++;
+    }
+
+    for (INT32U i = 0; i < n_buses; i++)                                /* INT still low: missed edge   */
+    {
+        if (buses[i].line != NULL && buses[i].line->active())
+        {
+            buses[i].rx_pending = true;
+            buses[i].tx_pending = true;
+        }
+    }
+
+    return work;
+}
+
+
+/*********************************************************************************************************
+** Function name:           drainRx
+** Descriptions:            One readMsgBatch on every bus with a pending interrupt. A bus stays pending while
+**                          its batch comes back full. Frames the hook does not take go to the RX ring.
+**                          Returns true if any frame was read.
+*********************************************************************************************************/
+bool McpBusManager::drainRx(void)
+{
+    CanFrame frames[MCP_RX_BATCH];
+    bool     any = false;
+
+    for (INT32U i = 0; i < n_buses; i++)
+    {
+        Bus         &b = buses[i];
+        McpBusStats *st;
+        INT32U      n, dropped = 0;
+
+        if (!b.rx_pending)
+        {
+            continue;
+        }
+
+        n            = b.can->readMsgBatch(frames, MCP_RX_BATCH);
+        b.rx_pending = (n == MCP_RX_BATCH);
+        if (n == 0)
+        {
+            continue;
+        }
+
+        any = true;
+        for (INT32U k = 0; k < n; k++)
+        {
+            if (hook != NULL && hook->onReceive(i, frames[k]))
+            {
+                continue;
+            }
+            if (!b.rx_ring.push(frames[k]))
+            {
+                dropped++;
+            }
+        }
+
+        st              = b.stats.writeBegin();                         /* not held across the hook   */
+        st->rx_drains++;
+        st->rx_frames  += n;
+        st->rx_dropped += dropped;
+        b.stats.writeEnd();
+    }
+
+    if (any)
+    {
+        for (INT32U i = 0; i < n_buses; i++)
+        {
+            if (txWaiting(buses[i]))
+            {
+                buses[i].stats.writeBegin()->tx_deferred++;
+                buses[i].stats.writeEnd();
+            }
+        }
+    }
+
+    return any;
+}
+
+
+/*********************************************************************************************************
+** Function name:           stepTx
+** Descriptions:            The next TX action, round robin over the buses: acknowledge TX interrupts
+**                          (serviceTx) or load one frame into a free TX buffer. TXnIF is acknowledged
+**                          also with no async frame in flight (left by sendMsgBuf or a reserved buffer)
+**                          if INT stays low after RX. A frame the controller refuses (blocked ID) is
+**                          dropped. Returns false if there was nothing to do.
+*********************************************************************************************************/
+bool McpBusManager::stepTx(void)
+{
+    INT8U res;
+
+    for (INT32U k = 0; k < n_buses; k++)
+    {
+        INT32U idx = (tx_next_bus + k) % n_buses;
+        Bus    &b  = buses[idx];
+
+        if (b.tx_pending)
+        {
+            b.tx_pending = false;
+            if (b.can->txPending() > 0 || b.line == NULL || b.line->active())
+            {                                                           /* RX is drained: TXnIF is left */
+                b.can->serviceTx();
+                b.stats.writeBegin()->tx_services++;
+                b.stats.writeEnd();
+                tx_next_bus = idx + 1;
+                return true;
+            }
+        }
+
+        if (!b.tx_held)
+        {
+            b.tx_held = (b.tx_ring.popBatch(&b.tx_next, 1) == 1);
+        }
+        if (b.tx_held && b.can->txPending() < MCP_N_TXBUFFERS)
+        {
+            res = b.can->sendFrameAsync(b.tx_next.frame);
+            if (res == CAN_OK)
+            {
+                b.tx_held = false;
+                b.stats.writeBegin()->tx_loaded++;
+                b.stats.writeEnd();
+                if (hook != NULL && b.tx_next.tag != MCP_BUS_TAG_NONE)
+                {
+                    hook->onLoaded(idx, b.tx_next.frame, b.tx_next.tag);
+                }
+            }
+            else if (res != CAN_TXQUEUEFULL)                            /* refused: would block the ring */
+            {
+                b.tx_held = false;
+                b.stats.writeBegin()->tx_refused++;
+                b.stats.writeEnd();
+            }
+            tx_next_bus = idx + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           txWaiting
+** Descriptions:            bus has a TX action the loop could do
+*********************************************************************************************************/
+bool McpBusManager::txWaiting(Bus &b)
+{
+    return b.tx_pending || b.tx_held || b.tx_ring.size() > 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           wake
+** Descriptions:            Makes epoll_wait return
+*********************************************************************************************************/
+void McpBusManager::wake(void)
+{
+    uint64_t one = 1;
+
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+    {
+        return;                                                         /* counter full: already awake  */
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           loopEntry
+** Descriptions:            pthread entry point of the loop thread
+*********************************************************************************************************/
+void *McpBusManager::loopEntry(void *arg)
+{
+    McpBusManager *mgr = (McpBusManager *)arg;
+
+    while (mgr->running)
+    {
+        mgr->runOnce(-1);
+    }
+    return NULL;
+}
+
+
+/*********************************************************************************************************
+** Function name:           start
+** Descriptions:            Public function, runs the loop in its own thread. priority: SCHED_FIFO 1..99,
+**                          0 = normal. cpu: CPU to run on, -1 = any.
+*********************************************************************************************************/
+INT8U McpBusManager::start(int priority, int cpu)
+{
+    if (running)
+    {
+        return CAN_OK;
+    }
+
+    running = true;
+    if (mcpCreateThread(&thread, loopEntry, this, priority, cpu) != 0)
+    {
+        running = false;
+#if DEBUG_MODE
+        printf("Starting bus manager thread Failure...\r\n");
+#endif
+        return CAN_FAIL;
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           stop
+** Descriptions:            Public function, stops the loop thread. Queued frames stay in the rings.
+*********************************************************************************************************/
+void McpBusManager::stop(void)
+{
+    if (!running)
+    {
+        return;
+    }
+
+    running = false;
+    wake();
+    pthread_join(thread, NULL);
+}
+
+
+/*********************************************************************************************************
+** Function name:           busStats
+** Descriptions:            Public function, consistent copy of the counters of bus (zeros for an unknown bus)
+*********************************************************************************************************/
+McpBusStats McpBusManager::busStats(INT8U bus)
+{
+    McpBusStats s;
+
+    if (bus >= n_buses)
+    {
+        memset(&s, 0, sizeof(s));
+        return s;
+    }
+
+    s             = buses[bus].stats.read();
+    s.tx_queued   = buses[bus].tx_queued.load(std::memory_order_relaxed);
+    s.tx_rejected = buses[bus].tx_rejected.load(std::memory_order_relaxed);
+
+    return s;
+}
+
+
+/*********************************************************************************************************
+** Function name:           busCount
+** Descriptions:            Public function, number of buses added
+*********************************************************************************************************/
+INT32U McpBusManager::busCount(void)
+{
+    return n_buses;
+}
+
+
+/*********************************************************************************************************
+** Function name:           eventFd
+** Descriptions:            Public function, the epoll fd, to nest the manager in another event loop instead
+**                          of start(): call runOnce(0) when it is readable, and again while it returns work.
+*********************************************************************************************************/
+int McpBusManager::eventFd(void)
+{
+    return epoll_fd;
+}
@@ -0,0 +1,125 @@
+/*
+ *  mcp_bus_manager_rpi.h
+ *  Services several MCP2515 controllers from one epoll loop: their INT pins are multiplexed in a
+ *  single thread, which owns all SPI traffic, drains receive buffers before loading transmit buffers
+ *  and keeps a receive ring and a transmit ring per controller.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_BUS_MANAGER_RPI_H
+#define MCP_BUS_MANAGER_RPI_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mcp_can_rpi.h"
+
+#define MCP_MAX_BUSES          4                                        /* Controllers per manager      */
+#define MCP_BUS_TXRING_SIZE    64                                       /* send() backlog per bus       */
+#define MCP_BUS_POLL_MS        10                                       /* Buses without a line: poll   */
+#define MCP_BUS_TAG_NONE       0xFF                                     /* Frames queued by send()      */
+
+struct McpBusStats
+{
+    INT32U rx_frames;                                                   // Read from the controller
+    INT32U rx_dropped;                                                  // Lost, RX ring full (not hooked)
+    INT32U rx_drains;                                                   // readMsgBatch calls with frames
+    INT32U tx_queued;                                                   // Accepted by send()
+    INT32U tx_rejected;                                                 // TX ring full
+    INT32U tx_loaded;                                                   // Handed to a TX buffer
+    INT32U tx_refused;                                                  // Dropped, ID blocked (blockTx)
+    INT32U tx_deferred;                                                 // Loads postponed by an RX drain
+    INT32U tx_services;                                                 // serviceTx calls
+    INT32U edges;                                                       // INT pin events
+};
+
+// Sees every frame in the loop thread, before it reaches the RX ring. onReceive() returns true when it
+// took the frame (it is then not queued for readFrames()); it may queue frames with forward().
+// onLoaded() is called when a frame queued with a tag other than MCP_BUS_TAG_NONE is in a TX buffer.
+class McpBusHook
+{
+public:
+    virtual ~McpBusHook() {}
+
+    virtual bool onReceive(INT8U bus, const CanFrame &frame) = 0;
+    virtual void onLoaded(INT8U bus, const CanFrame &frame, INT8U tag) = 0;
+};
+
+/*
+ *  Usage: addBus() every controller (after begin(), setMode() and setupInterruptGpio(), without its own
+ *  receive thread), then start() the loop thread or call runOnce() from your own loop. send() and
+ *  readFrames() may be called from other threads; readFrames() has one consumer per bus. MCP_CAN
+ *  calls from other threads still work but bypass the RX-before-TX ordering.
+ *
+ *  Scheduling inside the loop: every bus with a pending interrupt is drained (one readMsgBatch each)
+ *  until no receive buffer holds a frame; only then is one TX step done (acknowledge TX interrupts of
+ *  one bus, or load one frame into a free TX buffer) and receive is checked again. A frame arriving on
+ *  any bus therefore waits for at most one TX step.
+ */
+class McpBusManager
+{
+public:
+    McpBusManager();
+    ~McpBusManager();
+
+    int addBus(MCP_CAN *can, INT8U overflow_policy);                    // Bus number, -1 on failure
+    void setHook(McpBusHook *hook);                                     // Before start(), NULL = none
+    INT8U send(INT8U bus, const CanFrame &frame);                       // CAN_OK / CAN_TXQUEUEFULL
+    INT8U forward(INT8U bus, const CanFrame &frame, INT8U tag);         // From the hook (loop thread)
+    INT32U readFrames(INT8U bus, CanFrame *frames, INT32U max);         // Never blocks
+    INT32U runOnce(int timeout_ms);                                     // Wait once, do the work
+    INT8U start(int priority, int cpu);                                 // Loop thread (SCHED_FIFO, CPU)
+    void stop(void);
+    McpBusStats busStats(INT8U bus);
+    INT32U busCount(void);
+    int eventFd(void);                                                  // The epoll fd (nestable)
+
+private:
+    struct TxEntry
+    {
+        CanFrame frame;
+        INT8U tag;                                                      // MCP_BUS_TAG_NONE: send()
+    };
+
+    struct Bus
+    {
+        MCP_CAN *can;
+        McpIrqLine *line;                                               // NULL: polled every pass
+        bool rx_pending;                                                // INT seen, not drained yet
+        bool tx_pending;                                                // INT seen, serviceTx not run
+        bool tx_held;                                                   // tx_next popped, not loaded
+        TxEntry tx_next;
+        pthread_mutex_t tx_lock;                                        // Producers of tx_ring
+        CanRing<CanFrame, MCP_RXRING_SIZE> rx_ring;                     // Loop -> application
+        CanRing<TxEntry, MCP_BUS_TXRING_SIZE> tx_ring;                  // Application -> loop
+        CanSeqlock<McpBusStats> stats;                                  // Loop thread writes
+        std::atomic<INT32U> tx_queued;                                  // send() / forward()
+        std::atomic<INT32U> tx_rejected;
+    };
+
+    INT8U queueTx(INT8U bus, const CanFrame &frame, INT8U tag, bool *was_empty);
+    bool drainRx(void);                                                 // One batch on each pending bus
+    bool stepTx(void);                                                  // One TX action on one bus
+    bool txWaiting(Bus &b);
+    void wake(void);
+
+    static void *loopEntry(void *arg);
+
+    Bus buses[MCP_MAX_BUSES];
+    McpBusHook *hook;
+    INT32U n_buses;
+    INT32U tx_next_bus;                                                 // Round robin start for stepTx
+    int epoll_fd;
+    int wake_fd;                                                        // eventfd: send(), stop()
+    pthread_t thread;
+    volatile bool running;
+};
+
+#include "mcp_bus_manager_rpi.cpp"
+
+#endif
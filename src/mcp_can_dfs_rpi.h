@@ -52,8 +52,10 @@
 #define INT8U uint8_t
 #endif
 
-// if print debug information
+// if print debug information (define as 0 before including to silence the library)
+#ifndef DEBUG_MODE
 #define DEBUG_MODE 1
+#endif
 
 /*
  *   Begin mt
@@ -89,10 +91,43 @@
 #define MCP_TXB_RTR_M       0x40                                        /* In TXBnDLC                   */
 #define MCP_RXB_IDE_M       0x08                                        /* In RXBnSIDL                  */
 #define MCP_RXB_RTR_M       0x40                                        /* In RXBnDLC                   */
+#define MCP_RXB_SRR_M       0x10                                        /* In RXBnSIDL (std remote)     */
+
+/*
+** Layout of the image returned by READ RX BUFFER (starting at RXBnSIDH).
+*/
+#define MCP_RXB_DLC         4
+#define MCP_RXB_D0          5
+#define MCP_RXB_IMAGE_LEN   13                                          /* SIDH..D7                     */
+
+/*
+** Layout of the image written by LOAD TX BUFFER (starting at TXBnSIDH).
+*/
+#define MCP_TXB_DLC         4
+#define MCP_TXB_D0          5
+#define MCP_TXB_IMAGE_LEN   13                                          /* SIDH..D7                     */
 
 #define MCP_STAT_RXIF_MASK   (0x03)
 #define MCP_STAT_RX0IF       (1<<0)
 #define MCP_STAT_RX1IF       (1<<1)
+#define MCP_STAT_TX0REQ      (1<<2)
+#define MCP_STAT_TX1REQ      (1<<4)
+#define MCP_STAT_TX2REQ      (1<<6)
+#define MCP_STAT_TXREQ(n)    (MCP_STAT_TX0REQ << (2 * (n)))             /* n = TX buffer 0..2           */
+#define MCP_STAT_TX0IF       (1<<3)
+#define MCP_STAT_TX1IF       (1<<5)
+#define MCP_STAT_TX2IF       (1<<7)
+#define MCP_STAT_TXIF(n)     (MCP_STAT_TX0IF << (2 * (n)))              /* n = TX buffer 0..2           */
+
+/*
+** Result of the RX STATUS instruction. With both buffers full, bits 4..0 describe RXB0.
+*/
+#define MCP_RXS_MSG_MASK     (0xC0)
+#define MCP_RXS_RXB0         (1<<6)
+#define MCP_RXS_RXB1         (1<<7)
+#define MCP_RXS_EXT          (1<<4)
+#define MCP_RXS_RTR          (1<<3)
+#define MCP_RXS_FILHIT_MASK  (0x07)                                     /* RXF0..5, 6/7: RXF0/1 rollover*/
 
 #define MCP_EFLG_RX1OVR     (1<<7)
 #define MCP_EFLG_RX0OVR     (1<<6)
@@ -179,11 +214,13 @@
 #define MCP_LOAD_TX0        0x40
 #define MCP_LOAD_TX1        0x42
 #define MCP_LOAD_TX2        0x44
+#define MCP_LOAD_TX(n)      (MCP_LOAD_TX0 + ((n) << 1))                 /* n = TX buffer 0..2           */
 
 #define MCP_RTS_TX0         0x81
 #define MCP_RTS_TX1         0x82
 #define MCP_RTS_TX2         0x84
 #define MCP_RTS_ALL         0x87
+#define MCP_RTS_TX(n)       (0x80 | (1 << (n)))                         /* n = TX buffer 0..2           */
 
 #define MCP_READ_RX0        0x90
 #define MCP_READ_RX1        0x94
@@ -213,6 +250,8 @@
 #define CLKOUT_PS2      0x01
 #define CLKOUT_PS4      0x02
 #define CLKOUT_PS8      0x03
+#define MCP_CANCTRL_RESET 0x87                                          /* Config mode, CLKOUT on, /8   */
+#define MCP_MODE_UNKNOWN  0xFF
 
 
 /*
@@ -252,6 +291,7 @@
 #define MCP_ERRIF       0x20
 #define MCP_WAKIF       0x40
 #define MCP_MERRF       0x80
+#define MCP_TXIF(n)     (MCP_TX0IF << (n))                              /* n = TX buffer 0..2           */
 
 
 /*
@@ -411,6 +451,19 @@
 #define MCPDEBUG        (0)
 #define MCPDEBUG_TXBUF  (0)
 #define MCP_N_TXBUFFERS (3)
+#define MCP_TXB_RESERVED (2)                                            /* Kept by reserveTxBuffer()    */
+#define MCP_N_FILTERS   (6)
+#define MCP_TXQUEUE_SIZE (32)                                           /* Software queue for async TX  */
+#define MCP_RXRING_SIZE  (256)                                          /* RX thread ring, power of two */
+#define MCP_RX_BATCH     (16)                                           /* Frames per readMsgBatch call */
+#define MCP_RXTHREAD_TIMEOUT_NS (10000000L)                             /* Re-check INT every 10 ms     */
+#define MCP_CONFIG_TIMEOUT_NS (50000000L)                               /* OPMOD = CONFIG within 50 ms  */
+#define MCP_SHADOW_SIZE  (128)                                          /* Register map 0x00..0x7F      */
+
+#define MCP_VERIFY_ALWAYS   0                                           /* Read back every change       */
+#define MCP_VERIFY_SAMPLED  1                                           /* Read back 1 change in period */
+#define MCP_VERIFY_ON_ERROR 2                                           /* Read back after errors only  */
+#define MCP_VERIFY_PERIOD   (16)                                        /* Default sampling period      */
 
 #define MCP_RXBUF_0 (MCP_RXB0SIDH)
 #define MCP_RXBUF_1 (MCP_RXB1SIDH)
@@ -477,6 +530,7 @@
 #define CAN_CTRLERROR      (5)
 #define CAN_GETTXBFTIMEOUT (6)
 #define CAN_SENDMSGTIMEOUT (7)
+#define CAN_TXQUEUEFULL    (8)
 #define CAN_FAIL       (0xff)
 
 #define CAN_SPI_FAILINIT   (10)
@@ -42,75 +42,68 @@
 
 /*********************************************************************************************************
 ** Function name:           spiTransfer
-** Descriptions:            Performs a spi transfer on Raspberry Pi (using wiringPi)
+** Descriptions:            Performs a spi transfer through the selected transport. false if it failed.
 *********************************************************************************************************/
-void MCP_CAN::spiTransfer(uint8_t byte_number, unsigned char *buf)
+bool MCP_CAN::spiTransfer(uint8_t byte_number, unsigned char *buf)
 {
-#ifdef __arm__
-    digitalWrite(16, LOW);
-    wiringPiSPIDataRW(spi_channel, buf, byte_number);
-    nanosleep(&delay_spi_can, (struct timespec *)NULL);
-    digitalWrite(16, HIGH);
-#endif
+    return transport->transfer(buf, byte_number);
 }
 
 
 /*********************************************************************************************************
 ** Function name:           setupInterruptGpio
-** Descriptions:            Setups interrupt GPIO pin as input on Raspberry Pi (using wiringPi)
+** Descriptions:            Requests the interrupt GPIO (BCM number) as an input with falling edge events
+**                          through the GPIO character device. The receive thread waits on it.
 *********************************************************************************************************/
 bool MCP_CAN::setupInterruptGpio()
 {
-#ifdef __arm__
-    int result = wiringPiSetupGpio();
-    if (!result)
-    {
-        printf("Gpio started\n");
-    }
-    else
+    McpGpioLine *line = new McpGpioLine(MCP_GPIO_CHIP, gpio_can_interrupt);
+
+    if (!line->open())
     {
         printf("Gpio startup fail\n");
+        delete line;
         return false;
     }
 
-    pinMode(gpio_can_interrupt, INPUT);
-    nanosleep((const struct timespec[]){ { 0, 500000L } }, NULL);
+    setInterruptLine(line);
+    owns_irq_line = true;
+    printf("Gpio started\n");
     return true;
-#else
-    printf("Can't use GPIO on non-ARM processor");
-    return false;
-#endif
 }
 
 
 /*********************************************************************************************************
 ** Function name:           setupSpi
-** Descriptions:            Setups spi communication on Raspberry Pi (using wiringPi)
+** Descriptions:            Setups spi communication (wiringPi unless another transport was given)
 *********************************************************************************************************/
 bool MCP_CAN::setupSpi()
 {
-#ifdef __arm__
-    int result_spi = wiringPiSPISetup(spi_channel, spi_baudrate);
-    printf("Started SPI : %d\n", result_spi);
-    if (result_spi < 0)
-    {
-        return false;
-    }
-    nanosleep((const struct timespec[]){ { 0, 500000L } }, NULL);
-    return true;
-#else
-    printf("Can't use SPI on non-ARM processor");
-    return false;
-#endif
+    return transport->open();
+}
+
+
+/*********************************************************************************************************
+** Function name:           getTransport
+** Descriptions:            Returns the SPI transport, e.g. to read its statistics
+*********************************************************************************************************/
+McpTransport *MCP_CAN::getTransport(void)
+{
+    return transport;
 }
 
 
 /*********************************************************************************************************
 ** Function name:           canReadData
-** Descriptions:            Checks GPIO interrupt pin to see if data is available (using wiringPi)
+** Descriptions:            Checks GPIO interrupt pin to see if data is available (INT low). Uses the
+**                          interrupt line when there is one, wiringPi otherwise.
 *********************************************************************************************************/
 bool MCP_CAN::canReadData()
 {
+    if (irq_line != NULL)
+    {
+        return irq_line->active();
+    }
 #ifdef __arm__
     return !digitalRead(gpio_can_interrupt);
 #else
@@ -128,6 +121,7 @@ void MCP_CAN::mcp2515_reset(void)
     unsigned char cmd[1] = { MCP_RESET };
 
     spiTransfer(1, cmd);
+    mcp2515_shadowReset();
 
     nanosleep((const struct timespec[]){ { 0, 10000L } }, NULL);
 }
@@ -222,7 +216,8 @@ void MCP_CAN::mcp2515_modifyRegister(const INT8U address, const INT8U mask, cons
 
 /*********************************************************************************************************
 ** Function name:           mcp2515_readStatus
-** Descriptions:            Reads status register
+** Descriptions:            Reads status register. A failed transfer reads as every TX buffer pending and no
+**                          flag set, so nothing looks free or finished.
 *********************************************************************************************************/
 INT8U MCP_CAN::mcp2515_readStatus(void)
 {
@@ -230,19 +225,249 @@ INT8U MCP_CAN::mcp2515_readStatus(void)
 
     unsigned char buf[2] = { MCP_READ_STATUS, 0x00 };
 
-    spiTransfer(2, buf);
+    if (!spiTransfer(2, buf))
+    {
+        return MCP_STAT_TX0REQ | MCP_STAT_TX1REQ | MCP_STAT_TX2REQ;
+    }
     i = buf[1];
 
     return i;
 }
 
 
+/*********************************************************************************************************
+** Function name:           mcp2515_shadowReset
+** Descriptions:            Forgets the shadow and seeds the registers with a documented reset value
+**                          (masks and filters are undefined after reset and stay unknown)
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_shadowReset(void)
+{
+    const INT8U zero[3] = { 0, 0, 0 };
+    const INT8U ctrl    = MCP_CANCTRL_RESET;
+
+    mcp2515_shadowInvalidate();
+    mcp2515_shadowStore(MCP_CANCTRL, &ctrl, 1);
+    mcp2515_shadowStore(MCP_CNF3, zero, 3);                             /* CNF3, CNF2, CNF1             */
+    mcp2515_shadowStore(MCP_CANINTE, zero, 1);
+    mcp2515_shadowStore(MCP_RXB0CTRL, zero, 1);
+    mcp2515_shadowStore(MCP_RXB1CTRL, zero, 1);
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_shadowInvalidate
+** Descriptions:            Marks every shadowed register unknown; the next change is read back
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_shadowInvalidate(void)
+{
+    memset(shadow_valid, 0, sizeof(shadow_valid));
+    verify_pending = true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_shadowMatch
+** Descriptions:            True if the shadow is valid for all n registers and holds exactly values
+*********************************************************************************************************/
+bool MCP_CAN::mcp2515_shadowMatch(const INT8U address, const INT8U values[], const INT8U n)
+{
+    INT8U i, a;
+
+    for (i = 0; i < n; i++)
+    {
+        a = address + i;
+        if (!(shadow_valid[a >> 3] & (1 << (a & 7))) || shadow[a] != values[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_shadowStore
+** Descriptions:            Records values as the content of n registers from address
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_shadowStore(const INT8U address, const INT8U values[], const INT8U n)
+{
+    INT8U i, a;
+
+    for (i = 0; i < n; i++)
+    {
+        a = address + i;
+        shadow[a] = values[i];
+        shadow_valid[a >> 3] |= (1 << (a & 7));
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_shadowMode
+** Descriptions:            Mode last requested in CANCTRL, MCP_MODE_UNKNOWN if the shadow is invalid
+*********************************************************************************************************/
+INT8U MCP_CAN::mcp2515_shadowMode(void)
+{
+    if (shadow_valid[MCP_CANCTRL >> 3] & (1 << (MCP_CANCTRL & 7)))
+    {
+        return shadow[MCP_CANCTRL] & MODE_MASK;
+    }
+
+    return MCP_MODE_UNKNOWN;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_queueWrite
+** Descriptions:            Queues a register write on txn unless the shadow says it is already there
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_queueWrite(const INT8U address, const INT8U value)
+{
+    mcp2515_queueWriteS(address, &value, 1);
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_queueWriteS
+** Descriptions:            Queues a sequential write of the first to the last register that differs
+**                          from the shadow; nothing if none does
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_queueWriteS(const INT8U address, const INT8U values[], const INT8U n)
+{
+    INT8U first = 0, last = n;
+
+    while (first < n && mcp2515_shadowMatch(address + first, &values[first], 1))
+    {
+        first++;
+    }
+    if (first == n)
+    {
+        return;
+    }
+    while (mcp2515_shadowMatch(address + last - 1, &values[last - 1], 1))
+    {
+        last--;
+    }
+
+    txn.writeRegisters(address + first, &values[first], last - first);
+    mcp2515_shadowStore(address, values, n);
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_queueModify
+** Descriptions:            Queues a bit modify on txn unless the shadow shows the bits already set.
+**                          A register whose shadow is unknown stays unknown (only mask bits change).
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_queueModify(const INT8U address, const INT8U mask, const INT8U data)
+{
+    INT8U value;
+
+    if (!(shadow_valid[address >> 3] & (1 << (address & 7))))
+    {
+        txn.modifyRegister(address, mask, data);
+        return;
+    }
+
+    value = (shadow[address] & ~mask) | (data & mask);
+    if (value != shadow[address])
+    {
+        txn.modifyRegister(address, mask, data);
+        shadow[address] = value;
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_needsVerify
+** Descriptions:            Decides whether the configuration change being built is read back.
+**                          Call once per change.
+*********************************************************************************************************/
+bool MCP_CAN::mcp2515_needsVerify(void)
+{
+    if (verify_pending || verify_policy == MCP_VERIFY_ALWAYS)
+    {
+        return true;
+    }
+    if (verify_policy == MCP_VERIFY_SAMPLED && ++verify_count >= verify_period)
+    {
+        verify_count = 0;
+        return true;
+    }
+
+    return false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_queueVerify
+** Descriptions:            Queues a read of CANSTAT and CANCTRL (consecutive) into stat_ctrl[2]
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_queueVerify(INT8U stat_ctrl[])
+{
+    txn.readRegisters(MCP_CANSTAT, stat_ctrl, 2);
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_checkVerify
+** Descriptions:            Checks a read-back: CANCTRL bits in mask must equal value, and CANSTAT must
+**                          be in the requested mode or still in prev_mode (the mode requested before
+**                          this change). A request for configuration mode only passes once CANSTAT
+**                          shows it: registers written before that are ignored by the controller. A
+**                          change that does not touch the mode bits must find the request still at
+**                          prev_mode. Anything else means the controller is not where the shadow thinks
+**                          it is (e.g. it reset itself), so the shadow is dropped.
+*********************************************************************************************************/
+INT8U MCP_CAN::mcp2515_checkVerify(const INT8U stat_ctrl[], const INT8U mask, const INT8U value,
+                                   const INT8U prev_mode)
+{
+    INT8U opmod  = stat_ctrl[0] & MODE_MASK;
+    INT8U reqop  = stat_ctrl[1] & MODE_MASK;
+    bool  known  = (prev_mode != MCP_MODE_UNKNOWN);
+    bool  config = (mask & MODE_MASK) && (value & MODE_MASK) == MODE_CONFIG;
+
+    if ((stat_ctrl[1] & mask) != value ||
+        (config && opmod != MODE_CONFIG) ||
+        (known && !(mask & MODE_MASK) && reqop != prev_mode) ||
+        (known && opmod != reqop && opmod != prev_mode))
+    {
+        mcp2515_shadowInvalidate();
+        return MCP2515_FAIL;
+    }
+
+    mcp2515_shadowStore(MCP_CANCTRL, &stat_ctrl[1], 1);
+    verify_pending = false;
+
+    return MCP2515_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_submit
+** Descriptions:            Submits txn. If it could not be sent the shadow no longer matches the chip.
+*********************************************************************************************************/
+bool MCP_CAN::mcp2515_submit(void)
+{
+    if (!txn.submit(transport))
+    {
+        mcp2515_shadowInvalidate();
+        return false;
+    }
+
+    return true;
+}
+
+
 /*********************************************************************************************************
 ** Function name:           setMode
 ** Descriptions:            Sets control mode
 *********************************************************************************************************/
 INT8U MCP_CAN::setMode(const INT8U opMode)
 {
+    McpLockGuard guard(&spi_lock);
+
     mcpMode = opMode;
     return mcp2515_setCANCTRL_Mode(mcpMode);
 }
@@ -250,35 +475,127 @@ INT8U MCP_CAN::setMode(const INT8U opMode)
 
 /*********************************************************************************************************
 ** Function name:           mcp2515_setCANCTRL_Mode
-** Descriptions:            Set control mode
+** Descriptions:            Set control mode, read back according to verify_policy
 *********************************************************************************************************/
 INT8U MCP_CAN::mcp2515_setCANCTRL_Mode(const INT8U newmode)
 {
-    INT8U i;
+    INT8U stat_ctrl[2] = { 0, 0 };
+    INT8U prev;
+    bool  verify;
 
-    mcp2515_modifyRegister(MCP_CANCTRL, MODE_MASK, newmode);
+    if ((newmode & MODE_MASK) == MODE_CONFIG)
+    {
+        return mcp2515_enterConfig();
+    }
 
-    i  = mcp2515_readRegister(MCP_CANCTRL);
-    i &= MODE_MASK;
+    prev   = mcp2515_shadowMode();
+    verify = mcp2515_needsVerify();
 
-    if (i == newmode)
+    mcp2515_queueModify(MCP_CANCTRL, MODE_MASK, newmode);               /* skipped if already requested */
+    if (verify)
     {
-        return MCP2515_OK;
+        mcp2515_queueVerify(stat_ctrl);
     }
-    else
+    if (!mcp2515_submit())
+    {
+        return MCP2515_FAIL;
+    }
+
+    if (verify)
+    {
+        return mcp2515_checkVerify(stat_ctrl, MODE_MASK, newmode, prev);
+    }
+
+    return MCP2515_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_enterConfig
+** Descriptions:            Requests configuration mode and reads CANSTAT until OPMOD shows it. The
+**                          controller only switches once the frame on the bus is over, and ignores
+**                          mask, filter and CNF writes until then. On timeout the request is withdrawn
+**                          (back to mcpMode) and MCP2515_FAIL returned.
+*********************************************************************************************************/
+INT8U MCP_CAN::mcp2515_enterConfig(void)
+{
+    uint64_t now_ns, deadline = 0;
+    INT8U    canstat = 0;
+
+    mcp2515_queueModify(MCP_CANCTRL, MODE_MASK, MODE_CONFIG);
+    for (;;)
+    {
+        txn.readRegister(MCP_CANSTAT, &canstat);
+        if (!mcp2515_submit())
+        {
+            return MCP2515_FAIL;
+        }
+        if ((canstat & MODE_MASK) == MODE_CONFIG)
+        {
+            return MCP2515_OK;
+        }
+
+        now_ns = canNowNs();
+        if (deadline == 0)
+        {
+            deadline = now_ns + MCP_CONFIG_TIMEOUT_NS;
+        }
+        else if (now_ns > deadline)
+        {
+            break;
+        }
+    }
+
+#if DEBUG_MODE
+    printf("Configuration mode not reached...\r\n");
+#endif
+    mcp2515_queueModify(MCP_CANCTRL, MODE_MASK, mcpMode);
+    mcp2515_submit();
+    verify_pending = true;
+
+    return MCP2515_FAIL;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_leaveConfig
+** Descriptions:            Ends a configuration window: back to mcpMode, read back according to
+**                          verify_policy
+*********************************************************************************************************/
+INT8U MCP_CAN::mcp2515_leaveConfig(void)
+{
+    INT8U stat_back[2] = { 0, 0 };
+    bool  verify       = mcp2515_needsVerify();
+
+    mcp2515_queueModify(MCP_CANCTRL, MODE_MASK, mcpMode);
+    if (verify)
+    {
+        mcp2515_queueVerify(stat_back);
+    }
+    if (!mcp2515_submit())
+    {
+        return MCP2515_FAIL;
+    }
+
+    if (verify && mcp2515_checkVerify(stat_back, MODE_MASK, mcpMode, MODE_CONFIG))
     {
+#if DEBUG_MODE
+        printf("Entering Previous Mode Failure...\r\n");
+#endif
         return MCP2515_FAIL;
     }
+
+    return MCP2515_OK;
 }
 
 
 /*********************************************************************************************************
 ** Function name:           mcp2515_configRate
-** Descriptions:            Set baudrate
+** Descriptions:            Set baudrate (queued on txn, CNF3..CNF1 as one sequential write)
 *********************************************************************************************************/
 INT8U MCP_CAN::mcp2515_configRate(const INT8U canSpeed, const INT8U canClock)
 {
-    INT8U set, cfg1, cfg2, cfg3;
+    INT8U set, cfg1 = 0, cfg2 = 0, cfg3 = 0;
 
     set = 1;
     switch (canClock)
@@ -412,6 +729,7 @@ INT8U MCP_CAN::mcp2515_configRate(const INT8U canSpeed, const INT8U canClock)
             break;
 
         case (CAN_50KBPS):                                                  //  50Kbps
+            cfg1 = MCP_16MHz_50kBPS_CFG1;
             cfg2 = MCP_16MHz_50kBPS_CFG2;
             cfg3 = MCP_16MHz_50kBPS_CFG3;
             break;
@@ -540,9 +858,9 @@ INT8U MCP_CAN::mcp2515_configRate(const INT8U canSpeed, const INT8U canClock)
 
     if (set)
     {
-        mcp2515_setRegister(MCP_CNF1, cfg1);
-        mcp2515_setRegister(MCP_CNF2, cfg2);
-        mcp2515_setRegister(MCP_CNF3, cfg3);
+        INT8U cnf[3] = { cfg3, cfg2, cfg1 };                            /* CNF3, CNF2, CNF1 addresses   */
+
+        mcp2515_queueWriteS(MCP_CNF3, cnf, 3);
         return MCP2515_OK;
     }
 
@@ -552,45 +870,39 @@ INT8U MCP_CAN::mcp2515_configRate(const INT8U canSpeed, const INT8U canClock)
 
 /*********************************************************************************************************
 ** Function name:           mcp2515_initCANBuffers
-** Descriptions:            Initialize Buffers, Masks, and Filters
+** Descriptions:            Initialize Buffers, Masks, and Filters (queued on txn)
 *********************************************************************************************************/
 void MCP_CAN::mcp2515_initCANBuffers(void)
 {
-    INT8U i, a1, a2, a3;
-
+    INT8U  i;
     INT8U  std = 0;
     INT8U  ext = 1;
     INT32U ulMask = 0x00, ulFilt = 0x00;
+    INT8U  masks[8], filters[12];
 
-
-    mcp2515_write_mf(MCP_RXM0SIDH, ext, ulMask);            /*Set both masks to 0           */
-    mcp2515_write_mf(MCP_RXM1SIDH, ext, ulMask);            /*Mask register ignores ext bit */
+    mcp2515_encode_mf(ext, ulMask, &masks[0]);                          /*Set both masks to 0           */
+    mcp2515_encode_mf(ext, ulMask, &masks[4]);                          /*Mask register ignores ext bit */
+    mcp2515_queueWriteS(MCP_RXM0SIDH, masks, 8);
 
     /* Set all filters to 0         */
-    mcp2515_write_mf(MCP_RXF0SIDH, ext, ulFilt);            /* RXB0: extended               */
-    mcp2515_write_mf(MCP_RXF1SIDH, std, ulFilt);            /* RXB1: standard               */
-    mcp2515_write_mf(MCP_RXF2SIDH, ext, ulFilt);            /* RXB2: extended               */
-    mcp2515_write_mf(MCP_RXF3SIDH, std, ulFilt);            /* RXB3: standard               */
-    mcp2515_write_mf(MCP_RXF4SIDH, ext, ulFilt);
-    mcp2515_write_mf(MCP_RXF5SIDH, std, ulFilt);
+    mcp2515_encode_mf(ext, ulFilt, &filters[0]);                        /* RXB0: extended               */
+    mcp2515_encode_mf(std, ulFilt, &filters[4]);                        /* RXB1: standard               */
+    mcp2515_encode_mf(ext, ulFilt, &filters[8]);                        /* RXB2: extended               */
+    mcp2515_queueWriteS(MCP_RXF0SIDH, filters, 12);
+    mcp2515_encode_mf(std, ulFilt, &filters[0]);                        /* RXB3: standard               */
+    mcp2515_encode_mf(ext, ulFilt, &filters[4]);
+    mcp2515_encode_mf(std, ulFilt, &filters[8]);
+    mcp2515_queueWriteS(MCP_RXF3SIDH, filters, 12);
 
     /* Clear, deactivate the three  */
     /* transmit buffers             */
     /* TXBnCTRL -> TXBnD7           */
-    a1 = MCP_TXB0CTRL;
-    a2 = MCP_TXB1CTRL;
-    a3 = MCP_TXB2CTRL;
-    for (i = 0; i < 14; i++)                                            /* in-buffer loop               */
+    for (i = 0; i < MCP_N_TXBUFFERS; i++)
     {
-        mcp2515_setRegister(a1, 0);
-        mcp2515_setRegister(a2, 0);
-        mcp2515_setRegister(a3, 0);
-        a1++;
-        a2++;
-        a3++;
+        txn.fillRegisters(MCP_TXB0CTRL + 0x10 * i, 0, 14);
     }
-    mcp2515_setRegister(MCP_RXB0CTRL, 0);
-    mcp2515_setRegister(MCP_RXB1CTRL, 0);
+    mcp2515_queueWrite(MCP_RXB0CTRL, 0);
+    mcp2515_queueWrite(MCP_RXB1CTRL, 0);
 }
 
 
@@ -601,9 +913,14 @@ void MCP_CAN::mcp2515_initCANBuffers(void)
 INT8U MCP_CAN::mcp2515_init(const INT8U canIDMode, const INT8U canSpeed, const INT8U canClock)
 {
     INT8U res;
+    INT8U stat_ctrl[2] = { 0, 0 };
 
     mcp2515_reset();
 
+    tx_inflight_mask = 0;                                               /* reset aborted in-flight TX   */
+    tx_reserved_mask = 0;                                               /* ...and emptied TXB2          */
+    tx_int_enabled   = false;
+
     mcpMode = MCP_LOOPBACK;
 
     res = mcp2515_setCANCTRL_Mode(MODE_CONFIG);
@@ -618,35 +935,34 @@ INT8U MCP_CAN::mcp2515_init(const INT8U canIDMode, const INT8U canSpeed, const I
     printf("Entering Configuration Mode Successful!\r\n");
 #endif
 
+    // Everything below goes out as a single batch
+    txn.clear();
+
     // Set Baudrate
     if (mcp2515_configRate(canSpeed, canClock))
     {
 #if DEBUG_MODE
         printf("Setting Baudrate Failure...\r\n");
 #endif
-        return res;
+        txn.clear();
+        return MCP2515_FAIL;
     }
-#if DEBUG_MODE
-    printf("Setting Baudrate Successful!\r\n");
-#endif
 
-    if (res == MCP2515_OK)
-    {
-        /* init canbuffers              */
-        mcp2515_initCANBuffers();
+    /* init canbuffers              */
+    mcp2515_initCANBuffers();
 
-        /* interrupt mode               */
-        mcp2515_setRegister(MCP_CANINTE, MCP_RX0IF | MCP_RX1IF);
+    /* interrupt mode               */
+    mcp2515_queueWrite(MCP_CANINTE, MCP_RX0IF | MCP_RX1IF);
 
-        switch (canIDMode)
-        {
-        case (MCP_ANY):
-            mcp2515_modifyRegister(MCP_RXB0CTRL,
-                                   MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK,
-                                   MCP_RXB_RX_ANY | MCP_RXB_BUKT_MASK);
-            mcp2515_modifyRegister(MCP_RXB1CTRL, MCP_RXB_RX_MASK,
-                                   MCP_RXB_RX_ANY);
-            break;
+    switch (canIDMode)
+    {
+    case (MCP_ANY):
+        mcp2515_queueModify(MCP_RXB0CTRL,
+                            MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK,
+                            MCP_RXB_RX_ANY | MCP_RXB_BUKT_MASK);
+        mcp2515_queueModify(MCP_RXB1CTRL, MCP_RXB_RX_MASK,
+                            MCP_RXB_RX_ANY);
+        break;
 
 /*          The followingn two functions of the MCP2515 do not work, there is a bug in the silicon.
  *          case (MCP_STD):
@@ -664,34 +980,55 @@ INT8U MCP_CAN::mcp2515_init(const INT8U canIDMode, const INT8U canSpeed, const I
  *          MCP_RXB_RX_EXT);
  *          break;
  */
-        case (MCP_STDEXT):
-            mcp2515_modifyRegister(MCP_RXB0CTRL,
-                                   MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK,
-                                   MCP_RXB_RX_STDEXT | MCP_RXB_BUKT_MASK);
-            mcp2515_modifyRegister(MCP_RXB1CTRL, MCP_RXB_RX_MASK,
-                                   MCP_RXB_RX_STDEXT);
-            break;
+    case (MCP_STDEXT):
+        mcp2515_queueModify(MCP_RXB0CTRL,
+                            MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK,
+                            MCP_RXB_RX_STDEXT | MCP_RXB_BUKT_MASK);
+        mcp2515_queueModify(MCP_RXB1CTRL, MCP_RXB_RX_MASK,
+                            MCP_RXB_RX_STDEXT);
+        break;
 
-        default:
+    default:
 #if DEBUG_MODE
-            printf("`Setting ID Mode Failure...\r\n");
+        printf("`Setting ID Mode Failure...\r\n");
 #endif
-            return MCP2515_FAIL;
+        txn.clear();
+        mcp2515_shadowInvalidate();                                     /* queued writes never went out */
+        return MCP2515_FAIL;
 
-            break;
-        }
+        break;
+    }
 
+    mcp2515_queueModify(MCP_CANCTRL, MODE_MASK, mcpMode);               /* back to the previous mode    */
+    mcp2515_queueVerify(stat_ctrl);                                     /* always: is the chip there?   */
 
-        res = mcp2515_setCANCTRL_Mode(mcpMode);
-        if (res)
-        {
+    if (!mcp2515_submit())
+    {
+        return MCP2515_FAIL;
+    }
 #if DEBUG_MODE
-            printf("Returning to Previous Mode Failure...\r\n");
+    printf("Setting Baudrate Successful!\r\n");
 #endif
-            return res;
-        }
+
+    if (mcp2515_checkVerify(stat_ctrl, MODE_MASK, mcpMode, MODE_CONFIG))
+    {
+#if DEBUG_MODE
+        printf("Returning to Previous Mode Failure...\r\n");
+#endif
+        return MCP2515_FAIL;
     }
-    return res;
+
+    return MCP2515_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_encode_id
+** Descriptions:            Encode CAN ID into a SIDH/SIDL/EID8/EID0 register image
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_encode_id(const INT8U ext, const INT32U id, INT8U *tbufdata)
+{
+    canEncodeId(ext, id, tbufdata);
 }
 
 
@@ -701,64 +1038,107 @@ INT8U MCP_CAN::mcp2515_init(const INT8U canIDMode, const INT8U canSpeed, const I
 *********************************************************************************************************/
 void MCP_CAN::mcp2515_write_id(const INT8U mcp_addr, const INT8U ext, const INT32U id)
 {
-    uint16_t canid;
-    INT8U    tbufdata[4];
-
-    canid = (uint16_t)(id & 0x0FFFF);
-
-    if (ext == 1)
-    {
-        tbufdata[MCP_EID0] = (INT8U)(canid & 0xFF);
-        tbufdata[MCP_EID8] = (INT8U)(canid >> 8);
-        canid = (uint16_t)(id >> 16);
-        tbufdata[MCP_SIDL]  = (INT8U)(canid & 0x03);
-        tbufdata[MCP_SIDL] += (INT8U)((canid & 0x1C) << 3);
-        tbufdata[MCP_SIDL] |= MCP_TXB_EXIDE_M;
-        tbufdata[MCP_SIDH]  = (INT8U)(canid >> 5);
-    }
-    else
-    {
-        tbufdata[MCP_SIDH] = (INT8U)(canid >> 3);
-        tbufdata[MCP_SIDL] = (INT8U)((canid & 0x07) << 5);
-        tbufdata[MCP_EID0] = 0;
-        tbufdata[MCP_EID8] = 0;
-    }
+    INT8U tbufdata[4];
 
+    mcp2515_encode_id(ext, id, tbufdata);
     mcp2515_setRegisterS(mcp_addr, tbufdata, 4);
 }
 
 
+/*********************************************************************************************************
+** Function name:           mcp2515_encode_mf
+** Descriptions:            Encode Mask or Filter into a SIDH/SIDL/EID8/EID0 register image
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_encode_mf(const INT8U ext, const INT32U id, INT8U *tbufdata)
+{
+    canEncodeMf(ext, id, tbufdata);
+}
+
+
 /*********************************************************************************************************
 ** Function name:           mcp2515_write_mf
-** Descriptions:            Write Masks and Filters
+** Descriptions:            Write Masks and Filters (queued on txn, changed bytes only)
 *********************************************************************************************************/
 void MCP_CAN::mcp2515_write_mf(const INT8U mcp_addr, const INT8U ext, const INT32U id)
 {
-    uint16_t canid;
-    INT8U    tbufdata[4];
+    INT8U tbufdata[4];
+
+    mcp2515_encode_mf(ext, id, tbufdata);
+    mcp2515_queueWriteS(mcp_addr, tbufdata, 4);
+}
+
 
-    canid = (uint16_t)(id & 0x0FFFF);
+/*********************************************************************************************************
+** Function name:           mcp2515_setMF
+** Descriptions:            Writes one mask or filter inside a configuration mode window: the write is
+**                          only queued once the controller is in configuration mode, then the mode
+**                          returns to mcpMode. Nothing is sent if the shadow already holds the value.
+*********************************************************************************************************/
+INT8U MCP_CAN::mcp2515_setMF(const INT8U mcp_addr, const INT8U ext, const INT32U id)
+{
+    INT8U tbufdata[4];
 
-    if (ext == 1)
+    mcp2515_encode_mf(ext, id, tbufdata);
+    if (mcp2515_shadowMatch(mcp_addr, tbufdata, 4))
     {
-        tbufdata[MCP_EID0] = (INT8U)(canid & 0xFF);
-        tbufdata[MCP_EID8] = (INT8U)(canid >> 8);
-        canid = (uint16_t)(id >> 16);
-        tbufdata[MCP_SIDL]  = (INT8U)(canid & 0x03);
-        tbufdata[MCP_SIDL] += (INT8U)((canid & 0x1C) << 3);
-        tbufdata[MCP_SIDL] |= MCP_TXB_EXIDE_M;
-        tbufdata[MCP_SIDH]  = (INT8U)(canid >> 5);
+        return MCP2515_OK;
     }
-    else
+
+    if (mcp2515_enterConfig())
     {
-        tbufdata[MCP_EID0] = (INT8U)(canid & 0xFF);
-        tbufdata[MCP_EID8] = (INT8U)(canid >> 8);
-        canid = (uint16_t)(id >> 16);
-        tbufdata[MCP_SIDL] = (INT8U)((canid & 0x07) << 5);
-        tbufdata[MCP_SIDH] = (INT8U)(canid >> 3);
+#if DEBUG_MODE
+        printf("Entering Configuration Mode Failure...\r\n");
+#endif
+        return MCP2515_FAIL;
     }
+    mcp2515_queueWriteS(mcp_addr, tbufdata, 4);                         /* taken: OPMOD is CONFIG       */
 
-    mcp2515_setRegisterS(mcp_addr, tbufdata, 4);
+    return mcp2515_leaveConfig();
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_setFilters
+** Descriptions:            Writes both masks (8 bytes from RXM0SIDH), the six filters (24 bytes, RXF0..5)
+**                          and the RXM bits of RXB0/RXB1 inside one configuration mode window. Frames
+**                          arriving during the window are not received. Unchanged bytes are skipped;
+**                          if only the RXM bits change there is no window (RXBnCTRL is writable in any
+**                          mode).
+*********************************************************************************************************/
+INT8U MCP_CAN::mcp2515_setFilters(const INT8U *masks, const INT8U *filters, const INT8U rxm)
+{
+    if (mcp2515_shadowMatch(MCP_RXM0SIDH, masks, 8) && mcp2515_shadowMatch(MCP_RXF0SIDH, &filters[0], 12) &&
+        mcp2515_shadowMatch(MCP_RXF3SIDH, &filters[12], 12))
+    {
+        mcp2515_queueModify(MCP_RXB0CTRL, MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK, rxm | MCP_RXB_BUKT_MASK);
+        mcp2515_queueModify(MCP_RXB1CTRL, MCP_RXB_RX_MASK, rxm);
+        return mcp2515_submit() ? MCP2515_OK : MCP2515_FAIL;
+    }
+
+    if (mcp2515_enterConfig())
+    {
+#if DEBUG_MODE
+        printf("Entering Configuration Mode Failure...\r\n");
+#endif
+        return MCP2515_FAIL;
+    }
+    mcp2515_queueWriteS(MCP_RXM0SIDH, masks, 8);
+    mcp2515_queueWriteS(MCP_RXF0SIDH, &filters[0], 12);
+    mcp2515_queueWriteS(MCP_RXF3SIDH, &filters[12], 12);
+    mcp2515_queueModify(MCP_RXB0CTRL, MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK, rxm | MCP_RXB_BUKT_MASK);
+    mcp2515_queueModify(MCP_RXB1CTRL, MCP_RXB_RX_MASK, rxm);
+
+    return mcp2515_leaveConfig();
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_decode_id
+** Descriptions:            Decode CAN ID from a SIDH/SIDL/EID8/EID0 register image
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_decode_id(const INT8U *tbufdata, INT8U *ext, INT32U *id)
+{
+    canDecodeId(tbufdata, ext, id);
 }
 
 
@@ -770,99 +1150,169 @@ void MCP_CAN::mcp2515_read_id(const INT8U mcp_addr, INT8U *ext, INT32U *id)
 {
     INT8U tbufdata[4];
 
-    *ext = 0;
-    *id  = 0;
-
     mcp2515_readRegisterS(mcp_addr, tbufdata, 4);
+    mcp2515_decode_id(tbufdata, ext, id);
+}
 
-    *id = (tbufdata[MCP_SIDH] << 3) + (tbufdata[MCP_SIDL] >> 5);
 
-    if ((tbufdata[MCP_SIDL] & MCP_TXB_EXIDE_M) == MCP_TXB_EXIDE_M)
-    {
-        /* extended id                  */
-        *id  = (*id << 2) + (tbufdata[MCP_SIDL] & 0x03);
-        *id  = (*id << 8) + tbufdata[MCP_EID8];
-        *id  = (*id << 8) + tbufdata[MCP_EID0];
-        *ext = 1;
-    }
+/*********************************************************************************************************
+** Function name:           mcp2515_write_canMsg
+** Descriptions:            Write message with a single LOAD TX BUFFER transaction (SIDH to D[dlc-1]).
+**                          false if the transfer failed.
+*********************************************************************************************************/
+bool MCP_CAN::mcp2515_write_canMsg(const INT8U txbuf_n, const CanFrame &frame)
+{
+    unsigned char buf[1 + MCP_TXB_IMAGE_LEN];
+
+    buf[0] = MCP_LOAD_TX(txbuf_n);                                      /* LOAD TX, start at TXBnSIDH   */
+
+    return spiTransfer(1 + canEncodeTxImage(frame, &buf[1]), buf);
 }
 
 
 /*********************************************************************************************************
-** Function name:           mcp2515_write_canMsg
-** Descriptions:            Write message
+** Function name:           mcp2515_start_transmit
+** Descriptions:            Request to send the given TX buffer with a single RTS instruction. false if the
+**                          transfer failed.
 *********************************************************************************************************/
-void MCP_CAN::mcp2515_write_canMsg(const INT8U buffer_sidh_addr)
+bool MCP_CAN::mcp2515_start_transmit(const INT8U txbuf_n)
 {
-    INT8U mcp_addr;
+    unsigned char buf[1] = { (unsigned char)MCP_RTS_TX(txbuf_n) };
 
-    mcp_addr = buffer_sidh_addr;
-    mcp2515_setRegisterS(mcp_addr + 5, m_nDta, m_nDlc);                 /* write data bytes             */
+    return spiTransfer(1, buf);
+}
 
-    if (m_nRtr == 1)                                                    /* if RTR set bit in byte       */
-    {
-        m_nDlc |= MCP_RTR_MASK;
-    }
 
-    mcp2515_setRegister((mcp_addr + 4), m_nDlc);                        /* write the RTR and DLC        */
-    mcp2515_write_id(mcp_addr, m_nExtFlg, m_nID);                       /* write CAN id                 */
+/*********************************************************************************************************
+** Function name:           mcp2515_decode_canMsg
+** Descriptions:            Fills frame from a READ RX BUFFER image (SIDH to D7). filhit is left alone.
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_decode_canMsg(const INT8U *image, CanFrame &frame)
+{
+    canDecodeRxImage(image, frame);
 }
 
 
 /*********************************************************************************************************
-** Function name:           mcp2515_read_canMsg
-** Descriptions:            Read message
+** Function name:           mcp2515_readRxStatus
+** Descriptions:            RX STATUS: which buffers hold a frame, its type and the filter it matched.
+**                          0 (no frame) if the transfer failed.
 *********************************************************************************************************/
-void MCP_CAN::mcp2515_read_canMsg(const INT8U buffer_sidh_addr)         /* read can msg                 */
+INT8U MCP_CAN::mcp2515_readRxStatus(void)
 {
-    INT8U mcp_addr, ctrl;
+    unsigned char buf[2] = { MCP_RX_STATUS, 0x00 };
+
+    if (!spiTransfer(2, buf))
+    {
+        return 0;
+    }
 
-    mcp_addr = buffer_sidh_addr;
+    return buf[1];
+}
 
-    mcp2515_read_id(mcp_addr, &m_nExtFlg, &m_nID);
 
-    ctrl   = mcp2515_readRegister(mcp_addr - 1);
-    m_nDlc = mcp2515_readRegister(mcp_addr + 4);
+/*********************************************************************************************************
+** Function name:           mcp2515_readRxs_canMsg
+** Descriptions:            Reads the frame RX STATUS (rxs) reports: RXB0 when it is full, RXB1 otherwise,
+**                          and tags it with the filter that accepted it. If next_rxs is given, RX STATUS
+**                          is read again in the same batch, after READ RX has cleared the RXnIF flag.
+**                          false (frame untouched, *next_rxs = 0) if the transfer failed.
+*********************************************************************************************************/
+bool MCP_CAN::mcp2515_readRxs_canMsg(const INT8U rxs, CanFrame &frame, INT8U *next_rxs)
+{
+    INT8U image[MCP_RXB_IMAGE_LEN];
+    INT8U filhit = rxs & MCP_RXS_FILHIT_MASK;
 
-    if (ctrl & 0x08)
+    txn.readInstruction((rxs & MCP_RXS_RXB0) ? MCP_READ_RX0 : MCP_READ_RX1, image, MCP_RXB_IMAGE_LEN);
+    if (next_rxs != NULL)
     {
-        m_nRtr = 1;
+        txn.readInstruction(MCP_RX_STATUS, next_rxs, 1);
     }
-    else
+    if (!txn.submit(transport))                                         /* nothing read: no frame       */
+    {
+        if (next_rxs != NULL)
+        {
+            *next_rxs = 0;
+        }
+        return false;
+    }
+
+    mcp2515_decode_canMsg(image, frame);
+
+    if (filhit >= MCP_N_FILTERS)                                        /* RXF0/RXF1 rolled over to RXB1*/
     {
-        m_nRtr = 0;
+        filhit -= MCP_N_FILTERS;
     }
+    frame.filhit = filhit;
+    rx_filter_hits[filhit]++;
 
-    m_nDlc &= MCP_DLC_MASK;
-    mcp2515_readRegisterS(mcp_addr + 5, &(m_nDta[0]), m_nDlc);
+    return true;
 }
 
 
 /*********************************************************************************************************
 ** Function name:           mcp2515_getNextFreeTXBuf
-** Descriptions:            Send message
+** Descriptions:            Find a free TX buffer (0..2) using the TXnREQ bits of READ STATUS.
+**                          Buffers holding an async frame that serviceTx() has not collected, and the
+**                          reserved buffer, are skipped.
 *********************************************************************************************************/
 INT8U MCP_CAN::mcp2515_getNextFreeTXBuf(INT8U *txbuf_n)                 /* get Next free txbuf          */
 {
-    INT8U res, i, ctrlval;
-    INT8U ctrlregs[MCP_N_TXBUFFERS] = { MCP_TXB0CTRL, MCP_TXB1CTRL, MCP_TXB2CTRL };
+    INT8U i, stat;
 
-    res      = MCP_ALLTXBUSY;
     *txbuf_n = 0x00;
 
     /* check all 3 TX-Buffers       */
+    stat = mcp2515_readStatus();
     for (i = 0; i < MCP_N_TXBUFFERS; i++)
     {
-        ctrlval = mcp2515_readRegister(ctrlregs[i]);
-        if ((ctrlval & MCP_TXB_TXREQ_M) == 0)
+        if ((stat & MCP_STAT_TXREQ(i)) == 0 && ((tx_inflight_mask | tx_reserved_mask) & (1 << i)) == 0)
+        {
+            *txbuf_n = i;                                               /* return buffer number         */
+            return MCP2515_OK;                                          /* ! function exit              */
+        }
+    }
+    return MCP_ALLTXBUSY;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_fillTXBuffers
+** Descriptions:            Load queued async frames into the TX buffers that are free in stat (READ STATUS).
+**                          Must be called with spi_lock held.
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_fillTXBuffers(INT8U stat)
+{
+    INT8U i;
+
+    for (i = 0; i < MCP_N_TXBUFFERS && tx_queue_count > 0; i++)
+    {
+        if ((stat & MCP_STAT_TXREQ(i)) || ((tx_inflight_mask | tx_reserved_mask) & (1 << i)))
         {
-            *txbuf_n = ctrlregs[i] + 1;                                   /* return SIDH-address of Buffer*/
+            continue;                                                   /* busy, unserviced or reserved */
+        }
+
+        tx_inflight[i] = tx_queue[tx_queue_head];
+        tx_queue_head  = (tx_queue_head + 1) % MCP_TXQUEUE_SIZE;
+        tx_queue_count--;
 
-            res = MCP2515_OK;
-            return res;                                                 /* ! function exit              */
+        if (!mcp2515_write_canMsg(i, tx_inflight[i]) || !mcp2515_start_transmit(i))
+        {
+            tx_failed++;                                                /* SPI failed: frame lost       */
+            return;
         }
+        tx_inflight_mask |= (1 << i);
     }
-    return res;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_txBlocked
+** Descriptions:            frame has the ID refused by blockTx(). Must be called with spi_lock held.
+*********************************************************************************************************/
+bool MCP_CAN::mcp2515_txBlocked(const CanFrame &frame)
+{
+    return tx_blocked && frame.id == tx_block_id && (frame.ext != 0) == (tx_block_ext != 0);
 }
 
 
@@ -872,12 +1322,89 @@ INT8U MCP_CAN::mcp2515_getNextFreeTXBuf(INT8U *txbuf_n)                 /* get N
 *********************************************************************************************************/
 MCP_CAN::MCP_CAN(int spi_channel, int spi_baudrate, INT8U gpio_can_interrupt)
 {
-    this->spi_channel        = spi_channel;
-    this->spi_baudrate       = spi_baudrate;
+    this->transport          = new McpWiringPiTransport(spi_channel, spi_baudrate);
+    this->owns_transport     = true;
+    this->gpio_can_interrupt = gpio_can_interrupt;
+
+    initState();
+}
+
+
+/*********************************************************************************************************
+** Function name:           MCP_CAN
+** Descriptions:            Public function to declare CAN class on a given SPI transport (spidev, fake...)
+*********************************************************************************************************/
+MCP_CAN::MCP_CAN(McpTransport *transport, INT8U gpio_can_interrupt)
+{
+    this->transport          = transport;
+    this->owns_transport     = false;
     this->gpio_can_interrupt = gpio_can_interrupt;
 
-    delay_spi_can.tv_sec  = 0;
-    delay_spi_can.tv_nsec = 5000L; // wait 5 microseconds between 2 spi transfers
+    initState();
+}
+
+
+/*********************************************************************************************************
+** Function name:           initState
+** Descriptions:            Common part of the constructors
+*********************************************************************************************************/
+void MCP_CAN::initState(void)
+{
+    pthread_mutex_init(&spi_lock, NULL);
+    tx_queue_head    = 0;
+    tx_queue_count   = 0;
+    tx_inflight_mask = 0;
+    tx_reserved_mask = 0;
+    tx_blocked       = false;
+    tx_block_id      = 0;
+    tx_block_ext     = 0;
+    tx_int_enabled   = false;
+    tx_callback      = NULL;
+    tx_callback_ctx  = NULL;
+    tx_completed     = 0;
+    tx_failed        = 0;
+
+    rx_wake_fd    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    rx_running    = false;
+    rx_priority   = 0;
+    rx_cpu        = -1;
+    irq_line      = NULL;
+    owns_irq_line = false;
+    memset(&irq_stats, 0, sizeof(irq_stats));
+    for (INT8U i = 0; i < MCP_N_FILTERS; i++)
+    {
+        rx_filter_hits[i] = 0;
+    }
+    rx_plan_active = false;
+    rx_filtered    = 0;
+    rx_filter_callback     = NULL;
+    rx_filter_callback_ctx = NULL;
+
+    verify_policy = MCP_VERIFY_ALWAYS;
+    verify_period = MCP_VERIFY_PERIOD;
+    verify_count  = 0;
+    mcp2515_shadowInvalidate();
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~MCP_CAN
+** Descriptions:            Stops the receive thread and releases the transport and interrupt line if we
+**                          created them
+*********************************************************************************************************/
+MCP_CAN::~MCP_CAN()
+{
+    stopRxThread();
+    if (owns_transport)
+    {
+        delete transport;
+    }
+    if (owns_irq_line)
+    {
+        delete irq_line;
+    }
+    close(rx_wake_fd);
+    pthread_mutex_destroy(&spi_lock);
 }
 
 
@@ -887,7 +1414,8 @@ MCP_CAN::MCP_CAN(int spi_channel, int spi_baudrate, INT8U gpio_can_interrupt)
 *********************************************************************************************************/
 INT8U MCP_CAN::begin(INT8U idmodeset, INT8U speedset, INT8U clockset)
 {
-    INT8U res;
+    McpLockGuard guard(&spi_lock);
+    INT8U        res;
 
     res = mcp2515_init(idmodeset, speedset, clockset);
     if (res == MCP2515_OK)
@@ -905,43 +1433,27 @@ INT8U MCP_CAN::begin(INT8U idmodeset, INT8U speedset, INT8U clockset)
 *********************************************************************************************************/
 INT8U MCP_CAN::init_Mask(INT8U num, INT8U ext, INT32U ulData)
 {
-    INT8U res = MCP2515_OK;
+    McpLockGuard guard(&spi_lock);
+    INT8U        res;
 
 #if DEBUG_MODE
     printf("Starting to Set Mask!\r\n");
 #endif
-    res = mcp2515_setCANCTRL_Mode(MODE_CONFIG);
-    if (res > 0)
-    {
-#if DEBUG_MODE
-        printf("Entering Configuration Mode Failure...\r\n");
-#endif
-        return res;
-    }
-
     if (num == 0)
     {
-        mcp2515_write_mf(MCP_RXM0SIDH, ext, ulData);
+        res = mcp2515_setMF(MCP_RXM0SIDH, ext, ulData);
     }
     else if (num == 1)
     {
-        mcp2515_write_mf(MCP_RXM1SIDH, ext, ulData);
+        res = mcp2515_setMF(MCP_RXM1SIDH, ext, ulData);
     }
     else
     {
         res = MCP2515_FAIL;
     }
 
-    res = mcp2515_setCANCTRL_Mode(mcpMode);
-    if (res > 0)
-    {
-#if DEBUG_MODE
-        printf("Entering Previous Mode Failure...\r\nSetting Mask Failure...\r\n");
-#endif
-        return res;
-    }
 #if DEBUG_MODE
-    printf("Setting Mask Successful!\r\n");
+    printf(res ? "Setting Mask Failure...\r\n" : "Setting Mask Successful!\r\n");
 #endif
     return res;
 }
@@ -953,416 +1465,1080 @@ INT8U MCP_CAN::init_Mask(INT8U num, INT8U ext, INT32U ulData)
 *********************************************************************************************************/
 INT8U MCP_CAN::init_Mask(INT8U num, INT32U ulData)
 {
-    INT8U res = MCP2515_OK;
     INT8U ext = 0;
 
+    if ((ulData & 0x80000000) == 0x80000000)
+    {
+        ext = 1;
+    }
+
+    return init_Mask(num, ext, ulData);
+}
+
+
+/*********************************************************************************************************
+** Function name:           init_Filt
+** Descriptions:            Public function to set filter(s).
+*********************************************************************************************************/
+INT8U MCP_CAN::init_Filt(INT8U num, INT8U ext, INT32U ulData)
+{
+    McpLockGuard guard(&spi_lock);
+    INT8U        res;
+    const INT8U  filt_addr[6] = { MCP_RXF0SIDH, MCP_RXF1SIDH, MCP_RXF2SIDH,
+                                  MCP_RXF3SIDH, MCP_RXF4SIDH, MCP_RXF5SIDH };
+
 #if DEBUG_MODE
-    printf("Starting to Set Mask!\r\n");
+    printf("Starting to Set Filter!\r\n");
 #endif
-    res = mcp2515_setCANCTRL_Mode(MODE_CONFIG);
-    if (res > 0)
+    if (num < 6)
+    {
+        res = mcp2515_setMF(filt_addr[num], ext, ulData);
+    }
+    else
     {
+        res = MCP2515_FAIL;
+    }
+
 #if DEBUG_MODE
-        printf("Entering Configuration Mode Failure...\r\n");
+    printf(res ? "Setting Filter Failure...\r\n" : "Setting Filter Successfull!\r\n");
 #endif
-        return res;
-    }
+    return res;
+}
+
+
+/*********************************************************************************************************
+** Function name:           init_Filt
+** Descriptions:            Public function to set filter(s).
+*********************************************************************************************************/
+INT8U MCP_CAN::init_Filt(INT8U num, INT32U ulData)
+{
+    INT8U ext = 0;
 
-    if ((num & 0x80000000) == 0x80000000)
+    if ((ulData & 0x80000000) == 0x80000000)
     {
         ext = 1;
     }
 
-    if (num == 0)
+    return init_Filt(num, ext, ulData);
+}
+
+
+/*********************************************************************************************************
+** Function name:           sendMsg
+** Descriptions:            Send message and wait until it has left the controller. Waiting for a free
+**                          buffer and for the transmission are each bounded by CANSENDTIMEOUT ms.
+**                          CAN_FAILTX for an ID refused by blockTx().
+*********************************************************************************************************/
+INT8U MCP_CAN::sendMsg(const CanFrame &frame)
+{
+    INT8U    res, res1, txbuf_n;
+    uint64_t deadline = canNowNs() + CANSENDTIMEOUT * 1000000ULL;
+
+    do
+    {
+        {
+            McpLockGuard guard(&spi_lock);                              /* select, load and RTS as one  */
+
+            if (mcp2515_txBlocked(frame))
+            {
+                return CAN_FAILTX;
+            }
+            res = mcp2515_getNextFreeTXBuf(&txbuf_n);                   /* info = buffer number         */
+            if (res == MCP2515_OK &&
+                (!mcp2515_write_canMsg(txbuf_n, frame) || !mcp2515_start_transmit(txbuf_n)))
+            {
+                return CAN_FAILTX;                                      /* SPI failed                   */
+            }
+        }
+    } while (res == MCP_ALLTXBUSY && canNowNs() < deadline);
+
+    if (res == MCP_ALLTXBUSY)
     {
-        mcp2515_write_mf(MCP_RXM0SIDH, ext, ulData);
+        return CAN_GETTXBFTIMEOUT;                                      /* get tx buff time out         */
     }
-    else if (num == 1)
+
+    deadline = canNowNs() + CANSENDTIMEOUT * 1000000ULL;
+    do
+    {
+        {
+            McpLockGuard guard(&spi_lock);                              /* others may use SPI meanwhile */
+            res1 = mcp2515_readStatus();                                /* TXnREQ of the send buffer    */
+        }
+        res1 = res1 & MCP_STAT_TXREQ(txbuf_n);
+    } while (res1 && canNowNs() < deadline);
+
+    if (res1)                                                           /* send msg timeout             */
     {
-        mcp2515_write_mf(MCP_RXM1SIDH, ext, ulData);
+        return CAN_SENDMSGTIMEOUT;
     }
-    else
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           makeFrame
+** Descriptions:            Builds a frame, copying only the len bytes of pData that will be sent
+*********************************************************************************************************/
+CanFrame MCP_CAN::makeFrame(INT32U id, INT8U rtr, INT8U ext, INT8U len, const INT8U *pData)
+{
+    CanFrame frame;
+
+    if (len > MAX_CHAR_IN_MESSAGE)
     {
-        res = MCP2515_FAIL;
+        len = MAX_CHAR_IN_MESSAGE;
     }
 
-    res = mcp2515_setCANCTRL_Mode(mcpMode);
-    if (res > 0)
+    frame.id        = id;
+    frame.ext       = ext;
+    frame.rtr       = rtr;
+    frame.dlc       = len;
+    frame.filhit    = 0;
+    frame.timestamp = 0;
+    for (int i = 0; i < MAX_CHAR_IN_MESSAGE; i++)
     {
-#if DEBUG_MODE
-        printf("Entering Previous Mode Failure...\r\nSetting Mask Failure...\r\n");
-#endif
-        return res;
+        frame.data[i] = (i < len) ? pData[i] : 0x00;
+    }
+
+    return frame;
+}
+
+
+/*********************************************************************************************************
+** Function name:           sendFrame
+** Descriptions:            Public function, sends a frame and waits until it has left the controller
+*********************************************************************************************************/
+INT8U MCP_CAN::sendFrame(const CanFrame &frame)
+{
+    return sendMsg(frame);
+}
+
+
+/*********************************************************************************************************
+** Function name:           sendMsgBuf
+** Descriptions:            Send message to transmitt buffer
+*********************************************************************************************************/
+INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U ext, INT8U len, INT8U *buf)
+{
+    return sendMsg(makeFrame(id, 0, ext, len, buf));
+}
+
+
+/*********************************************************************************************************
+** Function name:           sendMsgBuf
+** Descriptions:            Send message to transmitt buffer
+*********************************************************************************************************/
+INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U len, INT8U *buf)
+{
+    INT8U ext = 0, rtr = 0;
+
+    if ((id & 0x80000000) == 0x80000000)
+    {
+        ext = 1;
+    }
+
+    if ((id & 0x40000000) == 0x40000000)
+    {
+        rtr = 1;
+    }
+
+    return sendMsg(makeFrame(id & 0x1FFFFFFF, rtr, ext, len, buf));
+}
+
+
+/*********************************************************************************************************
+** Function name:           sendFrameAsync
+** Descriptions:            Queue frame for transmission and return without waiting for the bus.
+**                          Completion is reported by serviceTx(), which must be called when the INT
+**                          pin fires (TX interrupts are enabled on first use). CAN_FAILTX for an ID
+**                          refused by blockTx().
+*********************************************************************************************************/
+INT8U MCP_CAN::sendFrameAsync(const CanFrame &frame)
+{
+    McpLockGuard guard(&spi_lock);
+    INT8U        slot;
+
+    if (mcp2515_txBlocked(frame))
+    {
+        return CAN_FAILTX;
+    }
+    if (tx_queue_count == MCP_TXQUEUE_SIZE)
+    {
+        return CAN_TXQUEUEFULL;
+    }
+
+    slot           = (tx_queue_head + tx_queue_count) % MCP_TXQUEUE_SIZE;
+    tx_queue[slot] = frame;
+    tx_queue_count++;
+
+    if (!tx_int_enabled)
+    {
+        mcp2515_queueModify(MCP_CANINTE, MCP_TX_INT, MCP_TX_INT);
+        mcp2515_submit();
+        tx_int_enabled = true;
+    }
+
+    if ((tx_inflight_mask | tx_reserved_mask) != 0x07)                  /* kick an idle TX buffer       */
+    {
+        mcp2515_fillTXBuffers(mcp2515_readStatus());
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           sendMsgBufAsync
+** Descriptions:            Queue message for transmission and return without waiting for the bus
+*********************************************************************************************************/
+INT8U MCP_CAN::sendMsgBufAsync(INT32U id, INT8U ext, INT8U len, INT8U *buf)
+{
+    return sendFrameAsync(makeFrame(id, 0, ext, len, buf));
+}
+
+
+/*********************************************************************************************************
+** Function name:           setTxCallback
+** Descriptions:            Sets the function called by serviceTx() for every completed async frame
+*********************************************************************************************************/
+void MCP_CAN::setTxCallback(CanTxCallback callback, void *ctx)
+{
+    McpLockGuard guard(&spi_lock);
+
+    tx_callback     = callback;
+    tx_callback_ctx = ctx;
+}
+
+
+/*********************************************************************************************************
+** Function name:           serviceTx
+** Descriptions:            Public function, acknowledges TXnIF of finished async frames, reports them and
+**                          refills the freed buffers from the queue. Returns the number of frames finished.
+*********************************************************************************************************/
+INT8U MCP_CAN::serviceTx(void)
+{
+    INT8U    stat, i, done_mask = 0, clear_mask = 0, n_done = 0;
+    CanFrame done[MCP_N_TXBUFFERS];
+    INT8U    done_status[MCP_N_TXBUFFERS];
+
+    pthread_mutex_lock(&spi_lock);
+
+    stat = mcp2515_readStatus();
+
+    for (i = 0; i < MCP_N_TXBUFFERS; i++)
+    {
+        if (stat & MCP_STAT_TXIF(i))
+        {
+            clear_mask |= MCP_TXIF(i);
+        }
+
+        if (!(tx_inflight_mask & (1 << i)) || (stat & MCP_STAT_TXREQ(i)))
+        {
+            continue;                                                   /* not ours or still sending    */
+        }
+
+        done[n_done]        = tx_inflight[i];
+        done_status[n_done] = (stat & MCP_STAT_TXIF(i)) ? CAN_OK : CAN_FAILTX;
+        if (done_status[n_done] == CAN_OK)
+        {
+            tx_completed++;
+        }
+        else
+        {
+            tx_failed++;
+        }
+        n_done++;
+        done_mask |= (1 << i);
+    }
+
+    if (clear_mask)
+    {
+        mcp2515_modifyRegister(MCP_CANINTF, clear_mask, 0);
+    }
+
+    tx_inflight_mask &= ~done_mask;
+    mcp2515_fillTXBuffers(stat);
+
+    CanTxCallback callback = tx_callback;
+    void          *ctx     = tx_callback_ctx;
+    pthread_mutex_unlock(&spi_lock);
+
+    if (callback != NULL)                                               /* outside the lock: callback   */
+    {                                                                   /* may queue the next frame     */
+        for (i = 0; i < n_done; i++)
+        {
+            callback(ctx, done[i], done_status[i]);
+        }
+    }
+
+    return n_done;
+}
+
+
+/*********************************************************************************************************
+** Function name:           txPending
+** Descriptions:            Returns the number of async frames queued or loaded but not yet finished
+*********************************************************************************************************/
+INT32U MCP_CAN::txPending(void)
+{
+    McpLockGuard guard(&spi_lock);
+    INT32U       n;
+
+    n = tx_queue_count;
+    for (INT8U i = 0; i < MCP_N_TXBUFFERS; i++)
+    {
+        if (tx_inflight_mask & (1 << i))
+        {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+/*********************************************************************************************************
+** Function name:           txCompleted
+** Descriptions:            Returns the number of async frames transmitted since construction
+*********************************************************************************************************/
+INT32U MCP_CAN::txCompleted(void)
+{
+    return tx_completed;
+}
+
+
+/*********************************************************************************************************
+** Function name:           txFailed
+** Descriptions:            Returns the number of async frames aborted since construction
+*********************************************************************************************************/
+INT32U MCP_CAN::txFailed(void)
+{
+    return tx_failed;
+}
+
+
+/*********************************************************************************************************
+** Function name:           reserveTxBuffer
+** Descriptions:            Public function, loads frame into TXB2 with the highest TXP and keeps the buffer
+**                          out of sendMsg() and the async queue, so fireReservedTx() sends it with one
+**                          RTS byte and it goes out before anything else queued in the controller.
+**                          CAN_FAIL while TXB2 still holds a frame; call again to change the frame.
+**                          begin() resets the controller and drops the reservation.
+*********************************************************************************************************/
+INT8U MCP_CAN::reserveTxBuffer(const CanFrame &frame)
+{
+    McpLockGuard guard(&spi_lock);
+    INT8U        stat;
+
+    stat = mcp2515_readStatus();
+    if ((tx_inflight_mask & (1 << MCP_TXB_RESERVED)) || (stat & MCP_STAT_TXREQ(MCP_TXB_RESERVED)))
+    {
+        return CAN_FAIL;
+    }
+
+    tx_reserved_mask |= (1 << MCP_TXB_RESERVED);
+    mcp2515_queueModify(MCP_TXB2CTRL, MCP_TXB_TXP10_M, MCP_TXB_TXP10_M);
+    if (!mcp2515_write_canMsg(MCP_TXB_RESERVED, frame) || !mcp2515_submit())
+    {
+        tx_reserved_mask &= ~(1 << MCP_TXB_RESERVED);                   /* TXB2 contents unknown        */
+        return CAN_FAIL;
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           fireReservedTx
+** Descriptions:            Public function, requests transmission of the frame preloaded in TXB2. Does not
+**                          wait; reservedTxBusy() turns false once it is on the wire. CAN_FAIL if no frame
+**                          is loaded (never reserved, released, a failed load, or begin() since) or the
+**                          RTS transfer failed.
+*********************************************************************************************************/
+INT8U MCP_CAN::fireReservedTx(void)
+{
+    McpLockGuard guard(&spi_lock);
+
+    if (!(tx_reserved_mask & (1 << MCP_TXB_RESERVED)) || !mcp2515_start_transmit(MCP_TXB_RESERVED))
+    {
+        return CAN_FAIL;
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           reservedTxBusy
+** Descriptions:            Public function, true while the reserved frame waits for the bus (TXREQ set),
+**                          and when READ STATUS fails (a dead bus never reports the frame as sent)
+*********************************************************************************************************/
+bool MCP_CAN::reservedTxBusy(void)
+{
+    McpLockGuard guard(&spi_lock);
+
+    return (mcp2515_readStatus() & MCP_STAT_TXREQ(MCP_TXB_RESERVED)) != 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           releaseTxBuffer
+** Descriptions:            Public function, gives TXB2 back to sendMsg() and the async queue
+*********************************************************************************************************/
+void MCP_CAN::releaseTxBuffer(void)
+{
+    McpLockGuard guard(&spi_lock);
+
+    tx_reserved_mask &= ~(1 << MCP_TXB_RESERVED);
+    mcp2515_queueModify(MCP_TXB2CTRL, MCP_TXB_TXP10_M, 0);
+    mcp2515_submit();
+}
+
+
+/*********************************************************************************************************
+** Function name:           abortTx
+** Descriptions:            Public function, drops the async queue (counted in txFailed()) and clears TXREQ
+**                          of every TX buffer except the reserved one. A frame already on the wire still
+**                          completes; the aborted ones are reported by serviceTx() with CAN_FAILTX.
+*********************************************************************************************************/
+INT8U MCP_CAN::abortTx(void)
+{
+    McpLockGuard guard(&spi_lock);
+
+    tx_failed     += tx_queue_count;
+    tx_queue_head  = 0;
+    tx_queue_count = 0;
+
+    for (INT8U i = 0; i < MCP_N_TXBUFFERS; i++)
+    {
+        if (!(tx_reserved_mask & (1 << i)))
+        {
+            txn.modifyRegister(MCP_TXB0CTRL + 0x10 * i, MCP_TXB_TXREQ_M, 0);
+        }
+    }
+    if (!mcp2515_submit())
+    {
+        return CAN_FAIL;
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           blockTx
+** Descriptions:            Public function, sendMsg() and sendFrameAsync() refuse frames with id (and
+**                          format ext) until unblockTx(). Frames already queued are not affected, see
+**                          abortTx(). The reserved buffer is not affected either.
+*********************************************************************************************************/
+void MCP_CAN::blockTx(INT32U id, INT8U ext)
+{
+    McpLockGuard guard(&spi_lock);
+
+    tx_block_id  = id;
+    tx_block_ext = ext;
+    tx_blocked   = true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           unblockTx
+** Descriptions:            Public function, lifts blockTx()
+*********************************************************************************************************/
+void MCP_CAN::unblockTx(void)
+{
+    McpLockGuard guard(&spi_lock);
+
+    tx_blocked = false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readMsg
+** Descriptions:            Read message. CAN_FAIL if the SPI transfer failed.
+*********************************************************************************************************/
+INT8U MCP_CAN::readMsg(CanFrame &frame)
+{
+    McpLockGuard guard(&spi_lock);
+    INT8U        rxs;
+    uint64_t     now_ns = 0;
+
+    rxs = mcp2515_readRxStatus();
+    for (;;)
+    {
+        now_ns = canNowNs();
+
+        if ((rxs & MCP_RXS_MSG_MASK) == 0)
+        {
+            return CAN_NOMSG;
+        }
+        if (!mcp2515_readRxs_canMsg(rxs, frame, rx_plan_active ? &rxs : NULL))  /* clears RXnIF  */
+        {
+            return CAN_FAIL;
+        }
+
+        if (!rx_plan_active || canPlanWanted(rx_plan, frame))
+        {
+            break;
+        }
+        mcp2515_postFiltered(frame);                                    /* try the other buffer         */
+    }
+
+    frame.timestamp = now_ns;
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readFrame
+** Descriptions:            Public function, reads one frame from the receive buffers
+*********************************************************************************************************/
+INT8U MCP_CAN::readFrame(CanFrame &frame)
+{
+    return readMsg(frame);
+}
+
+
+/*********************************************************************************************************
+** Function name:           readMsgBatch
+** Descriptions:            Public function, empties RXB0 and RXB1 until no receive flag is left (so the
+**                          INT pin is released) or max frames have been stored. Returns the count.
+*********************************************************************************************************/
+INT32U MCP_CAN::readMsgBatch(CanFrame *frames, INT32U max)
+{
+    McpLockGuard guard(&spi_lock);
+
+    return mcp2515_readBatch(frames, max);
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_readBatch
+** Descriptions:            readMsgBatch() with spi_lock already held
+*********************************************************************************************************/
+INT32U MCP_CAN::mcp2515_readBatch(CanFrame *frames, INT32U max)
+{
+    INT32U   n = 0;
+    INT8U    rxs;
+    uint64_t now_ns;
+
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    rxs = mcp2515_readRxStatus();
+    while (rxs & MCP_RXS_MSG_MASK)                                      /* RXB0 (older frame) first     */
+    {
+        now_ns = canNowNs();
+
+        // The next RX STATUS rides in the same batch as READ RX, unless this is the last slot (and the
+        // post-filter cannot free it again)
+        if (!mcp2515_readRxs_canMsg(rxs, frames[n], (n + 1 < max || rx_plan_active) ? &rxs : NULL))
+        {
+            break;                                                      /* SPI failed: nothing read     */
+        }
+        frames[n].timestamp = now_ns;
+
+        if (rx_plan_active && !canPlanWanted(rx_plan, frames[n]))
+        {
+            mcp2515_postFiltered(frames[n]);                            /* slot is reused               */
+        }
+        else
+        {
+            n++;
+        }
+        if (n == max)
+        {
+            break;
+        }
+    }
+
+    return n;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readMsgBuf
+** Descriptions:            Public function, Reads message from receive buffer.
+*********************************************************************************************************/
+INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *ext, INT8U *len, INT8U buf[])
+{
+    CanFrame frame;
+
+    if (readMsg(frame) == CAN_NOMSG)
+    {
+        return CAN_NOMSG;
+    }
+
+    *id  = frame.id;
+    *len = frame.dlc;
+    *ext = frame.ext;
+    for (int i = 0; i < frame.dlc; i++)
+    {
+        buf[i] = frame.data[i];
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readMsgBuf
+** Descriptions:            Public function, Reads message from receive buffer.
+*********************************************************************************************************/
+INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *len, INT8U buf[])
+{
+    CanFrame frame;
+
+    if (readMsg(frame) == CAN_NOMSG)
+    {
+        return CAN_NOMSG;
+    }
+
+    if (frame.ext)
+    {
+        frame.id |= 0x80000000;
+    }
+
+    if (frame.rtr)
+    {
+        frame.id |= 0x40000000;
+    }
+
+    *id  = frame.id;
+    *len = frame.dlc;
+
+    for (int i = 0; i < frame.dlc; i++)
+    {
+        buf[i] = frame.data[i];
     }
-#if DEBUG_MODE
-    printf("Setting Mask Successful!\r\n");
-#endif
-    return res;
+
+    return CAN_OK;
 }
 
 
 /*********************************************************************************************************
-** Function name:           init_Filt
-** Descriptions:            Public function to set filter(s).
+** Function name:           rxDrain
+** Descriptions:            Reads every pending frame and pushes it, timestamped, into rx_ring. The pushes
+**                          are made under spi_lock, so setFilterPlan() can drain from another thread.
 *********************************************************************************************************/
-INT8U MCP_CAN::init_Filt(INT8U num, INT8U ext, INT32U ulData)
+void MCP_CAN::rxDrain(void)
 {
-    INT8U res = MCP2515_OK;
+    McpLockGuard guard(&spi_lock);
 
-#if DEBUG_MODE
-    printf("Starting to Set Filter!\r\n");
-#endif
-    res = mcp2515_setCANCTRL_Mode(MODE_CONFIG);
-    if (res > 0)
-    {
-#if DEBUG_MODE
-        printf("Enter Configuration Mode Failure...\r\n");
-#endif
-        return res;
-    }
+    mcp2515_drainToRing();
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_drainToRing
+** Descriptions:            rxDrain() with spi_lock already held
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_drainToRing(void)
+{
+    CanFrame frames[MCP_RX_BATCH];
+    INT32U   n;
 
-    switch (num)
+    do
     {
-    case 0:
-        mcp2515_write_mf(MCP_RXF0SIDH, ext, ulData);
-        break;
+        n = mcp2515_readBatch(frames, MCP_RX_BATCH);
+        for (INT32U i = 0; i < n; i++)
+        {
+            rx_ring.push(frames[i]);
+        }
+    } while (n == MCP_RX_BATCH);
+}
 
-    case 1:
-        mcp2515_write_mf(MCP_RXF1SIDH, ext, ulData);
-        break;
 
-    case 2:
-        mcp2515_write_mf(MCP_RXF2SIDH, ext, ulData);
-        break;
+/*********************************************************************************************************
+** Function name:           rxThreadLoop
+** Descriptions:            Receive thread body: drain while INT is asserted, then sleep in poll() until an
+**                          edge on the interrupt line or notifyInterrupt()
+*********************************************************************************************************/
+void MCP_CAN::rxThreadLoop(void)
+{
+    struct pollfd fds[2];
+    uint64_t      edge_ns = 0, wake;
 
-    case 3:
-        mcp2515_write_mf(MCP_RXF3SIDH, ext, ulData);
-        break;
+    fds[0].fd     = rx_wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = (irq_line != NULL) ? irq_line->fd() : -1;         /* poll() skips negative fds    */
+    fds[1].events = POLLIN;
 
-    case 4:
-        mcp2515_write_mf(MCP_RXF4SIDH, ext, ulData);
-        break;
+    while (rx_running)
+    {
+        rxDrain();
+        if (edge_ns != 0)
+        {
+            rxRecordLatency(edge_ns);
+            edge_ns = 0;
+        }
+        if (tx_int_enabled)                                             /* benign unlocked read         */
+        {
+            serviceTx();
+        }
 
-    case 5:
-        mcp2515_write_mf(MCP_RXF5SIDH, ext, ulData);
-        break;
+        if (canReadData())                                              /* INT still low: keep going    */
+        {
+            irq_stats.level_drains++;
+            continue;
+        }
 
-    default:
-        res = MCP2515_FAIL;
-    }
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if (poll(fds, 2, MCP_RXTHREAD_TIMEOUT_NS / 1000000) == 0)       /* timeout covers missed edges  */
+        {
+            irq_stats.timeouts++;
+        }
+        irq_stats.wakeups++;
 
-    res = mcp2515_setCANCTRL_Mode(mcpMode);
-    if (res > 0)
-    {
-#if DEBUG_MODE
-        printf("Entering Previous Mode Failure...\r\nSetting Filter Failure...\r\n");
-#endif
-        return res;
+        if (fds[0].revents & POLLIN)
+        {
+            if (read(rx_wake_fd, &wake, sizeof(wake)) < 0)
+            {
+                wake = 0;
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            irq_stats.edges += irq_line->readEvents(&edge_ns);
+        }
     }
-#if DEBUG_MODE
-    printf("Setting Filter Successfull!\r\n");
-#endif
-
-    return res;
 }
 
 
 /*********************************************************************************************************
-** Function name:           init_Filt
-** Descriptions:            Public function to set filter(s).
+** Function name:           rxRecordLatency
+** Descriptions:            Time from the kernel timestamp of the edge to the frames being in the ring.
+**                          Timestamps from another clock (v1 uAPI before Linux 5.7) are ignored.
 *********************************************************************************************************/
-INT8U MCP_CAN::init_Filt(INT8U num, INT32U ulData)
+void MCP_CAN::rxRecordLatency(uint64_t edge_ns)
 {
-    INT8U res = MCP2515_OK;
-    INT8U ext = 0;
+    uint64_t now_ns = canNowNs(), latency;
 
-#if DEBUG_MODE
-    printf("Starting to Set Filter!\r\n");
-#endif
-    res = mcp2515_setCANCTRL_Mode(MODE_CONFIG);
-    if (res > 0)
+    if (edge_ns > now_ns || now_ns - edge_ns > 1000000000ULL)
     {
-#if DEBUG_MODE
-        printf("Enter Configuration Mode Failure...\r\n");
-#endif
-        return res;
+        return;
     }
 
-    if ((num & 0x80000000) == 0x80000000)
+    latency = now_ns - edge_ns;
+    irq_stats.latency_samples++;
+    irq_stats.latency_last_ns   = latency;
+    irq_stats.latency_total_ns += latency;
+    if (latency > irq_stats.latency_max_ns)
     {
-        ext = 1;
+        irq_stats.latency_max_ns = latency;
     }
+}
 
-    switch (num)
-    {
-    case 0:
-        mcp2515_write_mf(MCP_RXF0SIDH, ext, ulData);
-        break;
-
-    case 1:
-        mcp2515_write_mf(MCP_RXF1SIDH, ext, ulData);
-        break;
-
-    case 2:
-        mcp2515_write_mf(MCP_RXF2SIDH, ext, ulData);
-        break;
-
-    case 3:
-        mcp2515_write_mf(MCP_RXF3SIDH, ext, ulData);
-        break;
 
-    case 4:
-        mcp2515_write_mf(MCP_RXF4SIDH, ext, ulData);
-        break;
+/*********************************************************************************************************
+** Function name:           rxThreadEntry
+** Descriptions:            pthread entry point of the receive thread
+*********************************************************************************************************/
+void *MCP_CAN::rxThreadEntry(void *arg)
+{
+    ((MCP_CAN *)arg)->rxThreadLoop();
+    return NULL;
+}
 
-    case 5:
-        mcp2515_write_mf(MCP_RXF5SIDH, ext, ulData);
-        break;
 
-    default:
-        res = MCP2515_FAIL;
+/*********************************************************************************************************
+** Function name:           startRxThread
+** Descriptions:            Public function, starts the thread that moves received frames into the RX ring.
+**                          overflow_policy: CAN_RING_DROP_NEWEST / CAN_RING_DROP_OLDEST
+*********************************************************************************************************/
+INT8U MCP_CAN::startRxThread(INT8U overflow_policy)
+{
+    if (rx_running)
+    {
+        return CAN_OK;
     }
 
-    res = mcp2515_setCANCTRL_Mode(mcpMode);
-    if (res > 0)
+    rx_ring.setOverflowPolicy(overflow_policy);
+    rx_running = true;
+    if (mcpCreateThread(&rx_thread, rxThreadEntry, this, rx_priority, rx_cpu) != 0)
     {
+        rx_running = false;
 #if DEBUG_MODE
-        printf("Entering Previous Mode Failure...\r\nSetting Filter Failure...\r\n");
+        printf("Starting RX thread Failure...\r\n");
 #endif
-        return res;
+        return CAN_FAIL;
     }
-#if DEBUG_MODE
-    printf("Setting Filter Successfull!\r\n");
-#endif
 
-    return res;
+    return CAN_OK;
 }
 
 
 /*********************************************************************************************************
-** Function name:           setMsg
-** Descriptions:            Set can message, such as dlc, id, dta[] and so on
+** Function name:           stopRxThread
+** Descriptions:            Public function, stops the receive thread. Frames already in the ring are kept.
 *********************************************************************************************************/
-INT8U MCP_CAN::setMsg(INT32U id, INT8U rtr, INT8U ext, INT8U len, INT8U *pData)
+void MCP_CAN::stopRxThread(void)
 {
-    int i = 0;
-
-    m_nID     = id;
-    m_nRtr    = rtr;
-    m_nExtFlg = ext;
-    m_nDlc    = len;
-    for (i = 0; i < MAX_CHAR_IN_MESSAGE; i++)
+    if (!rx_running)
     {
-        m_nDta[i] = *(pData + i);
+        return;
     }
 
-    return MCP2515_OK;
+    rx_running = false;
+    notifyInterrupt();
+    pthread_join(rx_thread, NULL);
 }
 
 
 /*********************************************************************************************************
-** Function name:           clearMsg
-** Descriptions:            Set all messages to zero
+** Function name:           notifyInterrupt
+** Descriptions:            Public function, wakes the receive thread. Only needed when the INT pin is not
+**                          an interrupt line (setupInterruptGpio / setInterruptLine). Async-signal-safe.
 *********************************************************************************************************/
-INT8U MCP_CAN::clearMsg()
+void MCP_CAN::notifyInterrupt(void)
 {
-    m_nID     = 0;
-    m_nDlc    = 0;
-    m_nExtFlg = 0;
-    m_nRtr    = 0;
-    m_nfilhit = 0;
-    for (int i = 0; i < m_nDlc; i++)
+    uint64_t one = 1;
+
+    if (write(rx_wake_fd, &one, sizeof(one)) < 0)
     {
-        m_nDta[i] = 0x00;
+        return;                                                         /* counter full: already awake  */
     }
-
-    return MCP2515_OK;
 }
 
 
 /*********************************************************************************************************
-** Function name:           sendMsg
-** Descriptions:            Send message
+** Function name:           setRxThreadSched
+** Descriptions:            Public function, scheduling of the receive thread from the next startRxThread.
+**                          priority: SCHED_FIFO 1..99, 0 = normal. cpu: CPU to run on, -1 = any.
 *********************************************************************************************************/
-INT8U MCP_CAN::sendMsg()
+void MCP_CAN::setRxThreadSched(int priority, int cpu)
 {
-    INT8U    res, res1, txbuf_n;
-    uint16_t uiTimeOut = 0;
+    rx_priority = priority;
+    rx_cpu      = cpu;
+}
 
-    do
-    {
-        res = mcp2515_getNextFreeTXBuf(&txbuf_n);                       /* info = addr.                 */
-        uiTimeOut++;
-    } while (res == MCP_ALLTXBUSY && (uiTimeOut < TIMEOUTVALUE));
 
-    if (uiTimeOut == TIMEOUTVALUE)
+/*********************************************************************************************************
+** Function name:           setInterruptLine
+** Descriptions:            Public function, the INT pin source waited on by the receive thread (must be
+**                          open). Set it before startRxThread.
+*********************************************************************************************************/
+void MCP_CAN::setInterruptLine(McpIrqLine *line)
+{
+    if (owns_irq_line && irq_line != line)
     {
-        return CAN_GETTXBFTIMEOUT;                                      /* get tx buff time out         */
+        delete irq_line;
     }
-    uiTimeOut = 0;
-    mcp2515_write_canMsg(txbuf_n);
-    mcp2515_modifyRegister(txbuf_n - 1, MCP_TXB_TXREQ_M, MCP_TXB_TXREQ_M);
-
-    do
-    {
-        uiTimeOut++;
-        res1 = mcp2515_readRegister(txbuf_n - 1);                         /* read send buff ctrl reg  */
-        res1 = res1 & 0x08;
-    } while (res1 && (uiTimeOut < TIMEOUTVALUE));
+    irq_line      = line;
+    owns_irq_line = false;
+}
 
-    if (uiTimeOut == TIMEOUTVALUE)                                       /* send msg timeout             */
-    {
-        return CAN_SENDMSGTIMEOUT;
-    }
 
-    return CAN_OK;
+/*********************************************************************************************************
+** Function name:           interruptFd
+** Descriptions:            Public function, file descriptor of the INT pin events (readable on a falling
+**                          edge), for applications that wait on it themselves. -1 without a line.
+*********************************************************************************************************/
+int MCP_CAN::interruptFd(void)
+{
+    return (irq_line != NULL) ? irq_line->fd() : -1;
 }
 
 
 /*********************************************************************************************************
-** Function name:           sendMsgBuf
-** Descriptions:            Send message to transmitt buffer
+** Function name:           interruptLine
+** Descriptions:            Public function, the INT pin source, e.g. for an event loop that services the
+**                          controller itself (McpBusManager). NULL without a line.
 *********************************************************************************************************/
-INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U ext, INT8U len, INT8U *buf)
+McpIrqLine *MCP_CAN::interruptLine(void)
 {
-    INT8U res;
+    return irq_line;
+}
 
-    setMsg(id, 0, ext, len, buf);
-    res = sendMsg();
 
-    return res;
+/*********************************************************************************************************
+** Function name:           irqStats
+** Descriptions:            Public function, receive thread wakeups and interrupt-to-read latency
+*********************************************************************************************************/
+McpIrqStats MCP_CAN::irqStats(void)
+{
+    return irq_stats;
 }
 
 
 /*********************************************************************************************************
-** Function name:           sendMsgBuf
-** Descriptions:            Send message to transmitt buffer
+** Function name:           readFrames
+** Descriptions:            Public function, pops up to max frames received by the thread. Never blocks.
+**                          Only one thread may consume.
 *********************************************************************************************************/
-INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U len, INT8U *buf)
+INT32U MCP_CAN::readFrames(CanFrame *frames, INT32U max)
 {
-    INT8U ext = 0, rtr = 0;
-    INT8U res;
+    return rx_ring.popBatch(frames, max);
+}
 
-    if ((id & 0x80000000) == 0x80000000)
-    {
-        ext = 1;
-    }
 
-    if ((id & 0x40000000) == 0x40000000)
-    {
-        rtr = 1;
-    }
+/*********************************************************************************************************
+** Function name:           rxReceived
+** Descriptions:            Public function, number of frames the receive thread has queued
+*********************************************************************************************************/
+INT32U MCP_CAN::rxReceived(void)
+{
+    return rx_ring.pushed();
+}
 
-    setMsg(id, rtr, ext, len, buf);
-    res = sendMsg();
 
-    return res;
+/*********************************************************************************************************
+** Function name:           rxDropped
+** Descriptions:            Public function, number of frames lost because the ring was full
+*********************************************************************************************************/
+INT32U MCP_CAN::rxDropped(void)
+{
+    return rx_ring.dropped();
 }
 
 
 /*********************************************************************************************************
-** Function name:           readMsg
-** Descriptions:            Read message
+** Function name:           checkReceive
+** Descriptions:            Public function, Checks for received data.  (Used if not using the interrupt output)
 *********************************************************************************************************/
-INT8U MCP_CAN::readMsg()
+INT8U MCP_CAN::checkReceive(void)
 {
-    INT8U stat, res;
-
-    stat = mcp2515_readStatus();
+    McpLockGuard guard(&spi_lock);
+    INT8U        res;
 
-    if (stat & MCP_STAT_RX0IF)                                          /* Msg in Buffer 0              */
-    {
-        mcp2515_read_canMsg(MCP_RXBUF_0);
-        mcp2515_modifyRegister(MCP_CANINTF, MCP_RX0IF, 0);
-        res = CAN_OK;
-    }
-    else if (stat & MCP_STAT_RX1IF)                                     /* Msg in Buffer 1              */
+    res = mcp2515_readRxStatus();                                       /* RXB0/RXB1 full in Bit 6 and 7*/
+    if (res & MCP_RXS_MSG_MASK)
     {
-        mcp2515_read_canMsg(MCP_RXBUF_1);
-        mcp2515_modifyRegister(MCP_CANINTF, MCP_RX1IF, 0);
-        res = CAN_OK;
+        return CAN_MSGAVAIL;
     }
     else
     {
-        res = CAN_NOMSG;
+        return CAN_NOMSG;
     }
-
-    return res;
 }
 
 
 /*********************************************************************************************************
-** Function name:           readMsgBuf
-** Descriptions:            Public function, Reads message from receive buffer.
+** Function name:           filterHits
+** Descriptions:            Public function, frames accepted by filter num (0..5) since construction.
+**                          Only meaningful when masks and filters are in use (not MCP_ANY).
 *********************************************************************************************************/
-INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *ext, INT8U *len, INT8U buf[])
+INT32U MCP_CAN::filterHits(INT8U num)
 {
-    if (readMsg() == CAN_NOMSG)
+    if (num >= MCP_N_FILTERS)
     {
-        return CAN_NOMSG;
+        return 0;
     }
 
-    *id  = m_nID;
-    *len = m_nDlc;
-    *ext = m_nExtFlg;
-    for (int i = 0; i < m_nDlc; i++)
+    return rx_filter_hits[num];
+}
+
+
+/*********************************************************************************************************
+** Function name:           subscribe
+** Descriptions:            Public function, receive only the IDs in ids: plans masks and filters for them
+**                          (canPlanFilters, every ID weighed the same) and programs the plan.
+*********************************************************************************************************/
+INT8U MCP_CAN::subscribe(const CanIdRange *ids, INT32U n)
+{
+    CanFilterPlan plan;
+
+    if (canPlanFilters(ids, n, NULL, 0, &plan) != CAN_OK)
     {
-        buf[i] = m_nDta[i];
+        return CAN_FAIL;
     }
 
-    return CAN_OK;
+    return setFilterPlan(plan);
 }
 
 
 /*********************************************************************************************************
-** Function name:           readMsgBuf
-** Descriptions:            Public function, Reads message from receive buffer.
+** Function name:           setFilterPlan
+** Descriptions:            Public function, programs the masks and filters of plan in one configuration
+**                          mode window and drops the frames they let through but plan does not want
+**                          (see rxFiltered()) from then on. With the receive thread running, RXB0 and
+**                          RXB1 are emptied into the ring first, so the frame that ends while waiting
+**                          for configuration mode has room. On failure the previous plan stays.
 *********************************************************************************************************/
-INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *len, INT8U buf[])
+INT8U MCP_CAN::setFilterPlan(const CanFilterPlan &plan)
 {
-    if (readMsg() == CAN_NOMSG)
-    {
-        return CAN_NOMSG;
-    }
+    McpLockGuard guard(&spi_lock);
+    INT8U        masks[8], filters[4 * MCP_N_FILTERS];
 
-    if (m_nExtFlg)
+    canPlanImages(plan, masks, filters);
+    if (rx_running)
     {
-        m_nID |= 0x80000000;
+        mcp2515_drainToRing();
     }
-
-    if (m_nRtr)
+    if (mcp2515_setFilters(masks, filters, MCP_RXB_RX_STDEXT))
     {
-        m_nID |= 0x40000000;
+#if DEBUG_MODE
+        printf("Setting Filter Plan Failure...\r\n");
+#endif
+        return CAN_FAIL;
     }
 
-    *id  = m_nID;
-    *len = m_nDlc;
+    rx_plan        = plan;
+    rx_plan_active = true;
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           clearFilterPlan
+** Descriptions:            Public function, receive buffers accept any frame again (masks and filters
+**                          stay programmed but unused), no post-filter. RXBnCTRL is writable in any
+**                          mode, so reception is not interrupted.
+*********************************************************************************************************/
+INT8U MCP_CAN::clearFilterPlan(void)
+{
+    McpLockGuard guard(&spi_lock);
 
-    for (int i = 0; i < m_nDlc; i++)
+    mcp2515_queueModify(MCP_RXB0CTRL, MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK, MCP_RXB_RX_ANY | MCP_RXB_BUKT_MASK);
+    mcp2515_queueModify(MCP_RXB1CTRL, MCP_RXB_RX_MASK, MCP_RXB_RX_ANY);
+    if (!mcp2515_submit())
     {
-        buf[i] = m_nDta[i];
+        return CAN_FAIL;
     }
 
+    rx_plan_active = false;
     return CAN_OK;
 }
 
 
 /*********************************************************************************************************
-** Function name:           checkReceive
-** Descriptions:            Public function, Checks for received data.  (Used if not using the interrupt output)
+** Function name:           rxFiltered
+** Descriptions:            Public function, frames read from the controller and dropped because the
+**                          filter plan does not want them (accepted by a mask wider than the ID set)
 *********************************************************************************************************/
-INT8U MCP_CAN::checkReceive(void)
+INT32U MCP_CAN::rxFiltered(void)
 {
-    INT8U res;
+    return rx_filtered;
+}
 
-    res = mcp2515_readStatus();                                         /* RXnIF in Bit 1 and 0         */
-    if (res & MCP_STAT_RXIF_MASK)
-    {
-        return CAN_MSGAVAIL;
-    }
-    else
+
+/*********************************************************************************************************
+** Function name:           setRxFilterCallback
+** Descriptions:            Public function, sets the function told about every post-filtered frame
+*********************************************************************************************************/
+void MCP_CAN::setRxFilterCallback(CanRxFilterCallback callback, void *ctx)
+{
+    McpLockGuard guard(&spi_lock);
+
+    rx_filter_callback     = callback;
+    rx_filter_callback_ctx = ctx;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcp2515_postFiltered
+** Descriptions:            frame was read but the filter plan does not want it
+*********************************************************************************************************/
+void MCP_CAN::mcp2515_postFiltered(const CanFrame &frame)
+{
+    rx_filtered++;
+    if (rx_filter_callback != NULL)
     {
-        return CAN_NOMSG;
+        rx_filter_callback(rx_filter_callback_ctx, frame);
     }
 }
 
@@ -1373,10 +2549,12 @@ INT8U MCP_CAN::checkReceive(void)
 *********************************************************************************************************/
 INT8U MCP_CAN::checkError(void)
 {
-    INT8U eflg = mcp2515_readRegister(MCP_EFLG);
+    McpLockGuard guard(&spi_lock);
+    INT8U        eflg = mcp2515_readRegister(MCP_EFLG);
 
     if (eflg & MCP_EFLG_ERRORMASK)
     {
+        verify_pending = true;                                          /* MCP_VERIFY_ON_ERROR trigger  */
         return CAN_CTRLERROR;
     }
     else
@@ -1392,7 +2570,15 @@ INT8U MCP_CAN::checkError(void)
 *********************************************************************************************************/
 INT8U MCP_CAN::getError(void)
 {
-    return mcp2515_readRegister(MCP_EFLG);
+    McpLockGuard guard(&spi_lock);
+    INT8U        eflg = mcp2515_readRegister(MCP_EFLG);
+
+    if (eflg & MCP_EFLG_ERRORMASK)
+    {
+        verify_pending = true;
+    }
+
+    return eflg;
 }
 
 
@@ -1402,6 +2588,8 @@ INT8U MCP_CAN::getError(void)
 *********************************************************************************************************/
 INT8U MCP_CAN::errorCountRX(void)
 {
+    McpLockGuard guard(&spi_lock);
+
     return mcp2515_readRegister(MCP_REC);
 }
 
@@ -1412,6 +2600,8 @@ INT8U MCP_CAN::errorCountRX(void)
 *********************************************************************************************************/
 INT8U MCP_CAN::errorCountTX(void)
 {
+    McpLockGuard guard(&spi_lock);
+
     return mcp2515_readRegister(MCP_TEC);
 }
 
@@ -1422,8 +2612,23 @@ INT8U MCP_CAN::errorCountTX(void)
 *********************************************************************************************************/
 INT8U MCP_CAN::enOneShotTX(void)
 {
-    mcp2515_modifyRegister(MCP_CANCTRL, MODE_ONESHOT, MODE_ONESHOT);
-    if ((mcp2515_readRegister(MCP_CANCTRL) & MODE_ONESHOT) != MODE_ONESHOT)
+    McpLockGuard guard(&spi_lock);
+
+    INT8U stat_ctrl[2] = { 0, 0 };
+    INT8U prev         = mcp2515_shadowMode();
+    bool  verify       = mcp2515_needsVerify();
+
+    mcp2515_queueModify(MCP_CANCTRL, MODE_ONESHOT, MODE_ONESHOT);
+    if (verify)
+    {
+        mcp2515_queueVerify(stat_ctrl);
+    }
+    if (!mcp2515_submit())
+    {
+        return CAN_FAIL;
+    }
+
+    if (verify && mcp2515_checkVerify(stat_ctrl, MODE_ONESHOT, MODE_ONESHOT, prev))
     {
         return CAN_FAIL;
     }
@@ -1440,8 +2645,23 @@ INT8U MCP_CAN::enOneShotTX(void)
 *********************************************************************************************************/
 INT8U MCP_CAN::disOneShotTX(void)
 {
-    mcp2515_modifyRegister(MCP_CANCTRL, MODE_ONESHOT, 0);
-    if ((mcp2515_readRegister(MCP_CANCTRL) & MODE_ONESHOT) != 0)
+    McpLockGuard guard(&spi_lock);
+
+    INT8U stat_ctrl[2] = { 0, 0 };
+    INT8U prev         = mcp2515_shadowMode();
+    bool  verify       = mcp2515_needsVerify();
+
+    mcp2515_queueModify(MCP_CANCTRL, MODE_ONESHOT, 0);
+    if (verify)
+    {
+        mcp2515_queueVerify(stat_ctrl);
+    }
+    if (!mcp2515_submit())
+    {
+        return CAN_FAIL;
+    }
+
+    if (verify && mcp2515_checkVerify(stat_ctrl, MODE_ONESHOT, 0, prev))
     {
         return CAN_FAIL;
     }
@@ -1453,18 +2673,37 @@ INT8U MCP_CAN::disOneShotTX(void)
 
 
 /*********************************************************************************************************
-** Function name:           startCharging
-** Descriptions:            Starts charging at voltage and current specified
+** Function name:           setVerifyPolicy
+** Descriptions:            Chooses when mode, one-shot, mask and filter changes are read back:
+**                          MCP_VERIFY_ALWAYS (default), MCP_VERIFY_SAMPLED (one change in period) or
+**                          MCP_VERIFY_ON_ERROR (after checkError/getError saw an error or a read-back
+**                          failed). Redundant changes are skipped by the shadow under every policy.
+*********************************************************************************************************/
+void MCP_CAN::setVerifyPolicy(INT8U policy, INT32U period)
+{
+    McpLockGuard guard(&spi_lock);
+
+    verify_policy = policy;
+    verify_period = period ? period : 1;
+    verify_count  = 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           queryCharger
+** Descriptions:            Starts (charge != 0) or stops charging at voltage (V) and current (A) specified.
+**                          address: 29-bit ID of the charger.
 *********************************************************************************************************/
 INT8U MCP_CAN::queryCharger(float voltage, float current, int address, int charge)
 {
-    uint8_t v = (uint8_t)(voltage * 10);
-    uint8_t i = (uint8_t)(current * 10);
-    uint8_t messageCharger[5] = { (uint8_t)(v >> 8) & 0xFF, v & 0xFF, (i >> 8) & 0xFF, i & 0xFF, charge }; // Los 5 bytes que enviamos al Cargador
+    CanFrame frame;
 
-    int res = sendMsgBuf((uint8_t)address, 1, 5, messageCharger);
+    chargerCommandInit(&frame, (INT32U)address);
+    chargerSetVoltage(&frame, chargerDeci(voltage > 0 ? (INT32U)(voltage * 1000) : 0));
+    chargerSetCurrent(&frame, chargerDeci(current > 0 ? (INT32U)(current * 1000) : 0));
+    chargerSetCharge(&frame, charge != 0);
 
-    return res;
+    return sendFrame(frame);
 }
 
 
@@ -50,40 +50,119 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "mcp_can_dfs_rpi.h"
-
-#define MAX_CHAR_IN_MESSAGE    8
+#include "mcp_transport_rpi.h"
+#include "can_ring_rpi.h"
+#include "can_codec_rpi.h"
+#include "charger_codec_rpi.h"
+#include "can_filter_plan_rpi.h"
+#include "mcp_irq_rpi.h"
 
 #define CAN_MODEL_NUMBER       10000
 
+// Called from serviceTx() once an asynchronously queued frame has left the controller.
+// status is CAN_OK when transmitted, CAN_FAILTX when the buffer was aborted.
+typedef void (*CanTxCallback)(void *ctx, const CanFrame &frame, INT8U status);
+
+// Called for every frame the filter plan's post-filter drops, by the thread reading it and with the
+// SPI lock held (it must not call back into MCP_CAN).
+typedef void (*CanRxFilterCallback)(void *ctx, const CanFrame &frame);
+
+// Receive thread wakeups and interrupt-to-read latency (kernel edge timestamp to frames in the ring).
+// Updated by the receive thread; a copy taken while it runs may be slightly inconsistent.
+struct McpIrqStats
+{
+    INT32U edges;                                                       // Falling edges from the line
+    INT32U wakeups;                                                     // Returns from poll()
+    INT32U timeouts;                                                    // ...after MCP_RXTHREAD_TIMEOUT_NS
+    INT32U level_drains;                                                // Drained again, INT still low
+    INT32U latency_samples;
+    uint64_t latency_last_ns;
+    uint64_t latency_max_ns;
+    uint64_t latency_total_ns;
+};
+
+// Holds a pthread mutex for the lifetime of the object
+class McpLockGuard
+{
+private:
+    pthread_mutex_t *mutex;
+
+public:
+    explicit McpLockGuard(pthread_mutex_t *mutex) : mutex(mutex)
+    {
+        pthread_mutex_lock(mutex);
+    }
+
+    ~McpLockGuard()
+    {
+        pthread_mutex_unlock(mutex);
+    }
+};
+
 class MCP_CAN
 {
 private:
 
-    INT8U m_nExtFlg;                                                    // Identifier Type
-                                                                        // Extended (29 bit) or Standard (11 bit)
-    INT32U m_nID;                                                       // CAN ID
-    INT8U m_nDlc;                                                       // Data Length Code
-    INT8U m_nDta[MAX_CHAR_IN_MESSAGE];                                  // Data array
-    INT8U m_nRtr;                                                       // Remote request flag
-    INT8U m_nfilhit;                                                    // The number of the filter that matched the message
     //INT8U   MCPCS;  (NOT NEEDED, wiringPi already handles CS pin)     // Chip Select pin number
     INT8U mcpMode;                                                      // Mode to return to after configurations are performed.
 
-    int spi_channel;
-    int spi_baudrate;
+    McpTransport *transport;                                            // SPI backend
+    bool owns_transport;                                                // Created by the constructor
+    McpTransaction txn;                                                 // Batch being built (spi_lock)
     INT8U gpio_can_interrupt;
 
+    pthread_mutex_t spi_lock;                                           // Serializes SPI, guards TX state
+    CanFrame tx_queue[MCP_TXQUEUE_SIZE];                                // Frames waiting for a TX buffer
+    INT8U tx_queue_head;
+    INT8U tx_queue_count;
+    CanFrame tx_inflight[MCP_N_TXBUFFERS];                              // Frames loaded in TXB0..2
+    INT8U tx_inflight_mask;                                             // Bit n: TXBn holds an async frame
+    INT8U tx_reserved_mask;                                             // Bit n: TXBn kept by reserveTxBuffer
+    bool tx_blocked;                                                    // blockTx(): tx_block_id refused
+    INT32U tx_block_id;
+    INT8U tx_block_ext;
+    bool tx_int_enabled;                                                // TXnIE set in CANINTE
+    CanTxCallback tx_callback;
+    void *tx_callback_ctx;
+    INT32U tx_completed;
+    INT32U tx_failed;
+
+    CanRing<CanFrame, MCP_RXRING_SIZE> rx_ring;                         // RX thread -> application
+    pthread_t rx_thread;
+    int rx_wake_fd;                                                     // eventfd: notifyInterrupt(), stop
+    volatile bool rx_running;
+    int rx_priority;                                                    // SCHED_FIFO priority, 0 = normal
+    int rx_cpu;                                                         // CPU to pin the thread, -1 = any
+    McpIrqLine *irq_line;                                               // INT pin events, NULL = none
+    bool owns_irq_line;                                                 // Created by setupInterruptGpio
+    McpIrqStats irq_stats;
+    INT32U rx_filter_hits[MCP_N_FILTERS];                               // Frames accepted per filter
+    CanFilterPlan rx_plan;                                              // Masks/filters and post-filter
+    bool rx_plan_active;                                                // Post-filter reads with rx_plan
+    INT32U rx_filtered;                                                 // Dropped by the post-filter
+    CanRxFilterCallback rx_filter_callback;
+    void *rx_filter_callback_ctx;
+
+    INT8U shadow[MCP_SHADOW_SIZE];                                      // Last value written to owned registers
+    INT8U shadow_valid[MCP_SHADOW_SIZE / 8];                            // Bit per register: shadow is current
+    INT8U verify_policy;                                                // MCP_VERIFY_*
+    INT32U verify_period;                                               // MCP_VERIFY_SAMPLED: 1 change in N
+    INT32U verify_count;
+    bool verify_pending;                                                // Read back the next change
+
 /*********************************************************************************************************
 *  mcp2515 driver function
 *********************************************************************************************************/
     // private:
 private:
 
-    struct timespec delay_spi_can = {0};
-
-    void spiTransfer(uint8_t byte_number, unsigned char *buf);
+    bool spiTransfer(uint8_t byte_number, unsigned char *buf);
 
     void mcp2515_reset(void);                                           // Soft Reset MCP2515
 
@@ -107,7 +186,35 @@ private:
                                 const INT8U data);
 
     INT8U mcp2515_readStatus(void);                                     // Read MCP2515 Status
+
+    void mcp2515_shadowReset(void);                                     // Shadow = power-on values
+    void mcp2515_shadowInvalidate(void);                                // Forget the shadow
+    bool mcp2515_shadowMatch(const INT8U address,                       // Shadow holds these values
+                             const INT8U values[],
+                             const INT8U n);
+    void mcp2515_shadowStore(const INT8U address,
+                             const INT8U values[],
+                             const INT8U n);
+    INT8U mcp2515_shadowMode(void);                                     // Requested mode or MCP_MODE_UNKNOWN
+    void mcp2515_queueWrite(const INT8U address,                        // Queue write unless redundant
+                            const INT8U value);
+    void mcp2515_queueWriteS(const INT8U address,                       // Queue changed bytes only
+                             const INT8U values[],
+                             const INT8U n);
+    void mcp2515_queueModify(const INT8U address,                       // Queue bit modify unless redundant
+                             const INT8U mask,
+                             const INT8U data);
+    bool mcp2515_needsVerify(void);                                     // Apply verify_policy
+    void mcp2515_queueVerify(INT8U stat_ctrl[]);                        // Queue CANSTAT+CANCTRL read
+    INT8U mcp2515_checkVerify(const INT8U stat_ctrl[],                  // Compare read-back with request
+                              const INT8U mask,
+                              const INT8U value,
+                              const INT8U prev_mode);
+    bool mcp2515_submit(void);                                          // txn.submit, shadow kept coherent
+
     INT8U mcp2515_setCANCTRL_Mode(const INT8U newmode);                 // Set mode
+    INT8U mcp2515_enterConfig(void);                                    // Request CONFIG, wait for OPMOD
+    INT8U mcp2515_leaveConfig(void);                                    // Back to mcpMode
     INT8U mcp2515_configRate(const INT8U canSpeed,                      // Set baudrate
                              const INT8U canClock);
 
@@ -115,59 +222,138 @@ private:
                        const INT8U canSpeed,
                        const INT8U canClock);
 
+    void mcp2515_encode_mf(const INT8U  ext,                            // Encode CAN Mask or Filter
+                           const INT32U id,
+                           INT8U        *tbufdata);
+
     void mcp2515_write_mf(const INT8U  mcp_addr,                        // Write CAN Mask or Filter
                           const INT8U  ext,
                           const INT32U id);
 
+    INT8U mcp2515_setMF(const INT8U  mcp_addr,                          // Mask or Filter in a config
+                        const INT8U  ext,                               // mode window
+                        const INT32U id);
+
+    INT8U mcp2515_setFilters(const INT8U *masks,                        // All masks, filters and RXM
+                             const INT8U *filters,                      // bits in one config window
+                             const INT8U rxm);
+
+    void mcp2515_encode_id(const INT8U  ext,                            // Encode CAN ID into registers
+                           const INT32U id,
+                           INT8U        *tbufdata);
+
     void mcp2515_write_id(const INT8U  mcp_addr,                        // Write CAN ID
                           const INT8U  ext,
                           const INT32U id);
 
+    void mcp2515_decode_id(const INT8U *tbufdata,                       // Decode CAN ID from registers
+                           INT8U       *ext,
+                           INT32U      *id);
+
     void mcp2515_read_id(const INT8U mcp_addr,                          // Read CAN ID
                          INT8U       *ext,
                          INT32U      *id);
 
-    void mcp2515_write_canMsg(const INT8U buffer_sidh_addr);            // Write CAN message
-    void mcp2515_read_canMsg(const INT8U buffer_sidh_addr);             // Read CAN message
+    bool mcp2515_write_canMsg(const INT8U    txbuf_n,                   // Write CAN message (LOAD TX)
+                              const CanFrame &frame);
+    bool mcp2515_start_transmit(const INT8U txbuf_n);                   // Request to send (RTS)
+    void mcp2515_decode_canMsg(const INT8U *image,                      // Decode a READ RX image
+                               CanFrame    &frame);
+    INT8U mcp2515_readRxStatus(void);                                   // RX STATUS instruction
+    bool mcp2515_readRxs_canMsg(const INT8U rxs,                        // Read the buffer rxs points to,
+                                CanFrame    &frame,                     // optionally fetch the next
+                                INT8U       *next_rxs);                 // RX STATUS in the same batch
     INT8U mcp2515_getNextFreeTXBuf(INT8U *txbuf_n);                     // Find empty transmit buffer
+    void mcp2515_fillTXBuffers(INT8U stat);                             // Move queued frames to free TX buffers
+    bool mcp2515_txBlocked(const CanFrame &frame);                      // ID refused by blockTx()
+    void mcp2515_postFiltered(const CanFrame &frame);                   // Count and report a dropped frame
+
+    void initState(void);                                               // Shared by the constructors
+
+    static void *rxThreadEntry(void *arg);                              // Receive thread
+    void rxThreadLoop(void);
+    void rxRecordLatency(uint64_t edge_ns);                             // Edge to frames in the ring
+    void rxDrain(void);                                                 // Move pending frames to rx_ring
+    INT32U mcp2515_readBatch(CanFrame *frames,                          // readMsgBatch, spi_lock held
+                             INT32U max);
+    void mcp2515_drainToRing(void);                                     // rxDrain, spi_lock held
 
 /*********************************************************************************************************
 *  CAN operator function
 *********************************************************************************************************/
 
-    INT8U setMsg(INT32U id, INT8U rtr, INT8U ext, INT8U len, INT8U *pData); // Set message
-    INT8U clearMsg();                                                       // Clear all message to zero
-    INT8U readMsg();                                                        // Read message
-    INT8U sendMsg();                                                        // Send message
+    static CanFrame makeFrame(INT32U id, INT8U rtr, INT8U ext,             // Build frame from a buffer
+                              INT8U len, const INT8U *pData);
+    INT8U readMsg(CanFrame &frame);                                         // Read message
+    INT8U sendMsg(const CanFrame &frame);                                   // Send message
 
 public:
     MCP_CAN(int spi_channel, int spi_baudrate, INT8U gpio_can_interrupt);
+    MCP_CAN(McpTransport *transport, INT8U gpio_can_interrupt);      // Caller keeps ownership
+    ~MCP_CAN();
     INT8U begin(INT8U idmodeset, INT8U speedset, INT8U clockset);     // Initilize controller prameters
     INT8U init_Mask(INT8U num, INT8U ext, INT32U ulData);             // Initilize Mask(s)
     INT8U init_Mask(INT8U num, INT32U ulData);                        // Initilize Mask(s)
     INT8U init_Filt(INT8U num, INT8U ext, INT32U ulData);             // Initilize Filter(s)
     INT8U init_Filt(INT8U num, INT32U ulData);                        // Initilize Filter(s)
     INT8U setMode(INT8U opMode);                                      // Set operational mode
+    INT8U sendFrame(const CanFrame &frame);                           // Send frame and wait
     INT8U sendMsgBuf(INT32U id, INT8U ext, INT8U len, INT8U *buf);    // Send message to transmit buffer
     INT8U sendMsgBuf(INT32U id, INT8U len, INT8U *buf);               // Send message to transmit buffer
+    INT8U sendFrameAsync(const CanFrame &frame);                      // Queue frame, do not wait
+    INT8U sendMsgBufAsync(INT32U id, INT8U ext, INT8U len, INT8U *buf); // Queue message, do not wait
+    void setTxCallback(CanTxCallback callback, void *ctx);            // Async TX completion callback
+    INT8U serviceTx(void);                                            // Handle TXnIF, refill TX buffers
+    INT32U txPending(void);                                           // Async frames not yet completed
+    INT32U txCompleted(void);                                         // Async frames transmitted
+    INT32U txFailed(void);                                            // Async frames aborted
+    INT8U reserveTxBuffer(const CanFrame &frame);                     // Preload frame in TXB2, top priority
+    INT8U fireReservedTx(void);                                       // Send the preloaded frame (RTS)
+    bool reservedTxBusy(void);                                        // Preloaded frame waiting for the bus
+    void releaseTxBuffer(void);                                       // TXB2 back to sendMsg / async
+    INT8U abortTx(void);                                              // Drop queued and pending frames
+    void blockTx(INT32U id, INT8U ext);                               // Refuse id in sendMsg / async
+    void unblockTx(void);                                             // Accept it again
+    INT8U readFrame(CanFrame &frame);                                 // Read one frame
     INT8U readMsgBuf(INT32U *id, INT8U *ext, INT8U *len, INT8U *buf); // Read message from receive buffer
     INT8U readMsgBuf(INT32U *id, INT8U *len, INT8U *buf);             // Read message from receive buffer
+    INT32U readMsgBatch(CanFrame *frames, INT32U max);                // Empty both RX buffers
     INT8U checkReceive(void);                                         // Check for received data
+    INT32U filterHits(INT8U num);                                     // Frames accepted by filter num
+    INT8U subscribe(const CanIdRange *ids, INT32U n);                 // Plan and program filters for ids
+    INT8U setFilterPlan(const CanFilterPlan &plan);                   // Program a canPlanFilters() plan
+    INT8U clearFilterPlan(void);                                      // Accept everything again
+    INT32U rxFiltered(void);                                          // Frames dropped by the post-filter
+    void setRxFilterCallback(CanRxFilterCallback callback, void *ctx); // Sees post-filtered frames
     INT8U checkError(void);                                           // Check for errors
     INT8U getError(void);                                             // Check for errors
     INT8U errorCountRX(void);                                         // Get error count
     INT8U errorCountTX(void);                                         // Get error count
     INT8U enOneShotTX(void);                                          // Enable one-shot transmission
     INT8U disOneShotTX(void);                                         // Disable one-shot transmission
+    void setVerifyPolicy(INT8U policy, INT32U period);                // Read-back of config changes
 
-    INT8U queryCharger(float voltage, float current, int address, int charge);   // Start charging
+    INT8U queryCharger(float voltage, float current, int address, int charge);   // Start / stop charging
     INT8U queryBMS(int moduleID, int shuntVoltageMillivolts);         // Query BMS
 
+    INT8U startRxThread(INT8U overflow_policy);                       // Library-owned receive thread
+    void stopRxThread(void);
+    void notifyInterrupt(void);                                       // Call from the INT pin ISR
+    void setRxThreadSched(int priority, int cpu);                     // SCHED_FIFO priority, affinity
+    void setInterruptLine(McpIrqLine *line);                          // INT pin source, caller owns it
+    int interruptFd(void);                                            // INT pin event fd, -1 if none
+    McpIrqLine *interruptLine(void);                                  // INT pin source, NULL if none
+    McpIrqStats irqStats(void);
+    INT32U readFrames(CanFrame *frames, INT32U max);                  // Pop frames received by the thread
+    INT32U rxReceived(void);                                          // Frames queued by the thread
+    INT32U rxDropped(void);                                           // Frames lost to ring overflow
+
     bool setupInterruptGpio();
     bool setupSpi();
+    McpTransport *getTransport(void);
     bool canReadData();
 };
 
-#endif
-
 #include "mcp_can_rpi.cpp"
+
+#endif
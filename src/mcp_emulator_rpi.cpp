@@ -0,0 +1,977 @@
+/*
+ *  mcp_emulator_rpi.cpp
+ *  In-process MCP2515 emulator used as an SPI transport.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+#include <time.h>
+
+
+/*********************************************************************************************************
+** Function name:           McpEmulatorTransport
+** Descriptions:            Emulated controller after power-up, with the default SPI latency model
+*********************************************************************************************************/
+McpEmulatorTransport::McpEmulatorTransport(INT32U osc_hz)
+{
+    pthread_mutex_init(&lock, NULL);
+
+    this->osc_hz       = osc_hz;
+    latency.submit_ns  = MCP_EMU_SUBMIT_NS;
+    latency.cs_ns      = MCP_EMU_CS_NS;
+    latency.byte_ns    = MCP_EMU_BYTE_NS;
+    real_time          = false;
+    now_ns             = 0;
+    rx_pending_head    = 0;
+    rx_pending_count   = 0;
+    bus_out_head       = 0;
+    bus_out_count      = 0;
+    memset(&emu_stats, 0, sizeof(emu_stats));
+
+    reset();
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~McpEmulatorTransport
+** Descriptions:            Releases the lock
+*********************************************************************************************************/
+McpEmulatorTransport::~McpEmulatorTransport()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+
+/*********************************************************************************************************
+** Function name:           open
+** Descriptions:            Nothing to set up
+*********************************************************************************************************/
+bool McpEmulatorTransport::open(void)
+{
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setLatency
+** Descriptions:            Sets the time charged for each submit, chip-select window and byte
+*********************************************************************************************************/
+void McpEmulatorTransport::setLatency(const McpEmuLatency &latency)
+{
+    McpLockGuard guard(&lock);
+
+    this->latency = latency;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setRealTime
+** Descriptions:            If set, every transfer also busy-waits for its modelled duration, so wall
+**                          clock measurements include the SPI time
+*********************************************************************************************************/
+void McpEmulatorTransport::setRealTime(bool real_time)
+{
+    McpLockGuard guard(&lock);
+
+    this->real_time = real_time;
+}
+
+
+/*********************************************************************************************************
+** Function name:           now
+** Descriptions:            Emulated time in ns since construction
+*********************************************************************************************************/
+uint64_t McpEmulatorTransport::now(void)
+{
+    McpLockGuard guard(&lock);
+
+    return now_ns;
+}
+
+
+/*********************************************************************************************************
+** Function name:           advance
+** Descriptions:            Lets ns of bus time pass (pending transmissions and arrivals happen)
+*********************************************************************************************************/
+void McpEmulatorTransport::advance(uint64_t ns)
+{
+    McpLockGuard guard(&lock);
+
+    now_ns += ns;
+    step();
+}
+
+
+/*********************************************************************************************************
+** Function name:           busInject
+** Descriptions:            Another node finishes sending frame now
+*********************************************************************************************************/
+bool McpEmulatorTransport::busInject(const CanFrame &frame)
+{
+    return busInjectAt(frame, now());
+}
+
+
+/*********************************************************************************************************
+** Function name:           busInjectAt
+** Descriptions:            Another node finishes sending frame at emulated time at_ns. Times earlier
+**                          than the previous injection are moved up to it (the bus is a FIFO).
+*********************************************************************************************************/
+bool McpEmulatorTransport::busInjectAt(const CanFrame &frame, uint64_t at_ns)
+{
+    McpLockGuard guard(&lock);
+    INT32U       slot, last;
+
+    if (rx_pending_count == MCP_EMU_BUS_QUEUE)
+    {
+        emu_stats.bus_drops++;
+        return false;
+    }
+
+    if (rx_pending_count > 0)
+    {
+        last = (rx_pending_head + rx_pending_count - 1) % MCP_EMU_BUS_QUEUE;
+        if (at_ns < rx_pending_at[last])
+        {
+            at_ns = rx_pending_at[last];
+        }
+    }
+
+    slot                = (rx_pending_head + rx_pending_count) % MCP_EMU_BUS_QUEUE;
+    rx_pending[slot]    = frame;
+    rx_pending_at[slot] = at_ns;
+    rx_pending_count++;
+
+    step();
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           busPop
+** Descriptions:            Oldest frame transmitted on the bus by the controller, false if none
+*********************************************************************************************************/
+bool McpEmulatorTransport::busPop(CanFrame &frame)
+{
+    McpLockGuard guard(&lock);
+
+    if (bus_out_count == 0)
+    {
+        return false;
+    }
+
+    frame        = bus_out[bus_out_head];
+    bus_out_head = (bus_out_head + 1) % MCP_EMU_BUS_QUEUE;
+    bus_out_count--;
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           intActive
+** Descriptions:            State of the INT pin: asserted while an enabled interrupt flag is set
+*********************************************************************************************************/
+bool McpEmulatorTransport::intActive(void)
+{
+    McpLockGuard guard(&lock);
+
+    return (regs[MCP_CANINTE] & regs[MCP_CANINTF]) != 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           peekRegister
+** Descriptions:            Register value as a READ would return it, without SPI time
+*********************************************************************************************************/
+INT8U McpEmulatorTransport::peekRegister(INT8U address)
+{
+    McpLockGuard guard(&lock);
+
+    return readReg(address);
+}
+
+
+/*********************************************************************************************************
+** Function name:           emuStats
+** Descriptions:            Copy of the bus side counters
+*********************************************************************************************************/
+McpEmuStats McpEmulatorTransport::emuStats(void)
+{
+    McpLockGuard guard(&lock);
+
+    return emu_stats;
+}
+
+
+/*********************************************************************************************************
+** Function name:           bitTimeNs
+** Descriptions:            Nominal bit time from CNF1..3: (SYNC + PRSEG + PHSEG1 + PHSEG2) * 2 * BRP / Fosc
+*********************************************************************************************************/
+uint64_t McpEmulatorTransport::bitTimeNs(void)
+{
+    INT8U    cnf2 = regs[MCP_CNF2];
+    uint64_t brp  = (regs[MCP_CNF1] & 0x3F) + 1;
+    uint64_t prseg  = (cnf2 & 0x07) + 1;
+    uint64_t phseg1 = ((cnf2 >> 3) & 0x07) + 1;
+    uint64_t phseg2;
+
+    if (cnf2 & BTLMODE)
+    {
+        phseg2 = (regs[MCP_CNF3] & 0x07) + 1;
+    }
+    else                                                                /* greater of PHSEG1 and IPT    */
+    {
+        phseg2 = (phseg1 > 2) ? phseg1 : 2;
+    }
+
+    return (1 + prseg + phseg1 + phseg2) * 2 * brp * 1000000000ULL / osc_hz;
+}
+
+
+/*********************************************************************************************************
+** Function name:           frameBits
+** Descriptions:            Frame length on the wire without stuff bits, interframe space included
+*********************************************************************************************************/
+INT32U McpEmulatorTransport::frameBits(const CanFrame &frame)
+{
+    INT32U bits = frame.ext ? 67 : 47;
+
+    if (!frame.rtr)
+    {
+        bits += 8 * ((frame.dlc > MAX_CHAR_IN_MESSAGE) ? MAX_CHAR_IN_MESSAGE : frame.dlc);
+    }
+
+    return bits;
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransfer
+** Descriptions:            One chip-select window, charged as its own submit
+*********************************************************************************************************/
+bool McpEmulatorTransport::doTransfer(unsigned char *buf, INT32U len)
+{
+    McpLockGuard guard(&lock);
+
+    spi_stats.submits++;
+    execute(buf, len);
+    spend(latency.submit_ns + latency.cs_ns + (uint64_t)latency.byte_ns * len);
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransferBatch
+** Descriptions:            Charged like McpSpidevTransport: one submit per MCP_SPI_MAX_SEGMENTS windows
+*********************************************************************************************************/
+bool McpEmulatorTransport::doTransferBatch(McpSpiSegment *segments, INT32U n)
+{
+    McpLockGuard guard(&lock);
+
+    for (INT32U i = 0; i < n; i++)
+    {
+        uint64_t cost = latency.cs_ns + (uint64_t)latency.byte_ns * segments[i].len;
+
+        if (i % MCP_SPI_MAX_SEGMENTS == 0)
+        {
+            spi_stats.submits++;
+            cost += latency.submit_ns;
+        }
+        execute(segments[i].buf, segments[i].len);
+        spend(cost);
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           reset
+** Descriptions:            Power-on / RESET state: configuration mode, everything else cleared
+*********************************************************************************************************/
+void McpEmulatorTransport::reset(void)
+{
+    memset(regs, 0, sizeof(regs));
+    regs[MCP_CANSTAT] = MODE_CONFIG;
+    regs[MCP_CANCTRL] = MCP_CANCTRL_RESET;
+    tx_active         = -1;
+    tx_done_ns        = 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           execute
+** Descriptions:            Decodes one chip-select window (buf[0] is the instruction). Bytes shifted out
+**                          by the controller replace buf[1..len-1].
+*********************************************************************************************************/
+void McpEmulatorTransport::execute(unsigned char *buf, INT32U len)
+{
+    INT8U  ins = buf[0];
+    INT8U  address, n;
+    INT32U i;
+
+    if (ins == MCP_RESET)
+    {
+        reset();
+    }
+    else if (ins == MCP_READ && len >= 2)
+    {
+        address = buf[1];
+        for (i = 2; i < len; i++)
+        {
+            buf[i] = readReg(address++ & 0x7F);
+        }
+    }
+    else if (ins == MCP_WRITE && len >= 2)
+    {
+        address = buf[1];
+        for (i = 2; i < len; i++)
+        {
+            writeReg(address++ & 0x7F, buf[i], 0xFF);
+        }
+    }
+    else if (ins == MCP_BITMOD && len >= 4)
+    {
+        writeReg(buf[1] & 0x7F, buf[3], bitModifiable(buf[1] & 0x7F) ? buf[2] : 0xFF);
+    }
+    else if (ins == MCP_READ_STATUS)
+    {
+        for (i = 1; i < len; i++)                                       /* repeated while CS is low     */
+        {
+            buf[i] = readStatus();
+        }
+    }
+    else if (ins == MCP_RX_STATUS)
+    {
+        for (i = 1; i < len; i++)
+        {
+            buf[i] = rxStatus();
+        }
+    }
+    else if ((ins & 0xF8) == MCP_LOAD_TX0 && (ins & 0x07) <= 5)         /* 0x40..0x45                   */
+    {
+        n       = (ins & 0x07) >> 1;
+        address = MCP_TXB0CTRL + 0x10 * n + 1 + ((ins & 0x01) ? MCP_TXB_D0 : 0);
+        for (i = 1; i < len; i++)
+        {
+            writeReg(address++ & 0x7F, buf[i], 0xFF);
+        }
+    }
+    else if ((ins & 0xF9) == MCP_READ_RX0)                              /* 0x90, 0x92, 0x94, 0x96       */
+    {
+        n       = (ins >> 2) & 0x01;
+        address = MCP_RXB0SIDH + 0x10 * n + ((ins & 0x02) ? MCP_RXB_D0 : 0);
+        for (i = 1; i < len; i++)
+        {
+            buf[i] = readReg(address++ & 0x7F);
+        }
+        regs[MCP_CANINTF] &= ~(MCP_RX0IF << n);                         /* cleared when CS goes high    */
+    }
+    else if ((ins & 0xF8) == 0x80)                                      /* RTS                          */
+    {
+        for (n = 0; n < MCP_N_TXBUFFERS; n++)
+        {
+            if (ins & (1 << n))
+            {
+                address = MCP_TXB0CTRL + 0x10 * n;
+                writeReg(address, regs[address] | MCP_TXB_TXREQ_M, 0xFF);
+            }
+        }
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           readReg
+** Descriptions:            CANSTAT/CANCTRL are mirrored at xE/xF; CANSTAT carries the interrupt code
+*********************************************************************************************************/
+INT8U McpEmulatorTransport::readReg(INT8U address)
+{
+    static const INT8U icod_flag[7] = { MCP_ERRIF, MCP_WAKIF, MCP_TX0IF, MCP_TX1IF,
+                                        MCP_TX2IF, MCP_RX0IF, MCP_RX1IF };
+    INT8U pending;
+
+    if ((address & 0x0F) == MCP_CANCTRL)
+    {
+        return regs[MCP_CANCTRL];
+    }
+    if ((address & 0x0F) == MCP_CANSTAT)
+    {
+        pending = regs[MCP_CANINTE] & regs[MCP_CANINTF];
+        for (INT8U i = 0; i < 7; i++)
+        {
+            if (pending & icod_flag[i])
+            {
+                return (regs[MCP_CANSTAT] & MODE_MASK) | ((i + 1) << 1);
+            }
+        }
+        return regs[MCP_CANSTAT] & MODE_MASK;
+    }
+
+    return regs[address];
+}
+
+
+/*********************************************************************************************************
+** Function name:           writableMask
+** Descriptions:            Bits the SPI side may change. Configuration registers only in config mode.
+*********************************************************************************************************/
+INT8U McpEmulatorTransport::writableMask(INT8U address)
+{
+    bool config = (regs[MCP_CANSTAT] & MODE_MASK) == MODE_CONFIG;
+
+    if (address <= MCP_RXF5EID0 && (address & 0x0F) < 0x0C)            /* RXF0..RXF5                   */
+    {
+        return config ? 0xFF : 0x00;
+    }
+    if (address >= MCP_RXM0SIDH && address <= MCP_CNF1)                /* RXM0, RXM1, CNF3..CNF1       */
+    {
+        return config ? 0xFF : 0x00;
+    }
+
+    switch (address)
+    {
+    case 0x0C:                                                          /* BFPCTRL                      */
+        return 0x3F;
+    case 0x0D:                                                          /* TXRTSCTRL                    */
+        return config ? 0x07 : 0x00;
+    case MCP_CANCTRL:
+    case MCP_CANINTE:
+    case MCP_CANINTF:
+        return 0xFF;
+    case MCP_EFLG:
+        return MCP_EFLG_RX1OVR | MCP_EFLG_RX0OVR;
+    case MCP_TXB0CTRL:
+    case MCP_TXB1CTRL:
+    case MCP_TXB2CTRL:
+        return MCP_TXB_TXREQ_M | MCP_TXB_TXP10_M;
+    case MCP_RXB0CTRL:
+        return MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK;
+    case MCP_RXB1CTRL:
+        return MCP_RXB_RX_MASK;
+    default:
+        break;
+    }
+
+    if (address > MCP_TXB0CTRL && address < MCP_RXB0CTRL && (address & 0x0F) <= 0x0D)
+    {
+        return 0xFF;                                                    /* TXBnSIDH..TXBnD7             */
+    }
+
+    return 0x00;                                                        /* status, RX buffers, unused   */
+}
+
+
+/*********************************************************************************************************
+** Function name:           bitModifiable
+** Descriptions:            Registers accepting BIT MODIFY; on the others the mask is forced to 0xFF
+*********************************************************************************************************/
+bool McpEmulatorTransport::bitModifiable(INT8U address)
+{
+    if ((address & 0x0F) == MCP_CANCTRL)
+    {
+        return true;
+    }
+
+    switch (address)
+    {
+    case 0x0C:
+    case 0x0D:
+    case MCP_CNF3:
+    case MCP_CNF2:
+    case MCP_CNF1:
+    case MCP_CANINTE:
+    case MCP_CANINTF:
+    case MCP_EFLG:
+    case MCP_TXB0CTRL:
+    case MCP_TXB1CTRL:
+    case MCP_TXB2CTRL:
+    case MCP_RXB0CTRL:
+    case MCP_RXB1CTRL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           writeReg
+** Descriptions:            Writes the bits in mask that the register lets through, then applies side
+**                          effects: mode requests, abort, TXREQ and the BUKT1 copy
+*********************************************************************************************************/
+void McpEmulatorTransport::writeReg(INT8U address, INT8U value, INT8U mask)
+{
+    INT8U old, w, n;
+
+    if ((address & 0x0F) == MCP_CANSTAT || (address & 0x0F) == MCP_CANCTRL)
+    {
+        address = address & 0x0F;
+    }
+
+    old = regs[address];
+    w   = writableMask(address) & mask;
+    regs[address] = (old & ~w) | (value & w);
+
+    if (address == MCP_CANCTRL)
+    {
+        applyMode(now_ns);                                              /* or at the end of the frame   */
+        if (regs[MCP_CANCTRL] & ABORT_TX)
+        {
+            abortTx();
+        }
+    }
+    else if (address == MCP_TXB0CTRL || address == MCP_TXB1CTRL || address == MCP_TXB2CTRL)
+    {
+        n = (address - MCP_TXB0CTRL) >> 4;
+        if ((regs[address] & MCP_TXB_TXREQ_M) && !(old & MCP_TXB_TXREQ_M))
+        {
+            regs[address] &= ~(MCP_TXB_ABTF_M | MCP_TXB_MLOA_M | MCP_TXB_TXERR_M);
+        }
+        else if (!(regs[address] & MCP_TXB_TXREQ_M) && tx_active == n)
+        {
+            regs[address] |= MCP_TXB_TXREQ_M;                           /* already on the bus           */
+        }
+    }
+    else if (address == MCP_RXB0CTRL)
+    {
+        regs[address] = (regs[address] & ~0x02) | ((regs[address] & MCP_RXB_BUKT_MASK) ? 0x02 : 0x00);
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           readStatus
+** Descriptions:            READ STATUS: RX0IF, RX1IF, then TXREQ and TXnIF of each TX buffer
+*********************************************************************************************************/
+INT8U McpEmulatorTransport::readStatus(void)
+{
+    INT8U intf = regs[MCP_CANINTF];
+    INT8U stat = intf & (MCP_RX0IF | MCP_RX1IF);
+
+    for (INT8U n = 0; n < MCP_N_TXBUFFERS; n++)
+    {
+        if (regs[MCP_TXB0CTRL + 0x10 * n] & MCP_TXB_TXREQ_M)
+        {
+            stat |= MCP_STAT_TXREQ(n);
+        }
+        if (intf & MCP_TXIF(n))
+        {
+            stat |= MCP_STAT_TXIF(n);
+        }
+    }
+
+    return stat;
+}
+
+
+/*********************************************************************************************************
+** Function name:           rxStatus
+** Descriptions:            RX STATUS: full buffers, then type and filter of RXB0 (RXB1 if RXB0 is empty)
+*********************************************************************************************************/
+INT8U McpEmulatorTransport::rxStatus(void)
+{
+    INT8U full = regs[MCP_CANINTF] & (MCP_RX0IF | MCP_RX1IF);
+    INT8U stat = full << 6;
+    INT8U ctrl, base, filhit;
+
+    if (full == 0)
+    {
+        return stat;
+    }
+
+    base = (full & MCP_RX0IF) ? MCP_RXB0CTRL : MCP_RXB1CTRL;
+    ctrl = regs[base];
+    if (regs[base + 1 + MCP_SIDL] & MCP_RXB_IDE_M)
+    {
+        stat |= MCP_RXS_EXT;
+    }
+    if (ctrl & 0x08)                                                    /* RXRTR                        */
+    {
+        stat |= MCP_RXS_RTR;
+    }
+
+    if (base == MCP_RXB0CTRL)
+    {
+        filhit = ctrl & 0x01;
+    }
+    else
+    {
+        filhit = ctrl & 0x07;
+        if (filhit < 2)                                                 /* RXF0/RXF1 rolled over        */
+        {
+            filhit += MCP_N_FILTERS;
+        }
+    }
+
+    return stat | filhit;
+}
+
+
+/*********************************************************************************************************
+** Function name:           spend
+** Descriptions:            Advances the emulated clock (and the wall clock in real time mode)
+*********************************************************************************************************/
+void McpEmulatorTransport::spend(uint64_t ns)
+{
+    now_ns += ns;
+
+    if (real_time && ns > 0)
+    {
+        uint64_t t0 = canNowNs();
+
+        while (canNowNs() - t0 < ns)
+        {
+        }
+    }
+
+    step();
+}
+
+
+/*********************************************************************************************************
+** Function name:           step
+** Descriptions:            Runs bus events (end of a transmission, arrival of a frame) due by now_ns,
+**                          in time order
+*********************************************************************************************************/
+void McpEmulatorTransport::step(void)
+{
+    uint64_t t_rx, t_tx;
+    INT8U    mode;
+
+    if (tx_active < 0)
+    {
+        startTx(now_ns);
+    }
+
+    for (;;)
+    {
+        t_rx = rx_pending_count ? rx_pending_at[rx_pending_head] : UINT64_MAX;
+        t_tx = (tx_active >= 0) ? tx_done_ns : UINT64_MAX;
+
+        if (t_tx <= t_rx && t_tx <= now_ns)
+        {
+            completeTx();
+        }
+        else if (t_rx <= now_ns)
+        {
+            mode = regs[MCP_CANSTAT] & MODE_MASK;
+            if (mode == MCP_NORMAL || mode == MCP_LISTENONLY)
+            {
+                receive(rx_pending[rx_pending_head]);
+            }
+            else
+            {
+                emu_stats.rx_missed++;
+            }
+            rx_pending_head = (rx_pending_head + 1) % MCP_EMU_BUS_QUEUE;
+            rx_pending_count--;
+            applyMode(t_rx);
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           startTx
+** Descriptions:            Puts the pending buffer with the highest TXP (then highest number) on the bus
+*********************************************************************************************************/
+void McpEmulatorTransport::startTx(uint64_t at_ns)
+{
+    INT8U    mode = regs[MCP_CANSTAT] & MODE_MASK;
+    int      best = -1;
+    INT8U    ctrl, prio = 0;
+    CanFrame frame;
+
+    if (mode != MCP_NORMAL && mode != MCP_LOOPBACK)
+    {
+        return;
+    }
+
+    for (int n = MCP_N_TXBUFFERS - 1; n >= 0; n--)
+    {
+        ctrl = regs[MCP_TXB0CTRL + 0x10 * n];
+        if ((ctrl & MCP_TXB_TXREQ_M) && (best < 0 || (ctrl & MCP_TXB_TXP10_M) > prio))
+        {
+            best = n;
+            prio = ctrl & MCP_TXB_TXP10_M;
+        }
+    }
+    if (best < 0)
+    {
+        return;
+    }
+
+    const INT8U *image = &regs[MCP_TXB0CTRL + 0x10 * best + 1];
+
+    frame.ext  = (image[MCP_SIDL] & MCP_TXB_EXIDE_M) ? 1 : 0;
+    frame.rtr  = (image[MCP_TXB_DLC] & MCP_TXB_RTR_M) ? 1 : 0;
+    frame.dlc  = image[MCP_TXB_DLC] & MCP_DLC_MASK;
+    tx_active  = best;
+    tx_done_ns = at_ns + frameBits(frame) * bitTimeNs();
+}
+
+
+/*********************************************************************************************************
+** Function name:           completeTx
+** Descriptions:            The frame on the bus was acknowledged: TXREQ clear, TXnIF set, frame
+**                          delivered to the bus (or received by the controller itself in loopback)
+*********************************************************************************************************/
+void McpEmulatorTransport::completeTx(void)
+{
+    INT8U       n     = tx_active;
+    INT8U       addr  = MCP_TXB0CTRL + 0x10 * n;
+    const INT8U *image = &regs[addr + 1];
+    CanFrame    frame;
+    INT32U      sid, slot;
+
+    sid = (image[MCP_SIDH] << 3) | (image[MCP_SIDL] >> 5);
+    frame.ext = (image[MCP_SIDL] & MCP_TXB_EXIDE_M) ? 1 : 0;
+    if (frame.ext)
+    {
+        frame.id = (sid << 18) | ((INT32U)(image[MCP_SIDL] & 0x03) << 16) |
+                   ((INT32U)image[MCP_EID8] << 8) | image[MCP_EID0];
+    }
+    else
+    {
+        frame.id = sid;
+    }
+    frame.rtr = (image[MCP_TXB_DLC] & MCP_TXB_RTR_M) ? 1 : 0;
+    frame.dlc = image[MCP_TXB_DLC] & MCP_DLC_MASK;
+    if (frame.dlc > MAX_CHAR_IN_MESSAGE)
+    {
+        frame.dlc = MAX_CHAR_IN_MESSAGE;
+    }
+    for (int i = 0; i < MAX_CHAR_IN_MESSAGE; i++)
+    {
+        frame.data[i] = image[MCP_TXB_D0 + i];
+    }
+    frame.filhit    = 0;
+    frame.timestamp = tx_done_ns;
+
+    regs[addr]        &= ~MCP_TXB_TXREQ_M;
+    regs[MCP_CANINTF] |= MCP_TXIF(n);
+    emu_stats.tx_frames++;
+    tx_active = -1;
+
+    if ((regs[MCP_CANSTAT] & MODE_MASK) == MCP_LOOPBACK)
+    {
+        receive(frame);
+    }
+    else if (bus_out_count == MCP_EMU_BUS_QUEUE)
+    {
+        emu_stats.bus_drops++;
+    }
+    else
+    {
+        slot          = (bus_out_head + bus_out_count) % MCP_EMU_BUS_QUEUE;
+        bus_out[slot] = frame;
+        bus_out_count++;
+    }
+
+    applyMode(tx_done_ns);
+    startTx(tx_done_ns);                                                /* next one right after         */
+}
+
+
+/*********************************************************************************************************
+** Function name:           abortTx
+** Descriptions:            ABAT: every pending buffer not already on the bus is aborted (ABTF set)
+*********************************************************************************************************/
+void McpEmulatorTransport::abortTx(void)
+{
+    for (int n = 0; n < MCP_N_TXBUFFERS; n++)
+    {
+        INT8U addr = MCP_TXB0CTRL + 0x10 * n;
+
+        if ((regs[addr] & MCP_TXB_TXREQ_M) && n != tx_active)
+        {
+            regs[addr] = (regs[addr] & ~MCP_TXB_TXREQ_M) | MCP_TXB_ABTF_M;
+        }
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           applyMode
+** Descriptions:            Copies the mode requested in CANCTRL to CANSTAT unless a frame is on the bus at
+**                          at_ns: one being transmitted, or the next arrival already started
+*********************************************************************************************************/
+void McpEmulatorTransport::applyMode(uint64_t at_ns)
+{
+    INT8U    reqop = regs[MCP_CANCTRL] & MODE_MASK;
+    uint64_t length, start;
+
+    if ((regs[MCP_CANSTAT] & MODE_MASK) == reqop || tx_active >= 0)
+    {
+        return;
+    }
+    if (rx_pending_count > 0)
+    {
+        length = frameBits(rx_pending[rx_pending_head]) * bitTimeNs();
+        start  = rx_pending_at[rx_pending_head] > length ? rx_pending_at[rx_pending_head] - length : 0;
+        if (start < at_ns)
+        {
+            return;
+        }
+    }
+
+    regs[MCP_CANSTAT] = reqop;
+}
+
+
+/*********************************************************************************************************
+** Function name:           filterMatch
+** Descriptions:            Acceptance test of one filter under one mask. For standard frames the EID8
+**                          and EID0 bytes of mask and filter apply to the first two data bytes.
+*********************************************************************************************************/
+bool McpEmulatorTransport::filterMatch(INT8U mask_addr, INT8U filt_addr, const CanFrame &frame)
+{
+    return canFilterMatch(&regs[mask_addr], &regs[filt_addr], frame);
+}
+
+
+/*********************************************************************************************************
+** Function name:           accepts
+** Descriptions:            Acceptance for RXB0 (RXM0, RXF0..1) or RXB1 (RXM1, RXF2..5) per the RXM bits.
+**                          *filhit is the first matching filter (the first of the buffer if RXM = any).
+*********************************************************************************************************/
+bool McpEmulatorTransport::accepts(INT8U rxb, const CanFrame &frame, INT8U *filhit)
+{
+    static const INT8U filt_addr[MCP_N_FILTERS] = { MCP_RXF0SIDH, MCP_RXF1SIDH, MCP_RXF2SIDH,
+                                                    MCP_RXF3SIDH, MCP_RXF4SIDH, MCP_RXF5SIDH };
+    INT8U rxm   = regs[rxb ? MCP_RXB1CTRL : MCP_RXB0CTRL] & MCP_RXB_RX_MASK;
+    INT8U mask  = rxb ? MCP_RXM1SIDH : MCP_RXM0SIDH;
+    INT8U first = rxb ? 2 : 0;
+    INT8U last  = rxb ? 5 : 1;
+
+    if ((rxm == MCP_RXB_RX_STD && frame.ext) || (rxm == MCP_RXB_RX_EXT && !frame.ext))
+    {
+        return false;
+    }
+
+    for (INT8U i = first; i <= last; i++)
+    {
+        if (filterMatch(mask, filt_addr[i], frame))
+        {
+            *filhit = i;
+            return true;
+        }
+    }
+
+    *filhit = first;
+    return rxm == MCP_RXB_RX_ANY;
+}
+
+
+/*********************************************************************************************************
+** Function name:           receive
+** Descriptions:            A frame seen on the bus: RXB0 first, rolled over to RXB1 if BUKT is set
+*********************************************************************************************************/
+void McpEmulatorTransport::receive(const CanFrame &frame)
+{
+    INT8U filhit;
+
+    if (accepts(0, frame, &filhit))
+    {
+        if (!(regs[MCP_CANINTF] & MCP_RX0IF))
+        {
+            storeRx(0, frame, filhit);
+        }
+        else if (!(regs[MCP_RXB0CTRL] & MCP_RXB_BUKT_MASK))
+        {
+            overflow(MCP_EFLG_RX0OVR);
+        }
+        else if (!(regs[MCP_CANINTF] & MCP_RX1IF))
+        {
+            storeRx(1, frame, filhit);                                  /* FILHIT 0/1 marks the rollover*/
+        }
+        else
+        {
+            overflow(MCP_EFLG_RX1OVR);
+        }
+    }
+    else if (accepts(1, frame, &filhit))
+    {
+        if (!(regs[MCP_CANINTF] & MCP_RX1IF))
+        {
+            storeRx(1, frame, filhit);
+        }
+        else
+        {
+            overflow(MCP_EFLG_RX1OVR);
+        }
+    }
+    else
+    {
+        emu_stats.rx_rejected++;
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           storeRx
+** Descriptions:            Writes the frame into RXBn (SIDH..D7), the RXBnCTRL status bits and RXnIF
+*********************************************************************************************************/
+void McpEmulatorTransport::storeRx(INT8U rxb, const CanFrame &frame, INT8U filhit)
+{
+    INT8U ctrl_addr = rxb ? MCP_RXB1CTRL : MCP_RXB0CTRL;
+    INT8U *image    = &regs[ctrl_addr + 1];
+    INT8U ctrl      = regs[ctrl_addr];
+    INT32U sid      = frame.ext ? (frame.id >> 18) & 0x7FF : frame.id & 0x7FF;
+
+    image[MCP_SIDH] = (INT8U)(sid >> 3);
+    image[MCP_SIDL] = (INT8U)((sid & 0x07) << 5);
+    if (frame.ext)
+    {
+        image[MCP_SIDL] |= MCP_RXB_IDE_M | (INT8U)((frame.id >> 16) & 0x03);
+        image[MCP_EID8]  = (INT8U)(frame.id >> 8);
+        image[MCP_EID0]  = (INT8U)frame.id;
+    }
+    else
+    {
+        image[MCP_SIDL] |= frame.rtr ? MCP_RXB_SRR_M : 0;
+        image[MCP_EID8]  = 0;
+        image[MCP_EID0]  = 0;
+    }
+    image[MCP_RXB_DLC] = (frame.dlc & MCP_DLC_MASK) | ((frame.ext && frame.rtr) ? MCP_RXB_RTR_M : 0);
+    for (int i = 0; i < MAX_CHAR_IN_MESSAGE; i++)
+    {
+        image[MCP_RXB_D0 + i] = frame.data[i];
+    }
+
+    if (rxb == 0)
+    {
+        ctrl = (ctrl & (MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK | 0x02)) | (filhit & 0x01);
+    }
+    else
+    {
+        ctrl = (ctrl & MCP_RXB_RX_MASK) | (filhit & 0x07);
+    }
+    regs[ctrl_addr]    = ctrl | (frame.rtr ? 0x08 : 0x00);              /* RXRTR                        */
+    regs[MCP_CANINTF] |= MCP_RX0IF << rxb;
+    emu_stats.rx_frames++;
+}
+
+
+/*********************************************************************************************************
+** Function name:           overflow
+** Descriptions:            Frame lost because the receive buffer was still full
+*********************************************************************************************************/
+void McpEmulatorTransport::overflow(INT8U eflg_bit)
+{
+    regs[MCP_EFLG]    |= eflg_bit;
+    regs[MCP_CANINTF] |= MCP_ERRIF;
+    emu_stats.rx_overflows++;
+}
@@ -0,0 +1,124 @@
+/*
+ *  mcp_emulator_rpi.h
+ *  In-process MCP2515 emulator used as an SPI transport, so MCP_CAN can be run, measured and
+ *  checked on a workstation without the controller.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_EMULATOR_RPI_H
+#define MCP_EMULATOR_RPI_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mcp_can_rpi.h"
+
+#define MCP_EMU_NREGS        128                                        /* Register map 0x00..0x7F      */
+#define MCP_EMU_BUS_QUEUE    256                                        /* Frames waiting on each side  */
+
+#define MCP_EMU_SUBMIT_NS    5000                                       /* Default: per call (ioctl)    */
+#define MCP_EMU_CS_NS        500                                        /* Default: per chip select     */
+#define MCP_EMU_BYTE_NS      800                                        /* Default: per byte, 10 MHz    */
+
+// Time charged to the emulated clock for SPI traffic
+struct McpEmuLatency
+{
+    uint32_t submit_ns;                                                 // Per call into the backend
+    uint32_t cs_ns;                                                     // Per chip-select window
+    uint32_t byte_ns;                                                   // Per byte clocked
+};
+
+struct McpEmuStats
+{
+    INT32U rx_frames;                                                   // Stored in RXB0/RXB1
+    INT32U rx_rejected;                                                 // No filter matched
+    INT32U rx_overflows;                                                // Lost, receive buffer full
+    INT32U rx_missed;                                                   // Arrived while not listening
+    INT32U tx_frames;                                                   // Transmitted (or looped back)
+    INT32U bus_drops;                                                   // Bus queue full
+};
+
+/*
+ *  The emulator keeps its own clock (ns). SPI traffic advances it according to the latency model and
+ *  frames on the bus take their nominal length at the bit rate programmed in CNF1..3 (stuff bits are
+ *  not counted). Received frames go through masks, filters and the BUKT rollover like on the chip;
+ *  reception and transmission do not contend for the bus. A mode request in CANCTRL reaches CANSTAT
+ *  once no frame is being sent or received. The INT pin is intActive().
+ *  All public functions may be called from any thread.
+ */
+class McpEmulatorTransport : public McpTransport
+{
+public:
+    McpEmulatorTransport(INT32U osc_hz);                                // Crystal: 8000000, 16000000...
+    ~McpEmulatorTransport();
+    bool open(void);
+
+    void setLatency(const McpEmuLatency &latency);
+    void setRealTime(bool real_time);                                   // Also spend SPI time on the wall clock
+    uint64_t now(void);                                                 // Emulated time, ns
+    void advance(uint64_t ns);                                          // Let time pass without SPI traffic
+
+    bool busInject(const CanFrame &frame);                              // Another node sends frame now
+    bool busInjectAt(const CanFrame &frame, uint64_t at_ns);            // ...ends at at_ns (non-decreasing)
+    bool busPop(CanFrame &frame);                                       // Frames the controller sent
+    bool intActive(void);                                               // INT pin low
+    INT8U peekRegister(INT8U address);
+    McpEmuStats emuStats(void);
+    uint64_t bitTimeNs(void);                                           // From CNF1..3 and the crystal
+
+    static INT32U frameBits(const CanFrame &frame);
+
+protected:
+    bool doTransfer(unsigned char *buf, INT32U len);
+    bool doTransferBatch(McpSpiSegment *segments, INT32U n);
+
+private:
+    void reset(void);
+    void execute(unsigned char *buf, INT32U len);
+    INT8U readReg(INT8U address);
+    void writeReg(INT8U address, INT8U value, INT8U mask);
+    INT8U writableMask(INT8U address);
+    bool bitModifiable(INT8U address);
+    INT8U readStatus(void);
+    INT8U rxStatus(void);
+    void spend(uint64_t ns);                                            // Advance clock and run the bus
+    void step(void);
+    void startTx(uint64_t at_ns);
+    void completeTx(void);
+    void abortTx(void);
+    void applyMode(uint64_t at_ns);
+    bool accepts(INT8U rxb, const CanFrame &frame, INT8U *filhit);
+    bool filterMatch(INT8U mask_addr, INT8U filt_addr, const CanFrame &frame);
+    void receive(const CanFrame &frame);
+    void storeRx(INT8U rxb, const CanFrame &frame, INT8U filhit);
+    void overflow(INT8U eflg_bit);
+
+    pthread_mutex_t lock;
+    INT8U regs[MCP_EMU_NREGS];
+    INT32U osc_hz;
+    McpEmuLatency latency;
+    bool real_time;
+    uint64_t now_ns;
+
+    int tx_active;                                                      // TX buffer on the bus, -1 if idle
+    uint64_t tx_done_ns;
+
+    CanFrame rx_pending[MCP_EMU_BUS_QUEUE];                             // Bus -> controller
+    uint64_t rx_pending_at[MCP_EMU_BUS_QUEUE];
+    INT32U rx_pending_head;
+    INT32U rx_pending_count;
+    CanFrame bus_out[MCP_EMU_BUS_QUEUE];                                // Controller -> bus
+    INT32U bus_out_head;
+    INT32U bus_out_count;
+
+    McpEmuStats emu_stats;
+};
+
+#include "mcp_emulator_rpi.cpp"
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ *  mcp_gateway_rpi.cpp
+ *  CAN-to-CAN gateway on top of McpBusManager.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+#include <time.h>
+
+
+/*********************************************************************************************************
+** Function name:           McpGateway
+** Descriptions:            Empty routing table for the buses of manager
+*********************************************************************************************************/
+McpGateway::McpGateway(McpBusManager *manager)
+{
+    this->manager = manager;
+    n_routes      = 0;
+    memset(std_route, MCP_GW_NO_ROUTE, sizeof(std_route));
+    memset(n_ext_exact, 0, sizeof(n_ext_exact));
+    memset(n_ext_masked, 0, sizeof(n_ext_masked));
+}
+
+
+/*********************************************************************************************************
+** Function name:           addRoute
+** Descriptions:            Public function, appends route to the table. Takes effect at compile().
+*********************************************************************************************************/
+int McpGateway::addRoute(const McpGatewayRoute &route)
+{
+    if (n_routes == MCP_GW_MAX_ROUTES)
+    {
+        return -1;
+    }
+
+    routes[n_routes] = route;
+    return n_routes++;
+}
+
+
+/*********************************************************************************************************
+** Function name:           firstMatch
+** Descriptions:            First route in table order for id on bus
+*********************************************************************************************************/
+INT8U McpGateway::firstMatch(INT8U bus, INT8U ext, INT32U id)
+{
+    for (INT32U i = 0; i < n_routes; i++)
+    {
+        if (routes[i].src_bus == bus && routes[i].ext == ext && ((id ^ routes[i].id) & routes[i].mask) == 0)
+        {
+            return i;
+        }
+    }
+
+    return MCP_GW_NO_ROUTE;
+}
+
+
+/*********************************************************************************************************
+** Function name:           compile
+** Descriptions:            Public function, builds the lookup tables and installs the gateway as the
+**                          manager's hook. Standard IDs get a direct table per source bus; extended
+**                          routes with a full mask go into a sorted table (each entry already resolved
+**                          to the first matching route), the others are scanned in table order.
+*********************************************************************************************************/
+INT8U McpGateway::compile(void)
+{
+    for (INT32U i = 0; i < n_routes; i++)
+    {
+        if (routes[i].src_bus >= manager->busCount() || routes[i].dst_bus >= manager->busCount())
+        {
+#if DEBUG_MODE
+            printf("Gateway route %lu: unknown bus\r\n", (unsigned long)i);
+#endif
+            return CAN_FAIL;
+        }
+    }
+
+    for (INT8U bus = 0; bus < MCP_MAX_BUSES; bus++)
+    {
+        for (INT32U id = 0; id < MCP_GW_STD_IDS; id++)
+        {
+            std_route[bus][id] = firstMatch(bus, 0, id);
+        }
+
+        n_ext_exact[bus]  = 0;
+        n_ext_masked[bus] = 0;
+        for (INT32U i = 0; i < n_routes; i++)
+        {
+            const McpGatewayRoute &r = routes[i];
+
+            if (r.src_bus != bus || !r.ext)
+            {
+                continue;
+            }
+            if ((r.mask & 0x1FFFFFFF) != 0x1FFFFFFF)
+            {
+                ext_masked[bus][n_ext_masked[bus]++] = i;
+                continue;
+            }
+
+            INT32U id  = r.id & 0x1FFFFFFF;
+            INT32U pos = n_ext_exact[bus];
+
+            while (pos > 0 && ext_exact[bus][pos - 1].id > id)             /* insertion sort, by id        */
+            {
+                pos--;
+            }
+            if (pos > 0 && ext_exact[bus][pos - 1].id == id)
+            {
+                continue;                                               /* shadowed by an earlier route */
+            }
+            memmove(&ext_exact[bus][pos + 1], &ext_exact[bus][pos], (n_ext_exact[bus] - pos) * sizeof(ExtEntry));
+            ext_exact[bus][pos].id    = id;
+            ext_exact[bus][pos].route = firstMatch(bus, 1, id);
+            n_ext_exact[bus]++;
+        }
+    }
+
+    for (INT32U i = 0; i < n_routes; i++)
+    {
+        interval_ns[i] = routes[i].rate_hz ? 1000000000ULL / routes[i].rate_hz : 0;
+        credit_ns[i]   = interval_ns[i] * (routes[i].burst ? routes[i].burst : 1);
+        last_ns[i]     = 0;
+    }
+    for (INT32U i = 0; i < MCP_GW_MAX_ROUTES; i++)
+    {
+        stats[i].reset();
+    }
+    hist.reset();
+
+    manager->setHook(this);
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           lookup
+** Descriptions:            Route for a frame received on bus, MCP_GW_NO_ROUTE if none
+*********************************************************************************************************/
+INT8U McpGateway::lookup(INT8U bus, const CanFrame &frame)
+{
+    INT32U lo, hi, mid;
+
+    if (!frame.ext)
+    {
+        return std_route[bus][frame.id & 0x7FF];
+    }
+
+    lo = 0;
+    hi = n_ext_exact[bus];
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (ext_exact[bus][mid].id < frame.id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo < n_ext_exact[bus] && ext_exact[bus][lo].id == frame.id)
+    {
+        return ext_exact[bus][lo].route;
+    }
+
+    for (INT32U k = 0; k < n_ext_masked[bus]; k++)
+    {
+        const McpGatewayRoute &r = routes[ext_masked[bus][k]];
+
+        if (((frame.id ^ r.id) & r.mask) == 0)
+        {
+            return ext_masked[bus][k];
+        }
+    }
+
+    return MCP_GW_NO_ROUTE;
+}
+
+
+/*********************************************************************************************************
+** Function name:           admit
+** Descriptions:            Token bucket of route, in ns of credit: one frame costs 1/rate_hz, the bucket
+**                          holds burst frames. now_ns is the frame's reception timestamp.
+*********************************************************************************************************/
+bool McpGateway::admit(INT32U route, uint64_t now_ns)
+{
+    uint64_t cap;
+
+    if (interval_ns[route] == 0)
+    {
+        return true;
+    }
+
+    cap = interval_ns[route] * (routes[route].burst ? routes[route].burst : 1);
+    if (last_ns[route] != 0 && now_ns > last_ns[route])
+    {
+        credit_ns[route] += now_ns - last_ns[route];
+        if (credit_ns[route] > cap)
+        {
+            credit_ns[route] = cap;
+        }
+    }
+    last_ns[route] = now_ns;
+
+    if (credit_ns[route] < interval_ns[route])
+    {
+        return false;
+    }
+    credit_ns[route] -= interval_ns[route];
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           onReceive
+** Descriptions:            Loop thread: forwards frame along its route, the copy in the TX ring being the
+**                          only one made. Returns true when the frame is not for readFrames().
+*********************************************************************************************************/
+bool McpGateway::onReceive(INT8U bus, const CanFrame &frame)
+{
+    INT8U         r = lookup(bus, frame);
+    CanFrame      out;
+    McpRouteStats *st;
+    bool          queued;
+
+    if (r == MCP_GW_NO_ROUTE)
+    {
+        return false;
+    }
+
+    const McpGatewayRoute &route = routes[r];
+
+    if (!admit(r, frame.timestamp))
+    {
+        st = stats[r].writeBegin();
+        st->matched++;
+        st->rate_limited++;
+        stats[r].writeEnd();
+        return !route.local;
+    }
+
+    out = frame;
+    if (route.rewrite_mask)
+    {
+        out.id = (frame.id & ~route.rewrite_mask) | (route.rewrite_id & route.rewrite_mask);
+        out.id &= frame.ext ? 0x1FFFFFFF : 0x7FF;
+    }
+
+    queued = (manager->forward(route.dst_bus, out, r) == CAN_OK);
+
+    st = stats[r].writeBegin();                                         /* not held across forward()    */
+    st->matched++;
+    st->forwarded  += queued;
+    st->queue_full += !queued;
+    stats[r].writeEnd();
+
+    return !route.local;
+}
+
+
+/*********************************************************************************************************
+** Function name:           onLoaded
+** Descriptions:            Loop thread: a forwarded frame is in a TX buffer, records its latency (per
+**                          route; the route fixes the bus)
+*********************************************************************************************************/
+void McpGateway::onLoaded(INT8U, const CanFrame &frame, INT8U tag)
+{
+    uint64_t          ns, us;
+    INT32U            k = 0;
+    McpRouteStats     *st;
+    McpGatewayLatency *h;
+
+    if (tag >= n_routes)
+    {
+        return;
+    }
+
+    ns = canNowNs() - frame.timestamp;
+
+    st = stats[tag].writeBegin();
+    st->loaded++;
+    if (ns > st->latency_max_ns)
+    {
+        st->latency_max_ns = ns;
+    }
+    stats[tag].writeEnd();
+
+    for (us = ns / 1000; us != 0 && k < MCP_GW_HIST_BUCKETS - 1; us >>= 1)
+    {
+        k++;
+    }
+    h = hist.writeBegin();
+    h->buckets[k]++;
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns)
+    {
+        h->max_ns = ns;
+    }
+    hist.writeEnd();
+}
+
+
+/*********************************************************************************************************
+** Function name:           routeCount
+** Descriptions:            Public function, number of routes added
+*********************************************************************************************************/
+INT32U McpGateway::routeCount(void)
+{
+    return n_routes;
+}
+
+
+/*********************************************************************************************************
+** Function name:           routeStats
+** Descriptions:            Public function, consistent copy of the counters of route (zeros for an unknown
+**                          route). Any thread, while the manager runs.
+*********************************************************************************************************/
+McpRouteStats McpGateway::routeStats(INT32U route)
+{
+    McpRouteStats none;
+
+    if (route >= n_routes)
+    {
+        memset(&none, 0, sizeof(none));
+        return none;
+    }
+
+    return stats[route].read();
+}
+
+
+/*********************************************************************************************************
+** Function name:           latency
+** Descriptions:            Public function, consistent copy of the forward latency histogram of all routes
+*********************************************************************************************************/
+McpGatewayLatency McpGateway::latency(void)
+{
+    return hist.read();
+}
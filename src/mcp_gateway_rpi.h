@@ -0,0 +1,112 @@
+/*
+ *  mcp_gateway_rpi.h
+ *  CAN-to-CAN gateway on top of McpBusManager: a routing table (ID/mask on a source bus to a
+ *  destination bus, with an optional ID rewrite and rate limit) compiled into lookup tables and
+ *  applied in the manager's loop thread, from the RX drain straight into the destination TX ring.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_GATEWAY_RPI_H
+#define MCP_GATEWAY_RPI_H
+
+#include <stdint.h>
+
+#include "mcp_bus_manager_rpi.h"
+
+#define MCP_GW_MAX_ROUTES      32                                       /* Routes per gateway           */
+#define MCP_GW_NO_ROUTE        0xFF
+#define MCP_GW_STD_IDS         2048                                     /* 11 bit identifiers           */
+#define MCP_GW_HIST_BUCKETS    16                                       /* Latency histogram, log2 us   */
+
+struct McpGatewayRoute
+{
+    INT8U  src_bus;                                                     // Bus number in the manager
+    INT8U  ext;                                                         // Matches 0: standard, 1: ext
+    INT32U id;
+    INT32U mask;                                                        // Bits of id that must match
+    INT8U  dst_bus;
+    INT32U rewrite_mask;                                                // ID bits replaced, 0 = keep ID
+    INT32U rewrite_id;                                                  // ...by these
+    INT32U rate_hz;                                                     // Frames per second, 0 = no limit
+    INT32U burst;                                                       // Back to back frames (rate_hz)
+    INT8U  local;                                                       // Also deliver to readFrames()
+};
+
+struct McpRouteStats
+{
+    INT32U matched;                                                     // Frames that hit the route
+    INT32U forwarded;                                                   // Queued on the destination bus
+    INT32U rate_limited;                                                // Dropped by the rate limit
+    INT32U queue_full;                                                  // Dropped, destination TX ring full
+    INT32U loaded;                                                      // In a destination TX buffer
+    uint64_t latency_max_ns;
+};
+
+// Forward latency: from the frame being read on the source bus (its timestamp) to the frame being
+// loaded into a TX buffer of the destination controller. Bucket 0 counts < 1 us, bucket k counts
+// [2^(k-1), 2^k) us, the last bucket everything above.
+struct McpGatewayLatency
+{
+    INT32U buckets[MCP_GW_HIST_BUCKETS];
+    INT32U count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/*
+ *  Usage: addBus() the controllers to the manager, addRoute() every route, compile() (installs the
+ *  gateway as the manager's hook), then start the manager. The first route in table order that
+ *  matches a frame is used. Frames without a route, and routes with local set, are still delivered
+ *  to readFrames(). Routes cannot change while the manager runs.
+ */
+class McpGateway : public McpBusHook
+{
+public:
+    McpGateway(McpBusManager *manager);
+
+    int addRoute(const McpGatewayRoute &route);                         // Route number, -1 on failure
+    INT8U compile(void);                                                // CAN_OK / CAN_FAIL (bad bus)
+    INT32U routeCount(void);
+    McpRouteStats routeStats(INT32U route);                             // Consistent copy, any thread
+    McpGatewayLatency latency(void);                                    // Consistent copy, any thread
+
+    bool onReceive(INT8U bus, const CanFrame &frame);
+    void onLoaded(INT8U bus, const CanFrame &frame, INT8U tag);
+
+private:
+    struct ExtEntry
+    {
+        INT32U id;
+        INT8U route;
+    };
+
+    INT8U firstMatch(INT8U bus, INT8U ext, INT32U id);                  // Linear scan, compile() only
+    INT8U lookup(INT8U bus, const CanFrame &frame);
+    bool admit(INT32U route, uint64_t now_ns);                          // Token bucket
+
+    McpBusManager *manager;
+    McpGatewayRoute routes[MCP_GW_MAX_ROUTES];
+    CanSeqlock<McpRouteStats> stats[MCP_GW_MAX_ROUTES];                 // Loop thread writes
+    INT32U n_routes;
+
+    INT8U std_route[MCP_MAX_BUSES][MCP_GW_STD_IDS];                     // Route of every 11 bit ID
+    ExtEntry ext_exact[MCP_MAX_BUSES][MCP_GW_MAX_ROUTES];               // Full-mask ext IDs, sorted
+    INT32U n_ext_exact[MCP_MAX_BUSES];
+    INT8U ext_masked[MCP_MAX_BUSES][MCP_GW_MAX_ROUTES];                 // Other ext routes, table order
+    INT32U n_ext_masked[MCP_MAX_BUSES];
+
+    uint64_t interval_ns[MCP_GW_MAX_ROUTES];                            // Rate limit state
+    uint64_t credit_ns[MCP_GW_MAX_ROUTES];
+    uint64_t last_ns[MCP_GW_MAX_ROUTES];
+
+    CanSeqlock<McpGatewayLatency> hist;                                 // Loop thread writes
+};
+
+#include "mcp_gateway_rpi.cpp"
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ *  mcp_irq_rpi.cpp
+ *  MCP2515 INT pin sources used by the MCP_CAN receive thread.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#endif
+
+
+/*********************************************************************************************************
+** Function name:           McpGpioLine
+** Descriptions:            INT pin on line offset (BCM GPIO number) of chip, e.g. MCP_GPIO_CHIP
+*********************************************************************************************************/
+McpGpioLine::McpGpioLine(const char *chip, INT32U offset)
+{
+    this->chip   = chip;
+    this->offset = offset;
+    line_fd      = -1;
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~McpGpioLine
+** Descriptions:            Releases the line
+*********************************************************************************************************/
+McpGpioLine::~McpGpioLine()
+{
+#ifdef __linux__
+    if (line_fd >= 0)
+    {
+        close(line_fd);
+    }
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           open
+** Descriptions:            Requests the line as an input with falling edge events. The event fd is
+**                          non-blocking so readEvents() can empty it.
+*********************************************************************************************************/
+bool McpGpioLine::open(void)
+{
+#ifdef __linux__
+    int chip_fd;
+    int res;
+
+    if (line_fd >= 0)
+    {
+        return true;
+    }
+
+    chip_fd = ::open(chip, O_RDONLY | O_CLOEXEC);
+    if (chip_fd < 0)
+    {
+        printf("Can't open %s\n", chip);
+        return false;
+    }
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0]   = offset;
+    req.num_lines    = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    strncpy(req.consumer, MCP_GPIO_CONSUMER, sizeof(req.consumer) - 1);
+
+    res = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+#else
+    struct gpioevent_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffset  = offset;
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags  = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strncpy(req.consumer_label, MCP_GPIO_CONSUMER, sizeof(req.consumer_label) - 1);
+
+    res = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+#endif
+    close(chip_fd);
+
+    if (res < 0)
+    {
+        printf("Can't request GPIO %lu on %s\n", (unsigned long)offset, chip);
+        return false;
+    }
+
+    line_fd = req.fd;
+    fcntl(line_fd, F_SETFL, fcntl(line_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(line_fd, F_SETFD, FD_CLOEXEC);
+
+    printf("Interrupt GPIO %lu on %s\n", (unsigned long)offset, chip);
+    return true;
+#else
+    printf("Can't use GPIO character devices on non-Linux system");
+    return false;
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           fd
+** Descriptions:            Event file descriptor, readable while edges are queued (poll/epoll)
+*********************************************************************************************************/
+int McpGpioLine::fd(void)
+{
+    return line_fd;
+}
+
+
+/*********************************************************************************************************
+** Function name:           active
+** Descriptions:            Reads the pin level: true while INT is low. A closed line is never active.
+*********************************************************************************************************/
+bool McpGpioLine::active(void)
+{
+#ifdef __linux__
+    if (line_fd < 0)
+    {
+        return false;
+    }
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_values values;
+
+    values.bits = 0;
+    values.mask = 1;
+    if (ioctl(line_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+    {
+        return false;
+    }
+    return (values.bits & 1) == 0;
+#else
+    struct gpiohandle_data values;
+
+    if (ioctl(line_fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &values) < 0)
+    {
+        return false;
+    }
+    return values.values[0] == 0;
+#endif
+#else
+    return false;
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           readEvents
+** Descriptions:            Reads every queued edge. Returns how many there were and the kernel timestamp
+**                          of the oldest in *first_ns (left alone when there were none).
+*********************************************************************************************************/
+INT32U McpGpioLine::readEvents(uint64_t *first_ns)
+{
+    INT32U count = 0;
+
+#ifdef __linux__
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_event events[MCP_IRQ_EVENT_BATCH];
+#else
+    struct gpioevent_data events[MCP_IRQ_EVENT_BATCH];
+#endif
+    ssize_t n;
+
+    if (line_fd < 0)
+    {
+        return 0;
+    }
+
+    while ((n = read(line_fd, events, sizeof(events))) > 0)
+    {
+        if (count == 0)
+        {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+            *first_ns = events[0].timestamp_ns;
+#else
+            *first_ns = events[0].timestamp;
+#endif
+        }
+        count += n / sizeof(events[0]);
+
+        if ((size_t)n < sizeof(events))
+        {
+            break;
+        }
+    }
+#endif
+
+    return count;
+}
+
+
+/*********************************************************************************************************
+** Function name:           mcpCreateThread
+** Descriptions:            pthread_create with SCHED_FIFO priority and CPU affinity. Without CAP_SYS_NICE
+**                          the thread is created with the inherited policy instead (affinity is kept).
+*********************************************************************************************************/
+int mcpCreateThread(pthread_t *thread, void *(*entry)(void *), void *arg, int priority, int cpu)
+{
+    pthread_attr_t     attr;
+    struct sched_param param;
+    cpu_set_t          cpus;
+    int                res;
+
+    pthread_attr_init(&attr);
+    if (priority > 0)
+    {
+        param.sched_priority = priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    if (cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    res = pthread_create(thread, &attr, entry, arg);
+    if (res == EPERM && priority > 0)                                   /* no CAP_SYS_NICE: run anyway  */
+    {
+#if DEBUG_MODE
+        printf("SCHED_FIFO not permitted, using normal priority\r\n");
+#endif
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        res = pthread_create(thread, &attr, entry, arg);
+    }
+    pthread_attr_destroy(&attr);
+
+    return res;
+}
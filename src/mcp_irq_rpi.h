@@ -0,0 +1,68 @@
+/*
+ *  mcp_irq_rpi.h
+ *  MCP2515 INT pin sources used by the MCP_CAN receive thread. The GPIO line is requested through
+ *  the Linux GPIO character device, so falling edges arrive as timestamped events on a file
+ *  descriptor that can be polled, and the pin level can be read without wiringPi.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_IRQ_RPI_H
+#define MCP_IRQ_RPI_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mcp_can_dfs_rpi.h"
+
+#define MCP_GPIO_CHIP          "/dev/gpiochip0"                         /* BCM GPIOs on the Pi 3        */
+#define MCP_GPIO_CONSUMER      "mcp2515_int"                            /* Label shown by gpioinfo      */
+#define MCP_IRQ_EVENT_BATCH    16                                       /* Events read per read() call  */
+
+// The INT pin of one controller. fd() becomes readable when falling edges are queued; readEvents()
+// consumes them. Timestamps are CLOCK_MONOTONIC ns taken by the kernel when the edge happened.
+class McpIrqLine
+{
+public:
+    virtual ~McpIrqLine() {}
+
+    virtual bool open(void) = 0;                                        // Request the line
+    virtual int fd(void) = 0;                                           // Pollable, -1 if not open
+    virtual bool active(void) = 0;                                      // INT asserted (low) now
+    virtual INT32U readEvents(uint64_t *first_ns) = 0;                  // Consume queued edges, never
+                                                                        // blocks; *first_ns = oldest
+};
+
+// A BCM GPIO on a gpiochip, falling edges, input. Uses the v2 uAPI when the kernel headers have it
+// (event clock is CLOCK_MONOTONIC) and the v1 uAPI otherwise (monotonic from Linux 5.7).
+class McpGpioLine : public McpIrqLine
+{
+public:
+    McpGpioLine(const char *chip, INT32U offset);
+    ~McpGpioLine();
+
+    bool open(void);
+    int fd(void);
+    bool active(void);
+    INT32U readEvents(uint64_t *first_ns);
+
+private:
+    const char *chip;
+    INT32U offset;
+    int line_fd;
+};
+
+// Creates a thread for an interrupt loop. priority: SCHED_FIFO 1..99, 0 = inherit. cpu: -1 = any.
+// Falls back to the inherited policy when SCHED_FIFO is not permitted. Returns pthread_create's result.
+int mcpCreateThread(pthread_t *thread, void *(*entry)(void *), void *arg, int priority, int cpu);
+
+#include "mcp_irq_rpi.cpp"
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ *  mcp_protection_rpi.cpp
+ *  Protection fast path.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+/*********************************************************************************************************
+** Function name:           McpProtection
+** Descriptions:            Checks the limits of pack_stats as frames of pack arrive, stops through can
+*********************************************************************************************************/
+McpProtection::McpProtection(MCP_CAN *can, ZevaPackState *pack, ZevaPackStats *pack_stats)
+{
+    this->can        = can;
+    this->pack       = pack;
+    this->pack_stats = pack_stats;
+    line             = NULL;
+    callback         = NULL;
+    callback_ctx     = NULL;
+    wire_timeout_ns  = MCP_PROT_WIRE_TIMEOUT_US * 1000ULL;
+    latched          = false;
+    trip_cause       = 0;
+    running          = false;
+    stop_set         = false;
+    stop_id          = 0;
+    stop_ext         = 0;
+    checks.store(0);
+    line_edges.store(0);
+    pthread_mutex_init(&trip_lock, NULL);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~McpProtection
+** Descriptions:            Stops the input thread
+*********************************************************************************************************/
+McpProtection::~McpProtection()
+{
+    stop();
+    close(wake_fd);
+    pthread_mutex_destroy(&trip_lock);
+}
+
+
+/*********************************************************************************************************
+** Function name:           setStopFrame
+** Descriptions:            Public function, preloads the stop frame in the reserved TX buffer. Call again
+**                          to change it (CAN_FAIL while the previous one is still waiting for the bus).
+**                          Its ID is the one refused from a trip to rearm().
+*********************************************************************************************************/
+INT8U McpProtection::setStopFrame(const CanFrame &frame)
+{
+    McpLockGuard guard(&trip_lock);
+
+    if (can->reserveTxBuffer(frame) != CAN_OK)
+    {
+        return CAN_FAIL;
+    }
+    stop_set = true;
+    stop_id  = frame.id;
+    stop_ext = frame.ext;
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setCallback
+** Descriptions:            Public function, called once per trip
+*********************************************************************************************************/
+void McpProtection::setCallback(McpTripCallback callback, void *ctx)
+{
+    this->callback = callback;
+    callback_ctx   = ctx;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setLine
+** Descriptions:            Public function, protections input: active (low) means STOP. Set before start().
+*********************************************************************************************************/
+void McpProtection::setLine(McpIrqLine *line)
+{
+    this->line = line;
+}
+
+
+/*********************************************************************************************************
+** Function name:           setWireTimeout
+** Descriptions:            Public function, how long trip() waits for the stop frame to leave
+*********************************************************************************************************/
+void McpProtection::setWireTimeout(INT32U timeout_us)
+{
+    wire_timeout_ns = (uint64_t)timeout_us * 1000;
+}
+
+
+/*********************************************************************************************************
+** Function name:           onFrame
+** Descriptions:            Public function, decodes a BMS reply into pack, updates the analytics of its
+**                          module and trips on a violation. Trip time is the reception timestamp.
+*********************************************************************************************************/
+int McpProtection::onFrame(const CanFrame &frame)
+{
+    int   module = zevaDecode(pack, frame);
+    INT8U cause;
+
+    if (module < 0)
+    {
+        return -1;
+    }
+
+    zevaPackStatsUpdate(pack_stats, pack, module);
+    checks.fetch_add(1, std::memory_order_relaxed);
+    if (latched || zevaPackOK(pack_stats))
+    {
+        return module;
+    }
+
+    cause = violation();
+    if (cause != 0)
+    {
+        trip(cause, frame.timestamp != 0 ? frame.timestamp : canNowNs());
+    }
+
+    return module;
+}
+
+
+/*********************************************************************************************************
+** Function name:           violation
+** Descriptions:            MCP_PROT_CELLS / MCP_PROT_TEMP of the modules that have sent every reply. The
+**                          others are skipped: their missing cells read 0 mV, which is not a violation.
+*********************************************************************************************************/
+INT8U McpProtection::violation(void)
+{
+    INT8U cause = 0;
+
+    for (int m = 0; m < pack->n_modules; m++)
+    {
+        if (!zevaModuleReported(pack, m))
+        {
+            continue;
+        }
+        if (pack_stats->module[m].out_of_window != 0)
+        {
+            cause |= MCP_PROT_CELLS;
+        }
+        if (pack_stats->module_over_temp[m] != 0)
+        {
+            cause |= MCP_PROT_TEMP;
+        }
+    }
+
+    return cause;
+}
+
+
+/*********************************************************************************************************
+** Function name:           onFrameHandler
+** Descriptions:            Public function, onFrame() as a CanDispatcher handler (ctx: the protection)
+*********************************************************************************************************/
+void McpProtection::onFrameHandler(void *ctx, const CanFrame &frame)
+{
+    ((McpProtection *)ctx)->onFrame(frame);
+}
+
+
+/*********************************************************************************************************
+** Function name:           waitWire
+** Descriptions:            Polls TXB2 every MCP_PROT_WIRE_POLL_US until the stop frame is acknowledged and
+**                          records trip_ns to then. Called without trip_lock; takes it for the counters.
+*********************************************************************************************************/
+void McpProtection::waitWire(uint64_t trip_ns)
+{
+    struct timespec    pause = { 0, MCP_PROT_WIRE_POLL_US * 1000L };
+    uint64_t           deadline = canNowNs() + wire_timeout_ns;
+    uint64_t           now, latency;
+    McpProtectionStats *c;
+
+    while (can->reservedTxBusy())
+    {
+        if (canNowNs() > deadline)
+        {
+            McpLockGuard guard(&trip_lock);
+
+            counters.writeBegin()->wire_timeouts++;
+            counters.writeEnd();
+#if DEBUG_MODE
+            printf("Protection: stop frame not acknowledged...\r\n");
+#endif
+            return;
+        }
+        nanosleep(&pause, NULL);                                        /* SPI and CPU for the others   */
+    }
+
+    now     = canNowNs();
+    latency = now > trip_ns ? now - trip_ns : 0;
+
+    pthread_mutex_lock(&trip_lock);
+    c = counters.writeBegin();
+    c->latency_samples++;
+    c->latency_last_ns   = latency;
+    c->latency_total_ns += latency;
+    if (latency > c->latency_max_ns)
+    {
+        c->latency_max_ns = latency;
+    }
+    counters.writeEnd();
+    pthread_mutex_unlock(&trip_lock);
+}
+
+
+/*********************************************************************************************************
+** Function name:           trip
+** Descriptions:            Public function, fires the preloaded stop frame unless already tripped, blocks
+**                          its ID, aborts the other TX buffers and the async queue (serviceTx() reports
+**                          them from this thread), waits for the stop frame to leave and calls the
+**                          callback. trip_ns: CLOCK_MONOTONIC of the event.
+*********************************************************************************************************/
+bool McpProtection::trip(INT8U cause, uint64_t trip_ns)
+{
+    McpTripCallback cb;
+    void            *ctx;
+    bool            fired;
+
+    pthread_mutex_lock(&trip_lock);
+    if (latched)
+    {
+        pthread_mutex_unlock(&trip_lock);
+        return false;
+    }
+    latched    = true;
+    trip_cause = cause;
+
+    fired = (can->fireReservedTx() == CAN_OK);
+    if (stop_set)
+    {
+        can->blockTx(stop_id, stop_ext);                                /* nothing new behind it        */
+    }
+    can->abortTx();                                                     /* nor anything queued before   */
+    can->serviceTx();
+    if (!fired)
+    {
+        counters.writeBegin()->fire_failed++;
+    }
+    else
+    {
+        counters.writeBegin()->trips++;
+    }
+    counters.writeEnd();
+    cb  = callback;
+    ctx = callback_ctx;
+    pthread_mutex_unlock(&trip_lock);
+
+    if (fired)
+    {
+        waitWire(trip_ns);
+    }
+
+#if DEBUG_MODE
+    printf("Protection trip, cause 0x%02X\r\n", cause);
+#endif
+    if (cb != NULL)
+    {
+        cb(ctx, cause);
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           tripped
+** Descriptions:            Public function, a trip is latched
+*********************************************************************************************************/
+bool McpProtection::tripped(void)
+{
+    return latched;
+}
+
+
+/*********************************************************************************************************
+** Function name:           cause
+** Descriptions:            Public function, MCP_PROT_* bits of the latched trip (0 if none)
+*********************************************************************************************************/
+INT8U McpProtection::cause(void)
+{
+    return latched ? trip_cause : 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           rearm
+** Descriptions:            Public function, clears the latch and unblocks the stop frame's ID if every
+**                          cell is in the window, no sensor is over temperature and the input is not low
+*********************************************************************************************************/
+bool McpProtection::rearm(void)
+{
+    McpLockGuard guard(&trip_lock);
+
+    if (!zevaPackOK(pack_stats) || (line != NULL && line->active()))
+    {
+        return false;
+    }
+    latched    = false;
+    trip_cause = 0;
+    can->unblockTx();
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           lineLoop
+** Descriptions:            Input thread body: trips on a falling edge (kernel timestamp as trip time), and
+**                          on a low level found at start or after a poll timeout
+*********************************************************************************************************/
+void McpProtection::lineLoop(void)
+{
+    struct pollfd fds[2];
+    uint64_t      edge_ns, wake;
+    INT32U        edges;
+
+    fds[0].fd     = wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = line->fd();
+    fds[1].events = POLLIN;
+
+    while (running)
+    {
+        if (!latched && line->active())                                 /* low without an edge seen     */
+        {
+            trip(MCP_PROT_LINE, canNowNs());
+        }
+
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        poll(fds, 2, MCP_PROT_LINE_POLL_MS);
+
+        if (fds[0].revents & POLLIN)
+        {
+            if (read(wake_fd, &wake, sizeof(wake)) < 0)
+            {
+                wake = 0;
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            edge_ns = 0;
+            edges   = line->readEvents(&edge_ns);
+            line_edges.fetch_add(edges, std::memory_order_relaxed);
+            if (edges > 0)
+            {
+                trip(MCP_PROT_LINE, edge_ns != 0 ? edge_ns : canNowNs());
+            }
+        }
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           threadEntry
+** Descriptions:            pthread entry point of the input thread
+*********************************************************************************************************/
+void *McpProtection::threadEntry(void *arg)
+{
+    ((McpProtection *)arg)->lineLoop();
+    return NULL;
+}
+
+
+/*********************************************************************************************************
+** Function name:           start
+** Descriptions:            Public function, watches the input in its own thread. priority: SCHED_FIFO
+**                          1..99, 0 = normal. cpu: CPU to run on, -1 = any.
+*********************************************************************************************************/
+INT8U McpProtection::start(int priority, int cpu)
+{
+    if (running)
+    {
+        return CAN_OK;
+    }
+    if (line == NULL || line->fd() < 0)
+    {
+        return CAN_FAIL;
+    }
+
+    running = true;
+    if (mcpCreateThread(&thread, threadEntry, this, priority, cpu) != 0)
+    {
+        running = false;
+#if DEBUG_MODE
+        printf("Starting protection thread Failure...\r\n");
+#endif
+        return CAN_FAIL;
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           stop
+** Descriptions:            Public function, stops the input thread
+*********************************************************************************************************/
+void McpProtection::stop(void)
+{
+    uint64_t one = 1;
+
+    if (!running)
+    {
+        return;
+    }
+
+    running = false;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+    {
+        one = 0;
+    }
+    pthread_join(thread, NULL);
+}
+
+
+/*********************************************************************************************************
+** Function name:           stats
+** Descriptions:            Public function, consistent copy of the counters since construction
+*********************************************************************************************************/
+McpProtectionStats McpProtection::stats(void)
+{
+    McpProtectionStats c = counters.read();
+
+    c.checks     = checks.load(std::memory_order_relaxed);
+    c.line_edges = line_edges.load(std::memory_order_relaxed);
+
+    return c;
+}
@@ -0,0 +1,110 @@
+/*
+ *  mcp_protection_rpi.h
+ *  Protection fast path: the cell and temperature limits are checked as each BMS frame is decoded,
+ *  and the protections input (GPIO, low = STOP) is watched for its falling edge. A violation fires
+ *  a charger stop frame preloaded in the reserved TX buffer (TXB2, highest priority) with a single
+ *  RTS, and the time from the trip to the frame being acknowledged on the bus is recorded. The other
+ *  TX buffers and the async queue are aborted, and the stop frame's ID is refused by MCP_CAN until
+ *  rearm(), so no charge command queued before or after the trip follows the stop frame.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_PROTECTION_RPI_H
+#define MCP_PROTECTION_RPI_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "mcp_can_rpi.h"
+#include "zeva_bms_rpi.h"
+#include "zeva_pack_stats_rpi.h"
+
+#define MCP_PROT_CELLS         0x01                                     /* Cell outside the window      */
+#define MCP_PROT_TEMP          0x02                                     /* Sensor over temperature      */
+#define MCP_PROT_LINE          0x04                                     /* Protections input low        */
+#define MCP_PROT_MANUAL        0x08                                     /* trip() by the application    */
+#define MCP_PROT_WIRE_TIMEOUT_US 20000                                  /* Stop frame on the bus within */
+#define MCP_PROT_LINE_POLL_MS  100                                      /* Level re-check, missed edges */
+#define MCP_PROT_WIRE_POLL_US  20                                       /* TXB2 polls while waiting     */
+
+struct McpProtectionStats
+{
+    INT32U checks;                                                      // BMS frames evaluated
+    INT32U trips;                                                       // Stop frames fired
+    INT32U line_edges;                                                  // Falling edges of the input
+    INT32U fire_failed;                                                 // No stop frame preloaded
+    INT32U wire_timeouts;                                               // Not acknowledged in time
+    INT32U latency_samples;
+    uint64_t latency_last_ns;                                           // Trip -> stop frame on the bus
+    uint64_t latency_max_ns;
+    uint64_t latency_total_ns;                                          // / latency_samples = mean
+};
+
+// Called once per trip, after the stop frame is on the bus (or timed out). cause: MCP_PROT_* bits.
+typedef void (*McpTripCallback)(void *ctx, INT8U cause);
+
+/*
+ *  Usage: setStopFrame() after each MCP_CAN::begin() (it keeps TXB2 for itself), route the received
+ *  frames to onFrame() (or onFrameHandler in a CanDispatcher) and, with a protections input,
+ *  setLine() and start() its thread. A module is checked once all its replies have arrived, so a
+ *  pack still starting up does not trip. A trip latches: later violations do not fire again until
+ *  rearm(), which only succeeds while the whole pack and the input are OK. onFrame() must be called
+ *  from one thread; trip() may be called from any.
+ */
+class McpProtection
+{
+public:
+    McpProtection(MCP_CAN *can, ZevaPackState *pack, ZevaPackStats *pack_stats);
+    ~McpProtection();
+
+    INT8U setStopFrame(const CanFrame &frame);                          // Preload in TXB2
+    void setCallback(McpTripCallback callback, void *ctx);
+    void setLine(McpIrqLine *line);                                     // Protections input, caller owns it
+    void setWireTimeout(INT32U timeout_us);
+    int onFrame(const CanFrame &frame);                                 // Decode and check: module or -1
+    static void onFrameHandler(void *ctx, const CanFrame &frame);       // CanHandler, ctx = protection
+    bool trip(INT8U cause, uint64_t trip_ns);                           // true: this call fired the stop
+    bool tripped(void);
+    INT8U cause(void);                                                  // MCP_PROT_* of the latched trip
+    bool rearm(void);                                                   // false while still violated
+    INT8U start(int priority, int cpu);                                 // Thread watching the input
+    void stop(void);
+    McpProtectionStats stats(void);                                     // Consistent copy, any thread
+
+private:
+    INT8U violation(void);
+    void waitWire(uint64_t trip_ns);
+    void lineLoop(void);
+
+    static void *threadEntry(void *arg);
+
+    MCP_CAN *can;
+    ZevaPackState *pack;
+    ZevaPackStats *pack_stats;
+    McpIrqLine *line;
+    McpTripCallback callback;
+    void *callback_ctx;
+    uint64_t wire_timeout_ns;
+    pthread_mutex_t trip_lock;                                          // One trip at a time
+    volatile bool latched;
+    INT8U trip_cause;
+    CanSeqlock<McpProtectionStats> counters;                            // Trips: written under trip_lock
+    std::atomic<INT32U> checks;                                         // onFrame() thread
+    std::atomic<INT32U> line_edges;                                     // Input thread
+    bool stop_set;                                                      // stop_id / stop_ext valid
+    INT32U stop_id;                                                     // Blocked from trip to rearm
+    INT8U stop_ext;
+    int wake_fd;                                                        // eventfd: stop()
+    pthread_t thread;
+    volatile bool running;
+};
+
+#include "mcp_protection_rpi.cpp"
+
+#endif
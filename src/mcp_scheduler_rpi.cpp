@@ -0,0 +1,505 @@
+/*
+ *  mcp_scheduler_rpi.cpp
+ *  Cyclic transmit scheduler.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+
+/*********************************************************************************************************
+** Function name:           McpCyclicScheduler
+** Descriptions:            Scheduler that sends through can (its receive thread collects completions)
+*********************************************************************************************************/
+McpCyclicScheduler::McpCyclicScheduler(MCP_CAN *can)
+{
+    this->can = can;
+    manager   = NULL;
+    bus       = 0;
+    init();
+}
+
+
+/*********************************************************************************************************
+** Function name:           McpCyclicScheduler
+** Descriptions:            Scheduler that sends through bus of manager
+*********************************************************************************************************/
+McpCyclicScheduler::McpCyclicScheduler(McpBusManager *manager, INT8U bus)
+{
+    can           = NULL;
+    this->manager = manager;
+    this->bus     = bus;
+    init();
+}
+
+
+/*********************************************************************************************************
+** Function name:           init
+** Descriptions:            No messages, the timer and the wake-up eventfd
+*********************************************************************************************************/
+void McpCyclicScheduler::init(void)
+{
+    n_msgs   = 0;
+    running  = false;
+    armed    = false;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (timer_fd < 0 || wake_fd < 0)
+    {
+#if DEBUG_MODE
+        printf("Cyclic scheduler: timerfd setup Failure...\r\n");
+#endif
+    }
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~McpCyclicScheduler
+** Descriptions:            Stops the scheduler thread
+*********************************************************************************************************/
+McpCyclicScheduler::~McpCyclicScheduler()
+{
+    stop();
+    close(wake_fd);
+    close(timer_fd);
+}
+
+
+/*********************************************************************************************************
+** Function name:           pickPhase
+** Descriptions:            Phase for a new message of period_ns: of MCP_CYC_PHASES evenly spaced
+**                          candidates, the one whose releases fall within MCP_CYC_GUARD_US of the fewest
+**                          releases of the other messages (over a few of the longest periods), then the
+**                          one farthest from them
+*********************************************************************************************************/
+uint64_t McpCyclicScheduler::pickPhase(uint64_t period_ns)
+{
+    const uint64_t guard_ns  = MCP_CYC_GUARD_US * 1000ULL;
+    uint64_t       horizon   = period_ns;
+    uint64_t       best      = 0;
+    INT32U         best_hits = 0xFFFFFFFF;
+    uint64_t       best_gap  = 0;
+
+    for (INT32U i = 0; i < n_msgs; i++)
+    {
+        if (msgs[i].period_ns > horizon)
+        {
+            horizon = msgs[i].period_ns;
+        }
+    }
+    horizon *= 4;
+    if (horizon / period_ns > 1000)                                     /* bound the work per candidate */
+    {
+        horizon = period_ns * 1000;
+    }
+
+    for (INT32U c = 0; c < MCP_CYC_PHASES; c++)
+    {
+        uint64_t phase = period_ns * c / MCP_CYC_PHASES;
+        INT32U   hits  = 0;
+        uint64_t gap   = period_ns;
+
+        for (uint64_t t = phase; t < horizon; t += period_ns)
+        {
+            for (INT32U i = 0; i < n_msgs; i++)
+            {
+                const Message &m = msgs[i];
+                uint64_t       r = (t + m.period_ns - m.phase_ns % m.period_ns) % m.period_ns;
+                uint64_t       d = r < m.period_ns - r ? r : m.period_ns - r;
+
+                hits += d < guard_ns ? 1 : 0;
+                gap   = d < gap ? d : gap;
+            }
+        }
+        if (hits < best_hits || (hits == best_hits && gap > best_gap))
+        {
+            best      = phase;
+            best_hits = hits;
+            best_gap  = gap;
+        }
+    }
+
+    return best;
+}
+
+
+/*********************************************************************************************************
+** Function name:           addMessage
+** Descriptions:            Public function, sends frame every period_us, first phase_us after start()
+**                          (MCP_CYC_AUTO_PHASE: away from the releases of the messages added so far)
+*********************************************************************************************************/
+int McpCyclicScheduler::addMessage(const CanFrame &frame, INT32U period_us, INT32U phase_us)
+{
+    if (running || n_msgs == MCP_CYC_MAX_MSGS || period_us == 0 || frame.dlc > MAX_CHAR_IN_MESSAGE)
+    {
+        return -1;
+    }
+
+    Message &m = msgs[n_msgs];
+
+    m.id        = frame.id;
+    m.ext       = frame.ext;
+    m.rtr       = frame.rtr;
+    m.period_ns = (uint64_t)period_us * 1000;
+    m.phase_ns  = (phase_us == MCP_CYC_AUTO_PHASE) ? pickPhase(m.period_ns) : (uint64_t)phase_us * 1000;
+    m.seq.store(0, std::memory_order_relaxed);
+    m.stats.reset();
+    m.reset_stats.store(false, std::memory_order_relaxed);
+    n_msgs++;
+
+    updatePayload(n_msgs - 1, frame.data, frame.dlc);
+    m.last = frame;
+    return n_msgs - 1;
+}
+
+
+/*********************************************************************************************************
+** Function name:           updatePayload
+** Descriptions:            Public function, data and length of msg from its next release on. Seqlock
+**                          writer: the scheduler never waits for it and never sends a half written payload.
+*********************************************************************************************************/
+INT8U McpCyclicScheduler::updatePayload(int msg, const INT8U *data, INT8U dlc)
+{
+    uint32_t w1 = 0, w2 = 0;
+
+    if (msg < 0 || (INT32U)msg >= n_msgs || dlc > MAX_CHAR_IN_MESSAGE)
+    {
+        return CAN_FAIL;
+    }
+    for (INT8U i = 0; i < dlc; i++)
+    {
+        if (i < 4)
+        {
+            w1 |= (uint32_t)data[i] << (8 * i);
+        }
+        else
+        {
+            w2 |= (uint32_t)data[i] << (8 * (i - 4));
+        }
+    }
+
+    Message &m = msgs[msg];
+    uint32_t s = m.seq.load(std::memory_order_relaxed);
+
+    while ((s & 1) || !m.seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire))
+    {
+        s = m.seq.load(std::memory_order_relaxed);                      /* another writer: wait for it  */
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    m.words[0].store(dlc, std::memory_order_relaxed);
+    m.words[1].store(w1, std::memory_order_relaxed);
+    m.words[2].store(w2, std::memory_order_relaxed);
+    m.seq.store(s + 2, std::memory_order_release);
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readPayload
+** Descriptions:            Seqlock reader: copies the payload of msg into m.last if it can get a
+**                          consistent one within a few tries (a writer preempted halfway would keep it
+**                          busy for a whole time slice), false if m.last keeps the previous payload
+*********************************************************************************************************/
+bool McpCyclicScheduler::readPayload(Message &m)
+{
+    uint32_t s0, s1, w0, w1, w2;
+
+    for (INT32U tries = 0; tries < 16; tries++)
+    {
+        s0 = m.seq.load(std::memory_order_acquire);
+        w0 = m.words[0].load(std::memory_order_relaxed);
+        w1 = m.words[1].load(std::memory_order_relaxed);
+        w2 = m.words[2].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        s1 = m.seq.load(std::memory_order_relaxed);
+        if (s0 != s1 || (s0 & 1))
+        {
+            continue;
+        }
+
+        m.last.dlc = (INT8U)w0;
+        for (INT8U i = 0; i < 4; i++)
+        {
+            m.last.data[i]     = (INT8U)(w1 >> (8 * i));
+            m.last.data[i + 4] = (INT8U)(w2 >> (8 * i));
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           phase
+** Descriptions:            Public function, phase of msg in us (0 for an unknown message)
+*********************************************************************************************************/
+INT32U McpCyclicScheduler::phase(int msg)
+{
+    if (msg < 0 || (INT32U)msg >= n_msgs)
+    {
+        return 0;
+    }
+
+    return msgs[msg].phase_ns / 1000;
+}
+
+
+/*********************************************************************************************************
+** Function name:           send
+** Descriptions:            Queues frame on the controller or the manager's bus
+*********************************************************************************************************/
+INT8U McpCyclicScheduler::send(const CanFrame &frame)
+{
+    if (can != NULL)
+    {
+        return can->sendFrameAsync(frame);
+    }
+
+    return manager->send(bus, frame);
+}
+
+
+/*********************************************************************************************************
+** Function name:           release
+** Descriptions:            m's deadline has passed at now_ns: records how late, skips whole missed
+**                          periods, sends the current payload and moves to the next deadline
+*********************************************************************************************************/
+void McpCyclicScheduler::release(Message &m, uint64_t now_ns)
+{
+    McpCyclicStats *s;
+    uint64_t        late    = now_ns - m.deadline_ns;
+    uint64_t        skipped = 0;
+    bool            fresh, sent;
+
+    if (late >= m.period_ns)
+    {
+        skipped        = late / m.period_ns;
+        m.deadline_ns += skipped * m.period_ns;
+        late          -= skipped * m.period_ns;
+    }
+
+    fresh          = readPayload(m);
+    sent           = (send(m.last) == CAN_OK);
+    m.deadline_ns += m.period_ns;
+
+    s = m.stats.writeBegin();                                           /* not held across send()       */
+    if (m.reset_stats.exchange(false, std::memory_order_acquire))
+    {
+        *s = McpCyclicStats();
+    }
+    s->overruns += skipped;
+    s->released++;
+    s->late_total_ns += late;
+    if (s->released == 1 || late < s->late_min_ns)
+    {
+        s->late_min_ns = late;
+    }
+    if (late > s->late_max_ns)
+    {
+        s->late_max_ns = late;
+    }
+    s->stale       += !fresh;
+    s->sent        += sent;
+    s->send_failed += !sent;
+    m.stats.writeEnd();
+}
+
+
+/*********************************************************************************************************
+** Function name:           runOnce
+** Descriptions:            Public function, sleeps until the earliest deadline (absolute timer) or stop(),
+**                          then releases every message that is due. The first call fixes the time base.
+**                          Returns the number of releases, -1 on error.
+*********************************************************************************************************/
+int McpCyclicScheduler::runOnce(void)
+{
+    struct itimerspec timer;
+    struct pollfd     fds[2];
+    uint64_t          next, now, count;
+    int               released = 0;
+
+    if (n_msgs == 0 || timer_fd < 0)
+    {
+        return -1;
+    }
+
+    if (!armed)
+    {
+        now = canNowNs();
+        for (INT32U i = 0; i < n_msgs; i++)
+        {
+            msgs[i].deadline_ns = now + msgs[i].phase_ns;
+        }
+        armed = true;
+    }
+
+    next = msgs[0].deadline_ns;
+    for (INT32U i = 1; i < n_msgs; i++)
+    {
+        next = msgs[i].deadline_ns < next ? msgs[i].deadline_ns : next;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec  = next / 1000000000ULL;
+    timer.it_value.tv_nsec = next % 1000000000ULL;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+    {
+        return -1;
+    }
+
+    fds[0].fd      = timer_fd;
+    fds[0].events  = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd      = wake_fd;
+    fds[1].events  = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0)
+    {
+        return -1;
+    }
+    if (fds[1].revents & POLLIN)
+    {
+        if (read(wake_fd, &count, sizeof(count)) < 0)
+        {
+            count = 0;
+        }
+    }
+    if (!(fds[0].revents & POLLIN))
+    {
+        return 0;
+    }
+    if (read(timer_fd, &count, sizeof(count)) < 0)
+    {
+        count = 0;
+    }
+
+    now = canNowNs();
+    for (INT32U i = 0; i < n_msgs; i++)
+    {
+        if (msgs[i].deadline_ns <= now)
+        {
+            release(msgs[i], now);
+            released++;
+        }
+    }
+
+    return released;
+}
+
+
+/*********************************************************************************************************
+** Function name:           threadEntry
+** Descriptions:            pthread entry point of the scheduler thread
+*********************************************************************************************************/
+void *McpCyclicScheduler::threadEntry(void *arg)
+{
+    McpCyclicScheduler *sched = (McpCyclicScheduler *)arg;
+
+    while (sched->running)
+    {
+        if (sched->runOnce() < 0)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/*********************************************************************************************************
+** Function name:           start
+** Descriptions:            Public function, runs the scheduler in its own thread; deadlines count from
+**                          now. priority: SCHED_FIFO 1..99, 0 = normal. cpu: CPU to run on, -1 = any.
+*********************************************************************************************************/
+INT8U McpCyclicScheduler::start(int priority, int cpu)
+{
+    if (running)
+    {
+        return CAN_OK;
+    }
+    if (n_msgs == 0)
+    {
+        return CAN_FAIL;
+    }
+
+    running = true;
+    armed   = false;
+    if (mcpCreateThread(&thread, threadEntry, this, priority, cpu) != 0)
+    {
+        running = false;
+#if DEBUG_MODE
+        printf("Starting cyclic scheduler thread Failure...\r\n");
+#endif
+        return CAN_FAIL;
+    }
+
+    return CAN_OK;
+}
+
+
+/*********************************************************************************************************
+** Function name:           stop
+** Descriptions:            Public function, stops the scheduler thread. Frames already queued are sent.
+*********************************************************************************************************/
+void McpCyclicScheduler::stop(void)
+{
+    uint64_t one = 1;
+
+    if (!running)
+    {
+        return;
+    }
+
+    running = false;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+    {
+        one = 0;
+    }
+    pthread_join(thread, NULL);
+    armed = false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           stats
+** Descriptions:            Public function, consistent copy of the counters of msg (zeros for an unknown
+**                          message). Any thread, while the scheduler runs.
+*********************************************************************************************************/
+McpCyclicStats McpCyclicScheduler::stats(int msg)
+{
+    McpCyclicStats none;
+
+    if (msg < 0 || (INT32U)msg >= n_msgs || msgs[msg].reset_stats.load(std::memory_order_acquire))
+    {
+        memset(&none, 0, sizeof(none));
+        return none;
+    }
+
+    return msgs[msg].stats.read();
+}
+
+
+/*********************************************************************************************************
+** Function name:           resetStats
+** Descriptions:            Public function, zeroes the counters of every message. The scheduler thread is
+**                          their only writer: it clears them at the next release, stats() reads zeros
+**                          until then.
+*********************************************************************************************************/
+void McpCyclicScheduler::resetStats(void)
+{
+    for (INT32U i = 0; i < n_msgs; i++)
+    {
+        msgs[i].reset_stats.store(true, std::memory_order_release);
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ *  mcp_scheduler_rpi.h
+ *  Cyclic transmit scheduler: frames registered with a period and a phase are queued for
+ *  transmission from one thread that sleeps on absolute deadlines (timerfd, CLOCK_MONOTONIC), so the
+ *  periods do not drift with processing time. Payloads can be changed at any time without a lock,
+ *  and every message keeps release jitter and overrun counters.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_SCHEDULER_RPI_H
+#define MCP_SCHEDULER_RPI_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "mcp_bus_manager_rpi.h"
+
+#define MCP_CYC_MAX_MSGS       64                                       /* Messages per scheduler       */
+#define MCP_CYC_AUTO_PHASE     0xFFFFFFFF                               /* addMessage(): pick the phase */
+#define MCP_CYC_PHASES         32                                       /* Candidates tried per period  */
+#define MCP_CYC_GUARD_US       500                                      /* Releases closer than this    */
+                                                                        /* count as a burst             */
+
+struct McpCyclicStats
+{
+    INT32U released;                                                    // Deadlines reached
+    INT32U sent;                                                        // Queued for transmission
+    INT32U send_failed;                                                 // TX queue full
+    INT32U stale;                                                       // Sent with the previous payload
+    INT32U overruns;                                                    // Whole periods skipped
+    uint64_t late_min_ns;                                               // Release time - deadline
+    uint64_t late_max_ns;
+    uint64_t late_total_ns;                                             // / released = mean
+};
+
+/*
+ *  Usage: addMessage() every frame, then start() (or call runOnce() from your own loop). The
+ *  scheduler sends through MCP_CAN::sendFrameAsync(), whose completions the receive thread
+ *  collects, or through McpBusManager::send(). Deadlines of a message are start + phase + k * period;
+ *  a release later than a whole period skips the missed deadlines (counted as overruns) instead of
+ *  sending a burst. updatePayload() may be called from any thread while the scheduler runs (a
+ *  release that finds an update in progress sends the previous payload); messages cannot be added then.
+ */
+class McpCyclicScheduler
+{
+public:
+    McpCyclicScheduler(MCP_CAN *can);
+    McpCyclicScheduler(McpBusManager *manager, INT8U bus);
+    ~McpCyclicScheduler();
+
+    int addMessage(const CanFrame &frame, INT32U period_us,             // Message number, -1 on failure
+                   INT32U phase_us);                                    // or MCP_CYC_AUTO_PHASE
+    INT8U updatePayload(int msg, const INT8U *data, INT8U dlc);         // CAN_OK / CAN_FAIL
+    INT32U phase(int msg);                                              // us, after automatic placement
+    INT8U start(int priority, int cpu);                                 // Scheduler thread
+    void stop(void);
+    int runOnce(void);                                                  // Sleep to the next deadline, send
+    McpCyclicStats stats(int msg);
+    void resetStats(void);
+
+private:
+    struct Message
+    {
+        INT32U id;
+        INT8U ext;
+        INT8U rtr;
+        uint64_t period_ns;
+        uint64_t phase_ns;
+        uint64_t deadline_ns;                                           // Next release, absolute
+        std::atomic<uint32_t> seq;                                      // Seqlock: odd while written
+        std::atomic<uint32_t> words[3];                                 // dlc, data[0..3], data[4..7]
+        CanFrame last;                                                  // Last consistent read
+        CanSeqlock<McpCyclicStats> stats;                               // Scheduler thread writes
+        std::atomic<bool> reset_stats;                                  // resetStats(), applied by it
+    };
+
+    void init(void);
+    uint64_t pickPhase(uint64_t period_ns);
+    bool readPayload(Message &m);
+    INT8U send(const CanFrame &frame);
+    void release(Message &m, uint64_t now_ns);
+
+    static void *threadEntry(void *arg);
+
+    MCP_CAN *can;
+    McpBusManager *manager;
+    INT8U bus;
+    Message msgs[MCP_CYC_MAX_MSGS];
+    INT32U n_msgs;
+    int timer_fd;
+    int wake_fd;                                                        // eventfd: stop()
+    pthread_t thread;
+    volatile bool running;
+    bool armed;                                                         // Deadlines set from a start
+};
+
+#include "mcp_scheduler_rpi.cpp"
+
+#endif
@@ -0,0 +1,571 @@
+/*
+ *  mcp_transport_rpi.cpp
+ *  SPI transports used by MCP_CAN to talk to the MCP2515.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#endif
+
+
+/*********************************************************************************************************
+** Function name:           McpTransport
+** Descriptions:            Base transport, zeroes the statistics
+*********************************************************************************************************/
+McpTransport::McpTransport()
+{
+    resetStats();
+}
+
+
+/*********************************************************************************************************
+** Function name:           transfer
+** Descriptions:            Performs one chip-select window. false if the backend failed.
+*********************************************************************************************************/
+bool McpTransport::transfer(unsigned char *buf, INT32U len)
+{
+    spi_stats.transactions++;
+    spi_stats.bytes += len;
+    return doTransfer(buf, len);
+}
+
+
+/*********************************************************************************************************
+** Function name:           transferBatch
+** Descriptions:            Performs n chip-select windows, in order. false if the backend failed.
+*********************************************************************************************************/
+bool McpTransport::transferBatch(McpSpiSegment *segments, INT32U n)
+{
+    for (INT32U i = 0; i < n; i++)
+    {
+        spi_stats.transactions++;
+        spi_stats.bytes += segments[i].len;
+    }
+    return doTransferBatch(segments, n);
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransferBatch
+** Descriptions:            Default batch: one doTransfer per segment, stops at the first failure
+*********************************************************************************************************/
+bool McpTransport::doTransferBatch(McpSpiSegment *segments, INT32U n)
+{
+    for (INT32U i = 0; i < n; i++)
+    {
+        if (!doTransfer(segments[i].buf, segments[i].len))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           stats
+** Descriptions:            Returns the transaction, byte and submit counters
+*********************************************************************************************************/
+const McpSpiStats &McpTransport::stats(void) const
+{
+    return spi_stats;
+}
+
+
+/*********************************************************************************************************
+** Function name:           resetStats
+** Descriptions:            Zeroes the counters
+*********************************************************************************************************/
+void McpTransport::resetStats(void)
+{
+    spi_stats.transactions = 0;
+    spi_stats.bytes        = 0;
+    spi_stats.submits      = 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           McpWiringPiTransport
+** Descriptions:            wiringPi SPI channel 0 or 1
+*********************************************************************************************************/
+McpWiringPiTransport::McpWiringPiTransport(int spi_channel, int spi_baudrate)
+{
+    this->spi_channel  = spi_channel;
+    this->spi_baudrate = spi_baudrate;
+
+    delay_spi_can.tv_sec  = 0;
+    delay_spi_can.tv_nsec = 5000L; // wait 5 microseconds between 2 spi transfers
+}
+
+
+/*********************************************************************************************************
+** Function name:           open
+** Descriptions:            Setups spi communication on Raspberry Pi (using wiringPi)
+*********************************************************************************************************/
+bool McpWiringPiTransport::open(void)
+{
+#ifdef __arm__
+    int result_spi = wiringPiSPISetup(spi_channel, spi_baudrate);
+    printf("Started SPI : %d\n", result_spi);
+    if (result_spi < 0)
+    {
+        return false;
+    }
+    nanosleep((const struct timespec[]){ { 0, 500000L } }, NULL);
+    return true;
+#else
+    printf("Can't use SPI on non-ARM processor");
+    return false;
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransfer
+** Descriptions:            Performs a spi transfer on Raspberry Pi (using wiringPi)
+*********************************************************************************************************/
+bool McpWiringPiTransport::doTransfer(unsigned char *buf, INT32U len)
+{
+    bool ok = true;
+
+    spi_stats.submits++;
+#ifdef __arm__
+    digitalWrite(16, LOW);
+    ok = wiringPiSPIDataRW(spi_channel, buf, len) >= 0;
+    nanosleep(&delay_spi_can, (struct timespec *)NULL);
+    digitalWrite(16, HIGH);
+#endif
+
+    return ok;
+}
+
+
+/*********************************************************************************************************
+** Function name:           McpSpidevTransport
+** Descriptions:            device: "/dev/spidev0.0", speed_hz: SPI clock, cs_delay_us: CS high time
+**                          inserted between the segments of a batch
+*********************************************************************************************************/
+McpSpidevTransport::McpSpidevTransport(const char *device, INT32U speed_hz, INT32U cs_delay_us)
+{
+    this->device      = device;
+    this->speed_hz    = speed_hz;
+    this->cs_delay_us = cs_delay_us;
+    fd = -1;
+}
+
+
+/*********************************************************************************************************
+** Function name:           ~McpSpidevTransport
+** Descriptions:            Closes the spidev file descriptor
+*********************************************************************************************************/
+McpSpidevTransport::~McpSpidevTransport()
+{
+#ifdef __linux__
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           open
+** Descriptions:            Opens the spidev node in SPI mode 0, 8 bits per word
+*********************************************************************************************************/
+bool McpSpidevTransport::open(void)
+{
+#ifdef __linux__
+    uint8_t  mode  = SPI_MODE_0;
+    uint8_t  bits  = 8;
+    uint32_t speed = speed_hz;
+
+    fd = ::open(device, O_RDWR);
+    if (fd < 0)
+    {
+        printf("Can't open %s\n", device);
+        return false;
+    }
+
+    if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+    {
+        printf("Can't configure %s\n", device);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    printf("Started SPI : %s\n", device);
+    return true;
+#else
+    printf("Can't use spidev on non-Linux system");
+    return false;
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransfer
+** Descriptions:            One chip-select window, one ioctl
+*********************************************************************************************************/
+bool McpSpidevTransport::doTransfer(unsigned char *buf, INT32U len)
+{
+    McpSpiSegment segment = { buf, len };
+
+    return doTransferBatch(&segment, 1);
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransferBatch
+** Descriptions:            Submits up to MCP_SPI_MAX_SEGMENTS chip-select windows per SPI_IOC_MESSAGE.
+**                          false if an ioctl failed: the windows after it are not sent.
+*********************************************************************************************************/
+bool McpSpidevTransport::doTransferBatch(McpSpiSegment *segments, INT32U n)
+{
+#ifdef __linux__
+    struct spi_ioc_transfer xfer[MCP_SPI_MAX_SEGMENTS];
+
+    while (n > 0)
+    {
+        INT32U count = (n > MCP_SPI_MAX_SEGMENTS) ? MCP_SPI_MAX_SEGMENTS : n;
+
+        for (INT32U i = 0; i < count; i++)
+        {
+            memset(&xfer[i], 0, sizeof(xfer[i]));
+            xfer[i].tx_buf        = (unsigned long)segments[i].buf;
+            xfer[i].rx_buf        = (unsigned long)segments[i].buf;
+            xfer[i].len           = segments[i].len;
+            xfer[i].speed_hz      = speed_hz;
+            xfer[i].bits_per_word = 8;
+            if (i + 1 < count)                                          /* release CS before the next   */
+            {
+                xfer[i].cs_change   = 1;
+                xfer[i].delay_usecs = cs_delay_us;
+            }
+        }
+
+        // SPI_IOC_MESSAGE(count) with a run-time count
+        if (ioctl(fd, _IOC(_IOC_WRITE, SPI_IOC_MAGIC, 0, count * sizeof(struct spi_ioc_transfer)), xfer) < 0)
+        {
+#if DEBUG_MODE
+            printf("SPI_IOC_MESSAGE failed on %s\r\n", device);
+#endif
+            spi_stats.submits++;
+            return false;
+        }
+        spi_stats.submits++;
+
+        segments += count;
+        n        -= count;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+/*********************************************************************************************************
+** Function name:           McpFakeTransport
+** Descriptions:            handler(ctx, buf, len) plays the part of the MCP2515
+*********************************************************************************************************/
+McpFakeTransport::McpFakeTransport(McpFakeSpiHandler handler, void *ctx)
+{
+    this->handler = handler;
+    this->ctx     = ctx;
+}
+
+
+/*********************************************************************************************************
+** Function name:           open
+** Descriptions:            Nothing to set up
+*********************************************************************************************************/
+bool McpFakeTransport::open(void)
+{
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           doTransfer
+** Descriptions:            Passes the window to the handler
+*********************************************************************************************************/
+bool McpFakeTransport::doTransfer(unsigned char *buf, INT32U len)
+{
+    spi_stats.submits++;
+    if (handler != NULL)
+    {
+        handler(ctx, buf, len);
+    }
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           McpTransaction
+** Descriptions:            Empty transaction
+*********************************************************************************************************/
+McpTransaction::McpTransaction()
+{
+    clear();
+}
+
+
+/*********************************************************************************************************
+** Function name:           clear
+** Descriptions:            Drops every queued operation
+*********************************************************************************************************/
+void McpTransaction::clear(void)
+{
+    used       = 0;
+    n_segments = 0;
+    n_reads    = 0;
+    overflow   = false;
+}
+
+
+/*********************************************************************************************************
+** Function name:           append
+** Descriptions:            Reserves a new chip-select window of len bytes, NULL if full
+*********************************************************************************************************/
+unsigned char *McpTransaction::append(INT32U len)
+{
+    unsigned char *buf;
+
+    if (used + len > MCP_TXN_MAX_BYTES || n_segments == MCP_SPI_MAX_SEGMENTS)
+    {
+        overflow = true;
+        return NULL;
+    }
+
+    buf = &arena[used];
+    segments[n_segments].buf = buf;
+    segments[n_segments].len = len;
+    n_segments++;
+    used += len;
+
+    return buf;
+}
+
+
+/*********************************************************************************************************
+** Function name:           command
+** Descriptions:            Single byte instruction
+*********************************************************************************************************/
+bool McpTransaction::command(INT8U instruction)
+{
+    unsigned char *buf = append(1);
+
+    if (buf == NULL)
+    {
+        return false;
+    }
+    buf[0] = instruction;
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readStatus
+** Descriptions:            READ STATUS, result stored in *out by submit()
+*********************************************************************************************************/
+bool McpTransaction::readStatus(INT8U *out)
+{
+    return readInstruction(MCP_READ_STATUS, out, 1);
+}
+
+
+/*********************************************************************************************************
+** Function name:           readInstruction
+** Descriptions:            Instruction followed by n bytes clocked in (READ RX BUFFER, RX STATUS...),
+**                          stored in out[0..n-1] by submit()
+*********************************************************************************************************/
+bool McpTransaction::readInstruction(INT8U instruction, INT8U *out, INT8U n)
+{
+    unsigned char *buf;
+
+    if (n_reads == MCP_TXN_MAX_READS || (buf = append(1 + n)) == NULL)
+    {
+        overflow = true;
+        return false;
+    }
+    buf[0] = instruction;
+    memset(&buf[1], 0, n);
+
+    reads[n_reads].out    = out;
+    reads[n_reads].offset = (buf - arena) + 1;
+    reads[n_reads].len    = n;
+    n_reads++;
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           readRegister
+** Descriptions:            Read data register, result stored in *out by submit()
+*********************************************************************************************************/
+bool McpTransaction::readRegister(INT8U address, INT8U *out)
+{
+    return readRegisters(address, out, 1);
+}
+
+
+/*********************************************************************************************************
+** Function name:           readRegisters
+** Descriptions:            Reads successive data registers into out[0..n-1] on submit()
+*********************************************************************************************************/
+bool McpTransaction::readRegisters(INT8U address, INT8U *out, INT8U n)
+{
+    unsigned char *buf;
+
+    if (n_reads == MCP_TXN_MAX_READS || (buf = append(2 + n)) == NULL)
+    {
+        overflow = true;
+        return false;
+    }
+    buf[0] = MCP_READ;
+    buf[1] = address;
+    memset(&buf[2], 0, n);
+
+    reads[n_reads].out    = out;
+    reads[n_reads].offset = (buf - arena) + 2;
+    reads[n_reads].len    = n;
+    n_reads++;
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           writeRegister
+** Descriptions:            Sets data register
+*********************************************************************************************************/
+bool McpTransaction::writeRegister(INT8U address, INT8U value)
+{
+    return writeRegisters(address, &value, 1);
+}
+
+
+/*********************************************************************************************************
+** Function name:           writeRegisters
+** Descriptions:            Sets successive data registers
+*********************************************************************************************************/
+bool McpTransaction::writeRegisters(INT8U address, const INT8U *values, INT8U n)
+{
+    unsigned char *buf = append(2 + n);
+
+    if (buf == NULL)
+    {
+        return false;
+    }
+    buf[0] = MCP_WRITE;
+    buf[1] = address;
+    memcpy(&buf[2], values, n);
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           fillRegisters
+** Descriptions:            Sets n successive data registers to the same value
+*********************************************************************************************************/
+bool McpTransaction::fillRegisters(INT8U address, INT8U value, INT8U n)
+{
+    unsigned char *buf = append(2 + n);
+
+    if (buf == NULL)
+    {
+        return false;
+    }
+    buf[0] = MCP_WRITE;
+    buf[1] = address;
+    memset(&buf[2], value, n);
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           modifyRegister
+** Descriptions:            Sets specific bits of a register
+*********************************************************************************************************/
+bool McpTransaction::modifyRegister(INT8U address, INT8U mask, INT8U data)
+{
+    unsigned char *buf = append(4);
+
+    if (buf == NULL)
+    {
+        return false;
+    }
+    buf[0] = MCP_BITMOD;
+    buf[1] = address;
+    buf[2] = mask;
+    buf[3] = data;
+
+    return true;
+}
+
+
+/*********************************************************************************************************
+** Function name:           segmentCount
+** Descriptions:            Number of chip-select windows queued
+*********************************************************************************************************/
+INT32U McpTransaction::segmentCount(void) const
+{
+    return n_segments;
+}
+
+
+/*********************************************************************************************************
+** Function name:           submit
+** Descriptions:            Performs every queued operation in one batch, stores the reads and clears the
+**                          transaction. Nothing is sent if an operation did not fit. false on either
+**                          failure; the reads are not stored if the transport failed.
+*********************************************************************************************************/
+bool McpTransaction::submit(McpTransport *transport)
+{
+    if (overflow)
+    {
+#if DEBUG_MODE
+        printf("SPI transaction overflow\r\n");
+#endif
+        clear();
+        return false;
+    }
+
+    if (n_segments > 0 && !transport->transferBatch(segments, n_segments))
+    {
+#if DEBUG_MODE
+        printf("SPI transfer failed\r\n");
+#endif
+        clear();
+        return false;
+    }
+
+    for (INT32U i = 0; i < n_reads; i++)
+    {
+        memcpy(reads[i].out, &arena[reads[i].offset], reads[i].len);
+    }
+
+    clear();
+    return true;
+}
@@ -0,0 +1,160 @@
+/*
+ *  mcp_transport_rpi.h
+ *  SPI transports used by MCP_CAN to talk to the MCP2515: wiringPi (default), Linux spidev and an
+ *  in-process fake for builds without SPI hardware.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef MCP_TRANSPORT_RPI_H
+#define MCP_TRANSPORT_RPI_H
+
+#ifdef __arm__
+#include <wiringPi.h>
+#include <wiringPiSPI.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+
+#include "mcp_can_dfs_rpi.h"
+
+#define MCP_SPI_MAX_SEGMENTS   64                                       /* Segments per batched submit  */
+#define MCP_TXN_MAX_BYTES      512                                      /* Bytes per McpTransaction     */
+#define MCP_TXN_MAX_READS      16                                       /* Reads per McpTransaction     */
+
+// One chip-select window. buf is sent and overwritten with the received bytes (full duplex).
+struct McpSpiSegment
+{
+    unsigned char *buf;
+    INT32U        len;
+};
+
+struct McpSpiStats
+{
+    INT32U transactions;                                                // Chip-select windows
+    INT32U bytes;                                                       // Bytes clocked
+    INT32U submits;                                                     // Calls into the OS / backend
+};
+
+class McpTransport
+{
+public:
+    McpTransport();
+    virtual ~McpTransport() {}
+
+    virtual bool open(void) = 0;                                        // Prepare the SPI peripheral
+
+    bool transfer(unsigned char *buf, INT32U len);                      // One chip-select window
+    bool transferBatch(McpSpiSegment *segments, INT32U n);              // n windows, one submit if possible
+
+    const McpSpiStats &stats(void) const;
+    void resetStats(void);
+
+protected:
+    virtual bool doTransfer(unsigned char *buf, INT32U len) = 0;        // false: the transfer failed
+    virtual bool doTransferBatch(McpSpiSegment *segments, INT32U n);    // Default: one doTransfer each
+
+    McpSpiStats spi_stats;
+};
+
+// wiringPiSPIDataRW with the chip select handled by the SPI driver and a fixed pause after each
+// transfer. This is what MCP_CAN used before transports existed.
+class McpWiringPiTransport : public McpTransport
+{
+public:
+    McpWiringPiTransport(int spi_channel, int spi_baudrate);
+    bool open(void);
+
+protected:
+    bool doTransfer(unsigned char *buf, INT32U len);
+
+private:
+    int spi_channel;
+    int spi_baudrate;
+    struct timespec delay_spi_can;
+};
+
+// /dev/spidevX.Y. A batch is submitted as one SPI_IOC_MESSAGE ioctl with cs_change between segments.
+class McpSpidevTransport : public McpTransport
+{
+public:
+    McpSpidevTransport(const char *device, INT32U speed_hz, INT32U cs_delay_us);
+    ~McpSpidevTransport();
+    bool open(void);
+
+protected:
+    bool doTransfer(unsigned char *buf, INT32U len);
+    bool doTransferBatch(McpSpiSegment *segments, INT32U n);
+
+private:
+    const char *device;
+    INT32U speed_hz;
+    INT32U cs_delay_us;                                                 // CS high time between segments
+    int fd;
+};
+
+// Hands every transfer to a function in the same process (simulators, throughput measurements).
+typedef void (*McpFakeSpiHandler)(void *ctx, unsigned char *buf, INT32U len);
+
+class McpFakeTransport : public McpTransport
+{
+public:
+    McpFakeTransport(McpFakeSpiHandler handler, void *ctx);
+    bool open(void);
+
+protected:
+    bool doTransfer(unsigned char *buf, INT32U len);
+
+private:
+    McpFakeSpiHandler handler;
+    void *ctx;
+};
+
+// Collects MCP2515 register operations and submits them as one batched transfer. Each operation is
+// its own chip-select window; read results are copied to the given out-pointers by submit().
+class McpTransaction
+{
+public:
+    McpTransaction();
+
+    void clear(void);
+    bool command(INT8U instruction);                                    // RESET, RTS...
+    bool readStatus(INT8U *out);
+    bool readInstruction(INT8U instruction, INT8U *out, INT8U n);      // READ RX, RX STATUS...
+    bool readRegister(INT8U address, INT8U *out);
+    bool readRegisters(INT8U address, INT8U *out, INT8U n);
+    bool writeRegister(INT8U address, INT8U value);
+    bool writeRegisters(INT8U address, const INT8U *values, INT8U n);
+    bool modifyRegister(INT8U address, INT8U mask, INT8U data);
+    bool fillRegisters(INT8U address, INT8U value, INT8U n);            // n times value from address
+
+    INT32U segmentCount(void) const;
+    bool submit(McpTransport *transport);                               // false: did not fit or SPI failed
+
+private:
+    unsigned char *append(INT32U len);
+
+    struct PendingRead
+    {
+        INT8U  *out;
+        INT32U offset;
+        INT32U len;
+    };
+
+    unsigned char arena[MCP_TXN_MAX_BYTES];
+    INT32U used;
+    McpSpiSegment segments[MCP_SPI_MAX_SEGMENTS];
+    INT32U n_segments;
+    PendingRead reads[MCP_TXN_MAX_READS];
+    INT32U n_reads;
+    bool overflow;
+};
+
+#include "mcp_transport_rpi.cpp"
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ *  zeva_bms_rpi.h
+ *  Decoder for the reply frames of ZEVA BMS modules into a structure-of-arrays pack state: all cell
+ *  voltages in one contiguous array, all temperatures in another, so pack analytics can scan them
+ *  linearly. Module n replies with IDs 300 + 10n + 1..3 (cells 4k..4k+3, big endian mV, 8 bytes)
+ *  and 300 + 10n + 4 (two temperatures, degrees C + 40). The modules answer in the frame format of
+ *  the query (MCP_CAN::queryBMS() sends extended frames), so both formats are decoded. CPU only,
+ *  like can_codec_rpi.h.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef ZEVA_BMS_RPI_H
+#define ZEVA_BMS_RPI_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "can_codec_rpi.h"
+
+#define ZEVA_MAX_MODULES       16
+#define ZEVA_CELLS             12                                       /* Per module                   */
+#define ZEVA_TEMPS             2                                        /* Per module                   */
+#define ZEVA_BASE_ID           300
+#define ZEVA_ID_SPAN           (ZEVA_MAX_MODULES * 10)                  /* IDs 300..459                 */
+#define ZEVA_TEMP_OFFSET       40
+#define ZEVA_NO_SLOT           0xFF
+#define ZEVA_REPLIES_ALL       0x0F                                     /* seen: cells 0..11 and temps  */
+
+struct ZevaPackState
+{
+    uint16_t cell_mv[ZEVA_MAX_MODULES * ZEVA_CELLS];                    // Module n: [n * ZEVA_CELLS ...]
+    int8_t   temp_c[ZEVA_MAX_MODULES * ZEVA_TEMPS];                     // Module n: [n * ZEVA_TEMPS ...]
+    uint32_t seq[ZEVA_MAX_MODULES];                                     // +1 per decoded frame of module
+    uint8_t  seen[ZEVA_MAX_MODULES];                                    // Replies received, bit per reply
+    uint8_t  n_modules;
+};
+
+// ID - ZEVA_BASE_ID -> module << 2 | reply (0..2 cells, 3 temperatures), ZEVA_NO_SLOT for the query
+// ID and the unused IDs of each block of ten
+#define ZEVA_SLOT_ROW(m)       ZEVA_NO_SLOT, (m) << 2, (m) << 2 | 1, (m) << 2 | 2, (m) << 2 | 3, \
+                               ZEVA_NO_SLOT, ZEVA_NO_SLOT, ZEVA_NO_SLOT, ZEVA_NO_SLOT, ZEVA_NO_SLOT
+
+static const uint8_t zevaSlot[ZEVA_ID_SPAN] = {
+    ZEVA_SLOT_ROW(0),  ZEVA_SLOT_ROW(1),  ZEVA_SLOT_ROW(2),  ZEVA_SLOT_ROW(3),
+    ZEVA_SLOT_ROW(4),  ZEVA_SLOT_ROW(5),  ZEVA_SLOT_ROW(6),  ZEVA_SLOT_ROW(7),
+    ZEVA_SLOT_ROW(8),  ZEVA_SLOT_ROW(9),  ZEVA_SLOT_ROW(10), ZEVA_SLOT_ROW(11),
+    ZEVA_SLOT_ROW(12), ZEVA_SLOT_ROW(13), ZEVA_SLOT_ROW(14), ZEVA_SLOT_ROW(15),
+};
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackInit
+** Descriptions:            Empty pack state for n_modules modules
+*********************************************************************************************************/
+static inline void zevaPackInit(ZevaPackState *pack, INT8U n_modules)
+{
+    memset(pack, 0, sizeof(*pack));
+    pack->n_modules = n_modules > ZEVA_MAX_MODULES ? ZEVA_MAX_MODULES : n_modules;
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaDecode
+** Descriptions:            Decodes one reply frame into pack. Returns the module, -1 if the frame is not
+**                          a reply of a module in the pack, is a remote frame or is too short for its
+**                          reply (pack untouched).
+*********************************************************************************************************/
+static inline int zevaDecode(ZevaPackState *pack, const CanFrame &frame)
+{
+    uint32_t     off = (uint32_t)frame.id - ZEVA_BASE_ID;             /* below the base: wraps         */
+    const INT8U *d   = frame.data;
+    uint8_t      s;
+    uint32_t     module, reply;
+
+    if (frame.rtr || off >= ZEVA_ID_SPAN)
+    {
+        return -1;
+    }
+    s      = zevaSlot[off];
+    module = s >> 2;                                                    /* ZEVA_NO_SLOT: 63, rejected   */
+    reply  = s & 0x03;
+    if (module >= pack->n_modules || (reply < 3 ? frame.dlc != 8 : frame.dlc < ZEVA_TEMPS))
+    {
+        return -1;
+    }
+
+    if (reply < 3)
+    {
+        uint16_t *cell = &pack->cell_mv[module * ZEVA_CELLS + reply * 4];
+
+        cell[0] = (uint16_t)(d[0] << 8 | d[1]);
+        cell[1] = (uint16_t)(d[2] << 8 | d[3]);
+        cell[2] = (uint16_t)(d[4] << 8 | d[5]);
+        cell[3] = (uint16_t)(d[6] << 8 | d[7]);
+    }
+    else
+    {
+        int8_t *temp = &pack->temp_c[module * ZEVA_TEMPS];
+
+        temp[0] = (int8_t)(d[0] - ZEVA_TEMP_OFFSET);
+        temp[1] = (int8_t)(d[1] - ZEVA_TEMP_OFFSET);
+    }
+    pack->seq[module]++;
+    pack->seen[module] |= (uint8_t)(1 << reply);
+
+    return module;
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaModuleReported
+** Descriptions:            true once every reply of module has been decoded. Until then some of its cells
+**                          still read 0 mV.
+*********************************************************************************************************/
+static inline bool zevaModuleReported(const ZevaPackState *pack, int module)
+{
+    return pack->seen[module] == ZEVA_REPLIES_ALL;
+}
+
+#endif
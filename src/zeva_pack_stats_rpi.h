@@ -0,0 +1,274 @@
+/*
+ *  zeva_pack_stats_rpi.h
+ *  Pack analytics over the cell voltages of a ZevaPackState: min, max, sum, position of the min and
+ *  max, imbalance and cells out of the allowed window, all in one pass. With NEON (Raspberry Pi 2 and
+ *  later, 32 or 64 bit) eight cells are compared per instruction; other targets use the scalar loop,
+ *  which gives the same results. The per-module variant only rescans the module a frame came from,
+ *  so the checks can run on every received frame. CPU only, like zeva_bms_rpi.h.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef ZEVA_PACK_STATS_RPI_H
+#define ZEVA_PACK_STATS_RPI_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ZEVA_STATS_NEON        1
+#else
+#define ZEVA_STATS_NEON        0
+#endif
+
+#include "zeva_bms_rpi.h"
+
+// Aggregates of a run of cells. argmin / argmax: first cell with the min / max value, as an index
+// into the scanned array (the module's cells or pack.cell_mv).
+struct ZevaCellStats
+{
+    uint16_t min_mv;                                                    // 0xFFFF with no cells
+    uint16_t max_mv;
+    uint16_t argmin;
+    uint16_t argmax;
+    uint32_t sum_mv;                                                    // / count = mean
+    uint16_t count;
+    uint16_t imbalance_mv;                                              // max_mv - min_mv
+    uint16_t out_of_window;                                             // Cells < low_mv or > high_mv
+};
+
+struct ZevaPackStats
+{
+    uint16_t low_mv;                                                    // Allowed window, inclusive
+    uint16_t high_mv;
+    int8_t   max_temp_c;                                                // Hotter is over temperature
+    ZevaCellStats module[ZEVA_MAX_MODULES];
+    int8_t   module_temp_c[ZEVA_MAX_MODULES];                           // Hottest sensor of the module
+    uint8_t  module_over_temp[ZEVA_MAX_MODULES];
+    ZevaCellStats cells;                                                // Whole pack
+    int8_t   temp_c;                                                    // Hottest sensor of the pack
+    uint16_t over_temp;
+};
+
+
+/*********************************************************************************************************
+** Function name:           zevaCellStats
+** Descriptions:            One pass over n cells of mv: every field of out, window [low_mv, high_mv]
+*********************************************************************************************************/
+static inline void zevaCellStats(const uint16_t *mv, uint32_t n, uint16_t low_mv, uint16_t high_mv,
+                                 ZevaCellStats *out)
+{
+    uint16_t mn = 0xFFFF, mx = 0, amn = 0, amx = 0, outside = 0;
+    uint32_t sum = 0, i = 0;
+
+#if ZEVA_STATS_NEON
+    if (n >= 8)
+    {
+        static const uint16_t lane[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+        uint16x8_t idx   = vld1q_u16(lane);
+        uint16x8_t step  = vdupq_n_u16(8);
+        uint16x8_t lo    = vdupq_n_u16(low_mv);
+        uint16x8_t hi    = vdupq_n_u16(high_mv);
+        uint16x8_t vmn   = vdupq_n_u16(0xFFFF);
+        uint16x8_t vmx   = vdupq_n_u16(0);
+        uint16x8_t imn   = vdupq_n_u16(0);
+        uint16x8_t imx   = vdupq_n_u16(0);
+        uint16x8_t vout  = vdupq_n_u16(0);
+        uint32x4_t vsum  = vdupq_n_u32(0);
+        uint16_t   lmn[8], lmx[8], limn[8], limx[8], lout[8];
+        uint32_t   lsum[4];
+
+        for (; i + 8 <= n; i += 8)
+        {
+            uint16x8_t v     = vld1q_u16(mv + i);
+            uint16x8_t lower = vcltq_u16(v, vmn);                       /* Strict: first one stays      */
+            uint16x8_t upper = vcgtq_u16(v, vmx);
+
+            vmn  = vbslq_u16(lower, v, vmn);
+            imn  = vbslq_u16(lower, idx, imn);
+            vmx  = vbslq_u16(upper, v, vmx);
+            imx  = vbslq_u16(upper, idx, imx);
+            vout = vsubq_u16(vout, vorrq_u16(vcltq_u16(v, lo), vcgtq_u16(v, hi)));  /* mask = -1     */
+            vsum = vpadalq_u16(vsum, v);
+            idx  = vaddq_u16(idx, step);
+        }
+
+        vst1q_u16(lmn, vmn);
+        vst1q_u16(lmx, vmx);
+        vst1q_u16(limn, imn);
+        vst1q_u16(limx, imx);
+        vst1q_u16(lout, vout);
+        vst1q_u32(lsum, vsum);
+
+        // Lanes hold interleaved cells: the lowest index among the lanes with the extreme value
+        amn = 0xFFFF;
+        amx = 0xFFFF;
+        for (int l = 0; l < 8; l++)
+        {
+            if (lmn[l] < mn || (lmn[l] == mn && limn[l] < amn))
+            {
+                mn  = lmn[l];
+                amn = limn[l];
+            }
+            if (lmx[l] > mx || (lmx[l] == mx && limx[l] < amx))
+            {
+                mx  = lmx[l];
+                amx = limx[l];
+            }
+            outside += lout[l];
+        }
+        sum = lsum[0] + lsum[1] + lsum[2] + lsum[3];
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        uint16_t v = mv[i];
+
+        if (v < mn)
+        {
+            mn  = v;
+            amn = (uint16_t)i;
+        }
+        if (v > mx)
+        {
+            mx  = v;
+            amx = (uint16_t)i;
+        }
+        outside += (v < low_mv) | (v > high_mv);
+        sum     += v;
+    }
+
+    out->min_mv        = mn;
+    out->max_mv        = mx;
+    out->argmin        = amn;
+    out->argmax        = amx;
+    out->sum_mv        = sum;
+    out->count         = (uint16_t)n;
+    out->imbalance_mv  = n > 0 ? mx - mn : 0;
+    out->out_of_window = outside;
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackStatsMerge
+** Descriptions:            Pack aggregates from the module aggregates (n_modules entries, no cell access)
+*********************************************************************************************************/
+static inline void zevaPackStatsMerge(ZevaPackStats *stats, uint8_t n_modules)
+{
+    ZevaCellStats &p = stats->cells;
+
+    zevaCellStats(NULL, 0, stats->low_mv, stats->high_mv, &p);
+    stats->temp_c    = INT8_MIN;
+    stats->over_temp = 0;
+
+    for (uint8_t m = 0; m < n_modules; m++)
+    {
+        const ZevaCellStats &s = stats->module[m];
+
+        if (s.min_mv < p.min_mv)
+        {
+            p.min_mv = s.min_mv;
+            p.argmin = m * ZEVA_CELLS + s.argmin;
+        }
+        if (s.max_mv > p.max_mv)
+        {
+            p.max_mv = s.max_mv;
+            p.argmax = m * ZEVA_CELLS + s.argmax;
+        }
+        p.sum_mv        += s.sum_mv;
+        p.count         += s.count;
+        p.out_of_window += s.out_of_window;
+
+        if (stats->module_temp_c[m] > stats->temp_c)
+        {
+            stats->temp_c = stats->module_temp_c[m];
+        }
+        stats->over_temp += stats->module_over_temp[m];
+    }
+    p.imbalance_mv = p.count > 0 ? p.max_mv - p.min_mv : 0;
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackStatsScanModule
+** Descriptions:            Rescans the cells and temperatures of module
+*********************************************************************************************************/
+static inline void zevaPackStatsScanModule(ZevaPackStats *stats, const ZevaPackState *pack, int module)
+{
+    const int8_t *temp = &pack->temp_c[module * ZEVA_TEMPS];
+    int8_t        hot  = INT8_MIN;
+    uint8_t       over = 0;
+
+    zevaCellStats(&pack->cell_mv[module * ZEVA_CELLS], ZEVA_CELLS, stats->low_mv, stats->high_mv,
+                  &stats->module[module]);
+    for (int t = 0; t < ZEVA_TEMPS; t++)
+    {
+        hot   = temp[t] > hot ? temp[t] : hot;
+        over += temp[t] > stats->max_temp_c;
+    }
+    stats->module_temp_c[module]    = hot;
+    stats->module_over_temp[module] = over;
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackStatsUpdate
+** Descriptions:            After zevaDecode() returned module: rescans that module only and merges
+*********************************************************************************************************/
+static inline void zevaPackStatsUpdate(ZevaPackStats *stats, const ZevaPackState *pack, int module)
+{
+    if (module < 0 || module >= pack->n_modules)
+    {
+        return;
+    }
+    zevaPackStatsScanModule(stats, pack, module);
+    zevaPackStatsMerge(stats, pack->n_modules);
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackStatsAll
+** Descriptions:            Rescans every module of pack
+*********************************************************************************************************/
+static inline void zevaPackStatsAll(ZevaPackStats *stats, const ZevaPackState *pack)
+{
+    for (int m = 0; m < pack->n_modules; m++)
+    {
+        zevaPackStatsScanModule(stats, pack, m);
+    }
+    zevaPackStatsMerge(stats, pack->n_modules);
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackStatsInit
+** Descriptions:            Window of the checks, and a first scan of every module of pack
+*********************************************************************************************************/
+static inline void zevaPackStatsInit(ZevaPackStats *stats, const ZevaPackState *pack, uint16_t low_mv,
+                                     uint16_t high_mv, int8_t max_temp_c)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->low_mv     = low_mv;
+    stats->high_mv    = high_mv;
+    stats->max_temp_c = max_temp_c;
+    zevaPackStatsAll(stats, pack);
+}
+
+
+/*********************************************************************************************************
+** Function name:           zevaPackOK
+** Descriptions:            true if every cell is inside the window and no sensor is over temperature.
+**                          Cells not received yet read 0 mV, so an incomplete pack is not OK.
+*********************************************************************************************************/
+static inline bool zevaPackOK(const ZevaPackStats *stats)
+{
+    return stats->cells.out_of_window == 0 && stats->over_temp == 0;
+}
+
+#endif